@@ -0,0 +1,54 @@
+//
+//  SimpleRTK5BQL.cpp
+//  SimpleRTK5
+//
+
+#include "SimpleRTK5Ethernet.hpp"
+
+#pragma mark --- tx byte limit methods ---
+
+/*
+ * The tx byte limit follows the dynamic queue limits of Linux.
+ * Instead of filling the ring with up to numTxDesc packets, which
+ * may be several megabytes in case of TSO, only as many bytes are
+ * kept in flight as the NIC is able to send between two completion
+ * passes. The rest of the packets stay in the output queue of the
+ * interface, where they are subject to the stack's queue management.
+ * The limit never drops below kTxBqlMinLimit, so that a TSO packet
+ * of maximum size can always be sent.
+ *
+ * numQueued and lastObjCnt are written by the output thread only,
+ * all other fields by txInterrupt(). outputStart() reads adjLimit
+ * without a lock, which may delay a packet until the next pass but
+ * never loses one, as txInterrupt() signals the output thread.
+ */
+void SimpleRTK5::txBqlReset(rtlTxRing *ring)
+{
+    UInt64 holdTime, now;
+
+    nanoseconds_to_absolutetime(kTxBqlHoldTime, &holdTime);
+    clock_get_uptime(&now);
+
+    rtlTxBqlReset(&ring->txBql, enableTxByteLimit, holdTime, now);
+}
+
+void SimpleRTK5::txBqlQueued(rtlTxRing *ring, UInt32 bytes)
+{
+    if (enableTxByteLimit)
+        rtlTxBqlQueued(&ring->txBql, bytes);
+}
+
+/*
+ * Adapt the limit to the number of bytes the NIC has completed
+ * since the last call. See rtlTxBqlCompleted().
+ */
+void SimpleRTK5::txBqlCompleted(rtlTxRing *ring, UInt32 bytes)
+{
+    UInt64 now;
+
+    if (!enableTxByteLimit)
+        return;
+
+    clock_get_uptime(&now);
+    rtlTxBqlCompleted(&ring->txBql, bytes, now);
+}
@@ -0,0 +1,138 @@
+//
+//  SimpleRTK5Bql.hpp
+//  SimpleRTK5
+//
+//  The dynamic byte limit of the tx rings. The algorithm works on a
+//  plain rtlTxBql and takes the time from its caller, so that it's
+//  free of kernel dependencies and can be tested on the host.
+//
+
+#ifndef SimpleRTK5Bql_hpp
+#define SimpleRTK5Bql_hpp
+
+/* Dynamic limit of the bytes in flight per tx ring */
+#define kTxBqlMinLimit 0x10000  /* one TSO packet of maximum size */
+#define kTxBqlMaxLimit 0x100000
+#define kTxBqlNoLimit 0x7fffffff
+#define kTxBqlHoldTime 1000000000ULL
+#define kTxBqlHistorySize 16
+
+/* Difference of two counters or 0 in case it's negative. */
+#define posDiff(a, b) (((SInt32)((a) - (b)) > 0) ? ((a) - (b)) : 0)
+
+/* Check if counter a is equal to or after b. */
+#define afterEq(a, b) ((SInt32)((a) - (b)) >= 0)
+
+/*
+ * State of the dynamic byte limit of a tx ring. Bytes are queued
+ * by the output thread and completed in txInterrupt(). The limit
+ * grows when the NIC ran out of work in an interval and shrinks
+ * by the smallest excess seen within kTxBqlHoldTime.
+ */
+typedef struct rtlTxBql {
+    UInt32 numQueued;
+    UInt32 adjLimit;
+    UInt32 lastObjCnt;
+    UInt32 limit;
+    UInt32 numCompleted;
+    UInt32 prevOvLimit;
+    UInt32 prevNumQueued;
+    UInt32 prevLastObjCnt;
+    UInt32 lowestSlack;
+    UInt64 slackStartTime;
+    UInt64 slackHoldTime;
+    UInt32 history[kTxBqlHistorySize];
+    UInt32 historyIndex;
+    UInt32 historyCount;
+} rtlTxBql;
+
+/* Start with the minimum limit or no limit at all. */
+static inline void rtlTxBqlReset(rtlTxBql *bql, bool enabled, UInt64 holdTime, UInt64 now)
+{
+    memset(bql, 0, sizeof(rtlTxBql));
+
+    bql->limit = enabled ? kTxBqlMinLimit : kTxBqlNoLimit;
+    bql->adjLimit = bql->limit;
+    bql->lowestSlack = UINT32_MAX;
+    bql->slackHoldTime = holdTime;
+    bql->slackStartTime = now;
+}
+
+static inline void rtlTxBqlQueued(rtlTxBql *bql, UInt32 bytes)
+{
+    bql->lastObjCnt = bytes;
+    bql->numQueued += bytes;
+}
+
+/*
+ * Adapt the limit to the number of bytes the NIC has completed
+ * since the last call at time now.
+ */
+static inline void rtlTxBqlCompleted(rtlTxBql *bql, UInt32 bytes, UInt64 now)
+{
+    UInt32 numQueued, completed, limit, ovLimit;
+    UInt32 inProgress, prevInProgress;
+    UInt32 slack, slackLastObjs;
+    bool allPrevCompleted;
+
+    numQueued = bql->numQueued;
+    completed = bql->numCompleted + bytes;
+    limit = bql->limit;
+    ovLimit = posDiff(numQueued - bql->numCompleted, limit);
+    inProgress = numQueued - completed;
+    prevInProgress = bql->prevNumQueued - bql->numCompleted;
+    allPrevCompleted = afterEq(completed, bql->prevNumQueued);
+
+    if ((ovLimit && !inProgress) || (bql->prevOvLimit && allPrevCompleted)) {
+        /*
+         * The ring ran empty while there were packets waiting
+         * for it, i.e. the limit is too small. Raise it by the
+         * amount of bytes that were missing in the last interval.
+         */
+        limit += posDiff(completed, bql->prevNumQueued) + bql->prevOvLimit;
+
+        bql->slackStartTime = now;
+        bql->lowestSlack = UINT32_MAX;
+    } else if (inProgress && prevInProgress && !allPrevCompleted) {
+        /*
+         * There were still bytes in flight from the last interval,
+         * i.e. the limit is too large. Lower it by the smallest
+         * excess seen in the hold time.
+         */
+        slack = posDiff(limit + bql->prevOvLimit,
+                        2 * (completed - bql->numCompleted));
+        slackLastObjs = bql->prevOvLimit ?
+                        posDiff(bql->prevLastObjCnt, bql->prevOvLimit) : 0;
+        slack = (slack > slackLastObjs) ? slack : slackLastObjs;
+
+        if (slack < bql->lowestSlack)
+            bql->lowestSlack = slack;
+
+        if (now > (bql->slackStartTime + bql->slackHoldTime)) {
+            limit = posDiff(limit, bql->lowestSlack);
+
+            bql->slackStartTime = now;
+            bql->lowestSlack = UINT32_MAX;
+        }
+    }
+    limit = (limit < kTxBqlMinLimit) ? kTxBqlMinLimit : limit;
+    limit = (limit > kTxBqlMaxLimit) ? kTxBqlMaxLimit : limit;
+
+    if (limit != bql->limit) {
+        bql->limit = limit;
+        ovLimit = 0;
+
+        bql->history[bql->historyIndex] = limit;
+        bql->historyIndex = (bql->historyIndex + 1) % kTxBqlHistorySize;
+
+        if (bql->historyCount < kTxBqlHistorySize)
+            bql->historyCount++;
+    }
+    bql->adjLimit = limit + completed;
+    bql->prevOvLimit = ovLimit;
+    bql->prevLastObjCnt = bql->lastObjCnt;
+    bql->numCompleted = completed;
+    bql->prevNumQueued = numQueued;
+}
+
+#endif /* SimpleRTK5Bql_hpp */
@@ -0,0 +1,247 @@
+//
+//  SimpleRTK5BusyPoll.cpp
+//  SimpleRTK5
+//
+
+#include "SimpleRTK5Ethernet.hpp"
+
+#pragma mark --- busy poll methods ---
+
+/*
+ * The busy poll mode is owned by the driver and works independently
+ * of the stack's poll mode, which always takes precedence. Under load
+ * a high priority thread call polls the rx rings for busyPollBudget
+ * µs at a time instead of waiting for interrupts. When the arrival
+ * rate drops, the thread hands the rings back to the interrupt
+ * handler. Busy polling is supported with the MSI interrupt only.
+ */
+bool SimpleRTK5::initBusyPoll()
+{
+    UInt64 budget;
+    bool result = false;
+
+    if (!enableBusyPoll || msixLayout) {
+        result = true;
+        goto done;
+    }
+    /*
+     * A software interrupt source, which is used by the thread to
+     * reenable the rx interrupt in the context of the work loop.
+     */
+    busyPollSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::busyPollDone));
+
+    if (!busyPollSource) {
+        IOLog("SimpleRTK5: Failed to create busy poll event source.\n");
+        goto done;
+    }
+    workLoop->addEventSource(busyPollSource);
+
+    busyPollCall = thread_call_allocate_with_options((thread_call_func_t) &runBusyPollThread, (void *) this, THREAD_CALL_PRIORITY_HIGH, 0);
+
+    if (!busyPollCall) {
+        IOLog("SimpleRTK5: Couldn't alloc busy poll thread_call.\n");
+        goto error;
+    }
+    bzero(&busyPoll, sizeof(rtlBusyPoll));
+
+    nanoseconds_to_absolutetime(busyPollBudget * 1000ULL, &busyPoll.budget);
+    busyPoll.minPackets = rtlBusyPollMinPackets(busyPollRate, busyPollBudget);
+
+    IOLog("SimpleRTK5: Busy poll with %uµs budget above %u packets/s.\n",
+          busyPollBudget, busyPollRate);
+    result = true;
+
+done:
+    return result;
+
+error:
+    workLoop->removeEventSource(busyPollSource);
+    RELEASE(busyPollSource);
+    goto done;
+}
+
+void SimpleRTK5::freeBusyPoll()
+{
+    if (busyPollCall) {
+        busyPollStop();
+        thread_call_free(busyPollCall);
+        busyPollCall = NULL;
+    }
+    if (busyPollSource) {
+        workLoop->removeEventSource(busyPollSource);
+        RELEASE(busyPollSource);
+    }
+}
+
+/*
+ * Stop the busy poll thread and wait until it's neither running
+ * nor pending. A round which is about to finish may still schedule
+ * the next one after thread_call_cancel_wait() has waited for it,
+ * so that the stop flag keeps further rounds from polling and the
+ * loop cancels the one, which might have been scheduled. Must be
+ * called with the interrupts disabled or on the work loop, so that
+ * busyPollCheck() can't restart the thread in the meantime.
+ */
+void SimpleRTK5::busyPollStop()
+{
+    if (!busyPollCall)
+        return;
+
+    busyPoll.stop = true;
+    clear_bit(__BUSY_POLL, &stateFlags);
+
+    do {
+        thread_call_cancel_wait(busyPollCall);
+    } while (thread_call_isactive(busyPollCall));
+
+    busyPoll.stop = false;
+}
+
+/*
+ * Called by the interrupt handler after the rx rings have been
+ * processed. Samples the rx arrival rate and starts the busy poll
+ * thread once it exceeds busyPollRate. Returns true in case the
+ * thread owns the rx rings, so that the rx interrupt must be masked.
+ */
+bool SimpleRTK5::busyPollCheck()
+{
+    UInt64 rxPackets = 0;
+    UInt64 elapsed;
+    UInt64 now;
+    UInt32 i;
+
+    if (!busyPollCall)
+        return false;
+
+    if (test_bit(__BUSY_POLL, &stateFlags))
+        return true;
+
+    for (i = 0; i < numRxQueues; i++)
+        rxPackets += rxRing[i].rxPackets;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - busyPoll.windowStart, &elapsed);
+
+    if (!rtlBusyPollSample(&busyPoll, rxPackets, now, elapsed, busyPollRate))
+        return false;
+
+    set_bit(__BUSY_POLL, &stateFlags);
+    busyPoll.entries++;
+    thread_call_enter(busyPollCall);
+
+    return true;
+}
+
+void SimpleRTK5::runBusyPollThread(thread_call_param_t param0)
+{
+    ((SimpleRTK5 *)param0)->busyPollThread();
+}
+
+/*
+ * Poll the rings for one round of busyPollBudget. The rx rings are
+ * shared with the interrupt handler and pollInputPackets() using
+ * the __POLLING flag. Clearing __BUSY_POLL makes the thread stop
+ * at the next iteration.
+ */
+void SimpleRTK5::busyPollThread()
+{
+    UInt64 start, now;
+    UInt32 packets = 0;
+    UInt32 count;
+    UInt32 i;
+
+    if (busyPoll.stop)
+        return;
+
+    clock_get_uptime(&start);
+    now = start;
+
+    while (!busyPoll.stop && test_bit(__BUSY_POLL, &stateFlags) &&
+           ((now - start) < busyPoll.budget)) {
+        if (!test_and_set_bit(__POLLING, &stateFlags)) {
+            for (count = 0, i = 0; i < numRxQueues; i++) {
+                if (useAppleVTD)
+                    count += rxInterruptVTD(&rxRing[i], netif, numRxDesc, NULL, NULL);
+                else
+                    count += rxInterrupt(&rxRing[i], netif, numRxDesc, NULL, NULL);
+            }
+            if (count)
+                netif->flushInputQueue();
+
+            /* The tx interrupt is masked too. */
+            txReclaim();
+
+            clear_bit(__POLLING, &stateFlags);
+            packets += count;
+        }
+        clock_get_uptime(&now);
+    }
+    busyPoll.rounds++;
+    busyPoll.packets += packets;
+    busyPoll.time += (now - start);
+
+    if (!packets)
+        busyPoll.emptyRounds++;
+
+    /* busyPollStop() restores the interrupt mask itself. */
+    if (busyPoll.stop)
+        return;
+
+    /*
+     * Schedule the next round as long as the arrival rate stays
+     * high, otherwise return to interrupt mode.
+     */
+    if (test_bit(__BUSY_POLL, &stateFlags) && rtlBusyPollContinue(&busyPoll, packets))
+        thread_call_enter(busyPollCall);
+    else
+        busyPollSource->interruptOccurred(NULL, NULL, 0);
+}
+
+/* Reenable the rx interrupt after the busy poll thread has stopped. */
+void SimpleRTK5::busyPollDone(OSObject *client, IOInterruptEventSource *src,
+                              int count)
+{
+    struct srtk5_private *tp = &linuxData;
+    UInt64 rxPackets = 0;
+    UInt64 now;
+    UInt32 i;
+
+    if (!test_and_clear_bit(__BUSY_POLL, &stateFlags))
+        goto done;
+
+    for (i = 0; i < numRxQueues; i++)
+        rxPackets += rxRing[i].rxPackets;
+
+    clock_get_uptime(&now);
+    rtlBusyPollRestart(&busyPoll, rxPackets, now);
+
+    if (test_bit(__ENABLED, &stateFlags) &&
+        !test_bit(__POLL_MODE, &stateFlags)) {
+        intrMask = intrMaskRxTx;
+        timerValue = 0;
+
+        RTL_W32(tp, TIMER_INT0_8125, timerValue);
+        rtl812xSetIntrMask(intrMask);
+    }
+
+done:
+    return;
+}
+
+void SimpleRTK5::updateBusyPollStats()
+{
+    UInt64 time;
+
+    if (!busyPollCall)
+        return;
+
+    /* The time spent polling is reported in nanoseconds. */
+    absolutetime_to_nanoseconds(busyPoll.time, &time);
+
+    setProperty(kBusyPollEntriesName, busyPoll.entries, 64);
+    setProperty(kBusyPollRoundsName, busyPoll.rounds, 64);
+    setProperty(kBusyPollEmptyRoundsName, busyPoll.emptyRounds, 64);
+    setProperty(kBusyPollPacketsName, busyPoll.packets, 64);
+    setProperty(kBusyPollTimeName, time, 64);
+    setProperty(kBusyPollRxRateName, busyPoll.rxRate, 64);
+}
@@ -0,0 +1,86 @@
+//
+//  SimpleRTK5BusyPoll.hpp
+//  SimpleRTK5
+//
+//  Rules of the driver owned busy poll mode, when to hand the rx
+//  rings to the busy poll thread and when to give them back. Kept
+//  free of kernel dependencies, so that they can be tested on the
+//  host.
+//
+
+#ifndef SimpleRTK5BusyPoll_hpp
+#define SimpleRTK5BusyPoll_hpp
+
+/* driver owned busy poll mode */
+#define kBusyPollWindow 1000000UL
+#define kBusyPollDefBudget 50
+#define kBusyPollMaxBudget 1000
+#define kBusyPollDefRate 100000
+#define kBusyPollMinRate 1000
+
+/*
+ * State of the driver owned busy poll mode. The rx arrival rate is
+ * sampled by the interrupt handler over windows of at least
+ * kBusyPollWindow. Once it reaches busyPollRate, the rx interrupt
+ * is masked and the busy poll thread polls the rings in rounds of
+ * budget. It keeps on polling as long as a round finds at least
+ * minPackets, i.e. half the packets expected at busyPollRate.
+ */
+typedef struct rtlBusyPoll {
+    UInt64 windowStart;
+    UInt64 lastRxPackets;
+    UInt64 rxRate;
+    UInt64 budget;
+    UInt32 minPackets;
+    UInt64 entries;
+    UInt64 rounds;
+    UInt64 emptyRounds;
+    UInt64 packets;
+    UInt64 time;
+    volatile bool stop;
+} rtlBusyPoll;
+
+/* Half the packets arriving at rate packets/s in budget µs, at least one */
+static inline UInt32 rtlBusyPollMinPackets(UInt32 rate, UInt32 budget)
+{
+    UInt32 n = (UInt32)(((UInt64)rate * budget) / 2000000);
+
+    return (n > 1) ? n : 1;
+}
+
+/*
+ * Sample the rx packet counter at time now, elapsed ns after the
+ * start of the window. Once the window is complete, its arrival rate
+ * is computed and a new window is started. Returns true in case the
+ * rate has reached rate packets/s, i.e. busy polling should start.
+ */
+static inline bool rtlBusyPollSample(rtlBusyPoll *bp, UInt64 rxPackets, UInt64 now,
+                                     UInt64 elapsed, UInt32 rate)
+{
+    if (elapsed < kBusyPollWindow)
+        return false;
+
+    bp->rxRate = ((rxPackets - bp->lastRxPackets) * 1000000000ULL) / elapsed;
+    bp->lastRxPackets = rxPackets;
+    bp->windowStart = now;
+
+    return (bp->rxRate >= rate);
+}
+
+/* Keep on polling after a round, which found packets. */
+static inline bool rtlBusyPollContinue(const rtlBusyPoll *bp, UInt32 packets)
+{
+    return (packets >= bp->minPackets);
+}
+
+/*
+ * Start a new window after the busy poll thread has stopped, so that
+ * the polled packets don't count.
+ */
+static inline void rtlBusyPollRestart(rtlBusyPoll *bp, UInt64 rxPackets, UInt64 now)
+{
+    bp->windowStart = now;
+    bp->lastRxPackets = rxPackets;
+}
+
+#endif /* SimpleRTK5BusyPoll_hpp */
@@ -0,0 +1,159 @@
+//
+//  SimpleRTK5CopyBreak.hpp
+//  SimpleRTK5
+//
+//  Adaptive copybreak of the rx buffer pool. The cost model is kept
+//  free of kernel dependencies, so that it can be replayed on the host.
+//
+
+#ifndef SimpleRTK5CopyBreak_hpp
+#define SimpleRTK5CopyBreak_hpp
+
+/*
+ * Packet sizes are counted in buckets of 128 bytes. Packets
+ * in the last bucket are never copied.
+ */
+#define kCopyBreakBucketShift   7
+#define kCopyBreakBuckets       16
+#define kCopyBreakSampleMask    7   /* time one out of 8 packets */
+#define kCopyBreakProbeDrains   64  /* probe the next bucket every 64 drains */
+#define kCopyBreakAvgShift      3   /* weight of a new sample is 1/8 */
+
+/*
+ * State of the adaptive copybreak. Packets of buckets below index
+ * are copied, the others are replaced. Costs are scaled by
+ * 2^kCopyBreakAvgShift, the histogram average by 16.
+ */
+typedef struct RxCopyBreak {
+    UInt32 limit;
+    UInt32 index;
+    UInt32 maxCopySize;
+    UInt32 hist[kCopyBreakBuckets];
+    UInt64 histAvg[kCopyBreakBuckets];
+    UInt64 histTotal[kCopyBreakBuckets];
+    UInt64 copyCost[kCopyBreakBuckets];
+    UInt64 replaceCost;
+    UInt64 mapCostAvg;
+    UInt32 drainReplaced;
+    UInt32 drainCount;
+    UInt32 sampleCount;
+} RxCopyBreak;
+
+/*
+ * Packets up to maxCopySize always get copied. Start with the
+ * lowest index, whose buckets are covered by maxCopySize.
+ */
+static inline void rxCopyBreakInit(RxCopyBreak *cb, UInt32 maxCopySize)
+{
+    memset(cb, 0, sizeof(RxCopyBreak));
+
+    cb->maxCopySize = maxCopySize;
+    cb->limit = maxCopySize;
+    cb->index = (maxCopySize + 1) >> kCopyBreakBucketShift;
+}
+
+static inline UInt64 rxCopyBreakAvg(UInt64 avg, UInt64 sample)
+{
+    sample <<= kCopyBreakAvgShift;
+
+    if (!avg)
+        return sample;
+
+    return avg - (avg >> kCopyBreakAvgShift) + (sample >> kCopyBreakAvgShift);
+}
+
+/*
+ * Count a received packet in the histogram and return its bucket.
+ * Sets *timed for the packets whose cost should be measured.
+ */
+static inline UInt32 rxCopyBreakCount(RxCopyBreak *cb, UInt32 len, bool *timed)
+{
+    UInt32 bucket = len >> kCopyBreakBucketShift;
+
+    if (bucket > kCopyBreakBuckets - 1)
+        bucket = kCopyBreakBuckets - 1;
+
+    cb->hist[bucket]++;
+    *timed = !(++cb->sampleCount & kCopyBreakSampleMask);
+
+    return bucket;
+}
+
+static inline bool rxCopyBreakReplace(RxCopyBreak *cb, UInt32 len, UInt32 bucket)
+{
+    return ((len > cb->limit) || (bucket == kCopyBreakBuckets - 1));
+}
+
+/*
+ * Called at the end of each rx drain with the time spent to remap
+ * replaced buffers. Fold the drain's packet size histogram into a
+ * decaying average and move the copybreak to the bucket boundary
+ * with the lowest estimated total cost. Buckets which have never
+ * been copied have no cost estimate, so that the next bucket above
+ * the copybreak is probed from time to time.
+ */
+static inline void rxCopyBreakUpdate(RxCopyBreak *cb, UInt64 mapCost)
+{
+    SInt64 cost, curCost, bestCost;
+    UInt64 replCost;
+    UInt32 i, best, minIndex;
+
+    if (cb->drainReplaced)
+        cb->mapCostAvg = rxCopyBreakAvg(cb->mapCostAvg, mapCost / cb->drainReplaced);
+
+    for (i = 0; i < kCopyBreakBuckets; i++) {
+        cb->histTotal[i] += cb->hist[i];
+        cb->histAvg[i] = cb->histAvg[i] - (cb->histAvg[i] >> 2) + ((UInt64)cb->hist[i] << 4);
+        cb->hist[i] = 0;
+    }
+    cb->drainReplaced = 0;
+    replCost = cb->replaceCost + cb->mapCostAvg;
+
+    if (!cb->replaceCost)
+        return;
+
+    /*
+     * Relative to replacing all packets, moving the copybreak
+     * above bucket i changes the total cost by the bucket's
+     * weight times the difference of copy and replace cost.
+     * Only move away from the current copybreak in case it
+     * reduces the cost.
+     */
+    best = cb->index;
+    bestCost = curCost = cost = 0;
+
+    for (i = 0; i < kCopyBreakBuckets - 1; i++) {
+        if (!cb->copyCost[i] && (i >= cb->index))
+            break;
+
+        if (cb->copyCost[i])
+            cost += (SInt64)(cb->histAvg[i] >> 4) * ((SInt64)cb->copyCost[i] - (SInt64)replCost);
+
+        if (i + 1 == cb->index)
+            curCost = cost;
+
+        if (cost < bestCost) {
+            bestCost = cost;
+            best = i + 1;
+        }
+    }
+    if (curCost <= bestCost)
+        best = cb->index;
+
+    if (((++cb->drainCount % kCopyBreakProbeDrains) == 0) && (best < kCopyBreakBuckets - 1))
+        best++;
+
+    /* The copybreak never drops below maxCopySize. */
+    minIndex = (cb->maxCopySize + 1) >> kCopyBreakBucketShift;
+
+    if (best < minIndex)
+        best = minIndex;
+
+    cb->index = best;
+    cb->limit = best ? (best << kCopyBreakBucketShift) - 1 : 0;
+
+    if (cb->limit < cb->maxCopySize)
+        cb->limit = cb->maxCopySize;
+}
+
+#endif /* SimpleRTK5CopyBreak_hpp */
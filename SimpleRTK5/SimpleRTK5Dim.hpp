@@ -0,0 +1,127 @@
+//
+//  SimpleRTK5Dim.hpp
+//  SimpleRTK5
+//
+//  Dynamic interrupt moderation. The selection of the moderation
+//  profile works on a plain rtlDimState and is kept free of kernel
+//  dependencies, so that it can be tested on the host.
+//
+
+#ifndef SimpleRTK5Dim_hpp
+#define SimpleRTK5Dim_hpp
+
+/* timer value for interrupt throttling */
+#define kTimerDefault 0x2600
+#define kTimerBulk 0x5f00
+#define kTimerLat1 (kTimerDefault / 2)
+#define kTimerLat2 ((kTimerDefault / 4) * 3)
+
+/* dynamic interrupt moderation */
+#define kDimWindow 1000000UL
+#define kDimEwmaShift 2
+#define kDimHoldWindows 2
+#define kDimBulkPktSize 2000
+
+/*
+ * Interrupt moderation profiles ordered by increasing timer value
+ * and the maximum packet rate in packets per second each of them
+ * is used for.
+ */
+static const struct {
+    UInt32 timer;
+    UInt64 maxPktRate;
+} dimProfiles[] = {
+    { kTimerLat1, 30000 },
+    { kTimerLat2, 80000 },
+    { kTimerDefault, 200000 },
+    { kTimerBulk, UINT64_MAX },
+};
+
+#define kDimNumProfiles (sizeof(dimProfiles) / sizeof(dimProfiles[0]))
+#define kDimDefProfile 2
+#define kDimJumboProfile 2
+
+/*
+ * State of the dynamic interrupt moderation. Packet and byte rates
+ * are sampled over windows of at least kDimWindow and smoothed with
+ * an EWMA. The moderation profile follows the rates one step at a
+ * time, once they have pointed to the same direction for
+ * kDimHoldWindows windows.
+ */
+typedef struct rtlDimState {
+    UInt64 windowStart;
+    UInt64 lastRxPackets;
+    UInt64 lastRxBytes;
+    UInt64 lastTxPackets;
+    UInt64 lastTxBytes;
+    UInt64 packets;
+    UInt64 bytes;
+    UInt64 pktRate;
+    UInt64 byteRate;
+    UInt64 switches;
+    UInt32 profile;
+    UInt32 holdCount;
+    SInt32 holdDir;
+} rtlDimState;
+
+/* Start over with the default profile. The switch count is kept. */
+static inline void rtlDimReset(rtlDimState *dim)
+{
+    UInt64 switches = dim->switches;
+
+    memset(dim, 0, sizeof(rtlDimState));
+
+    dim->switches = switches;
+    dim->profile = kDimDefProfile;
+}
+
+/*
+ * End a window of elapsed ns with the packets and bytes added to
+ * dim in it. The smoothed rates are updated and the target profile
+ * is selected by the packet rate, or the bulk profile in case the
+ * average packet is large, i.e. with TSO or LRO. Moving down requires
+ * the rate to fall below 3/4 of the lower profile's bound, so that a
+ * rate near a bound doesn't make the profile flap. Jumbo frames use
+ * few rx buffers per window and never go beyond kDimJumboProfile.
+ */
+static inline void rtlDimEndWindow(rtlDimState *dim, UInt64 elapsed, bool jumbo)
+{
+    UInt32 target;
+    SInt32 dir;
+
+    dim->pktRate += ((SInt64)((dim->packets * 1000000000ULL) / elapsed) -
+                     (SInt64)dim->pktRate) >> kDimEwmaShift;
+    dim->byteRate += ((SInt64)((dim->bytes * 1000000000ULL) / elapsed) -
+                      (SInt64)dim->byteRate) >> kDimEwmaShift;
+    dim->packets = 0;
+    dim->bytes = 0;
+
+    if (dim->pktRate && ((dim->byteRate / dim->pktRate) > kDimBulkPktSize)) {
+        target = kDimNumProfiles - 1;
+    } else {
+        for (target = 0; target < (kDimNumProfiles - 1); target++) {
+            if (dim->pktRate <= dimProfiles[target].maxPktRate)
+                break;
+        }
+        if ((target < dim->profile) &&
+            (dim->pktRate > ((dimProfiles[dim->profile - 1].maxPktRate / 4) * 3)))
+            target = dim->profile;
+    }
+    if (jumbo && (target > kDimJumboProfile))
+        target = kDimJumboProfile;
+
+    dir = (target > dim->profile) ? 1 : ((target < dim->profile) ? -1 : 0);
+
+    if (dir && (dir == dim->holdDir)) {
+        if (++dim->holdCount >= kDimHoldWindows) {
+            dim->profile += dir;
+            dim->holdCount = 0;
+            dim->switches++;
+        }
+    } else {
+        dim->holdDir = dir;
+        dim->holdCount = dir ? 1 : 0;
+    }
+}
+
+#endif /* SimpleRTK5Dim_hpp */
@@ -135,8 +135,8 @@ static unsigned const ethernet_polynomial = 0x04c11db7U;
 
 #pragma mark--- function prototypes ---
 
-static inline void prepareTSO4(mbuf_t m, UInt32 *tcpOffset, UInt32 *mss);
-static inline void prepareTSO6(mbuf_t m, UInt32 *tcpOffset, UInt32 *mss);
+static inline void prepareTSO4(mbuf_t m, rtlTxHdrInfo *info, UInt32 *mss);
+static inline void prepareTSO6(mbuf_t m, rtlTxHdrInfo *info, UInt32 *mss);
 
 static inline u32 ether_crc(int length, unsigned char *data);
 
@@ -159,20 +159,38 @@ OSDefineMetaClassAndStructors(SimpleRTK5, super)
         txQueue = NULL;
         interruptSource = NULL;
         timerSource = NULL;
+        msixLayout = NULL;
+        txWorkLoop = NULL;
+        memset(rxIntrSource, 0, sizeof(rxIntrSource));
+        memset(txIntrSource, 0, sizeof(txIntrSource));
+        linkIntrSource = NULL;
         netif = NULL;
         netStats = NULL;
         etherStats = NULL;
         baseMap = NULL;
-        rxPool = NULL;
         txMbufCursor = NULL;
-        rxBufArrayMem = NULL;
-        txBufArrayMem = NULL;
+        memset(txRing, 0, sizeof(txRing));
+        numTxQueues = 1;
         statBufDesc = NULL;
         statPhyAddr = (IOPhysicalAddress64)NULL;
         statData = NULL;
-        rxPacketHead = NULL;
-        rxPacketTail = NULL;
-        rxPacketSize = 0;
+        memset(rxRing, 0, sizeof(rxRing));
+        numRxQueues = 1;
+        rxPollQueue = 0;
+        numRxDesc = kDefaultRingSize;
+        numTxDesc = kDefaultRingSize;
+        rxDescMask = kDefaultRingSize - 1;
+        txDescMask = kDefaultRingSize - 1;
+        numRxMemDesc = 0;
+        numTxMemDesc = 0;
+        txMemDescMask = 0;
+        rxMapMemSize = 0;
+        txMapMemSize = 0;
+        txQueueWakeTreshhold = kDefaultRingSize / 10;
+        txCopyBreak = kTxDefCopyBreak;
+        rxBufferSize = kRxBufferSize;
+        rxDescBufSize = kRxBufferSize;
+        rxDescType = RX_DESC_RING_TYPE_1;
 
         /* Initialize state flags. */
         stateFlags = 0;
@@ -189,6 +207,28 @@ OSDefineMetaClassAndStructors(SimpleRTK5, super)
         timerValue = 0;
         enableTSO4 = false;
         enableTSO6 = false;
+        enableSoftTSO = false;
+        enableTxByteLimit = false;
+        enableTxReclaimThread = false;
+        txReclaimCall = NULL;
+        enableMSIX = false;
+        enableIntrFilter = true;
+        enableBusyPoll = false;
+        enablePollTuning = true;
+        pollTime1G = 170000;
+        memset(&pollTune, 0, sizeof(pollTune));
+        busyPollBudget = kBusyPollDefBudget;
+        busyPollRate = kBusyPollDefRate;
+        busyPollCall = NULL;
+        busyPollSource = NULL;
+        memset(&busyPoll, 0, sizeof(busyPoll));
+        intrStatus = 0;
+        intrTime = 0;
+        intrSpurious = 0;
+        memset(intrLatHist, 0, sizeof(intrLatHist));
+        enableJumboRx = false;
+        enableLRO = false;
+        enableExtRxDesc = false;
         wolCapable = false;
         enableGigaLite = false;
         pciPMCtrlOffset = 0;
@@ -218,6 +258,9 @@ void SimpleRTK5::free() {
             workLoop->removeEventSource(interruptSource);
             RELEASE(interruptSource);
         }
+        freeMsixSources();
+        freeBusyPoll();
+
         if (timerSource) {
             workLoop->removeEventSource(timerSource);
             RELEASE(timerSource);
@@ -380,6 +423,9 @@ void SimpleRTK5::stop(IOService *provider) {
             workLoop->removeEventSource(interruptSource);
             RELEASE(interruptSource);
         }
+        freeMsixSources();
+        freeBusyPoll();
+
         if (timerSource) {
             workLoop->removeEventSource(timerSource);
             RELEASE(timerSource);
@@ -475,6 +521,7 @@ void SimpleRTK5::systemWillShutdown(IOOptionBits specifier) {
 IOReturn SimpleRTK5::enable(IONetworkInterface *netif) {
     const IONetworkMedium *selectedMedium;
     IOReturn result = kIOReturnError;
+    UInt32 i;
 
     DebugLog("SimpleRTK5: enable() ===>\n");
 
@@ -500,10 +547,11 @@ IOReturn SimpleRTK5::enable(IONetworkInterface *netif) {
     rtl812xEnable();
 
     /* We have to enable the interrupt because we are using a msi interrupt. */
-    interruptSource->enable();
+    intrEnable();
+
+    for (i = 0; i < numRxQueues; i++)
+        discardPacketFragment(&rxRing[i]);
 
-    rxPacketHead = rxPacketTail = NULL;
-    rxPacketSize = 0;
     txDescDoneCount = txDescDoneLast = 0;
     deadlockWarn = 0;
     set_bit(__ENABLED, &stateFlags);
@@ -542,14 +590,14 @@ IOReturn SimpleRTK5::disable(IONetworkInterface *netif) {
             t += delay;
         }
     }
-    clear_mask((__ENABLED_M | __LINK_UP_M | __POLL_MODE_M | __POLLING_M),
-               &stateFlags);
+    clear_mask((__ENABLED_M | __LINK_UP_M | __POLL_MODE_M | __POLLING_M |
+                __BUSY_POLL_M), &stateFlags);
 
     timerSource->cancelTimeout();
     txDescDoneCount = txDescDoneLast = 0;
 
     /* Disable interrupt as we are using msi. */
-    interruptSource->disable();
+    intrDisable();
 
     rtl812xDisable();
 
@@ -564,185 +612,452 @@ done:
     return kIOReturnSuccess;
 }
 
-IOReturn SimpleRTK5::outputStart(IONetworkInterface *interface,
-                                 IOOptionBits options) {
+/*
+ * Fill in the descriptors for a packet. Returns false in case
+ * the packet had to be dropped. The caller is responsible for
+ * ringing the doorbell of the ring after a batch of packets.
+ */
+bool SimpleRTK5::txSendPacket(rtlTxRing *ring, mbuf_t m, UInt32 pktBytes) {
     IOPhysicalSegment txSegments[kMaxSegs];
-    mbuf_t m;
     RtlTxDesc *desc;
-    UInt64 pktBytes;
-    IOReturn result = kIOReturnNoResources;
     UInt32 cmd;
     UInt32 opts2;
     UInt32 offloadFlags;
     UInt32 mss;
     UInt32 len;
-    UInt32 tcpOff;
     UInt32 opts1;
     UInt32 vlanTag;
     UInt32 numSegs;
+    rtlTxHdrInfo hdrInfo;
     UInt32 lastSeg;
     UInt32 index;
     UInt32 i;
+    bool premapped = false;
+    bool linearized = false;
+    bool result = true;
 
-    // DebugLog("SimpleRTK5: outputStart() ===>\n");
+    cmd = 0;
+    opts2 = 0;
 
-    if (!(test_mask((__ENABLED_M | __LINK_UP_M), &stateFlags))) {
-        DebugLog("SimpleRTK5: Interface down. Dropping packets.\n");
-        goto done;
+    /* Get the packet length. */
+    len = (UInt32)mbuf_pkthdr_len(m);
+
+    if (mbuf_get_tso_requested(m, &offloadFlags, &mss)) {
+        DebugLog("SimpleRTK5: mbuf_get_tso_requested() failed. Dropping "
+                 "packet.\n");
+        goto drop;
     }
-    while ((txNumFreeDesc > kMinFreeDescs) &&
-           (interface->dequeueOutputPackets(1, &m, NULL, NULL, &pktBytes) ==
-            kIOReturnSuccess)) {
-        cmd = 0;
-        opts2 = 0;
+    if (offloadFlags & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) {
+        if (offloadFlags & MBUF_TSO_IPV4) {
+            if ((len - ETH_HLEN) > mtu) {
+                /*
+                 * Fix the pseudo header checksum, get the
+                 * TCP header offset and set paylen.
+                 */
+                if (!txParseHeaders(m, &hdrInfo) ||
+                    (hdrInfo.l4Proto != IPPROTO_TCP) ||
+                    (hdrInfo.l4Off > GTTCPHO_MAX))
+                    goto bad_hdr;
 
-        /* Get the packet length. */
-        len = (UInt32)mbuf_pkthdr_len(m);
+                prepareTSO4(m, &hdrInfo, &mss);
 
-        if (mbuf_get_tso_requested(m, &offloadFlags, &mss)) {
-            DebugLog("SimpleRTK5: mbuf_get_tso_requested() failed. Dropping "
-                     "packet.\n");
-            mbuf_freem_list(m);
-            continue;
-        }
-        if (offloadFlags & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) {
-            if (offloadFlags & MBUF_TSO_IPV4) {
-                if ((len - ETH_HLEN) > mtu) {
-                    /*
-                     * Fix the pseudo header checksum, get the
-                     * TCP header offset and set paylen.
-                     */
-                    prepareTSO4(m, &tcpOff, &mss);
+                cmd = (GiantSendv4 | (hdrInfo.l4Off << GTTCPHO_SHIFT));
+                opts2 = ((mss & MSSMask) << MSSShift);
+            } else {
+                /*
+                 * There is no need for a TSO4 operation as the packet
+                 * can be sent in one frame.
+                 */
+                offloadFlags = kChecksumTCP;
+                opts2 = (TxIPCS_C | TxTCPCS_C);
+            }
+        } else {
+            if (!txParseHeaders(m, &hdrInfo) ||
+                (hdrInfo.l4Proto != IPPROTO_TCP))
+                goto bad_hdr;
 
-                    cmd = (GiantSendv4 | (tcpOff << GTTCPHO_SHIFT));
-                    opts2 = ((mss & MSSMask) << MSSShift);
-                } else {
-                    /*
-                     * There is no need for a TSO4 operation as the packet
-                     * can be sent in one frame.
-                     */
-                    offloadFlags = kChecksumTCP;
-                    opts2 = (TxIPCS_C | TxTCPCS_C);
-                }
+            if ((len - ETH_HLEN) > mtu) {
+                if (hdrInfo.l4Off > GTTCPHO_MAX)
+                    goto bad_hdr;
+
+                /* The pseudoheader checksum has to be adjusted first. */
+                prepareTSO6(m, &hdrInfo, &mss);
+
+                cmd = (GiantSendv6 | (hdrInfo.l4Off << GTTCPHO_SHIFT));
+                opts2 = ((mss & MSSMask) << MSSShift);
             } else {
-                if ((len - ETH_HLEN) > mtu) {
-                    /* The pseudoheader checksum has to be adjusted first. */
-                    prepareTSO6(m, &tcpOff, &mss);
+                /*
+                 * There is no need for a TSO6 operation as the packet
+                 * can be sent in one frame.
+                 */
+                if (hdrInfo.l4Off > TCPHO_MAX)
+                    goto bad_hdr;
 
-                    cmd = (GiantSendv6 | (tcpOff << GTTCPHO_SHIFT));
-                    opts2 = ((mss & MSSMask) << MSSShift);
-                } else {
-                    /*
-                     * There is no need for a TSO6 operation as the packet
-                     * can be sent in one frame.
-                     */
-                    offloadFlags = kChecksumTCPIPv6;
-                    opts2 = (TxTCPCS_C | TxIPV6F_C |
-                             (((ETH_HLEN + kIPv6HdrLen) & TCPHO_MAX)
-                              << TCPHO_SHIFT));
-                }
+                offloadFlags = kChecksumTCPIPv6;
+                opts2 = (TxTCPCS_C | TxIPV6F_C |
+                         (hdrInfo.l4Off << TCPHO_SHIFT));
             }
-        } else {
-            /* We use mss as a dummy here because it isn't needed anymore. */
-            mbuf_get_csum_requested(m, &offloadFlags, &mss);
+        }
+    } else {
+        /* We use mss as a dummy here because it isn't needed anymore. */
+        mbuf_get_csum_requested(m, &offloadFlags, &mss);
 
-            if (offloadFlags & kChecksumTCP)
-                opts2 = (TxIPCS_C | TxTCPCS_C);
-            else if (offloadFlags & kChecksumTCPIPv6)
-                opts2 =
-                    (TxTCPCS_C | TxIPV6F_C |
-                     (((ETH_HLEN + kIPv6HdrLen) & TCPHO_MAX) << TCPHO_SHIFT));
-            else if (offloadFlags & kChecksumUDP)
-                opts2 = (TxIPCS_C | TxUDPCS_C);
-            else if (offloadFlags & kChecksumUDPIPv6)
-                opts2 =
-                    (TxUDPCS_C | TxIPV6F_C |
-                     (((ETH_HLEN + kIPv6HdrLen) & TCPHO_MAX) << TCPHO_SHIFT));
-            else if (offloadFlags & kChecksumIP)
-                opts2 = TxIPCS_C;
+        if (offloadFlags & (kChecksumTCPIPv6 | kChecksumUDPIPv6)) {
+            /*
+             * The L4 header offset must be given to the NIC and
+             * it's behind the IPv6 extension headers, if any.
+             */
+            if (!txParseHeaders(m, &hdrInfo) ||
+                (hdrInfo.l4Off > TCPHO_MAX))
+                goto bad_hdr;
         }
-        /* Finally get the physical segments. */
-        if (useAppleVTD)
-            numSegs = txMapPacket(m, txSegments, kMaxSegs);
-        else
-            numSegs = txMbufCursor->getPhysicalSegmentsWithCoalesce(
-                m, txSegments, kMaxSegs);
-
-        /* Alloc required number of descriptors. As the descriptor
-         * which has been freed last must be considered to be still
-         * in use we never fill the ring completely but leave at
-         * least one unused.
-         */
-        if (!numSegs) {
-            DebugLog("SimpleRTK5: getPhysicalSegmentsWithCoalesce() failed. "
-                     "Dropping packet.\n");
-            mbuf_freem_list(m);
-            continue;
+        if (offloadFlags & kChecksumTCP)
+            opts2 = (TxIPCS_C | TxTCPCS_C);
+        else if (offloadFlags & kChecksumTCPIPv6)
+            opts2 = (TxTCPCS_C | TxIPV6F_C |
+                     (hdrInfo.l4Off << TCPHO_SHIFT));
+        else if (offloadFlags & kChecksumUDP)
+            opts2 = (TxIPCS_C | TxUDPCS_C);
+        else if (offloadFlags & kChecksumUDPIPv6)
+            opts2 = (TxUDPCS_C | TxIPV6F_C |
+                     (hdrInfo.l4Off << TCPHO_SHIFT));
+        else if (offloadFlags & kChecksumIP)
+            opts2 = TxIPCS_C;
+    }
+    /*
+     * Finally get the physical segments. Small packets are copied
+     * into the pre-mapped bounce buffer of the descriptor in order
+     * to avoid the cost of mapping them with AppleVTD.
+     */
+map:
+    if (ring->txBounceArray && (len <= txCopyBreak)) {
+        index = ring->txNextDescIndex;
+        mbuf_copydata(m, 0, len, ring->txBounceArray + index * kTxBounceBufSize);
+
+        txSegments[0].location = ring->txBouncePhyAddr + index * kTxBounceBufSize;
+        txSegments[0].length = len;
+        numSegs = 1;
+        premapped = true;
+    } else if (useAppleVTD)
+        numSegs = txMapPacket(ring, m, txSegments, kMaxSegs, &premapped);
+    else
+        numSegs = txMbufCursor->getPhysicalSegmentsWithCoalesce(
+            m, txSegments, kMaxSegs);
+
+    /* Alloc required number of descriptors. As the descriptor
+     * which has been freed last must be considered to be still
+     * in use we never fill the ring completely but leave at
+     * least one unused.
+     */
+    if (!numSegs) {
+        /* Compact an over-fragmented packet and try once again. */
+        if (!linearized && txLinearize(ring, &m)) {
+            linearized = true;
+            goto map;
         }
-        OSAddAtomic(-numSegs, &txNumFreeDesc);
-        index = txNextDescIndex;
-        txNextDescIndex = (txNextDescIndex + numSegs) & kTxDescMask;
+        DebugLog("SimpleRTK5: getPhysicalSegmentsWithCoalesce() failed. "
+                 "Dropping packet.\n");
+        goto drop;
+    }
+    OSAddAtomic(-numSegs, &ring->txNumFreeDesc);
+    ring->txPendingDescs += numSegs;
+    ring->txPackets++;
+    txBqlQueued(ring, pktBytes);
+    index = ring->txNextDescIndex;
+    ring->txNextDescIndex = rtlRingAdvance(ring->txNextDescIndex, numSegs, txDescMask);
 
 #ifdef ENABLE_TX_NO_CLOSE
-        txTailPtr0 += numSegs;
+    ring->txTailPtr0 += numSegs;
 #endif
 
-        lastSeg = numSegs - 1;
+    lastSeg = numSegs - 1;
 
-        /* Next fill in the VLAN tag. */
-        opts2 |= (getVlanTagDemand(m, &vlanTag))
-                     ? (OSSwapInt16(vlanTag) | TxVlanTag)
-                     : 0;
+    /* Next fill in the VLAN tag. */
+    opts2 |= (getVlanTagDemand(m, &vlanTag))
+                 ? (OSSwapInt16(vlanTag) | TxVlanTag)
+                 : 0;
 
-        /* And finally fill in the descriptors. */
-        for (i = 0; i < numSegs; i++) {
-            desc = &txDescArray[index];
-            opts1 = (((UInt32)txSegments[i].length) | cmd | DescOwn);
+    /* And finally fill in the descriptors. */
+    for (i = 0; i < numSegs; i++) {
+        desc = &ring->txDescArray[index];
+        opts1 = (((UInt32)txSegments[i].length) | cmd | DescOwn);
 
-            if (i == 0)
-                opts1 |= FirstFrag;
+        if (i == 0)
+            opts1 |= FirstFrag;
 
-            // opts1 |= (i == 0) ? (FirstFrag | DescOwn) : DescOwn;
+        // opts1 |= (i == 0) ? (FirstFrag | DescOwn) : DescOwn;
 
-            if (i == lastSeg) {
-                opts1 |= LastFrag;
-                txBufArray[index].mbuf = m;
-                txBufArray[index].numDescs = numSegs;
-                txBufArray[index].packetBytes = (UInt32)pktBytes;
-            } else {
-                txBufArray[index].mbuf = NULL;
-                txBufArray[index].numDescs = 0;
-                txBufArray[index].packetBytes = 0;
-            }
-            if (index == kTxLastDesc)
-                opts1 |= RingEnd;
+        if (i == lastSeg) {
+            opts1 |= LastFrag;
+            ring->txBufArray[index].mbuf = m;
+            ring->txBufArray[index].numDescs = numSegs;
+            ring->txBufArray[index].packetBytes = pktBytes;
+            ring->txBufArray[index].premapped = premapped;
+        } else {
+            ring->txBufArray[index].mbuf = NULL;
+            ring->txBufArray[index].numDescs = 0;
+            ring->txBufArray[index].packetBytes = 0;
+            ring->txBufArray[index].premapped = false;
+        }
+        if (index == (numTxDesc - 1))
+            opts1 |= RingEnd;
 
-            desc->addr = OSSwapHostToLittleInt64(txSegments[i].location);
-            desc->opts2 = OSSwapHostToLittleInt32(opts2);
+        desc->addr = OSSwapHostToLittleInt64(txSegments[i].location);
+        desc->opts2 = OSSwapHostToLittleInt32(opts2);
 
 #ifndef ENABLE_TX_NO_CLOSE
-            wmb();
+        wmb();
 #endif
 
-            desc->opts1 = OSSwapHostToLittleInt32(opts1);
+        desc->opts1 = OSSwapHostToLittleInt32(opts1);
+
+        // DebugLog("SimpleRTK5: opts1=0x%x, opts2=0x%x, addr=0x%llx,
+        // len=0x%llx\n", opts1, opts2, txSegments[i].location,
+        // txSegments[i].length);
+        ++index &= txDescMask;
+    }
+
+done:
+    return result;
+
+bad_hdr:
+    DebugLog("SimpleRTK5: Can't locate the L4 header. Dropping packet.\n");
+
+drop:
+    mbuf_freem_list(m);
+    result = false;
+    goto done;
+}
+
+/*
+ * Copy a packet, which is spread over more pages than the NIC
+ * takes segments, into a chain of as few clusters as possible.
+ * The packet header, i.e. the offload requests and the VLAN tag,
+ * is preserved. Returns true and replaces *m with the copy in case
+ * of success. Otherwise *m is left untouched and the caller has to
+ * drop it.
+ */
+bool SimpleRTK5::txLinearize(rtlTxRing *ring, mbuf_t *m) {
+    mbuf_t n, p;
+    UInt64 start, end;
+    UInt32 len, off, l;
+    UInt32 numSegs = 0;
+    unsigned int chunks = kMaxSegs / 2;
+    bool result = false;
+
+    /*
+     * Count the page segments first. A packet which fits into
+     * kMaxSegs segments failed to map for some other reason and
+     * isn't worth to be copied.
+     */
+    for (p = *m; p; p = mbuf_next(p))
+        numSegs += rtlTxPageSegs((IOVirtualAddress)mbuf_data(p), (UInt32)mbuf_len(p));
+
+    if (numSegs <= kMaxSegs)
+        goto done;
+
+    clock_get_uptime(&start);
+
+    len = (UInt32)mbuf_pkthdr_len(*m);
+
+    if (mbuf_allocpacket(MBUF_DONTWAIT, len, &chunks, &n)) {
+        ring->txLinearizeFailures++;
+        goto done;
+    }
+    mbuf_copy_pkthdr(n, *m);
+
+    for (p = n, off = 0; p; p = mbuf_next(p), off += l) {
+        l = min((UInt32)mbuf_maxlen(p), len - off);
+
+        mbuf_setdata(p, mbuf_datastart(p), l);
+        mbuf_copydata(*m, off, l, mbuf_data(p));
+    }
+    mbuf_pkthdr_setlen(n, len);
+    mbuf_freem(*m);
+    *m = n;
+
+    clock_get_uptime(&end);
+
+    ring->txLinearized++;
+    ring->txLinearizeTime += (end - start);
+    result = true;
+
+done:
+    return result;
+}
+
+/*
+ * Send a list of packets linked by their nextpkt field. Returns
+ * the number of packets which have been placed in the ring.
+ */
+UInt32 SimpleRTK5::txSendList(rtlTxRing *ring, mbuf_t list) {
+    mbuf_t m;
+    mbuf_t segs;
+    mbuf_t tail;
+    UInt32 tsoFlags;
+    UInt32 mss;
+    UInt32 count = 0;
+
+    while (list) {
+        /*
+         * Packets which don't fit into the ring anymore, e.g. the
+         * rest of a segmented packet, or exceed the byte limit are
+         * kept for the next pass.
+         */
+        if ((ring->txNumFreeDesc <= kMinFreeDescs) || (txBqlAvail(ring) < 0)) {
+            tail = list;
+
+            while (mbuf_nextpkt(tail))
+                tail = mbuf_nextpkt(tail);
+
+            if (ring->txBacklogTail)
+                mbuf_setnextpkt(ring->txBacklogTail, list);
+            else
+                ring->txBacklogHead = list;
+
+            ring->txBacklogTail = tail;
+            break;
+        }
+        m = list;
+        list = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+
+        /* Send the segments in place of the TSO packet. */
+        if (txNeedsSoftTSO(m, &tsoFlags, &mss)) {
+            segs = txSoftSegment(m, tsoFlags, mss, &tail);
 
-            // DebugLog("SimpleRTK5: opts1=0x%x, opts2=0x%x, addr=0x%llx,
-            // len=0x%llx\n", opts1, opts2, txSegments[i].location,
-            // txSegments[i].length);
-            ++index &= kTxDescMask;
+            if (segs) {
+                mbuf_setnextpkt(tail, list);
+                list = segs;
+            }
+            continue;
         }
+        if (txSendPacket(ring, m, (UInt32)mbuf_pkthdr_len(m)))
+            count++;
+
+        /*
+         * Don't let the NIC wait for the end of a large batch
+         * but announce the descriptors in chunks.
+         */
+        if (ring->txPendingDescs >= kTxDoorbellTreshhold)
+            txDoorbell(ring);
     }
+    return count;
+}
+
+/*
+ * Send the packets left over from the last pass first in order
+ * to maintain the packet order.
+ */
+void SimpleRTK5::txSendBacklog(rtlTxRing *ring) {
+    mbuf_t list = ring->txBacklogHead;
+
+    ring->txBacklogHead = ring->txBacklogTail = NULL;
+    txSendList(ring, list);
+}
+
+/*
+ * Announce the descriptors, which have been filled in since the
+ * last call, to the NIC.
+ */
+void SimpleRTK5::txDoorbell(rtlTxRing *ring) {
     wmb();
 
 #ifndef ENABLE_TX_NO_CLOSE
     /* Update tail pointer. */
-    rtl812xDoorbell(&linuxData, txTailPtr0);
+    rtl812xDoorbell(&linuxData, ring, ring->txTailPtr0);
 #else
-    RTL_W16(&linuxData, TPPOLL_8125, BIT_0);
+    RTL_W16(&linuxData, TPPOLL_8125, BIT(ring->queue));
 #endif
 
-    result = (txNumFreeDesc > kMinFreeDescs) ? kIOReturnSuccess
-                                             : kIOReturnNoResources;
+    ring->txPendingDescs = 0;
+    ring->txDoorbells++;
+}
+
+/*
+ * The number of packets which can be dequeued at once. Even if all
+ * of them need the maximum number of segments, the ring will not
+ * run out of descriptors. The byte budget assumes packets of
+ * maxPktLen bytes, but TSO packets may be much larger. Therefore
+ * txSendList() checks the byte limit for each packet, so that it's
+ * exceeded by one packet at most, which may be a TSO packet of up
+ * to 64KB. The caller has to make sure that txRingHasRoom() is true.
+ */
+static inline UInt32 txBatchBudget(rtlTxRing *ring, UInt32 maxPktLen) {
+    return rtlTxBatchSize(ring->txNumFreeDesc, txBqlAvail(ring), maxPktLen);
+}
+
+/*
+ * Service classes in the order they are dequeued in driver managed
+ * mode. The first kTxNumPrioClasses classes are latency sensitive
+ * and go to the high priority queue, the others to queue 0.
+ */
+static const mbuf_svc_class_t txServiceClasses[] = {
+    MBUF_SC_CTL, MBUF_SC_VO, MBUF_SC_VI, MBUF_SC_RV,
+    MBUF_SC_AV, MBUF_SC_OAM, MBUF_SC_RD,
+    MBUF_SC_BE, MBUF_SC_BK, MBUF_SC_BK_SYS
+};
+
+#define kTxNumServiceClasses (sizeof(txServiceClasses) / sizeof(mbuf_svc_class_t))
+#define kTxNumPrioClasses 7
+#define kTxPrioQueue 1
+
+IOReturn SimpleRTK5::outputStart(IONetworkInterface *interface,
+                                 IOOptionBits options) {
+    rtlTxRing *ring;
+    mbuf_t m;
+    IOReturn result = kIOReturnNoResources;
+    UInt32 i;
+    bool full;
+
+    // DebugLog("SimpleRTK5: outputStart() ===>\n");
+
+    if (!(test_mask((__ENABLED_M | __LINK_UP_M), &stateFlags))) {
+        DebugLog("SimpleRTK5: Interface down. Dropping packets.\n");
+        goto done;
+    }
+    for (i = 0; i < numTxQueues; i++) {
+        if (txRing[i].txBacklogHead)
+            txSendBacklog(&txRing[i]);
+    }
+    if (numTxQueues > 1) {
+        /*
+         * Serve the latency sensitive classes first, so that small
+         * packets don't have to wait behind a TSO burst of a bulk
+         * transfer in the same ring.
+         */
+        for (i = 0; i < kTxNumServiceClasses; i++) {
+            ring = &txRing[(i < kTxNumPrioClasses) ? kTxPrioQueue : 0];
+
+            while (txRingHasRoom(ring) &&
+                   (interface->dequeueOutputPacketsWithServiceClass(
+                    txBatchBudget(ring, mtu + ETH_HLEN), txServiceClasses[i],
+                    &m, NULL, NULL, NULL) == kIOReturnSuccess)) {
+                txSendList(ring, m);
+            }
+        }
+    } else {
+        ring = &txRing[0];
+
+        while (txRingHasRoom(ring) &&
+               (interface->dequeueOutputPackets(txBatchBudget(ring, mtu + ETH_HLEN),
+                &m, NULL, NULL, NULL) == kIOReturnSuccess)) {
+            txSendList(ring, m);
+        }
+    }
+    full = true;
+
+    for (i = 0; i < numTxQueues; i++) {
+        ring = &txRing[i];
+
+        /* Never leave a descriptor unannounced at the end of a pass. */
+        if (ring->txPendingDescs)
+            txDoorbell(ring);
+
+        if (txRingHasRoom(ring))
+            full = false;
+    }
+    result = full ? kIOReturnNoResources : kIOReturnSuccess;
 
 done:
     // DebugLog("SimpleRTK5: outputStart() <===\n");
@@ -820,8 +1135,14 @@ bool SimpleRTK5::configureInterface(IONetworkInterface *interface) {
             goto done;
         }
     }
+    /*
+     * With multiple tx queues the driver dequeues packets by
+     * service class in order to map them to the tx queues.
+     */
     error = interface->configureOutputPullModel(
-        kNumTxDesc, 0, 0,
+        numTxDesc, 0, 0,
+        (numTxQueues > 1) ?
+        IONetworkInterface::kOutputPacketSchedulingModelDriverManaged :
         IONetworkInterface::kOutputPacketSchedulingModelNormal);
 
     if (error != kIOReturnSuccess) {
@@ -829,7 +1150,7 @@ bool SimpleRTK5::configureInterface(IONetworkInterface *interface) {
         result = false;
         goto done;
     }
-    error = interface->configureInputPacketPolling(kNumRxDesc, 0);
+    error = interface->configureInputPacketPolling(numRxDesc, 0);
 
     if (error != kIOReturnSuccess) {
         IOLog("SimpleRTK5: configureInputPacketPolling() failed\n.");
@@ -984,10 +1305,10 @@ UInt32 SimpleRTK5::getFeatures() const {
 
     DebugLog("SimpleRTK5: getFeatures() ===>\n");
 
-    if (enableTSO4)
+    if (enableTSO4 || enableSoftTSO)
         features |= kIONetworkFeatureTSOIPv4;
 
-    if (enableTSO6)
+    if (enableTSO6 || enableSoftTSO)
         features |= kIONetworkFeatureTSOIPv6;
 
     DebugLog("SimpleRTK5: getFeatures() <===\n");
@@ -1179,45 +1500,64 @@ void SimpleRTK5::pciErrorInterrupt() {
 }
 
 #ifdef ENABLE_TX_NO_CLOSE
-void SimpleRTK5::txInterrupt() {
+void SimpleRTK5::txInterrupt(rtlTxRing *ring) {
     struct srtk5_private *tp = &linuxData;
     mbuf_t m;
-    UInt32 nextClosePtr = rtl812xGetHwCloPtr(tp);
-    UInt32 oldDirtyIndex = txDirtyDescIndex;
+    UInt32 nextClosePtr = rtl812xGetHwCloPtr(tp, ring);
+    UInt32 oldDirtyIndex = ring->txDirtyDescIndex;
     UInt32 bytes = 0;
     UInt32 descs = 0;
+    UInt32 packets = 0;
+    SInt32 done = 0;
     UInt32 n;
 
-    n = ((nextClosePtr - txClosePtr0) & tp->MaxTxDescPtrMask);
+    n = ((nextClosePtr - ring->txClosePtr0) & tp->MaxTxDescPtrMask);
 
-    // DebugLog("SimpleRTK5: txInterrupt() txClosePtr0: %u, nextClosePtr: %u,
-    // numDone: %u.\n", txClosePtr0, nextClosePtr, numDone);
+    // DebugLog("SimpleRTK5: txInterrupt() ring->txClosePtr0: %u, nextClosePtr: %u,
+    // numDone: %u.\n", ring->txClosePtr0, nextClosePtr, numDone);
 
-    // txClosePtr0 = nextClosePtr;
-    n = min(txNextDescIndex - txDirtyDescIndex, n);
-    txClosePtr0 += n;
+    // ring->txClosePtr0 = nextClosePtr;
+    n = min(ring->txNextDescIndex - ring->txDirtyDescIndex, n);
+    ring->txClosePtr0 += n;
 
     while (n-- > 0) {
-        m = txBufArray[txDirtyDescIndex].mbuf;
-        txBufArray[txDirtyDescIndex].mbuf = NULL;
+        m = ring->txBufArray[ring->txDirtyDescIndex].mbuf;
+        ring->txBufArray[ring->txDirtyDescIndex].mbuf = NULL;
 
         if (m) {
-            if (useAppleVTD)
-                txUnmapPacket();
+            if (useAppleVTD && !ring->txBufArray[ring->txDirtyDescIndex].premapped)
+                txUnmapPacket(ring);
 
-            descs += txBufArray[txDirtyDescIndex].numDescs;
-            bytes += txBufArray[txDirtyDescIndex].packetBytes;
-            txBufArray[txDirtyDescIndex].numDescs = 0;
-            txBufArray[txDirtyDescIndex].packetBytes = 0;
+            descs += ring->txBufArray[ring->txDirtyDescIndex].numDescs;
+            bytes += ring->txBufArray[ring->txDirtyDescIndex].packetBytes;
+            ring->txBufArray[ring->txDirtyDescIndex].numDescs = 0;
+            ring->txBufArray[ring->txDirtyDescIndex].packetBytes = 0;
+            packets++;
 
             freePacket(m, kDelayFree);
         }
+        if (ring->txBufArray[ring->txDirtyDescIndex].iova) {
+            txIovaPut(ring, ring->txBufArray[ring->txDirtyDescIndex].iova);
+            ring->txBufArray[ring->txDirtyDescIndex].iova = NULL;
+        }
         txDescDoneCount++;
-        OSIncrementAtomic(&txNumFreeDesc);
-        ++txDirtyDescIndex &= kTxDescMask;
+        done++;
+        ++ring->txDirtyDescIndex &= txDescMask;
     }
-    if (oldDirtyIndex != txDirtyDescIndex) {
-        if (txNumFreeDesc > kTxQueueWakeTreshhold)
+    if (oldDirtyIndex != ring->txDirtyDescIndex) {
+        /*
+         * Publish the freed descriptors to outputStart() at once,
+         * after all buffer info entries have been cleared.
+         */
+        OSAddAtomic(done, &ring->txNumFreeDesc);
+        txBqlCompleted(ring, bytes);
+
+        /* Sampled by updateTimerValue(), never reset. */
+        ring->txDonePackets += packets;
+        ring->txDoneBytes += bytes;
+
+        if ((ring->txNumFreeDesc > txQueueWakeTreshhold) &&
+            (txBqlAvail(ring) >= 0))
             netif->signalOutputThread();
 
         releaseFreePackets();
@@ -1227,70 +1567,171 @@ void SimpleRTK5::txInterrupt() {
 }
 
 #else
-void SimpleRTK5::txInterrupt() {
+void SimpleRTK5::txInterrupt(rtlTxRing *ring) {
     mbuf_t m;
-    SInt32 numDirty = kNumTxDesc - txNumFreeDesc;
-    UInt32 oldDirtyIndex = txDirtyDescIndex;
+    SInt32 numDirty = numTxDesc - ring->txNumFreeDesc;
+    UInt32 oldDirtyIndex = ring->txDirtyDescIndex;
     UInt32 bytes = 0;
     UInt32 descs = 0;
+    UInt32 packets = 0;
+    SInt32 done = 0;
     UInt32 descStatus;
 
     while (numDirty-- > 0) {
         descStatus =
-            OSSwapLittleToHostInt32(txDescArray[txDirtyDescIndex].opts1);
+            OSSwapLittleToHostInt32(ring->txDescArray[ring->txDirtyDescIndex].opts1);
 
         if (descStatus & DescOwn)
             break;
 
-        m = txBufArray[txDirtyDescIndex].mbuf;
-        txBufArray[txDirtyDescIndex].mbuf = NULL;
+        m = ring->txBufArray[ring->txDirtyDescIndex].mbuf;
+        ring->txBufArray[ring->txDirtyDescIndex].mbuf = NULL;
 
         if (m) {
-            if (useAppleVTD)
-                txUnmapPacket();
+            if (useAppleVTD && !ring->txBufArray[ring->txDirtyDescIndex].premapped)
+                txUnmapPacket(ring);
 
-            descs += txBufArray[txDirtyDescIndex].numDescs;
-            bytes += txBufArray[txDirtyDescIndex].packetBytes;
-            txBufArray[txDirtyDescIndex].numDescs = 0;
-            txBufArray[txDirtyDescIndex].packetBytes = 0;
+            descs += ring->txBufArray[ring->txDirtyDescIndex].numDescs;
+            bytes += ring->txBufArray[ring->txDirtyDescIndex].packetBytes;
+            ring->txBufArray[ring->txDirtyDescIndex].numDescs = 0;
+            ring->txBufArray[ring->txDirtyDescIndex].packetBytes = 0;
+            packets++;
 
             freePacket(m, kDelayFree);
         }
+        if (ring->txBufArray[ring->txDirtyDescIndex].iova) {
+            txIovaPut(ring, ring->txBufArray[ring->txDirtyDescIndex].iova);
+            ring->txBufArray[ring->txDirtyDescIndex].iova = NULL;
+        }
         txDescDoneCount++;
-        OSIncrementAtomic(&txNumFreeDesc);
-        ++txDirtyDescIndex &= kTxDescMask;
+        done++;
+        ++ring->txDirtyDescIndex &= txDescMask;
     }
-    if (oldDirtyIndex != txDirtyDescIndex) {
-        if (txNumFreeDesc > kTxQueueWakeTreshhold)
+    if (oldDirtyIndex != ring->txDirtyDescIndex) {
+        /*
+         * Publish the freed descriptors to outputStart() at once,
+         * after all buffer info entries have been cleared.
+         */
+        OSAddAtomic(done, &ring->txNumFreeDesc);
+        txBqlCompleted(ring, bytes);
+
+        /* Sampled by updateTimerValue(), never reset. */
+        ring->txDonePackets += packets;
+        ring->txDoneBytes += bytes;
+
+        if ((ring->txNumFreeDesc > txQueueWakeTreshhold) &&
+            (txBqlAvail(ring) >= 0))
             netif->signalOutputThread();
 
         releaseFreePackets();
         OSAddAtomic(descs, &totalDescs);
         OSAddAtomic(bytes, &totalBytes);
 
-        RTL_W16(&linuxData, TPPOLL_8125, BIT_0);
+        /* Kick the NIC again only if there is still work left. */
+        if (ring->txNumFreeDesc < (SInt32)numTxDesc) {
+            RTL_W16(&linuxData, TPPOLL_8125, BIT(ring->queue));
+            ring->txDoorbells++;
+        }
     }
 }
 #endif
 
-UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
-                               IOMbufQueue *pollQueue, void *context) {
-    RtlRxDesc *desc = &rxDescArray[rxNextDescIndex];
+/*
+ * Reclaim the completed descriptors of all tx rings. With the tx
+ * reclaim thread enabled, the work is handed off to a thread call
+ * so that freeing the mbufs and unmapping them isn't charged to the
+ * interrupt or poll path, which then only has to process received
+ * packets. A pending reclaim pass covers all completions up to the
+ * time it runs, so that it's scheduled only once.
+ */
+void SimpleRTK5::txReclaim() {
+    UInt32 i;
+
+    if (txReclaimCall) {
+        if (!test_and_set_bit(__TX_RECLAIM, &stateFlags))
+            thread_call_enter(txReclaimCall);
+    } else if (txWorkLoop) {
+        /* In MSI-X mode the tx rings are owned by the tx work loop. */
+        txWorkLoop->runAction(&txReclaimAction, this);
+    } else {
+        for (i = 0; i < numTxQueues; i++)
+            txInterrupt(&txRing[i]);
+    }
+}
+
+void SimpleRTK5::runTxReclaimThread(thread_call_param_t param0) {
+    ((SimpleRTK5 *)param0)->txReclaimThread();
+}
+
+void SimpleRTK5::txReclaimThread() {
+    UInt32 i;
+
+    /*
+     * Clear the flag first, so that completions which are signaled
+     * while we are running schedule another pass.
+     */
+    clear_bit(__TX_RECLAIM, &stateFlags);
+
+    for (i = 0; i < numTxQueues; i++)
+        txInterrupt(&txRing[i]);
+}
+
+/*
+ * Get the status of the next batch of ready descriptors and prefetch
+ * the buffer info as well as the packet headers of the batch before
+ * it's processed.
+ */
+UInt32 SimpleRTK5::rxScanBatch(rtlRxRing *ring, rtlRxDescStatus *status, UInt32 count) {
+    rtlRxBufferInfo *info;
+    UInt32 index = ring->rxNextDescIndex;
+    UInt32 n, i;
+
+    n = rxScanDescs(ring->rxDescArray, rxDescType, index, rxDescMask, status, count);
+
+    for (i = 0; i < n; i++) {
+        __builtin_prefetch(&ring->rxBufArray[index]);
+        index = (index + 1) & rxDescMask;
+    }
+    for (i = 0, index = ring->rxNextDescIndex; i < n; i++) {
+        info = &ring->rxBufArray[index];
+        __builtin_prefetch(mbuf_datastart(info->mbuf));
+        index = (index + 1) & rxDescMask;
+    }
+    return n;
+}
+
+UInt32 SimpleRTK5::rxInterrupt(rtlRxRing *ring, IONetworkInterface *interface,
+                               uint32_t maxCount, IOMbufQueue *pollQueue,
+                               void *context) {
+    rtlRxDescStatus batchStatus[kRxScanBatch];
+    rtlRxDescStatus *status;
     mbuf_t bufPkt, newPkt;
+    IOPhysicalAddress64 pa;
     UInt64 addr;
-    UInt64 word1;
+    UInt32 word1;
+    UInt32 batchCount = 0;
+    UInt32 batchIndex = 0;
     UInt32 descStatus1, descStatus2;
     SInt32 pktSize;
     UInt32 goodPkts = 0;
     bool replaced;
 
-    while (
-        !((descStatus1 = OSSwapLittleToHostInt32(desc->cmd.opts1)) & DescOwn) &&
-        (goodPkts < maxCount)) {
-        word1 = (rxNextDescIndex == kRxLastDesc)
-                    ? (kRxBufferSize | DescOwn | RingEnd)
-                    : (kRxBufferSize | DescOwn);
-        addr = rxBufArray[rxNextDescIndex].phyAddr;
+    while (goodPkts < maxCount) {
+        /* Get the status of the next batch of ready descriptors. */
+        if (batchIndex == batchCount) {
+            batchCount = rxScanBatch(ring, batchStatus, min(maxCount - goodPkts, kRxScanBatch));
+            batchIndex = 0;
+
+            if (!batchCount)
+                break;
+        }
+        status = &batchStatus[batchIndex++];
+        descStatus1 = status->opts1;
+        descStatus2 = status->opts2;
+        word1 = (ring->rxNextDescIndex == (numRxDesc - 1))
+                    ? (rxDescBufSize | DescOwn | RingEnd)
+                    : (rxDescBufSize | DescOwn);
+        addr = ring->rxBufArray[ring->rxNextDescIndex].phyAddr;
 
         /* Drop packets with receive errors. */
         if (unlikely(descStatus1 & RxRES)) {
@@ -1302,17 +1743,16 @@ UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
             if (descStatus1 & RxCRC)
                 etherStats->dot3StatsEntry.fcsErrors++;
 
-            discardPacketFragment();
+            discardPacketFragment(ring);
             goto nextDesc;
         }
 
-        descStatus2 = OSSwapLittleToHostInt32(desc->cmd.opts2);
-        pktSize = (descStatus1 & 0x1fff);
-        bufPkt = rxBufArray[rxNextDescIndex].mbuf;
+        pktSize = (descStatus1 & 0x3fff);
+        bufPkt = ring->rxBufArray[ring->rxNextDescIndex].mbuf;
         // DebugLog("SimpleRTK5: rxInterrupt(): descStatus1=0x%x,
         // descStatus2=0x%x, pktSize=%u\n", descStatus1, descStatus2, pktSize);
 
-        newPkt = rxPool->replaceOrCopyPacket(&bufPkt, pktSize, &replaced);
+        newPkt = ring->rxPool->replaceOrCopyPacket(&bufPkt, pktSize, &replaced, &pa);
 
         if (unlikely(!newPkt)) {
             /*
@@ -1321,7 +1761,7 @@ UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
              */
             DebugLog("SimpleRTK5: replaceOrCopyPacket() failed.\n");
             etherStats->dot3RxExtraEntry.resourceErrors++;
-            discardPacketFragment();
+            discardPacketFragment(ring);
             goto nextDesc;
         }
     handle_pkt:
@@ -1331,26 +1771,26 @@ UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
             if (unlikely(mbuf_next(bufPkt) != NULL)) {
                 DebugLog("SimpleRTK5: getPhysicalSegment() failed.\n");
                 etherStats->dot3RxExtraEntry.resourceErrors++;
-                discardPacketFragment();
+                discardPacketFragment(ring);
                 mbuf_freem_list(bufPkt);
                 goto nextDesc;
             }
-            rxBufArray[rxNextDescIndex].mbuf = bufPkt;
-            addr = mbuf_data_to_physical(mbuf_datastart(bufPkt));
-            rxBufArray[rxNextDescIndex].phyAddr = addr;
+            ring->rxBufArray[ring->rxNextDescIndex].mbuf = bufPkt;
+            addr = (pa) ? pa : mbuf_data_to_physical(mbuf_datastart(bufPkt));
+            ring->rxBufArray[ring->rxNextDescIndex].phyAddr = addr;
         }
         if (descStatus1 & LastFrag) {
             pktSize -= kIOEthernetCRCSize;
 
-            if (rxPacketHead) {
+            if (ring->rxPacketHead) {
                 if (pktSize > 0) {
                     /* This is the last buffer of a jumbo frame. */
                     mbuf_setlen(newPkt, pktSize);
 
                     mbuf_setflags_mask(newPkt, 0, MBUF_PKTHDR);
-                    mbuf_setnext(rxPacketTail, newPkt);
+                    mbuf_setnext(ring->rxPacketTail, newPkt);
 
-                    rxPacketTail = newPkt;
+                    ring->rxPacketTail = newPkt;
                 } else {
                     /*
                      * The last fragment consists only of the FCS or a part
@@ -1360,9 +1800,9 @@ UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
                     DebugLog("SimpleRTK5: Packet size: %d. Dropping!\n",
                              pktSize);
                     mbuf_free(newPkt);
-                    mbuf_adjustlen(rxPacketTail, pktSize);
+                    mbuf_adjustlen(ring->rxPacketTail, pktSize);
                 }
-                rxPacketSize += pktSize;
+                ring->rxPacketSize += pktSize;
             } else {
                 /*
                  * We've got a complete packet in one buffer.
@@ -1370,67 +1810,226 @@ UInt32 SimpleRTK5::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
                  */
                 mbuf_setlen(newPkt, pktSize);
 
-                rxPacketHead = newPkt;
-                rxPacketSize = pktSize;
+                ring->rxPacketHead = newPkt;
+                ring->rxPacketSize = pktSize;
             }
             getChecksumResult(newPkt, descStatus1, descStatus2);
 
             /* Also get the VLAN tag if there is any. */
             if (descStatus2 & RxVlanTag)
-                setVlanTag(rxPacketHead, OSSwapInt16(descStatus2 & 0xffff));
+                setVlanTag(ring->rxPacketHead, OSSwapInt16(descStatus2 & 0xffff));
+
+            mbuf_pkthdr_setlen(ring->rxPacketHead, ring->rxPacketSize);
 
-            mbuf_pkthdr_setlen(rxPacketHead, rxPacketSize);
-            interface->enqueueInputPacket(rxPacketHead, pollQueue);
+            if (enableLRO)
+                lroInput(ring, ring->rxPacketHead, status);
+            else
+                rxListAppend(ring, ring->rxPacketHead);
 
-            rxPacketHead = rxPacketTail = NULL;
-            rxPacketSize = 0;
+            ring->rxPacketHead = ring->rxPacketTail = NULL;
+            ring->rxPacketSize = 0;
 
             goodPkts++;
         } else {
             mbuf_setlen(newPkt, pktSize);
 
-            if (rxPacketHead) {
+            if (ring->rxPacketHead) {
                 /* We are in the middle of a jumbo frame. */
                 mbuf_setflags_mask(newPkt, 0, MBUF_PKTHDR);
-                mbuf_setnext(rxPacketTail, newPkt);
+                mbuf_setnext(ring->rxPacketTail, newPkt);
 
-                rxPacketTail = newPkt;
-                rxPacketSize += pktSize;
+                ring->rxPacketTail = newPkt;
+                ring->rxPacketSize += pktSize;
             } else {
                 /* This is the first buffer of a jumbo frame. */
-                rxPacketHead = rxPacketTail = newPkt;
-                rxPacketSize = pktSize;
+                ring->rxPacketHead = ring->rxPacketTail = newPkt;
+                ring->rxPacketSize = pktSize;
             }
         }
 
         /* Finally update the descriptor and get the next one to examine. */
     nextDesc:
-        desc->buf.addr = OSSwapHostToLittleInt64(addr);
-        desc->buf.blen = OSSwapHostToLittleInt64(word1);
+        rxDescSet(ring, ring->rxNextDescIndex, addr, word1);
 
-        ++rxNextDescIndex &= kRxDescMask;
-        desc = &rxDescArray[rxNextDescIndex];
+        ++ring->rxNextDescIndex &= rxDescMask;
     }
+    if (enableLRO)
+        lroFlushAll(ring);
+
+    /* Hand the packets of this drain over to the stack. */
+    if (ring->rxListHead)
+        rxListHandoff(ring, interface, pollQueue);
+
+    if (goodPkts)
+        ring->rxPool->updateCopyBreak(0);
+
     return goodPkts;
 }
 
+/*
+ * Hand the list of packets collected during a rx drain over to the
+ * network stack in a single pass. IONetworkInterface accepts only one
+ * packet at a time, but as the descriptors have already been returned
+ * to the NIC, the packets are passed up back to back. The ring's
+ * counters are updated once per drain.
+ */
+void SimpleRTK5::rxListHandoff(rtlRxRing *ring, IONetworkInterface *interface,
+                               IOMbufQueue *pollQueue) {
+    mbuf_t m, next;
+
+    for (m = ring->rxListHead; m; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+
+        interface->enqueueInputPacket(m, pollQueue);
+    }
+    ring->rxPackets += ring->rxListCount;
+    ring->rxBytes += ring->rxListBytes;
+
+    ring->rxListHead = ring->rxListTail = NULL;
+    ring->rxListCount = 0;
+    ring->rxListBytes = 0;
+}
+
+/*
+ * Rx queues 1 to 3 report their interrupts in ISR1 and are masked
+ * in IMR1, a pair of 16 bit registers per queue. With the single
+ * MSI vector they are enabled together with RxOK in IMR0 and their
+ * status is merged into the status of ISR0.
+ */
+void SimpleRTK5::rtl812xSetQueueIntrMask(struct srtk5_private *tp, UInt32 mask) {
+    UInt16 qMask = (mask & RxOK) ? other_q_intr_mask : 0;
+    UInt32 i;
+
+    for (i = 1; i < numRxQueues; i++)
+        RTL_W16(tp, IMR1_8125 + (i - 1) * 4, qMask);
+}
+
+UInt32 SimpleRTK5::rtl812xAckQueueIntr(struct srtk5_private *tp) {
+    UInt32 status = 0;
+    UInt16 qStatus;
+    UInt32 i;
+
+    for (i = 1; i < numRxQueues; i++) {
+        qStatus = RTL_R16(tp, ISR1_8125 + (i - 1) * 4);
+
+        if ((qStatus == 0xFFFF) || !(qStatus & other_q_intr_mask))
+            continue;
+
+        RTL_W16(tp, ISR1_8125 + (i - 1) * 4, (qStatus & other_q_intr_mask));
+
+        if (qStatus & RxOK1)
+            status |= RxOK;
+
+        if (qStatus & RxDU1)
+            status |= RxDescUnavail;
+    }
+    return status;
+}
+
+/*
+ * Primary interrupt filter of the MSI interrupt, which runs in
+ * interrupt context. With enableIntrFilter it reads and acknowledges
+ * the interrupt status, so that the work loop is only woken up in
+ * case there is work pending. Otherwise it just takes the timestamp
+ * for the latency statistics and leaves everything else to the
+ * secondary handler.
+ */
+bool SimpleRTK5::intrFilter(OSObject *owner, IOFilterInterruptEventSource *src) {
+    struct srtk5_private *tp = &linuxData;
+    UInt32 status;
+    bool result = true;
+
+    if (enableIntrFilter) {
+        status = RTL_R32(tp, ISR0_8125);
+
+        if ((status != 0xFFFFFFFF) && (numRxQueues > 1))
+            status |= rtl812xAckQueueIntr(tp);
+
+        /* hotplug/major error/no more work/shared irq */
+        if ((status == 0xFFFFFFFF) || !(status & intrMask)) {
+            intrSpurious++;
+            result = false;
+            goto done;
+        }
+        RTL_W32(tp, IMR0_8125, 0x0000);
+        RTL_W32(tp, ISR0_8125, (status & ~RxFIFOOver));
+        rtl812xSetQueueIntrMask(tp, 0);
+
+        OSBitOrAtomic(status, &intrStatus);
+    }
+    if (!intrTime)
+        clock_get_uptime(&intrTime);
+
+done:
+    return result;
+}
+
+/*
+ * Get the interrupt status for the secondary handler, either from
+ * the filter, which has already masked and acknowledged it, or from
+ * the chip. Returns 0 in case there is nothing to do.
+ */
+UInt32 SimpleRTK5::intrGetStatus(struct srtk5_private *tp) {
+    UInt32 status;
+
+    intrUpdateLatency();
+
+    if (enableIntrFilter) {
+        status = OSBitAndAtomic(0, &intrStatus);
+    } else {
+        status = RTL_R32(tp, ISR0_8125);
+
+        // DebugLog("SimpleRTK5: interruptHandler: status = 0x%x.\n", status);
+
+        if ((status != 0xFFFFFFFF) && (numRxQueues > 1))
+            status |= rtl812xAckQueueIntr(tp);
+
+        /* hotplug/major error/no more work/shared irq */
+        if ((status == 0xFFFFFFFF) || !status) {
+            intrSpurious++;
+            status = 0;
+            goto done;
+        }
+        RTL_W32(tp, IMR0_8125, 0x0000);
+        RTL_W32(tp, ISR0_8125, (status & ~RxFIFOOver));
+        rtl812xSetQueueIntrMask(tp, 0);
+    }
+
+done:
+    return status;
+}
+
+/* Account the time from the primary interrupt to its handler. */
+void SimpleRTK5::intrUpdateLatency() {
+    UInt64 now, delay;
+    UInt32 i;
+
+    if (!intrTime)
+        return;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - intrTime, &delay);
+    intrTime = 0;
+
+    for (delay /= 2000, i = 0; delay && (i < (kIntrLatBuckets - 1)); i++)
+        delay >>= 1;
+
+    intrLatHist[i]++;
+}
+
 void SimpleRTK5::interruptOccurred(OSObject *client,
                                    IOInterruptEventSource *src, int count) {
     struct srtk5_private *tp = &linuxData;
     UInt32 rxPackets = 0;
     UInt32 status;
+    UInt32 i;
 
-    status = RTL_R32(tp, ISR0_8125);
-
-    // DebugLog("SimpleRTK5: interruptHandler: status = 0x%x.\n", status);
+    status = intrGetStatus(tp);
 
-    /* hotplug/major error/no more work/shared irq */
-    if ((status == 0xFFFFFFFF) || !status)
+    if (!status)
         goto done;
 
-    RTL_W32(tp, IMR0_8125, 0x0000);
-    RTL_W32(tp, ISR0_8125, (status & ~RxFIFOOver));
-
     if (status & SYSErr) {
         pciErrorInterrupt();
         goto done;
@@ -1439,7 +2038,9 @@ void SimpleRTK5::interruptOccurred(OSObject *client,
         !test_and_set_bit(__POLLING, &stateFlags)) {
         /* Rx interrupt */
         if (status & (RxOK | RxDescUnavail)) {
-            rxPackets = rxInterrupt(netif, kNumRxDesc, NULL, NULL);
+            /* All rx queues share a single interrupt vector. */
+            for (i = 0; i < numRxQueues; i++)
+                rxPackets += rxInterrupt(&rxRing[i], netif, numRxDesc, NULL, NULL);
 
             if (rxPackets)
                 netif->flushInputQueue();
@@ -1448,7 +2049,7 @@ void SimpleRTK5::interruptOccurred(OSObject *client,
         }
         /* Tx interrupt */
         if (status & (TxOK)) {
-            txInterrupt();
+            txReclaim();
 
             etherStats->dot3TxExtraEntry.interrupts++;
         }
@@ -1463,6 +2064,10 @@ void SimpleRTK5::interruptOccurred(OSObject *client,
         } else {
             intrMask = intrMaskRxTx;
         }
+        /* Leave the rings to the busy poll thread under load. */
+        if (busyPollCheck())
+            intrMask = intrMaskPoll;
+
         clear_bit(__POLLING, &stateFlags);
     }
     if (status & LinkChg) {
@@ -1475,13 +2080,20 @@ void SimpleRTK5::interruptOccurred(OSObject *client,
 
 done:
     RTL_W32(tp, IMR0_8125, intrMask);
+    rtl812xSetQueueIntrMask(tp, intrMask);
 }
 
 bool SimpleRTK5::txHangCheck() {
     struct srtk5_private *tp = &linuxData;
+    UInt32 q;
+    bool pending = false;
     bool deadlock = false;
 
-    if ((txDescDoneCount == txDescDoneLast) && (txNumFreeDesc < kNumTxDesc)) {
+    for (q = 0; q < numTxQueues; q++) {
+        if (txRing[q].txNumFreeDesc < numTxDesc)
+            pending = true;
+    }
+    if ((txDescDoneCount == txDescDoneLast) && pending) {
         if (++deadlockWarn == kTxCheckTreshhold) {
             /* Some members of the RTL8125 family seem to be prone to lose
              * transmitter rinterrupts. In order to avoid false positives when
@@ -1493,17 +2105,23 @@ bool SimpleRTK5::txHangCheck() {
                      RTL_R32(tp, ISR0_8125), RTL_R32(tp, IMR0_8125),
                      test_bit(__POLL_MODE, &stateFlags));
             etherStats->dot3TxExtraEntry.timeouts++;
-            txInterrupt();
+
+            txReclaim();
         } else if (deadlockWarn >= kTxDeadlockTreshhold) {
 #ifdef DEBUG
+            rtlTxRing *ring;
             UInt32 i, index;
 
-            for (i = 0; i < 10; i++) {
-                index = ((txDirtyDescIndex - 1 + i) & kTxDescMask);
-                IOLog("SimpleRTK5: desc[%u]: opts1=0x%x, opts2=0x%x, "
-                      "addr=0x%llx.\n",
-                      index, txDescArray[index].opts1, txDescArray[index].opts2,
-                      txDescArray[index].addr);
+            for (q = 0; q < numTxQueues; q++) {
+                ring = &txRing[q];
+
+                for (i = 0; i < 10; i++) {
+                    index = rtlRingAdvance(ring->txDirtyDescIndex - 1, i, txDescMask);
+                    IOLog("SimpleRTK5: queue %u desc[%u]: opts1=0x%x, opts2=0x%x, "
+                          "addr=0x%llx.\n", q,
+                          index, ring->txDescArray[index].opts1, ring->txDescArray[index].opts2,
+                          ring->txDescArray[index].addr);
+                }
             }
 #endif
             IOLog("SimpleRTK5: Tx stalled? Resetting chipset. ISR0=0x%x, "
@@ -1529,7 +2147,9 @@ IOReturn SimpleRTK5::setInputPacketPollingEnable(IONetworkInterface *interface,
 
     if (test_bit(__ENABLED, &stateFlags)) {
         if (enabled) {
+            /* The stack's poll mode takes precedence over busy polling. */
             set_bit(__POLL_MODE, &stateFlags);
+            clear_bit(__BUSY_POLL, &stateFlags);
 
             intrMask = intrMaskPoll;
         } else {
@@ -1540,9 +2160,10 @@ IOReturn SimpleRTK5::setInputPacketPollingEnable(IONetworkInterface *interface,
             /* Clear per interrupt tx counters. */
             totalDescs = 0;
             totalBytes = 0;
+            dimReset();
         }
         timerValue = 0;
-        RTL_W32(tp, IMR0_8125, intrMask);
+        rtl812xSetIntrMask(intrMask);
     }
     DebugLog("SimpleRTK5: Input polling %s.\n",
              enabled ? "enabled" : "disabled");
@@ -1555,18 +2176,44 @@ IOReturn SimpleRTK5::setInputPacketPollingEnable(IONetworkInterface *interface,
 void SimpleRTK5::pollInputPackets(IONetworkInterface *interface,
                                   uint32_t maxCount, IOMbufQueue *pollQueue,
                                   void *context) {
+    rtlRxRing *ring;
+    UInt32 packets = 0;
+    UInt32 count;
+    UInt32 i;
+
     // DebugLog("SimpleRTK5: pollInputPackets() ===>\n");
 
     if (test_bit(__POLL_MODE, &stateFlags) &&
         !test_and_set_bit(__POLLING, &stateFlags)) {
 
-        if (useAppleVTD)
-            rxInterruptVTD(interface, maxCount, pollQueue, context);
-        else
-            rxInterrupt(interface, maxCount, pollQueue, context);
+        /*
+         * Start with a different queue each time so that the budget
+         * is shared fairly among the rx queues.
+         */
+        for (i = 0; (i < numRxQueues) && (packets < maxCount); i++) {
+            ring = &rxRing[(rxPollQueue + i) & (numRxQueues - 1)];
+
+            if (useAppleVTD)
+                count = rxInterruptVTD(ring, interface, maxCount - packets, pollQueue, context);
+            else
+                count = rxInterrupt(ring, interface, maxCount - packets, pollQueue, context);
+
+            if (count > pollTune.maxFill)
+                pollTune.maxFill = count;
+
+            packets += count;
+        }
+        rxPollQueue = (rxPollQueue + 1) & (numRxQueues - 1);
+
+        /* Feed the poll interval controller. */
+        if (enablePollTuning) {
+            pollTune.polls++;
+            pollTune.packets += packets;
+        }
 
-        /* Finally cleanup the transmitter ring. */
-        txInterrupt();
+        /* Finally cleanup the transmitter rings. */
+        if (!msixLayout)
+            txReclaim();
 
         clear_bit(__POLLING, &stateFlags);
     }
@@ -1575,6 +2222,7 @@ void SimpleRTK5::pollInputPackets(IONetworkInterface *interface,
 
 void SimpleRTK5::timerAction(IOTimerEventSource *timer) {
     struct srtk5_private *tp = &linuxData;
+    UInt32 i;
 
 #ifdef DEBUG_INTR
     UInt32 tmrIntr = tmrInterrupts - lastTmrIntrupts;
@@ -1597,9 +2245,21 @@ void SimpleRTK5::timerAction(IOTimerEventSource *timer) {
     if (!test_bit(__LINK_UP, &stateFlags))
         goto done;
 
+    /* Sample the last dump before the tally counters are refreshed. */
+    if (enablePollTuning)
+        pollTuneUpdate();
+
     rtl812xDumpTallyCounter(tp);
     thread_call_enter_delayed(statCall, statDelay);
 
+    /* Unmap the pages an idle tx ring still keeps mapped. */
+    if (useAppleVTD) {
+        for (i = 0; i < numTxQueues; i++) {
+            if (txRing[i].txIovaCache)
+                txIovaSweep(&txRing[i]);
+        }
+    }
+
     /* Check for tx deadlock. */
     if (txHangCheck())
         goto done;
@@ -1612,73 +2272,53 @@ done:
 
 #pragma mark--- miscellaneous functions ---
 
-static inline void prepareTSO4(mbuf_t m, UInt32 *tcpOffset, UInt32 *mss) {
-    struct ip *iphdr;
-
-    struct tcphdr *tcphdr;
-    UInt16 *addr;
-    int i = (int)mbuf_len(m);
+static inline void prepareTSO4(mbuf_t m, rtlTxHdrInfo *info, UInt32 *mss) {
+    UInt16 addr[4];
+    UInt16 sum;
     UInt32 csum32 = 6;
-    UInt32 il;
+    int i;
 
     /*
-     * VLAN packets have the L3 and L4 headers in the second mbuf.
-     * The first one carries only the L2 header.
+     * The headers may be spread over several mbufs, so that they
+     * are accessed with mbuf_copydata() and mbuf_copyback() using
+     * the offsets found by txParseHeaders().
      */
-    if (i == ETH_HLEN)
-        iphdr = (struct ip *)mbuf_data(mbuf_next(m));
-    else
-        iphdr = (struct ip *)((UInt8 *)mbuf_data(m) + ETH_HLEN);
-
-    addr = (UInt16 *)&iphdr->ip_src;
+    mbuf_copydata(m, info->l3Off + offsetof(struct ip, ip_src), sizeof(addr), addr);
 
     for (i = 0; i < 4; i++) {
-        csum32 += ntohs(*addr++);
+        csum32 += ntohs(addr[i]);
         csum32 += (csum32 >> 16);
         csum32 &= 0xffff;
     }
-    il = ((iphdr->ip_hl & 0x0f) << 2);
-    tcphdr = (struct tcphdr *)((UInt8 *)iphdr + il);
-    // DebugLog("SimpleRTK5: IPv4 header length: %u\n", il);
-
     /* Fill in the pseudo header checksum for TSOv4. */
-    tcphdr->th_sum = htons((UInt16)csum32);
-
-    *tcpOffset = ETH_HLEN + il;
+    sum = htons((UInt16)csum32);
+    mbuf_copyback(m, info->l4Off + offsetof(struct tcphdr, th_sum), sizeof(sum), &sum, MBUF_DONTWAIT);
 
     if (*mss > MSS_MAX)
         *mss = MSS_MAX;
 }
 
-static inline void prepareTSO6(mbuf_t m, UInt32 *tcpOffset, UInt32 *mss) {
-    struct ip6_hdr *ip6Hdr;
-    struct tcphdr *tcpHdr;
-    int i = (int)mbuf_len(m);
+static inline void prepareTSO6(mbuf_t m, rtlTxHdrInfo *info, UInt32 *mss) {
+    UInt16 addr[16];
+    UInt16 sum = 0;
     UInt32 csum32 = 6;
+    int i;
 
-    /*
-     * VLAN packets have the L3 and L4 headers in the second mbuf.
-     * The first one carries only the L2 header.
-     */
-    if (i == ETH_HLEN)
-        ip6Hdr = (struct ip6_hdr *)mbuf_data(mbuf_next(m));
-    else
-        ip6Hdr = (struct ip6_hdr *)((UInt8 *)mbuf_data(m) + ETH_HLEN);
-
-    ip6Hdr->ip6_ctlun.ip6_un1.ip6_un1_plen = 0;
+    /* Clear the payload length. */
+    mbuf_copyback(m, info->l3Off + offsetof(struct ip6_hdr, ip6_ctlun.ip6_un1.ip6_un1_plen), sizeof(sum), &sum, MBUF_DONTWAIT);
+    mbuf_copydata(m, info->l3Off + offsetof(struct ip6_hdr, ip6_src), sizeof(addr), addr);
 
     for (i = 0; i < 16; i++) {
-        csum32 += ntohs(ip6Hdr->ip6_src.__u6_addr.__u6_addr16[i]);
+        csum32 += ntohs(addr[i]);
         csum32 += (csum32 >> 16);
         csum32 &= 0xffff;
     }
-    /* Get the length of the TCP header. */
-    tcpHdr = (struct tcphdr *)((UInt8 *)ip6Hdr + kIPv6HdrLen);
-
-    /* Fill in the pseudo header checksum for TSOv6. */
-    tcpHdr->th_sum = htons((UInt16)csum32);
-
-    *tcpOffset = ETH_HLEN + kIPv6HdrLen;
+    /*
+     * Fill in the pseudo header checksum for TSOv6. The TCP header
+     * follows the extension headers, if there are any.
+     */
+    sum = htons((UInt16)csum32);
+    mbuf_copyback(m, info->l4Off + offsetof(struct tcphdr, th_sum), sizeof(sum), &sum, MBUF_DONTWAIT);
 
     if (*mss > MSS_MAX)
         *mss = MSS_MAX;
@@ -26,7 +26,17 @@
  */
 
 #include "SimpleRTK5RxPool.hpp"
+#include "SimpleRTK5Ring.hpp"
+#include "SimpleRTK5Rss.hpp"
 #include "rtl812x.h"
+#include "SimpleRTK5RxDesc.hpp"
+#include "SimpleRTK5Iova.hpp"
+#include "SimpleRTK5TxHdr.hpp"
+#include "SimpleRTK5Bql.hpp"
+#include "SimpleRTK5Dim.hpp"
+#include "SimpleRTK5Msix.hpp"
+#include "SimpleRTK5BusyPoll.hpp"
+#include "SimpleRTK5Lro.hpp"
 
 struct RtlChipFwInfo {
     const char *name;
@@ -111,6 +121,8 @@ enum RtlStateFlags {
     __M_CAST = 3,    /* multicast mode enabled */
     __POLL_MODE = 4, /* poll mode is active */
     __POLLING = 5,   /* poll routine is polling */
+    __TX_RECLAIM = 6, /* tx reclaim thread is scheduled */
+    __BUSY_POLL = 7, /* busy poll thread owns the rx rings */
 };
 
 enum RtlStateMask {
@@ -120,21 +132,10 @@ enum RtlStateMask {
     __M_CAST_M = (1 << __M_CAST),
     __POLL_MODE_M = (1 << __POLL_MODE),
     __POLLING_M = (1 << __POLLING),
+    __TX_RECLAIM_M = (1 << __TX_RECLAIM),
+    __BUSY_POLL_M = (1 << __BUSY_POLL),
 };
 
-/* RTL8125's Rx descriptor. */
-typedef union RtlRxDesc {
-    struct {
-        UInt32 opts1;
-        UInt32 opts2;
-        UInt64 addr;
-    } cmd;
-    struct {
-        UInt64 blen;
-        UInt64 addr;
-    } buf;
-} RtlRxDesc;
-
 /* RTL8125's Tx descriptor. */
 typedef struct RtlTxDesc {
     UInt32 opts1;
@@ -194,39 +195,12 @@ typedef struct RtlStatData {
 
 #define kTransmitQueueCapacity 1024
 
-/* With up to 32 segments we should be on the save side. */
-#define kMaxSegs 32
-
-/* The number of descriptors must be a power of 2. */
-#define kNumTxDesc 512 /* Number of Tx descriptors */
-#define kNumRxDesc 512 /* Number of Rx descriptors */
-#define kTxLastDesc (kNumTxDesc - 1)
-#define kRxLastDesc (kNumRxDesc - 1)
-#define kTxDescMask (kNumTxDesc - 1)
-#define kRxDescMask (kNumRxDesc - 1)
-#define kTxDescSize (kNumTxDesc * sizeof(struct RtlTxDesc))
-#define kRxDescSize (kNumRxDesc * sizeof(union RtlRxDesc))
-#define kRxBufArraySize (kNumRxDesc * sizeof(struct rtlRxBufferInfo))
-#define kTxBufArraySize (kNumTxDesc * sizeof(struct rtlTxBufferInfo))
-
-/* Numbers of IOMemoryDescriptors and IORanges for tx */
-#define kNumTxMemDesc (kNumTxDesc / 2)
-#define kTxMemDescMask (kNumTxMemDesc - 1)
-#define kNumTxRanges (kNumTxDesc + kMaxSegs)
-#define kTxRangeMask kTxDescMask
-#define kTxMapMemSize sizeof(struct rtlTxMapInfo)
-
-/* Numbers of IOMemoryDescriptors and batch size for rx */
-#define kRxMemBaseShift 4
-#define kNumRxMemDesc (kNumRxDesc >> kRxMemBaseShift)
-#define kRxMapMemSize (sizeof(struct rtlRxMapInfo))
-#define kRxMemBatchSize (kNumRxDesc / kNumRxMemDesc)
-#define kRxMemDescMask (kRxMemBatchSize - 1)
-#define kRxMemBaseMask ~kRxMemDescMask
-
 /* This is the receive buffer size (must be large enough to hold a packet). */
 #define kRxBufferSize PAGE_SIZE
 
+/* In jumbo mode a 16k cluster holds a complete jumbo frame. */
+#define kRxJumboBufferSize (16 * 1024)
+
 /* This is the receive buffer size (must be large enough to hold a packet). */
 #define kMCFilterLimit 32
 #define kMaxMtu 9000
@@ -236,27 +210,32 @@ typedef struct RtlStatData {
 #define kTimeoutMS 1000
 #define kStatDelayTime 1000000UL /* 1ms */
 
+/* Number of rx descriptors examined at once */
+#define kRxScanBatch 16
+
 /* RealtekRxPool capacities */
 #define kRxPoolClstCap 100 /* mbufs with 4k cluster*/
 #define kRxPoolMbufCap 50  /* mbufs without clusters */
 
-/* Treshhold value to wake a stalled queue */
-#define kTxQueueWakeTreshhold (kNumTxDesc / 10)
-#define kMinFreeDescs (kMaxSegs + 2)
+/* Size of the pre-mapped tx bounce buffers used with AppleVTD */
+#define kTxBounceBufSize 512
+#define kTxDefCopyBreak 256
 
 /* transmitter deadlock treshhold in seconds. */
 #define kTxDeadlockTreshhold 6
 #define kTxCheckTreshhold (kTxDeadlockTreshhold - 1)
 
-/* timer value for interrupt throttling */
-#define kTimerDefault 0x2600
-#define kTimerBulk 0x5f00
-#define kTimerLat1 (kTimerDefault / 2)
-#define kTimerLat2 ((kTimerDefault / 4) * 3)
 #define kTimespan4ms 4000000UL
 
-#define kIPv6HdrLen sizeof(struct ip6_hdr)
-#define kIPv4HdrLen sizeof(struct ip)
+/* latency histogram of the MSI interrupt in power of 2 µs buckets */
+#define kIntrLatBuckets 8
+
+/* poll interval controller */
+#define kPollTuneMinPolls 100
+#define kPollTuneLowPkts 2
+#define kPollTuneMinTime 25000
+#define kPollTuneMaxTime 1000000
+
 #define kL234HdrLenV6                                                          \
     (sizeof(struct ether_header) + kIPv6HdrLen + sizeof(struct tcphdr))
 #define kL234HdrLenV4                                                          \
@@ -297,11 +276,63 @@ enum {
 #define kEnableCSO6Name "enableCSO6"
 #define kEnableTSO4Name "enableTSO4"
 #define kEnableTSO6Name "enableTSO6"
+#define kEnableSoftTSOName "enableSoftTSO"
+#define kEnableTxByteLimitName "enableTxByteLimit"
+#define kEnableTxReclaimThreadName "enableTxReclaimThread"
+#define kEnableMSIXName "enableMSIX"
+#define kEnableIntrFilterName "enableIntrFilter"
+#define kEnableBusyPollName "enableBusyPoll"
+#define kBusyPollBudgetName "µsBusyPollBudget"
+#define kBusyPollRateName "busyPollRate"
 #define kPollTime10GName "µsPollTime10G"
 #define kPollTime5GName "µsPollTime5G"
 #define kPollTime2GName "µsPollTime2G"
+#define kPollTime1GName "µsPollTime1G"
+#define kEnablePollTuningName "enablePollTuning"
 #define kDriverVersionName "Driver Version"
 #define kFallbackName "fallbackMAC"
+#define kNumRxQueuesName "numRxQueues"
+#define kNumTxQueuesName "numTxQueues"
+#define kRxRingSizeName "rxRingSize"
+#define kTxRingSizeName "txRingSize"
+#define kTxCopyBreakName "txCopyBreak"
+#define kEnableJumboRxName "enableJumboRx"
+#define kEnableLROName "enableLRO"
+#define kEnableExtRxDescName "enableExtRxDesc"
+#define kRxPoolHitsName "RxPoolHits"
+#define kRxPoolMissesName "RxPoolMisses"
+#define kRxCopyBreakName "RxCopyBreak"
+#define kRxSizeHistogramName "RxSizeHistogram"
+#define kRxQueuePacketsName "RxQueuePackets"
+#define kRxQueueBytesName "RxQueueBytes"
+#define kTxQueuePacketsName "TxQueuePackets"
+#define kTxDoorbellsName "TxDoorbells"
+#define kTxIovaHitsName "TxIovaHits"
+#define kTxIovaMissesName "TxIovaMisses"
+#define kTxIovaEvictionsName "TxIovaEvictions"
+#define kTxIovaReleasesName "TxIovaReleases"
+#define kTxLinearizedName "TxLinearized"
+#define kTxLinearizeFailuresName "TxLinearizeFailures"
+#define kTxLinearizeTimeName "TxLinearizeTime"
+#define kIntrProfileName "IntrProfile"
+#define kIntrProfileSwitchesName "IntrProfileSwitches"
+#define kIntrPacketRateName "IntrPacketRate"
+#define kIntrLatencyName "IntrLatencyHistogram"
+#define kIntrSpuriousName "IntrSpurious"
+#define kBusyPollEntriesName "BusyPollEntries"
+#define kBusyPollRoundsName "BusyPollRounds"
+#define kBusyPollEmptyRoundsName "BusyPollEmptyRounds"
+#define kBusyPollPacketsName "BusyPollPackets"
+#define kBusyPollTimeName "BusyPollTime"
+#define kBusyPollRxRateName "BusyPollRxRate"
+#define kPollIntervalName "PollInterval"
+#define kPollIntervalBaseName "PollIntervalBase"
+#define kPollIntervalAdjustmentsName "PollIntervalAdjustments"
+#define kPollPacketsPerPollName "PollPacketsPerPoll"
+#define kPollRxDescUnavailName "PollRxDescUnavail"
+#define kPollTuneDecisionName "PollTuneDecision"
+#define kTxByteLimitName "TxByteLimit"
+#define kTxByteLimitHistoryName "TxByteLimitHistory"
 #define kNameLenght 64
 
 #define kChipsetName "Chipset"
@@ -314,22 +345,24 @@ enum { kIOMemoryInactive = 0, kIOMemoryActive = 1 };
 
 typedef struct rtlTxBufferInfo {
     mbuf_t mbuf;
+    rtlIovaEntry *iova;
     UInt32 numDescs;
     UInt32 packetBytes;
+    bool premapped;
 } rtlTxBufferInfo;
 
 typedef struct rtlTxMapInfo {
     UInt16 txNextMem2Use;
     UInt16 txNextMem2Free;
     SInt16 txNumFreeMem;
-    IOMemoryDescriptor *txMemIO[kNumTxMemDesc];
-    IOAddressRange txMemRange[kNumTxRanges];
+    IOMemoryDescriptor **txMemIO;
+    IOAddressRange *txMemRange;
     IOAddressRange txSCRange[kMaxSegs];
 } rtlTxMapInfo;
 
 typedef struct rtlRxMapInfo {
-    IOMemoryDescriptor *rxMemIO[kNumRxMemDesc];
-    IOAddressRange rxMemRange[kNumRxDesc];
+    IOMemoryDescriptor **rxMemIO;
+    IOAddressRange *rxMemRange;
 } rtlRxMapInfo;
 
 typedef struct rtlRxBufferInfo {
@@ -337,6 +370,138 @@ typedef struct rtlRxBufferInfo {
     IOPhysicalAddress64 phyAddr;
 } rtlRxBufferInfo;
 
+/*
+ * Each rx queue has its own descriptor ring, buffer pool and
+ * packet assembly state so that the rings can be drained
+ * independently of each other.
+ */
+typedef struct rtlRxRing {
+    IOBufferMemoryDescriptor *rxBufDesc;
+    IOPhysicalAddress64 rxPhyAddr;
+    IODMACommand *rxDescDmaCmd;
+    RtlRxDesc *rxDescArray;
+    rtlRxBufferInfo *rxBufArray;
+    void *rxBufArrayMem;
+    void *rxMapMem;
+    rtlRxMapInfo *rxMapInfo;
+    SimpleRTK5RxPool *rxPool;
+    mbuf_t rxPacketHead;
+    mbuf_t rxPacketTail;
+    SInt32 rxPacketSize;
+    mbuf_t rxListHead;
+    mbuf_t rxListTail;
+    UInt32 rxListCount;
+    UInt32 rxListBytes;
+    UInt64 rxPackets;
+    UInt64 rxBytes;
+    UInt16 rxNextDescIndex;
+    UInt16 rxMapNextIndex;
+    UInt16 queue;
+    UInt16 lroNumFlows;
+    UInt16 lroEvict;
+    rtlLroFlow lroFlows[kLroMaxFlows];
+} rtlRxRing;
+
+/*
+ * Decisions of the poll interval controller.
+ */
+enum {
+    kPollTuneHold = 0,
+    kPollTuneRdu,
+    kPollTuneRingFull,
+    kPollTuneBusy,
+    kPollTuneIdle,
+    kPollTuneDecisions
+};
+
+/*
+ * State of the poll interval controller. The counters are updated
+ * by pollInputPackets() and sampled once per second by the
+ * controller, which moves the poll interval between minTime and
+ * maxTime. Rx descriptor unavailable events are taken from the
+ * tally counter, lastRdu being its value at the previous sample.
+ */
+typedef struct rtlPollTune {
+    UInt64 polls;
+    UInt64 packets;
+    UInt64 rdus;
+    UInt64 lastPolls;
+    UInt64 lastPackets;
+    UInt64 baseTime;
+    UInt64 minTime;
+    UInt64 maxTime;
+    UInt64 adjustments;
+    UInt64 pktsPerPoll;
+    UInt32 maxFill;
+    UInt32 lastRdu;
+    UInt32 decision;
+} rtlPollTune;
+
+/*
+ * Each tx queue has its own descriptor ring, buffer info array
+ * and doorbell. Queue 1 is served first and carries the packets
+ * of the latency sensitive service classes.
+ */
+typedef struct rtlTxRing {
+    IOBufferMemoryDescriptor *txBufDesc;
+    IOPhysicalAddress64 txPhyAddr;
+    IODMACommand *txDescDmaCmd;
+    struct RtlTxDesc *txDescArray;
+    rtlTxBufferInfo *txBufArray;
+    void *txBufArrayMem;
+    rtlTxMapInfo *txMapInfo;
+    void *txMapMem;
+    rtlIovaEntry *txIovaCache;
+    UInt64 txIovaHits;
+    UInt64 txIovaMisses;
+    UInt64 txIovaEvictions;
+    volatile SInt64 txIovaReleases;
+    UInt64 txIovaSweepDeadline;
+    IOBufferMemoryDescriptor *txBounceDesc;
+    IODMACommand *txBounceDmaCmd;
+    UInt8 *txBounceArray;
+    IOPhysicalAddress64 txBouncePhyAddr;
+    UInt32 txNextDescIndex;
+    UInt32 txDirtyDescIndex;
+    SInt32 txNumFreeDesc;
+    UInt32 txPendingDescs;
+    mbuf_t txBacklogHead;
+    mbuf_t txBacklogTail;
+    UInt64 txPackets;
+    UInt64 txDonePackets;
+    UInt64 txDoneBytes;
+    UInt64 txDoorbells;
+    UInt64 txLinearized;
+    UInt64 txLinearizeFailures;
+    UInt64 txLinearizeTime;
+    rtlTxBql txBql;
+#ifdef ENABLE_TX_NO_CLOSE
+    UInt32 txTailPtr0;
+    UInt32 txClosePtr0;
+    UInt16 swTailPtrReg;
+    UInt16 hwCloPtrReg;
+#endif
+    UInt16 queue;
+} rtlTxRing;
+
+/* Bytes which may still be queued before the limit is reached. */
+static inline SInt32 txBqlAvail(rtlTxRing *ring)
+{
+    return (SInt32)(ring->txBql.adjLimit - ring->txBql.numQueued);
+}
+
+/*
+ * A ring accepts new packets as long as it has enough free
+ * descriptors for a packet with the maximum number of segments,
+ * no packets are waiting in its backlog and the byte limit hasn't
+ * been reached.
+ */
+static inline bool txRingHasRoom(rtlTxRing *ring)
+{
+    return ((ring->txNumFreeDesc > kMinFreeDescs) && !ring->txBacklogHead &&
+            (txBqlAvail(ring) >= 0));
+}
+
 /**
  *  Known kernel versions
  */
@@ -441,44 +606,133 @@ class SimpleRTK5 : public super {
 
     void interruptOccurred(OSObject *client, IOInterruptEventSource *src,
                            int count);
-    UInt32 rxInterrupt(IONetworkInterface *interface, uint32_t maxCount,
-                       IOMbufQueue *pollQueue, void *context);
-    void txInterrupt();
+    bool intrFilter(OSObject *owner, IOFilterInterruptEventSource *src);
+    UInt32 intrGetStatus(struct srtk5_private *tp);
+    void rtl812xSetQueueIntrMask(struct srtk5_private *tp, UInt32 mask);
+    UInt32 rtl812xAckQueueIntr(struct srtk5_private *tp);
+    void intrUpdateLatency();
+
+    /* MSI-X interrupt methods */
+    void msixSelectLayout(struct srtk5_private *tp);
+    bool initMsixSources(IOService *provider);
+    void freeMsixSources();
+    void intrEnable();
+    void intrDisable();
+    void rtl812xSetIntrMask(UInt32 mask);
+    void msixRxInterrupt(OSObject *client, IOInterruptEventSource *src,
+                         int count);
+    void msixTxInterrupt(OSObject *client, IOInterruptEventSource *src,
+                         int count);
+    void msixLinkInterrupt(OSObject *client, IOInterruptEventSource *src,
+                           int count);
+    static IOReturn txReclaimAction(OSObject *owner, void *arg1, void *arg2,
+                                    void *arg3, void *arg4);
+
+    UInt32 rxScanBatch(rtlRxRing *ring, rtlRxDescStatus *status, UInt32 count);
+    inline void rxDescSet(rtlRxRing *ring, UInt32 index, UInt64 addr, UInt32 cmd);
+    inline void rxListAppend(rtlRxRing *ring, mbuf_t m);
+    void rxListHandoff(rtlRxRing *ring, IONetworkInterface *interface,
+                       IOMbufQueue *pollQueue);
+    UInt32 rxInterrupt(rtlRxRing *ring, IONetworkInterface *interface,
+                       uint32_t maxCount, IOMbufQueue *pollQueue,
+                       void *context);
+    void txInterrupt(rtlTxRing *ring);
+    void txReclaim();
+    static void runTxReclaimThread(thread_call_param_t param0);
+    void txReclaimThread();
+
+    /* busy poll methods */
+    bool initBusyPoll();
+    void freeBusyPoll();
+    void busyPollStop();
+    bool busyPollCheck();
+    static void runBusyPollThread(thread_call_param_t param0);
+    void busyPollThread();
+    void busyPollDone(OSObject *client, IOInterruptEventSource *src,
+                      int count);
+    void updateBusyPollStats();
+
+    bool txSendPacket(rtlTxRing *ring, mbuf_t m, UInt32 pktBytes);
+    bool txLinearize(rtlTxRing *ring, mbuf_t *m);
+    UInt32 txSendList(rtlTxRing *ring, mbuf_t list);
+    void txSendBacklog(rtlTxRing *ring);
+    void txDoorbell(rtlTxRing *ring);
     void pciErrorInterrupt();
 
     static void runStatUpdateThread(thread_call_param_t param0);
     void statUpdateThread();
 
     bool setupRxResources();
+    bool setupRxRing(rtlRxRing *ring);
     bool setupTxResources();
+    bool setupTxRing(rtlTxRing *ring);
     bool setupStatResources();
     void freeRxResources();
+    void freeRxRing(rtlRxRing *ring);
     void freeTxResources();
+    void freeTxRing(rtlTxRing *ring);
     void freeStatResources();
 
     void clearRxTxRings();
-    void discardPacketFragment();
+    void discardPacketFragment(rtlRxRing *ring);
     void updateStatitics();
+    void updateRxPoolStats();
+    void updateTxStats();
+    void updateTxBqlStats();
     void setLinkUp();
     void setLinkDown();
     bool txHangCheck();
     void getChecksumResult(mbuf_t m, UInt32 status1, UInt32 status2);
     UInt32 updateTimerValue(struct srtk5_private *tp, UInt32 status);
+    void dimReset();
+    void updateDimStats();
+    void pollTuneReset(UInt64 pollTime);
+    void pollTuneUpdate();
+    void updatePollTuneStats();
+    void updateIntrStats();
 
     /* AppleVTD support methods*/
-    bool setupRxMap();
-    void freeRxMap();
-    bool setupTxMap();
-    void freeTxMap();
+    bool setupRxMap(rtlRxRing *ring);
+    void freeRxMap(rtlRxRing *ring);
+    bool setupTxMap(rtlTxRing *ring);
+    void freeTxMap(rtlTxRing *ring);
+    bool setupTxBounce(rtlTxRing *ring);
+    void freeTxBounce(rtlTxRing *ring);
 
     void interruptOccurredVTD(OSObject *client, IOInterruptEventSource *src,
                               int count);
-    UInt32 rxInterruptVTD(IONetworkInterface *interface, uint32_t maxCount,
-                          IOMbufQueue *pollQueue, void *context);
-    UInt32 txMapPacket(mbuf_t packet, IOPhysicalSegment *vector,
-                       UInt32 maxSegs);
-    void txUnmapPacket();
-    UInt16 rxMapBuffers(UInt16 index, UInt16 count);
+    UInt32 rxInterruptVTD(rtlRxRing *ring, IONetworkInterface *interface,
+                          uint32_t maxCount, IOMbufQueue *pollQueue,
+                          void *context);
+    UInt32 txMapPacket(rtlTxRing *ring, mbuf_t packet,
+                       IOPhysicalSegment *vector, UInt32 maxSegs,
+                       bool *premapped);
+    void txUnmapPacket(rtlTxRing *ring);
+    bool txIovaLookup(rtlTxRing *ring, IOAddressRange *srcRange,
+                      UInt32 numSegs, IOPhysicalSegment *vector);
+    rtlIovaEntry *txIovaInsert(rtlTxRing *ring, IOVirtualAddress page,
+                               addr64_t phyPage);
+    void txIovaPut(rtlTxRing *ring, rtlIovaEntry *entry);
+    void txIovaRelease(rtlIovaEntry *entry);
+    void txIovaSweep(rtlTxRing *ring);
+    void txIovaFlush(rtlTxRing *ring);
+    UInt16 rxMapBuffers(rtlRxRing *ring, UInt16 index, UInt16 count);
+
+    /* Software segmentation methods */
+    bool txParseHeaders(mbuf_t m, rtlTxHdrInfo *info);
+    bool txNeedsSoftTSO(mbuf_t m, UInt32 *tsoFlags, UInt32 *mss);
+    mbuf_t txSoftSegment(mbuf_t m, UInt32 tsoFlags, UInt32 mss,
+                         mbuf_t *tail);
+
+    /* Tx byte limit methods */
+    void txBqlReset(rtlTxRing *ring);
+    void txBqlQueued(rtlTxRing *ring, UInt32 bytes);
+    void txBqlCompleted(rtlTxRing *ring, UInt32 bytes);
+
+    /* Receive coalescing methods */
+    void lroInput(rtlRxRing *ring, mbuf_t m, rtlRxDescStatus *status);
+    void lroFlush(rtlRxRing *ring, rtlLroFlow *flow);
+    void lroFlushAll(rtlRxRing *ring);
 
     /* Watchdog timer method. */
     void timerAction(IOTimerEventSource *timer);
@@ -497,6 +751,7 @@ class SimpleRTK5 : public super {
     void rtl812xSetOffloadFeatures(bool active);
     void rtl812xSetMrrs(struct srtk5_private *tp, UInt8 setting);
     void rtl812xHwConfig(struct srtk5_private *tp);
+    void rtl812xConfigRss(struct srtk5_private *tp);
     void rtl812xHwInit(struct srtk5_private *tp);
     void rtl812xSetHwFeatures(struct srtk5_private *tp);
     void rtl812xSetPhyMedium(struct srtk5_private *tp, UInt8 autoneg,
@@ -506,8 +761,9 @@ class SimpleRTK5 : public super {
     void rtl812xDumpTallyCounter(struct srtk5_private *tp);
 
 #ifdef ENABLE_TX_NO_CLOSE
-    UInt32 rtl812xGetHwCloPtr(struct srtk5_private *tp);
-    void rtl812xDoorbell(struct srtk5_private *tp, UInt32 txTailPtr);
+    UInt32 rtl812xGetHwCloPtr(struct srtk5_private *tp, rtlTxRing *ring);
+    void rtl812xDoorbell(struct srtk5_private *tp, rtlTxRing *ring,
+                         UInt32 txTailPtr);
 #endif
 
     void rtl812xLinkOnPatch(struct srtk5_private *tp);
@@ -527,6 +783,20 @@ class SimpleRTK5 : public super {
 
     IOInterruptEventSource *interruptSource;
     IOTimerEventSource *timerSource;
+
+    /* Status taken by the interrupt filter and latency statistics */
+    volatile UInt32 intrStatus;
+    UInt64 intrTime;
+    UInt64 intrSpurious;
+    UInt64 intrLatHist[kIntrLatBuckets];
+
+    /* MSI-X vectors, tx completions are handled on their own work loop */
+    const rtlMsixLayout *msixLayout;
+    IOWorkLoop *txWorkLoop;
+    IOInterruptEventSource *rxIntrSource[kMaxRxQueues];
+    IOInterruptEventSource *txIntrSource[kMaxTxQueues];
+    IOInterruptEventSource *linkIntrSource;
+
     IOEthernetInterface *netif;
     IOMemoryMap *baseMap;
     IOMapper *mapper;
@@ -536,45 +806,35 @@ class SimpleRTK5 : public super {
 #endif /* ENABLE_USE_FIRMWARE_FILE */
 
     /* transmitter data */
-    IOBufferMemoryDescriptor *txBufDesc;
-    IOPhysicalAddress64 txPhyAddr;
-    IODMACommand *txDescDmaCmd;
-    struct RtlTxDesc *txDescArray;
-    SimpleRTK5RxPool *rxPool;
+    rtlTxRing txRing[kMaxTxQueues];
+    UInt32 numTxQueues;
     IOMbufNaturalMemoryCursor *txMbufCursor;
-    rtlTxBufferInfo *txBufArray;
-    void *txBufArrayMem;
-    rtlTxMapInfo *txMapInfo;
-    void *txMapMem;
     UInt64 txDescDoneCount;
     UInt64 txDescDoneLast;
-    UInt32 txNextDescIndex;
-    UInt32 txDirtyDescIndex;
-    
-#ifdef ENABLE_TX_NO_CLOSE
-    UInt32 txTailPtr0;
-    UInt32 txClosePtr0;
-#endif
-
-    SInt32 txNumFreeDesc;
+    UInt32 numTxDesc;
+    UInt32 txDescMask;
+    UInt32 numTxMemDesc;
+    UInt32 txMemDescMask;
+    UInt32 txMapMemSize;
+    SInt32 txQueueWakeTreshhold;
+    UInt32 txCopyBreak;
     SInt32 totalBytes;
     SInt32 totalDescs;
+    rtlDimState dim;
 
     /* receiver data */
-    IOBufferMemoryDescriptor *rxBufDesc;
-    IOPhysicalAddress64 rxPhyAddr;
-    IODMACommand *rxDescDmaCmd;
-    RtlRxDesc *rxDescArray;
-    rtlRxBufferInfo *rxBufArray;
-    void *rxBufArrayMem;
-    void *rxMapMem;
-    rtlRxMapInfo *rxMapInfo;
+    rtlRxRing rxRing[kMaxRxQueues];
+    UInt32 numRxQueues;
+    UInt32 rxPollQueue;
+    UInt32 numRxDesc;
+    UInt32 rxDescMask;
+    UInt32 numRxMemDesc;
+    UInt32 rxMapMemSize;
+    UInt32 rxBufferSize;
+    UInt32 rxDescBufSize;
+    UInt8 rxDescType;
+    UInt32 rssKey[kRssKeySize / 4];
     UInt64 multicastFilter;
-    mbuf_t rxPacketHead;
-    mbuf_t rxPacketTail;
-    SInt32 rxPacketSize;
-    UInt16 rxNextDescIndex;
-    UInt16 rxMapNextIndex;
 
     /* power management data */
     unsigned long powerState;
@@ -589,6 +849,10 @@ class SimpleRTK5 : public super {
     IOPhysicalAddress64 statPhyAddr;
     IODMACommand *statDescDmaCmd;
     thread_call_t statCall;
+    thread_call_t txReclaimCall;
+    thread_call_t busyPollCall;
+    IOInterruptEventSource *busyPollSource;
+    rtlBusyPoll busyPoll;
     struct RtlStatData *statData;
 
     UInt32 mtu;
@@ -604,7 +868,11 @@ class SimpleRTK5 : public super {
     UInt64 pollTime10G;
     UInt64 pollTime5G;
     UInt64 pollTime2G;
+    UInt64 pollTime1G;
     UInt64 actualPollTime;
+    rtlPollTune pollTune;
+    UInt32 busyPollBudget;
+    UInt32 busyPollRate;
     UInt64 statDelay;
     UInt64 updatePeriod;
 
@@ -621,6 +889,16 @@ class SimpleRTK5 : public super {
     bool enableASPM;
     bool enableTSO4;
     bool enableTSO6;
+    bool enableSoftTSO;
+    bool enableTxByteLimit;
+    bool enableTxReclaimThread;
+    bool enableMSIX;
+    bool enableIntrFilter;
+    bool enableBusyPoll;
+    bool enablePollTuning;
+    bool enableJumboRx;
+    bool enableLRO;
+    bool enableExtRxDesc;
     bool useAppleVTD;
     bool wolCapable;
     bool enableGigaLite;
@@ -634,3 +912,51 @@ class SimpleRTK5 : public super {
     UInt32 maxTxPkt;
 #endif
 };
+
+/*
+ * Hand a rx descriptor back to the NIC. The buffer address has to be
+ * written first as the status word with DescOwn passes ownership.
+ * Note that the v4 format overwrites the address field with the RSS
+ * info so that it must be rewritten every time.
+ */
+inline void SimpleRTK5::rxDescSet(rtlRxRing *ring, UInt32 index,
+                                  UInt64 addr, UInt32 cmd)
+{
+    RtlRxDescV3 *descV3;
+    RtlRxDescV4 *descV4;
+
+    switch (rxDescType) {
+    case RX_DESC_RING_TYPE_3:
+        descV3 = &((RtlRxDescV3 *)ring->rxDescArray)[index];
+        descV3->addr = OSSwapHostToLittleInt64(addr);
+        descV3->opts = OSSwapHostToLittleInt64((UInt64)cmd << 32);
+        break;
+
+    case RX_DESC_RING_TYPE_4:
+        descV4 = &((RtlRxDescV4 *)ring->rxDescArray)[index];
+        descV4->addr = OSSwapHostToLittleInt64(addr);
+        descV4->opts = OSSwapHostToLittleInt64((UInt64)cmd << 32);
+        break;
+
+    default:
+        ring->rxDescArray[index].buf.addr = OSSwapHostToLittleInt64(addr);
+        ring->rxDescArray[index].buf.blen = OSSwapHostToLittleInt64(cmd);
+        break;
+    }
+}
+
+/*
+ * Add a received packet to the ring's list of packets, which are
+ * handed over to the network stack at the end of the rx drain.
+ */
+inline void SimpleRTK5::rxListAppend(rtlRxRing *ring, mbuf_t m)
+{
+    if (ring->rxListTail)
+        mbuf_setnextpkt(ring->rxListTail, m);
+    else
+        ring->rxListHead = m;
+
+    ring->rxListTail = m;
+    ring->rxListCount++;
+    ring->rxListBytes += (UInt32)mbuf_pkthdr_len(m);
+}
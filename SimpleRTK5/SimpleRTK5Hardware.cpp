@@ -45,6 +45,11 @@ static const char *onFlowName = "flow-control";
 static const char *eeeNames[kEEETypeCount] = {"",
                                               ", energy-efficient-ethernet"};
 
+static const char *pollTuneNames[kPollTuneDecisions] = {
+    "hold", "faster: rx descriptors unavailable", "faster: ring filling up",
+    "faster: busy polls", "slower: idle polls"
+};
+
 #pragma mark--- PCIe configuration methods ---
 
 bool SimpleRTK5::initPCIConfigSpace(IOPCIDevice *provider) {
@@ -387,6 +392,37 @@ bool SimpleRTK5::rtl812xInit() {
     setupASPM(pciDevice, enableASPM);
     srtk5_init_software_variable(tp, enableASPM);
 
+    /* Multiple rx and tx queues are supported by RTL8125B and later only. */
+    switch (tp->mcfg) {
+    case CFG_METHOD_4:
+    case CFG_METHOD_5:
+    case CFG_METHOD_7 ... CFG_METHOD_13:
+        break;
+
+    default:
+        numRxQueues = 1;
+        numTxQueues = 1;
+        break;
+    }
+
+    msixSelectLayout(tp);
+
+    /*
+     * With a single MSI vector, ISR0 reports the completions of the
+     * first tx queue only, so that the second one requires MSI-X.
+     */
+    if ((numTxQueues > 1) && !msixLayout) {
+        IOLog("SimpleRTK5: The second tx queue requires MSI-X.\n");
+        numTxQueues = 1;
+    }
+
+    /* The extended rx descriptors report the hash with one queue too. */
+    random_buf(rssKey, kRssKeySize);
+
+    IOLog("SimpleRTK5: Using %u rx queue(s), RSS %s.\n", numRxQueues,
+          (numRxQueues > 1) ? "enabled" : "disabled");
+    IOLog("SimpleRTK5: Using %u tx queue(s).\n", numTxQueues);
+
     /* Setup lpi timer. */
     tp->eee.tx_lpi_timer = mtu + ETH_HLEN + 0x20;
 
@@ -460,7 +496,7 @@ void SimpleRTK5::rtl812xEnable() {
     /* Enable link change interrupt. */
     intrMask = intrMaskRxTx;
     timerValue = 0;
-    RTL_W32(tp, IMR0_8125, intrMask);
+    rtl812xSetIntrMask(intrMask);
 }
 
 void SimpleRTK5::rtl812xSetOffloadFeatures(bool active) {
@@ -468,15 +504,16 @@ void SimpleRTK5::rtl812xSetOffloadFeatures(bool active) {
     ifnet_offload_t offload;
     UInt32 mask = 0;
 
-    if (enableTSO4)
+    if (enableTSO4 || enableSoftTSO)
         mask |= IFNET_TSO_IPV4;
 
-    if (enableTSO6)
+    if (enableTSO6 || enableSoftTSO)
         mask |= IFNET_TSO_IPV6;
 
     offload = ifnet_offload(ifnet);
 
-    if (active) {
+    /* Software segmentation takes over when hardware TSO can't be used. */
+    if (active || enableSoftTSO) {
         offload |= mask;
         DebugLog("SimpleRTK5: Enable hardware offload features: %x!\n", mask);
     } else {
@@ -506,6 +543,15 @@ void SimpleRTK5::rtl812xSetHwFeatures(struct srtk5_private *tp) {
     tp->srtk5_rx_config |= (EnableInnerVlan | EnableOuterVlan);
     rxcfg |= (EnableInnerVlan | EnableOuterVlan);
 
+    /* Select the rx descriptor format (EnableRxDescV4_1 is the same bit). */
+    if (rxDescType != RX_DESC_RING_TYPE_1) {
+        tp->srtk5_rx_config |= EnableRxDescV3;
+        rxcfg |= EnableRxDescV3;
+    } else {
+        tp->srtk5_rx_config &= ~EnableRxDescV3;
+        rxcfg &= ~EnableRxDescV3;
+    }
+
     RTL_W32(tp, RxConfig, rxcfg);
 
     tp->cp_cmd |= RxChkSum;
@@ -556,6 +602,16 @@ void SimpleRTK5::rtl812xHwInit(struct srtk5_private *tp) {
 
 void SimpleRTK5::rtl812xDown(struct srtk5_private *tp) {
     srtk5_irq_mask_and_ack(tp);
+
+    if (!msixLayout) {
+        rtl812xSetQueueIntrMask(tp, 0);
+        rtl812xAckQueueIntr(tp);
+    }
+
+    if (msixLayout) {
+        RTL_W32(tp, IMR_V2_CLEAR_REG_8125, 0xffffffff);
+        RTL_W32(tp, ISR_V2_8125, 0xffffffff);
+    }
     srtk5_hw_reset(tp);
     clearRxTxRings();
 }
@@ -589,7 +645,14 @@ void SimpleRTK5::rtl812xRestart(struct srtk5_private *tp) {
 }
 
 void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
+    IOPhysicalAddress64 pa;
+    rtlTxRing *txr;
     UInt16 mac_ocp_data;
+    UInt16 reg;
+#ifdef ENABLE_TX_NO_CLOSE
+    UInt16 stride;
+#endif
+    UInt32 i;
 
     srtk5_disable_rx_packet_filter(tp);
 
@@ -615,18 +678,48 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
     srtk5_set_mac_ocp_bit(tp, 0xEA84, (BIT_1 | BIT_0));
 
     /* Setup the descriptor rings. */
+    for (i = 0; i < numTxQueues; i++) {
+        txr = &txRing[i];
+
 #ifdef ENABLE_TX_NO_CLOSE
-    txTailPtr0 = txClosePtr0 = 0;
+        txr->txTailPtr0 = txr->txClosePtr0 = 0;
+
+        /* The RTL8125BP spaces the pointer registers of its queues wider. */
+        stride = (tp->HwSuppTxNoCloseVer == 6) ? 8 : 4;
+        txr->hwCloPtrReg = tp->HwCloPtrReg + i * stride;
+        txr->swTailPtrReg = tp->SwTailPtrReg + i * stride;
 #endif
 
-    txNextDescIndex = txDirtyDescIndex = 0;
-    txNumFreeDesc = kNumTxDesc;
-    rxNextDescIndex = 0;
+        txr->txNextDescIndex = txr->txDirtyDescIndex = 0;
+        txr->txNumFreeDesc = numTxDesc;
+        txr->txPendingDescs = 0;
+        txBqlReset(txr);
+    }
+    for (i = 0; i < numRxQueues; i++)
+        rxRing[i].rxNextDescIndex = 0;
+
+    RTL_W32(tp, TxDescStartAddrLow, (txRing[0].txPhyAddr & 0x00000000ffffffff));
+    RTL_W32(tp, TxDescStartAddrHigh, (txRing[0].txPhyAddr >> 32));
 
-    RTL_W32(tp, TxDescStartAddrLow, (txPhyAddr & 0x00000000ffffffff));
-    RTL_W32(tp, TxDescStartAddrHigh, (txPhyAddr >> 32));
-    RTL_W32(tp, RxDescAddrLow, (rxPhyAddr & 0x00000000ffffffff));
-    RTL_W32(tp, RxDescAddrHigh, (rxPhyAddr >> 32));
+    /* The second tx queue has its own ring address registers too. */
+    for (i = 1; i < numTxQueues; i++) {
+        pa = txRing[i].txPhyAddr;
+        reg = TNPDS_Q1_LOW_8125 + (i - 1) * 8;
+
+        RTL_W32(tp, reg, (pa & 0x00000000ffffffff));
+        RTL_W32(tp, reg + 4, (pa >> 32));
+    }
+    RTL_W32(tp, RxDescAddrLow, (rxRing[0].rxPhyAddr & 0x00000000ffffffff));
+    RTL_W32(tp, RxDescAddrHigh, (rxRing[0].rxPhyAddr >> 32));
+
+    /* Additional rx queues have their own ring address registers. */
+    for (i = 1; i < numRxQueues; i++) {
+        pa = rxRing[i].rxPhyAddr;
+        reg = RDSAR_Q1_LOW_8125 + (i - 1) * 8;
+
+        RTL_W32(tp, reg, (pa & 0x00000000ffffffff));
+        RTL_W32(tp, reg + 4, (pa >> 32));
+    }
 
     /* Set DMA burst size and Interframe Gap Time */
     RTL_W32(tp, TxConfig,
@@ -651,9 +744,7 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
 
     rtl812xSetMrrs(tp, 0x40);
 
-    RTL_W32(tp, RSS_CTRL_8125, 0x00);
-
-    RTL_W16(tp, Q_NUM_CTRL_8125, 0);
+    rtl812xConfigRss(tp);
 
     RTL_W8(tp, Config1, RTL_R8(tp, Config1) & ~0x10);
 
@@ -685,9 +776,10 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
 
     srtk5_mac_ocp_write(tp, 0xE614, mac_ocp_data);
 
-    /* Set number of tx queues to 1. */
+    /* Set number of tx queues. */
     mac_ocp_data = srtk5_mac_ocp_read(tp, 0xE63E);
     mac_ocp_data &= ~(BIT_11 | BIT_10);
+    mac_ocp_data |= (((numTxQueues - 1) & 0x03) << 10);
     srtk5_mac_ocp_write(tp, 0xE63E, mac_ocp_data);
 
     mac_ocp_data = srtk5_mac_ocp_read(tp, 0xE63E);
@@ -789,7 +881,10 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
     RTL_W16(tp, 0x1880, RTL_R16(tp, 0x1880) & ~(BIT_4 | BIT_5));
 
     if (tp->HwSuppRxDescType == RX_DESC_RING_TYPE_4) {
-        RTL_W8(tp, 0xd8, RTL_R8(tp, 0xd8) & ~EnableRxDescV4_0);
+        if (rxDescType == RX_DESC_RING_TYPE_4)
+            RTL_W8(tp, 0xd8, RTL_R8(tp, 0xd8) | EnableRxDescV4_0);
+        else
+            RTL_W8(tp, 0xd8, RTL_R8(tp, 0xd8) & ~EnableRxDescV4_0);
     }
 
     if (tp->mcfg == CFG_METHOD_12) {
@@ -802,6 +897,11 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
 
     srtk5_hw_clear_int_miti(tp);
 
+    /* Switch to the per vector interrupt registers in MSI-X mode. */
+    if (msixLayout)
+        RTL_W8(tp, INT_CFG0_8125,
+               RTL_R8(tp, INT_CFG0_8125) | INT_CFG0_ENABLE_8125);
+
     srtk5_enable_exit_l1_mask(tp);
 
     srtk5_mac_ocp_write(tp, 0xE098, 0xC302);
@@ -840,23 +940,56 @@ void SimpleRTK5::rtl812xHwConfig(struct srtk5_private *tp) {
     udelay(10);
 }
 
+/*
+ * Program the RSS hash key, the indirection table and the number of rx
+ * queues. The indirection table's entries are spread evenly over all
+ * queues. With a single queue RSS is disabled unless the extended rx
+ * descriptors are used, which report the hash and the packet type.
+ */
+void SimpleRTK5::rtl812xConfigRss(struct srtk5_private *tp) {
+    UInt32 rssCtrl = 0;
+    UInt32 i;
+    UInt16 shift = rtlRssQueueShift(numRxQueues);
+
+    if ((numRxQueues > 1) || (rxDescType != RX_DESC_RING_TYPE_1)) {
+        for (i = 0; i < kRssKeySize; i += 4)
+            RTL_W32(tp, RSS_KEY_8125 + i, rssKey[i / 4]);
+
+        for (i = 0; i < kRssIndirTblSize; i += 4)
+            RTL_W32(tp, RSS_INDIRECTION_TBL_8125_V2 + i, rtlRssReta(i, numRxQueues));
+
+        rssCtrl = (RSS_CTRL_TCP_IPV4_SUPP | RSS_CTRL_IPV4_SUPP |
+                   RSS_CTRL_TCP_IPV6_SUPP | RSS_CTRL_IPV6_SUPP |
+                   RSS_CTRL_IPV6_EXT_SUPP | RSS_CTRL_TCP_IPV6_EXT_SUPP);
+
+        /* log2 of the indirection table size and of the queue number. */
+        rssCtrl |= (7 << RSS_MASK_BITS_OFFSET);
+        rssCtrl |= (shift << RSS_CPU_NUM_OFFSET);
+    }
+    RTL_W32(tp, RSS_CTRL_8125, rssCtrl);
+
+    RTL_W16(tp, Q_NUM_CTRL_8125, (shift << 2));
+}
+
 #ifdef ENABLE_TX_NO_CLOSE
-UInt32 SimpleRTK5::rtl812xGetHwCloPtr(struct srtk5_private *tp) {
+UInt32 SimpleRTK5::rtl812xGetHwCloPtr(struct srtk5_private *tp,
+                                      rtlTxRing *ring) {
     UInt32 cloPtr;
 
     if (tp->HwSuppTxNoCloseVer == 3)
-        cloPtr = RTL_R16(tp, tp->HwCloPtrReg);
+        cloPtr = RTL_R16(tp, ring->hwCloPtrReg);
     else
-        cloPtr = RTL_R32(tp, tp->HwCloPtrReg);
+        cloPtr = RTL_R32(tp, ring->hwCloPtrReg);
 
     return cloPtr;
 }
 
-void SimpleRTK5::rtl812xDoorbell(struct srtk5_private *tp, UInt32 txTailPtr) {
+void SimpleRTK5::rtl812xDoorbell(struct srtk5_private *tp, rtlTxRing *ring,
+                                 UInt32 txTailPtr) {
     if (tp->HwSuppTxNoCloseVer > 3)
-        RTL_W32(tp, tp->SwTailPtrReg, txTailPtr);
+        RTL_W32(tp, ring->swTailPtrReg, txTailPtr);
     else
-        RTL_W16(tp, tp->SwTailPtrReg, txTailPtr & 0xffff);
+        RTL_W16(tp, ring->swTailPtrReg, txTailPtr & 0xffff);
 }
 #endif
 
@@ -876,31 +1009,71 @@ void SimpleRTK5::getChecksumResult(mbuf_t m, UInt32 status1, UInt32 status2) {
         mbuf_set_csum_performed(m, performed, value);
 }
 
+#pragma mark--- interrupt moderation methods ---
+
+/*
+ * Reset the interrupt moderation engine, e.g. after a link change,
+ * and start over with the default profile.
+ */
+void SimpleRTK5::dimReset() {
+    UInt32 i;
+
+    rtlDimReset(&dim);
+
+    for (i = 0; i < numRxQueues; i++) {
+        dim.lastRxPackets += rxRing[i].rxPackets;
+        dim.lastRxBytes += rxRing[i].rxBytes;
+    }
+    for (i = 0; i < numTxQueues; i++) {
+        dim.lastTxPackets += txRing[i].txDonePackets;
+        dim.lastTxBytes += txRing[i].txDoneBytes;
+    }
+    clock_get_uptime(&dim.windowStart);
+}
+
+/*
+ * Select the interrupt timer value. The packets and bytes received
+ * and sent since the last call are added to the current window. At
+ * the end of a window rtlDimEndWindow() moves the profile.
+ */
 UInt32 SimpleRTK5::updateTimerValue(struct srtk5_private *tp, UInt32 status) {
+    UInt64 rxPackets = 0;
+    UInt64 rxBytes = 0;
+    UInt64 txPackets = 0;
+    UInt64 txBytes = 0;
+    UInt64 elapsed;
+    UInt64 now;
     UInt32 newTimerValue = 0;
+    UInt32 i;
 
     if (status & (RxOK | TxOK)) {
         if (tp->speed < SPEED_1000) {
             newTimerValue = kTimerBulk;
             goto done;
         }
-        if (mtu > MSS_MAX) {
-            if ((totalDescs > 96) || (totalDescs < 4))
-                newTimerValue = kTimerLat2;
-            else
-                newTimerValue = kTimerDefault;
-
-            goto done;
+        for (i = 0; i < numRxQueues; i++) {
+            rxPackets += rxRing[i].rxPackets;
+            rxBytes += rxRing[i].rxBytes;
         }
-        if ((totalDescs > 4) && (totalBytes / totalDescs) > 2000) {
-            newTimerValue = kTimerBulk;
-            goto done;
+        for (i = 0; i < numTxQueues; i++) {
+            txPackets += txRing[i].txDonePackets;
+            txBytes += txRing[i].txDoneBytes;
         }
-        if ((totalDescs > 35) || (totalBytes < 1500)) {
-            newTimerValue = kTimerLat1;
-            goto done;
+        dim.packets += (rxPackets - dim.lastRxPackets) + (txPackets - dim.lastTxPackets);
+        dim.bytes += (rxBytes - dim.lastRxBytes) + (txBytes - dim.lastTxBytes);
+        dim.lastRxPackets = rxPackets;
+        dim.lastRxBytes = rxBytes;
+        dim.lastTxPackets = txPackets;
+        dim.lastTxBytes = txBytes;
+
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - dim.windowStart, &elapsed);
+
+        if (elapsed >= kDimWindow) {
+            rtlDimEndWindow(&dim, elapsed, (mtu > MSS_MAX));
+            dim.windowStart = now;
         }
-        newTimerValue = kTimerDefault;
+        newTimerValue = dimProfiles[dim.profile].timer;
     }
 
 done:
@@ -913,13 +1086,104 @@ done:
     }
 #endif
 
-clear_count:
     totalDescs = 0;
     totalBytes = 0;
 
     return newTimerValue;
 }
 
+#pragma mark--- poll interval tuning methods ---
+
+/*
+ * Start the poll interval controller with the configured interval
+ * of the current link speed. The controller may move it within half
+ * and twice of its value.
+ */
+void SimpleRTK5::pollTuneReset(UInt64 pollTime) {
+    pollTune.lastPolls = pollTune.polls;
+    pollTune.lastPackets = pollTune.packets;
+    pollTune.lastRdu = OSSwapLittleToHostInt32(statData->rdu);
+    pollTune.baseTime = pollTime;
+    pollTune.minTime = max(pollTime / 2, (UInt64)kPollTuneMinTime);
+    pollTune.maxTime = min(pollTime * 2, (UInt64)kPollTuneMaxTime);
+    pollTune.pktsPerPoll = 0;
+    pollTune.maxFill = 0;
+    pollTune.decision = kPollTuneHold;
+}
+
+/*
+ * Called once per second by timerAction(). Polling faster is given
+ * precedence, as running out of rx descriptors means packet loss,
+ * while polling too often only costs CPU time. No decision is made
+ * unless the stack has been polling for most of the last period.
+ * The rx descriptor unavailable events are taken from the tally
+ * counters dumped a second ago. As a reset of the chip clears them,
+ * a value below the previous one is taken as a new start.
+ */
+void SimpleRTK5::pollTuneUpdate() {
+    UInt64 pollTime = pollParms.pollIntervalTime;
+    UInt64 polls, packets;
+    UInt32 rdu, rdus;
+    UInt32 fill;
+    UInt32 decision = kPollTuneHold;
+
+    polls = pollTune.polls - pollTune.lastPolls;
+    packets = pollTune.packets - pollTune.lastPackets;
+    rdu = OSSwapLittleToHostInt32(statData->rdu);
+    rdus = (rdu >= pollTune.lastRdu) ? (rdu - pollTune.lastRdu) : 0;
+    fill = pollTune.maxFill;
+
+    pollTune.lastPolls = pollTune.polls;
+    pollTune.lastPackets = pollTune.packets;
+    pollTune.lastRdu = rdu;
+    pollTune.rdus += rdus;
+    pollTune.maxFill = 0;
+
+    if (polls < kPollTuneMinPolls)
+        goto done;
+
+    pollTune.pktsPerPoll = packets / polls;
+
+    if (rdus) {
+        decision = kPollTuneRdu;
+        pollTime -= (pollTime >> 2);
+    } else if (fill > (numRxDesc >> 1)) {
+        decision = kPollTuneRingFull;
+        pollTime -= (pollTime >> 3);
+    } else if (pollTune.pktsPerPoll > (numRxDesc >> 3)) {
+        decision = kPollTuneBusy;
+        pollTime -= (pollTime >> 3);
+    } else if (pollTune.pktsPerPoll < kPollTuneLowPkts) {
+        decision = kPollTuneIdle;
+        pollTime += (pollTime >> 3);
+    }
+    pollTime = min(max(pollTime, pollTune.minTime), pollTune.maxTime);
+
+    if (pollTime != pollParms.pollIntervalTime) {
+        pollParms.pollIntervalTime = pollTime;
+        netif->setPacketPollingParameters(&pollParms, 0);
+        pollTune.adjustments++;
+
+        DebugLog("SimpleRTK5: pollIntervalTime: %lluµs (%s)\n",
+                 (pollTime / 1000), pollTuneNames[decision]);
+    }
+
+done:
+    pollTune.decision = decision;
+}
+
+void SimpleRTK5::updatePollTuneStats() {
+    if (!enablePollTuning)
+        return;
+
+    setProperty(kPollIntervalName, pollParms.pollIntervalTime / 1000, 64);
+    setProperty(kPollIntervalBaseName, pollTune.baseTime / 1000, 64);
+    setProperty(kPollIntervalAdjustmentsName, pollTune.adjustments, 64);
+    setProperty(kPollPacketsPerPollName, pollTune.pktsPerPoll, 64);
+    setProperty(kPollRxDescUnavailName, pollTune.rdus, 64);
+    setProperty(kPollTuneDecisionName, pollTuneNames[pollTune.decision]);
+}
+
 #pragma mark--- link management methods ---
 
 void SimpleRTK5::rtl812xLinkOnPatch(struct srtk5_private *tp) {
@@ -1099,10 +1363,12 @@ void SimpleRTK5::setLinkUp() {
     UInt32 mediumIndex = MIDX_AUTO;
     UInt32 spd = tp->speed;
     UInt32 fc = tp->fcpause;
+    UInt32 i;
     bool eee;
 
     totalDescs = 0;
     totalBytes = 0;
+    dimReset();
 
     eee = tp->eee.eee_active;
     eeeName = eeeNames[kEEETypeNo];
@@ -1215,8 +1481,8 @@ void SimpleRTK5::setLinkUp() {
             duplexName = duplexHalfName;
         }
     }
-    rxPacketHead = rxPacketTail = NULL;
-    rxPacketSize = 0;
+    for (i = 0; i < numRxQueues; i++)
+        discardPacketFragment(&rxRing[i]);
 
     /* Start hardware. */
     RTL_W8(tp, ChipCmd, CmdTxEnb | CmdRxEnb);
@@ -1247,10 +1513,11 @@ void SimpleRTK5::setLinkUp() {
         else if (spd == SPEED_2500)
             pollParms.pollIntervalTime = pollTime2G;
         else if (spd == SPEED_1000)
-            pollParms.pollIntervalTime = 170000; /* 170µs */
+            pollParms.pollIntervalTime = pollTime1G;
         else
             pollParms.pollIntervalTime = 1000000; /* 1ms */
     }
+    pollTuneReset(pollParms.pollIntervalTime);
     netif->setPacketPollingParameters(&pollParms, 0);
     DebugLog("SimpleRTK5: pollIntervalTime: %lluµs\n",
              (pollParms.pollIntervalTime / 1000));
@@ -1280,7 +1547,7 @@ void SimpleRTK5::setLinkDown() {
     /* Enable link change interrupt. */
     intrMask = intrMaskRxTx;
     timerValue = 0;
-    RTL_W32(tp, IMR0_8125, intrMask);
+    rtl812xSetIntrMask(intrMask);
 
     rtl812xSetPhyMedium(tp, tp->autoneg, tp->speed, tp->duplex,
                         tp->advertising);
@@ -1417,4 +1684,217 @@ void SimpleRTK5::statUpdateThread() {
         etherStats->dot3TxExtraEntry.underruns =
             OSSwapLittleToHostInt16(statData->txUnderun);
     }
+    updateRxPoolStats();
+    updateTxStats();
+    updateDimStats();
+    updateIntrStats();
+    updateBusyPollStats();
+    updatePollTuneStats();
+}
+
+void SimpleRTK5::updateRxPoolStats() {
+    OSArray *copyBreaks;
+    OSArray *queuePackets;
+    OSArray *queueBytes;
+    OSArray *histogram;
+    OSNumber *num;
+    const UInt64 *hist;
+    UInt64 sizes[kCopyBreakBuckets];
+    UInt64 hits = 0;
+    UInt64 misses = 0;
+    UInt32 i, j;
+
+    copyBreaks = OSArray::withCapacity(numRxQueues);
+    queuePackets = OSArray::withCapacity(numRxQueues);
+    queueBytes = OSArray::withCapacity(numRxQueues);
+    bzero(sizes, sizeof(sizes));
+
+    for (i = 0; i < numRxQueues; i++) {
+        if (queuePackets && (num = OSNumber::withNumber(rxRing[i].rxPackets, 64))) {
+            queuePackets->setObject(num);
+            num->release();
+        }
+        if (queueBytes && (num = OSNumber::withNumber(rxRing[i].rxBytes, 64))) {
+            queueBytes->setObject(num);
+            num->release();
+        }
+        if (rxRing[i].rxPool) {
+            hits += rxRing[i].rxPool->getPageHits();
+            misses += rxRing[i].rxPool->getPageMisses();
+
+            hist = rxRing[i].rxPool->getSizeHistogram();
+
+            for (j = 0; j < kCopyBreakBuckets; j++)
+                sizes[j] += hist[j];
+
+            if (copyBreaks && (num = OSNumber::withNumber(rxRing[i].rxPool->getCopyBreak(), 32))) {
+                copyBreaks->setObject(num);
+                num->release();
+            }
+        }
+    }
+    setProperty(kRxPoolHitsName, hits, 64);
+    setProperty(kRxPoolMissesName, misses, 64);
+
+    if (copyBreaks) {
+        setProperty(kRxCopyBreakName, copyBreaks);
+        copyBreaks->release();
+    }
+    if (queuePackets) {
+        setProperty(kRxQueuePacketsName, queuePackets);
+        queuePackets->release();
+    }
+    if (queueBytes) {
+        setProperty(kRxQueueBytesName, queueBytes);
+        queueBytes->release();
+    }
+    /* Packet size histogram in buckets of 128 bytes. */
+    histogram = OSArray::withCapacity(kCopyBreakBuckets);
+
+    if (histogram) {
+        for (j = 0; j < kCopyBreakBuckets; j++) {
+            if ((num = OSNumber::withNumber(sizes[j], 64))) {
+                histogram->setObject(num);
+                num->release();
+            }
+        }
+        setProperty(kRxSizeHistogramName, histogram);
+        histogram->release();
+    }
+}
+
+void SimpleRTK5::updateTxStats() {
+    OSArray *queuePackets;
+    OSArray *doorbells;
+    OSNumber *num;
+    UInt64 hits = 0;
+    UInt64 misses = 0;
+    UInt64 evictions = 0;
+    UInt64 releases = 0;
+    UInt64 linearized = 0;
+    UInt64 linFailures = 0;
+    UInt64 linTime = 0;
+    UInt32 i;
+
+    queuePackets = OSArray::withCapacity(numTxQueues);
+    doorbells = OSArray::withCapacity(numTxQueues);
+
+    for (i = 0; i < numTxQueues; i++) {
+        if (queuePackets && (num = OSNumber::withNumber(txRing[i].txPackets, 64))) {
+            queuePackets->setObject(num);
+            num->release();
+        }
+        if (doorbells && (num = OSNumber::withNumber(txRing[i].txDoorbells, 64))) {
+            doorbells->setObject(num);
+            num->release();
+        }
+    }
+    if (queuePackets) {
+        setProperty(kTxQueuePacketsName, queuePackets);
+        queuePackets->release();
+    }
+    if (doorbells) {
+        setProperty(kTxDoorbellsName, doorbells);
+        doorbells->release();
+    }
+    for (i = 0; i < numTxQueues; i++) {
+        hits += txRing[i].txIovaHits;
+        misses += txRing[i].txIovaMisses;
+        evictions += txRing[i].txIovaEvictions;
+        releases += txRing[i].txIovaReleases;
+        linearized += txRing[i].txLinearized;
+        linFailures += txRing[i].txLinearizeFailures;
+        linTime += txRing[i].txLinearizeTime;
+    }
+    setProperty(kTxIovaHitsName, hits, 64);
+    setProperty(kTxIovaMissesName, misses, 64);
+    setProperty(kTxIovaEvictionsName, evictions, 64);
+    setProperty(kTxIovaReleasesName, releases, 64);
+
+    /* The time spent copying packets is reported in nanoseconds. */
+    absolutetime_to_nanoseconds(linTime, &linTime);
+    setProperty(kTxLinearizedName, linearized, 64);
+    setProperty(kTxLinearizeFailuresName, linFailures, 64);
+    setProperty(kTxLinearizeTimeName, linTime, 64);
+
+    if (enableTxByteLimit)
+        updateTxBqlStats();
+}
+
+void SimpleRTK5::updateDimStats() {
+    setProperty(kIntrProfileName, dimProfiles[dim.profile].timer, 32);
+    setProperty(kIntrProfileSwitchesName, dim.switches, 64);
+    setProperty(kIntrPacketRateName, dim.pktRate, 64);
+}
+
+/*
+ * Export the latency histogram of the MSI interrupt, i.e. the time
+ * from the primary interrupt to its handler on the work loop, and
+ * the number of interrupts without pending work.
+ */
+void SimpleRTK5::updateIntrStats() {
+    OSArray *histogram;
+    OSNumber *num;
+    UInt32 i;
+
+    setProperty(kIntrSpuriousName, intrSpurious, 64);
+
+    histogram = OSArray::withCapacity(kIntrLatBuckets);
+
+    if (histogram) {
+        for (i = 0; i < kIntrLatBuckets; i++) {
+            if ((num = OSNumber::withNumber(intrLatHist[i], 64))) {
+                histogram->setObject(num);
+                num->release();
+            }
+        }
+        setProperty(kIntrLatencyName, histogram);
+        histogram->release();
+    }
+}
+
+/*
+ * Export the current byte limit of each tx ring and its last
+ * kTxBqlHistorySize values, oldest first.
+ */
+void SimpleRTK5::updateTxBqlStats() {
+    OSArray *limits;
+    OSArray *history;
+    OSArray *ringHistory;
+    OSNumber *num;
+    rtlTxBql *bql;
+    UInt32 i, j, k;
+
+    limits = OSArray::withCapacity(numTxQueues);
+    history = OSArray::withCapacity(numTxQueues);
+
+    for (i = 0; i < numTxQueues; i++) {
+        bql = &txRing[i].txBql;
+
+        if (limits && (num = OSNumber::withNumber(bql->limit, 32))) {
+            limits->setObject(num);
+            num->release();
+        }
+        if (history && (ringHistory = OSArray::withCapacity(kTxBqlHistorySize))) {
+            k = (bql->historyIndex + kTxBqlHistorySize - bql->historyCount) % kTxBqlHistorySize;
+
+            for (j = 0; j < bql->historyCount; j++) {
+                if ((num = OSNumber::withNumber(bql->history[k], 32))) {
+                    ringHistory->setObject(num);
+                    num->release();
+                }
+                k = (k + 1) % kTxBqlHistorySize;
+            }
+            history->setObject(ringHistory);
+            ringHistory->release();
+        }
+    }
+    if (limits) {
+        setProperty(kTxByteLimitName, limits);
+        limits->release();
+    }
+    if (history) {
+        setProperty(kTxByteLimitHistoryName, history);
+        history->release();
+    }
 }
@@ -0,0 +1,147 @@
+//
+//  SimpleRTK5Iova.hpp
+//  SimpleRTK5
+//
+//  The set associative tx IOVA cache. The lookup of pages in their
+//  set, the choice of the entry to evict and the reference counts of
+//  the entries are kept free of kernel dependencies, so that they can
+//  be tested on the host. Mapping and unmapping of the pages is done
+//  by the driver in SimpleRTK5VTD.cpp.
+//
+
+#ifndef SimpleRTK5Iova_hpp
+#define SimpleRTK5Iova_hpp
+
+class IOMemoryDescriptor;
+
+/* Pages kept mapped per tx ring, organized in sets of kTxIovaWays */
+#define kTxIovaCacheSize 256
+#define kTxIovaWays 4
+#define kTxIovaSetMask ((kTxIovaCacheSize / kTxIovaWays) - 1)
+
+/* Unused pages are unmapped after two sweeps at most (in ns). */
+#define kTxIovaSweepTime 100000000ULL
+
+/* The reference count of an entry, which is being unmapped */
+#define kTxIovaReleased -1
+
+/*
+ * A tx page kept mapped for AppleVTD. Entries with packets in
+ * flight (refs > 0) are never evicted. An entry is free when md
+ * is NULL. Whoever changes refs from 0 to kTxIovaReleased owns
+ * the entry and unmaps it, clearing md when it's done.
+ */
+typedef struct rtlIovaEntry {
+    IOVirtualAddress page;
+    addr64_t phyPage;
+    IOPhysicalAddress64 iova;
+    IOMemoryDescriptor * volatile md;
+    volatile SInt32 refs;
+    bool used;
+} rtlIovaEntry;
+
+/* The set of kTxIovaWays entries a page belongs to */
+static inline rtlIovaEntry *rtlIovaSet(rtlIovaEntry *cache, UInt64 pageNum)
+{
+    return &cache[(pageNum & kTxIovaSetMask) * kTxIovaWays];
+}
+
+/* Find the mapped entry of a page in its set or NULL. */
+static inline rtlIovaEntry *rtlIovaFind(rtlIovaEntry *set, IOVirtualAddress page)
+{
+    UInt32 j;
+
+    for (j = 0; j < kTxIovaWays; j++) {
+        if (set[j].md && (set[j].refs >= 0) && (set[j].page == page))
+            return &set[j];
+    }
+    return NULL;
+}
+
+/* Take a reference, fails if the entry is being unmapped. */
+static inline bool rtlIovaGet(rtlIovaEntry *entry)
+{
+    SInt32 refs;
+
+    do {
+        refs = entry->refs;
+
+        if (refs < 0)
+            return false;
+    } while (!OSCompareAndSwap(refs, refs + 1, (volatile UInt32 *)&entry->refs));
+
+    entry->used = true;
+    return true;
+}
+
+/* Claim an entry without references for unmapping. */
+static inline bool rtlIovaClaim(rtlIovaEntry *entry)
+{
+    return OSCompareAndSwap(0, kTxIovaReleased, (volatile UInt32 *)&entry->refs);
+}
+
+/*
+ * Drop a reference. Returns true if it was the last one and the
+ * caller has claimed the entry, which it must unmap now.
+ */
+static inline bool rtlIovaPut(rtlIovaEntry *entry)
+{
+    return ((OSDecrementAtomic(&entry->refs) == 1) && rtlIovaClaim(entry));
+}
+
+/*
+ * Choose the entry of a set to map a page into. A free entry is
+ * taken first. Otherwise an entry without references, which hasn't
+ * been used since the last pass, is claimed and *evict is set, so
+ * that the caller unmaps it first. Returns NULL if all entries have
+ * references.
+ */
+static inline rtlIovaEntry *rtlIovaVictim(rtlIovaEntry *set, bool *evict)
+{
+    UInt32 j;
+
+    *evict = false;
+
+    for (j = 0; j < kTxIovaWays; j++) {
+        if (!set[j].md)
+            return &set[j];
+    }
+    for (j = 0; j < kTxIovaWays; j++) {
+        if (!set[j].refs) {
+            if (!set[j].used && rtlIovaClaim(&set[j]))
+                goto evict;
+
+            set[j].used = false;
+        }
+    }
+    for (j = 0; j < kTxIovaWays; j++) {
+        if (!set[j].refs && rtlIovaClaim(&set[j]))
+            goto evict;
+    }
+    return NULL;
+
+evict:
+    *evict = true;
+    return &set[j];
+}
+
+/* Make a free entry, which has just been mapped, visible to lookups. */
+static inline void rtlIovaPublish(rtlIovaEntry *entry, IOVirtualAddress page, addr64_t phyPage,
+                                  IOPhysicalAddress64 iova, IOMemoryDescriptor *md)
+{
+    entry->page = page;
+    entry->phyPage = phyPage;
+    entry->iova = iova;
+    entry->used = false;
+    entry->refs = 0;
+    OSCompareAndSwapPtr(NULL, md, (void * volatile *)&entry->md);
+}
+
+/* The entry has been unmapped and is free again. */
+static inline void rtlIovaFree(rtlIovaEntry *entry)
+{
+    entry->used = false;
+    OSCompareAndSwapPtr(entry->md, NULL, (void * volatile *)&entry->md);
+}
+
+#endif /* SimpleRTK5Iova_hpp */
@@ -0,0 +1,183 @@
+//
+//  SimpleRTK5LRO.cpp
+//  SimpleRTK5
+//
+
+#include "SimpleRTK5Ethernet.hpp"
+
+#define kLroDataCsumFlags (MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR)
+#define kLroIPCsumFlags (MBUF_CSUM_DID_IP | MBUF_CSUM_IP_GOOD)
+
+#pragma mark --- receive coalescing methods ---
+
+/*
+ * Coalesce in-order TCP segments of the same flow into a single
+ * packet. Only segments, which have been verified by the hardware
+ * checksum offload, carry payload and have no flags apart from ACK
+ * and PSH are merged. All other packets are passed up unchanged
+ * after the flow they belong to has been flushed, so that the order
+ * of a flow's packets is maintained. The caller must flush all flows
+ * at the end of a rx drain. With the extended descriptor formats the
+ * packet type and the RSS hash reported by the NIC are used to pass
+ * up non-TCP packets early and to speed up the flow lookup.
+ */
+void SimpleRTK5::lroInput(rtlRxRing *ring, mbuf_t m,
+                          rtlRxDescStatus *status)
+{
+    mbuf_csum_performed_flags_t performed;
+    rtlLroFlow *flow = NULL;
+    struct tcphdr *tcpHdr;
+    struct ip *ipHdr;
+    struct ip6_hdr *ip6Hdr;
+    UInt8 *data = (UInt8 *)mbuf_data(m);
+    UInt8 *l3Hdr = data + ETH_HLEN;
+    UInt32 pktLen, hdrLen, tcpLen, payload;
+    UInt32 value;
+    UInt16 etherType, tag;
+    UInt16 i;
+    UInt8 flags;
+    bool eligible;
+
+    /* The descriptor tells us already if it's not a TCP segment. */
+    if (status->type && !(status->type & kRxPktTypeTCP))
+        goto input;
+
+    /* Only untagged packets in a single buffer are coalesced. */
+    if (mbuf_next(m) || !mbuf_get_vlan_tag(m, &tag))
+        goto input;
+
+    if (mbuf_get_csum_performed(m, &performed, &value) ||
+        ((performed & kLroDataCsumFlags) != kLroDataCsumFlags))
+        goto input;
+
+    pktLen = (UInt32)mbuf_len(m);
+    etherType = ntohs(*(UInt16 *)(data + 12));
+
+    if (etherType == ETHERTYPE_IP) {
+        ipHdr = (struct ip *)l3Hdr;
+
+        if ((pktLen < (ETH_HLEN + kIPv4HdrLen + kTcpHdrLen)) ||
+            ((performed & kLroIPCsumFlags) != kLroIPCsumFlags) ||
+            (ipHdr->ip_hl != (kIPv4HdrLen >> 2)) ||
+            (ipHdr->ip_p != IPPROTO_TCP) ||
+            (ntohs(ipHdr->ip_off) & (IP_MF | IP_OFFMASK)))
+            goto input;
+
+        hdrLen = ETH_HLEN + kIPv4HdrLen;
+        pktLen = ETH_HLEN + ntohs(ipHdr->ip_len);
+    } else if (etherType == ETHERTYPE_IPV6) {
+        ip6Hdr = (struct ip6_hdr *)l3Hdr;
+
+        if ((pktLen < (ETH_HLEN + kIPv6HdrLen + kTcpHdrLen)) ||
+            (ip6Hdr->ip6_nxt != IPPROTO_TCP))
+            goto input;
+
+        hdrLen = ETH_HLEN + kIPv6HdrLen;
+        pktLen = ETH_HLEN + kIPv6HdrLen + ntohs(ip6Hdr->ip6_plen);
+    } else {
+        goto input;
+    }
+    tcpHdr = (struct tcphdr *)(data + hdrLen);
+    tcpLen = tcpHdr->th_off << 2;
+    hdrLen += tcpLen;
+
+    if ((tcpLen < kTcpHdrLen) || (hdrLen > pktLen) || (pktLen > mbuf_len(m)))
+        goto input;
+
+    payload = pktLen - hdrLen;
+    flags = tcpHdr->th_flags;
+    eligible = rtlLroEligible(tcpHdr, tcpLen, payload);
+
+    if (ring->lroNumFlows) {
+        for (i = 0; i < kLroMaxFlows; i++) {
+            if (ring->lroFlows[i].head &&
+                (ring->lroFlows[i].hash == status->hash) &&
+                rtlLroSameFlow(&ring->lroFlows[i], etherType, l3Hdr, tcpHdr)) {
+                flow = &ring->lroFlows[i];
+                break;
+            }
+        }
+    }
+    if (flow) {
+        if (eligible && rtlLroCanMerge(flow, l3Hdr, tcpHdr, payload)) {
+            /*
+             * A segment, which can't be turned into a plain mbuf,
+             * is passed up unmerged after the flow.
+             */
+            if (mbuf_setflags_mask(m, 0, MBUF_PKTHDR)) {
+                lroFlush(ring, flow);
+                goto input;
+            }
+            /* Chain the payload to the flow's packet. */
+            mbuf_setdata(m, data + hdrLen, payload);
+            mbuf_setnext(flow->tail, m);
+            flow->tail = m;
+
+            rtlLroMerge(flow, tcpHdr, tcpLen, payload);
+
+            if ((flags & TH_PUSH) || (flow->segs >= kLroMaxSegs))
+                lroFlush(ring, flow);
+
+            goto done;
+        }
+        /* Maintain the packet order of the flow. */
+        lroFlush(ring, flow);
+    }
+    if (!eligible || (flags & TH_PUSH))
+        goto input;
+
+    if (!flow) {
+        for (i = 0; i < kLroMaxFlows; i++) {
+            if (!ring->lroFlows[i].head) {
+                flow = &ring->lroFlows[i];
+                break;
+            }
+        }
+        if (!flow) {
+            flow = &ring->lroFlows[ring->lroEvict];
+            ring->lroEvict = (ring->lroEvict + 1) % kLroMaxFlows;
+
+            lroFlush(ring, flow);
+        }
+    }
+    /* Start a new flow and strip the padding of short frames. */
+    mbuf_setlen(m, pktLen);
+
+    flow->head = flow->tail = m;
+    flow->l3Hdr = l3Hdr;
+    flow->tcpHdr = tcpHdr;
+    flow->hash = status->hash;
+    flow->nextSeq = ntohl(tcpHdr->th_seq) + payload;
+    flow->len = pktLen;
+    flow->segs = 1;
+    flow->etherType = etherType;
+    ring->lroNumFlows++;
+
+done:
+    return;
+
+input:
+    rxListAppend(ring, m);
+    goto done;
+}
+
+void SimpleRTK5::lroFlush(rtlRxRing *ring, rtlLroFlow *flow)
+{
+    if (!flow->head)
+        return;
+
+    rtlLroFinish(flow);
+    mbuf_pkthdr_setlen(flow->head, flow->len);
+    rxListAppend(ring, flow->head);
+
+    flow->head = flow->tail = NULL;
+    ring->lroNumFlows--;
+}
+
+void SimpleRTK5::lroFlushAll(rtlRxRing *ring)
+{
+    UInt32 i;
+
+    for (i = 0; (i < kLroMaxFlows) && ring->lroNumFlows; i++)
+        lroFlush(ring, &ring->lroFlows[i]);
+}
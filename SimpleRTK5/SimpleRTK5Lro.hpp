@@ -0,0 +1,167 @@
+//
+//  SimpleRTK5Lro.hpp
+//  SimpleRTK5
+//
+//  Header rules of receive coalescing: which TCP segments can be
+//  merged and how the headers of the first segment are rewritten to
+//  describe the coalesced packet. They work on the flat headers of
+//  the segments, so that they are free of kernel dependencies and can
+//  be tested on the host.
+//
+
+#ifndef SimpleRTK5Lro_hpp
+#define SimpleRTK5Lro_hpp
+
+#include "SimpleRTK5TxHdr.hpp"
+
+/* Receive coalescing */
+#define kLroMaxFlows 8
+#define kLroMaxSegs 16
+#define kLroMaxLen 0xfe00
+
+#define kTcpHdrLenTS (kTcpHdrLen + TCPOLEN_TSTAMP_APPA)
+
+/*
+ * A TCP flow being coalesced. The headers of the first segment
+ * are updated with each merged segment and the payload of the
+ * following segments is chained to it.
+ */
+typedef struct rtlLroFlow {
+    mbuf_t head;
+    mbuf_t tail;
+    UInt8 *l3Hdr;
+    struct tcphdr *tcpHdr;
+    UInt32 hash;
+    UInt32 nextSeq;
+    UInt32 len;
+    UInt16 segs;
+    UInt16 etherType;
+} rtlLroFlow;
+
+static inline UInt16 rtlIPv4HdrChecksum(struct ip *ipHdr)
+{
+    UInt16 *p = (UInt16 *)ipHdr;
+    UInt32 sum = 0;
+    UInt32 i;
+
+    for (i = 0; i < (kIPv4HdrLen >> 1); i++)
+        sum += p[i];
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return (UInt16)~sum;
+}
+
+/*
+ * Only segments with payload and no flags apart from ACK and PSH can
+ * be merged. The only TCP option accepted is the timestamp.
+ */
+static inline bool rtlLroEligible(const struct tcphdr *tcpHdr, UInt32 tcpLen, UInt32 payload)
+{
+    const UInt32 *opts = (const UInt32 *)(tcpHdr + 1);
+
+    return (payload && ((tcpHdr->th_flags & ~TH_PUSH) == TH_ACK) &&
+            ((tcpLen == kTcpHdrLen) ||
+             ((tcpLen == kTcpHdrLenTS) && (ntohl(opts[0]) == TCPOPT_TSTAMP_HDR))));
+}
+
+static inline bool rtlLroSameFlow(const rtlLroFlow *flow, UInt16 etherType,
+                                  const UInt8 *l3Hdr, const struct tcphdr *tcpHdr)
+{
+    if ((flow->etherType != etherType) ||
+        (flow->tcpHdr->th_sport != tcpHdr->th_sport) ||
+        (flow->tcpHdr->th_dport != tcpHdr->th_dport))
+        return false;
+
+    if (etherType == ETHERTYPE_IP)
+        return !memcmp(&((struct ip *)flow->l3Hdr)->ip_src,
+                       &((const struct ip *)l3Hdr)->ip_src,
+                       2 * sizeof(struct in_addr));
+    else
+        return !memcmp(&((struct ip6_hdr *)flow->l3Hdr)->ip6_src,
+                       &((const struct ip6_hdr *)l3Hdr)->ip6_src,
+                       2 * sizeof(struct in6_addr));
+}
+
+/*
+ * A segment can be appended in case it's the next one in sequence,
+ * has the same header layout and doesn't exceed the limits. Segments
+ * with different TOS/traffic class or TTL/hop limit must be passed
+ * up unchanged, as for example ECN marks would get lost otherwise.
+ */
+static inline bool rtlLroCanMerge(const rtlLroFlow *flow, const UInt8 *l3Hdr,
+                                  const struct tcphdr *tcpHdr, UInt32 payload)
+{
+    const struct ip *ipHdr, *flowIpHdr;
+    const struct ip6_hdr *ip6Hdr, *flowIp6Hdr;
+
+    if ((ntohl(tcpHdr->th_seq) != flow->nextSeq) ||
+        (tcpHdr->th_off != flow->tcpHdr->th_off) ||
+        (flow->segs >= kLroMaxSegs) ||
+        ((flow->len + payload) > kLroMaxLen))
+        return false;
+
+    if (flow->etherType == ETHERTYPE_IP) {
+        ipHdr = (const struct ip *)l3Hdr;
+        flowIpHdr = (const struct ip *)flow->l3Hdr;
+
+        return ((ipHdr->ip_tos == flowIpHdr->ip_tos) &&
+                (ipHdr->ip_ttl == flowIpHdr->ip_ttl));
+    } else {
+        ip6Hdr = (const struct ip6_hdr *)l3Hdr;
+        flowIp6Hdr = (const struct ip6_hdr *)flow->l3Hdr;
+
+        return ((ip6Hdr->ip6_flow == flowIp6Hdr->ip6_flow) &&
+                (ip6Hdr->ip6_hlim == flowIp6Hdr->ip6_hlim));
+    }
+}
+
+/*
+ * Account for a segment with payload bytes appended to the flow and
+ * take over its ack, window, flags and timestamps.
+ */
+static inline void rtlLroMerge(rtlLroFlow *flow, const struct tcphdr *tcpHdr,
+                               UInt32 tcpLen, UInt32 payload)
+{
+    const UInt32 *opts = (const UInt32 *)(tcpHdr + 1);
+    UInt32 *flowOpts = (UInt32 *)(flow->tcpHdr + 1);
+
+    flow->len += payload;
+    flow->nextSeq += payload;
+    flow->segs++;
+
+    flow->tcpHdr->th_ack = tcpHdr->th_ack;
+    flow->tcpHdr->th_win = tcpHdr->th_win;
+    flow->tcpHdr->th_flags |= tcpHdr->th_flags;
+
+    if (tcpLen == kTcpHdrLenTS) {
+        flowOpts[1] = opts[1];
+        flowOpts[2] = opts[2];
+    }
+}
+
+/*
+ * Update the length fields of the IP header of a flow before it's
+ * passed up, and the IPv4 header checksum with them.
+ */
+static inline void rtlLroFinish(rtlLroFlow *flow)
+{
+    struct ip *ipHdr;
+    struct ip6_hdr *ip6Hdr;
+
+    if (flow->segs < 2)
+        return;
+
+    if (flow->etherType == ETHERTYPE_IP) {
+        ipHdr = (struct ip *)flow->l3Hdr;
+        ipHdr->ip_len = htons(flow->len - ETH_HLEN);
+        ipHdr->ip_sum = 0;
+        ipHdr->ip_sum = rtlIPv4HdrChecksum(ipHdr);
+    } else {
+        ip6Hdr = (struct ip6_hdr *)flow->l3Hdr;
+        ip6Hdr->ip6_plen = htons(flow->len - ETH_HLEN - kIPv6HdrLen);
+    }
+}
+
+#endif /* SimpleRTK5Lro_hpp */
@@ -0,0 +1,300 @@
+//
+//  SimpleRTK5MSIX.cpp
+//  SimpleRTK5
+//
+
+#include "SimpleRTK5Ethernet.hpp"
+
+#pragma mark --- MSI-X interrupt methods ---
+
+/*
+ * Select the MSI-X layout of the chip. Chips with the original
+ * interrupt registers or without tx completion bits in ISR_V2
+ * always use a single MSI vector.
+ */
+void SimpleRTK5::msixSelectLayout(struct srtk5_private *tp)
+{
+    msixLayout = NULL;
+
+    if (!enableMSIX)
+        goto done;
+
+    msixLayout = rtlMsixLayoutOf(tp->mcfg);
+
+    if (!msixLayout)
+        IOLog("SimpleRTK5: MSI-X isn't supported by this chip.\n");
+
+done:
+    return;
+}
+
+/*
+ * Create an interrupt source for each rx queue, each tx queue and
+ * the link change interrupt. The rx and link vectors are handled
+ * on the main work loop, while the tx vectors get a work loop of
+ * their own, so that reclaiming sent packets never delays the
+ * processing of received ones.
+ */
+bool SimpleRTK5::initMsixSources(IOService *provider)
+{
+    IOInterruptEventSource::Action rxAction;
+    IOInterruptEventSource::Action txAction;
+    IOInterruptEventSource::Action linkAction;
+    int msixBase = -1;
+    int intrIndex = 0;
+    int intrType = 0;
+    UInt32 numVectors = 0;
+    UInt32 i;
+    bool result = false;
+
+    while (pciDevice->getInterruptType(intrIndex, &intrType) == kIOReturnSuccess) {
+        if (intrType & kIOInterruptTypePCIMessagedX) {
+            if (msixBase < 0)
+                msixBase = intrIndex;
+
+            numVectors++;
+        } else if (msixBase >= 0) {
+            break;
+        }
+        intrIndex++;
+    }
+    if (numVectors <= msixLayout->linkMsg) {
+        IOLog("SimpleRTK5: Only %u MSI-X vectors available.\n", numVectors);
+        goto done;
+    }
+    DebugLog("SimpleRTK5: MSI-X interrupt index: %d, vectors: %u\n", msixBase, numVectors);
+
+    txWorkLoop = IOWorkLoop::workLoop();
+
+    if (!txWorkLoop) {
+        IOLog("SimpleRTK5: Failed to create tx work loop.\n");
+        goto done;
+    }
+    rxAction = OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::msixRxInterrupt);
+    txAction = OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::msixTxInterrupt);
+    linkAction = OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::msixLinkInterrupt);
+
+    for (i = 0; i < numRxQueues; i++) {
+        rxIntrSource[i] = IOInterruptEventSource::interruptEventSource(this, rxAction, provider, msixBase + i);
+
+        if (!rxIntrSource[i])
+            goto error;
+
+        workLoop->addEventSource(rxIntrSource[i]);
+    }
+    for (i = 0; i < numTxQueues; i++) {
+        txIntrSource[i] = IOInterruptEventSource::interruptEventSource(this, txAction, provider, msixBase + msixLayout->txMsg[i]);
+
+        if (!txIntrSource[i])
+            goto error;
+
+        txWorkLoop->addEventSource(txIntrSource[i]);
+    }
+    linkIntrSource = IOInterruptEventSource::interruptEventSource(this, linkAction, provider, msixBase + msixLayout->linkMsg);
+
+    if (!linkIntrSource)
+        goto error;
+
+    workLoop->addEventSource(linkIntrSource);
+
+    result = true;
+
+done:
+    return result;
+
+error:
+    IOLog("SimpleRTK5: Failed to create MSI-X interrupt source.\n");
+    freeMsixSources();
+    goto done;
+}
+
+void SimpleRTK5::freeMsixSources()
+{
+    UInt32 i;
+
+    for (i = 0; i < kMaxRxQueues; i++) {
+        if (rxIntrSource[i]) {
+            workLoop->removeEventSource(rxIntrSource[i]);
+            RELEASE(rxIntrSource[i]);
+        }
+    }
+    for (i = 0; i < kMaxTxQueues; i++) {
+        if (txIntrSource[i]) {
+            txWorkLoop->removeEventSource(txIntrSource[i]);
+            RELEASE(txIntrSource[i]);
+        }
+    }
+    if (linkIntrSource) {
+        workLoop->removeEventSource(linkIntrSource);
+        RELEASE(linkIntrSource);
+    }
+    RELEASE(txWorkLoop);
+}
+
+void SimpleRTK5::intrEnable()
+{
+    UInt32 i;
+
+    if (msixLayout) {
+        for (i = 0; i < numRxQueues; i++)
+            rxIntrSource[i]->enable();
+
+        for (i = 0; i < numTxQueues; i++)
+            txIntrSource[i]->enable();
+
+        linkIntrSource->enable();
+    } else {
+        interruptSource->enable();
+    }
+}
+
+void SimpleRTK5::intrDisable()
+{
+    UInt32 i;
+
+    if (msixLayout) {
+        for (i = 0; i < numRxQueues; i++)
+            rxIntrSource[i]->disable();
+
+        for (i = 0; i < numTxQueues; i++)
+            txIntrSource[i]->disable();
+
+        linkIntrSource->disable();
+
+        /* Wait for a tx handler, which might still be running. */
+        txWorkLoop->closeGate();
+        txWorkLoop->openGate();
+    } else {
+        interruptSource->disable();
+    }
+}
+
+/*
+ * Program the interrupt mask. In MSI-X mode, the mask of IMR0 is
+ * translated into the per-vector mask of IMR_V2. The tx and link
+ * vectors are always enabled, the rx vectors only in case the mask
+ * contains RxOK, i.e. they are masked in poll mode.
+ */
+void SimpleRTK5::rtl812xSetIntrMask(UInt32 mask)
+{
+    struct srtk5_private *tp = &linuxData;
+    UInt32 v2Mask;
+
+    if (msixLayout) {
+        v2Mask = rtlMsixIntrMask(msixLayout, numRxQueues, numTxQueues, (mask & RxOK));
+
+        RTL_W32(tp, IMR0_8125, 0x0000);
+        RTL_W32(tp, IMR_V2_CLEAR_REG_8125, ~v2Mask);
+        RTL_W32(tp, IMR_V2_SET_REG_8125, v2Mask);
+    } else {
+        RTL_W32(tp, IMR0_8125, mask);
+        rtl812xSetQueueIntrMask(tp, mask);
+    }
+}
+
+/*
+ * The vector handlers mask their own vector while they are running
+ * and acknowledge it in ISR_V2, leaving the other vectors alone.
+ */
+void SimpleRTK5::msixRxInterrupt(OSObject *client,
+                                 IOInterruptEventSource *src, int count)
+{
+    struct srtk5_private *tp = &linuxData;
+    rtlRxRing *ring = NULL;
+    UInt32 rxPackets;
+    UInt32 i;
+
+    for (i = 0; i < numRxQueues; i++) {
+        if (rxIntrSource[i] == src) {
+            ring = &rxRing[i];
+            break;
+        }
+    }
+    if (!ring)
+        goto done;
+
+    RTL_W32(tp, IMR_V2_CLEAR_REG_8125, BIT(i));
+    RTL_W32(tp, ISR_V2_8125, BIT(i));
+
+    if (!test_bit(__POLL_MODE, &stateFlags) &&
+        !test_and_set_bit(__POLLING, &stateFlags)) {
+        if (useAppleVTD)
+            rxPackets = rxInterruptVTD(ring, netif, numRxDesc, NULL, NULL);
+        else
+            rxPackets = rxInterrupt(ring, netif, numRxDesc, NULL, NULL);
+
+        if (rxPackets)
+            netif->flushInputQueue();
+
+        etherStats->dot3RxExtraEntry.interrupts++;
+
+        clear_bit(__POLLING, &stateFlags);
+
+        /* In poll mode the vector stays masked. */
+        RTL_W32(tp, IMR_V2_SET_REG_8125, BIT(i));
+    }
+
+done:
+    return;
+}
+
+void SimpleRTK5::msixTxInterrupt(OSObject *client,
+                                 IOInterruptEventSource *src, int count)
+{
+    struct srtk5_private *tp = &linuxData;
+    UInt32 msg;
+    UInt32 i;
+
+    for (i = 0; i < numTxQueues; i++) {
+        if (txIntrSource[i] == src)
+            break;
+    }
+    if (i == numTxQueues)
+        goto done;
+
+    msg = msixLayout->txMsg[i];
+
+    RTL_W32(tp, IMR_V2_CLEAR_REG_8125, BIT(msg));
+    RTL_W32(tp, ISR_V2_8125, BIT(msg));
+
+    /* We are running on the tx work loop already. */
+    if (txReclaimCall)
+        txReclaim();
+    else
+        txInterrupt(&txRing[i]);
+
+    etherStats->dot3TxExtraEntry.interrupts++;
+
+    RTL_W32(tp, IMR_V2_SET_REG_8125, BIT(msg));
+
+done:
+    return;
+}
+
+void SimpleRTK5::msixLinkInterrupt(OSObject *client,
+                                   IOInterruptEventSource *src, int count)
+{
+    struct srtk5_private *tp = &linuxData;
+    UInt32 msg = msixLayout->linkMsg;
+
+    RTL_W32(tp, IMR_V2_CLEAR_REG_8125, BIT(msg));
+    RTL_W32(tp, ISR_V2_8125, BIT(msg));
+
+    rtl812xCheckLinkStatus(tp);
+
+    RTL_W32(tp, IMR_V2_SET_REG_8125, BIT(msg));
+}
+
+/* Reclaim the tx rings in the context of the tx work loop. */
+IOReturn SimpleRTK5::txReclaimAction(OSObject *owner, void *arg1, void *arg2,
+                                     void *arg3, void *arg4)
+{
+    SimpleRTK5 *ethCtlr = OSDynamicCast(SimpleRTK5, owner);
+    UInt32 i;
+
+    if (ethCtlr) {
+        for (i = 0; i < ethCtlr->numTxQueues; i++)
+            ethCtlr->txInterrupt(&ethCtlr->txRing[i]);
+    }
+    return kIOReturnSuccess;
+}
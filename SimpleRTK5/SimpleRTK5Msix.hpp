@@ -0,0 +1,89 @@
+//
+//  SimpleRTK5Msix.hpp
+//  SimpleRTK5
+//
+//  MSI-X message layouts of the chip families and the IMR_V2 mask
+//  built from them. Kept free of kernel dependencies, so that they
+//  can be checked against the register definitions on the host.
+//
+
+#ifndef SimpleRTK5Msix_hpp
+#define SimpleRTK5Msix_hpp
+
+#include "rtl812x.h"
+#include "SimpleRTK5Rss.hpp"
+
+/*
+ * MSI-X message numbers of a chip family. Rx queue n always uses
+ * message n. The bit of a message in the ISR_V2/IMR_V2 registers
+ * has the same number.
+ */
+typedef struct rtlMsixLayout {
+    UInt8 isrVer;
+    UInt8 txMsg[kMaxTxQueues];
+    UInt8 linkMsg;
+} rtlMsixLayout;
+
+/*
+ * Message numbers of the tx queues and the link change interrupt
+ * for each of the interrupt register layouts, which can be used
+ * with MSI-X.
+ */
+static const rtlMsixLayout msixLayouts[] = {
+    { 2, { 16, 18 }, 21 },  /* CFG_METHOD_4, 5, 7 */
+    { 5, { 16, 17 }, 18 },  /* CFG_METHOD_10, 11, 13 */
+    { 7, { 27, 28 }, 29 },  /* CFG_METHOD_12 */
+};
+
+/*
+ * The MSI-X layout of a chip. Chips with the original interrupt
+ * registers or without tx completion bits in ISR_V2 have none.
+ */
+static inline const rtlMsixLayout *rtlMsixLayoutOf(UInt32 mcfg)
+{
+    const rtlMsixLayout *layout = NULL;
+
+    switch (mcfg) {
+    case CFG_METHOD_4:
+    case CFG_METHOD_5:
+    case CFG_METHOD_7:
+        layout = &msixLayouts[0];
+        break;
+
+    case CFG_METHOD_10:
+    case CFG_METHOD_11:
+    case CFG_METHOD_13:
+        layout = &msixLayouts[1];
+        break;
+
+    case CFG_METHOD_12:
+        layout = &msixLayouts[2];
+        break;
+
+    default:
+        break;
+    }
+    return layout;
+}
+
+/*
+ * The IMR_V2 mask of a layout. The tx and link vectors are always
+ * enabled, the rx vectors only with rx interrupts.
+ */
+static inline UInt32 rtlMsixIntrMask(const rtlMsixLayout *layout, UInt32 numRxQueues,
+                                     UInt32 numTxQueues, bool rx)
+{
+    UInt32 mask = (1U << layout->linkMsg);
+    UInt32 i;
+
+    for (i = 0; i < numTxQueues; i++)
+        mask |= (1U << layout->txMsg[i]);
+
+    if (rx) {
+        for (i = 0; i < numRxQueues; i++)
+            mask |= (1U << i);
+    }
+    return mask;
+}
+
+#endif /* SimpleRTK5Msix_hpp */
@@ -0,0 +1,89 @@
+//
+//  SimpleRTK5Ring.hpp
+//  SimpleRTK5
+//
+//  Descriptor ring sizes and index arithmetic. Kept free of kernel
+//  dependencies, so that it can be tested on the host as well.
+//
+
+#ifndef SimpleRTK5Ring_hpp
+#define SimpleRTK5Ring_hpp
+
+/*
+ * The number of descriptors must be a power of 2. Ring sizes are
+ * configurable in the range kMinRingSize to kMaxRingSize.
+ */
+#define kMinRingSize 256
+#define kMaxRingSize 4096
+#define kDefaultRingSize 512
+
+/* Size of a batch of rx buffers mapped by one IOMemoryDescriptor */
+#define kRxMemBaseShift 4
+#define kRxMemBatchSize (1 << kRxMemBaseShift)
+#define kRxMemDescMask (kRxMemBatchSize - 1)
+#define kRxMemBaseMask ~kRxMemDescMask
+
+/*
+ * Limit the requested ring size to the supported range and round it
+ * down to the next power of 2.
+ */
+static inline UInt32 rtlRingSize(UInt32 size)
+{
+    if (size >= kMaxRingSize)
+        return kMaxRingSize;
+
+    if (size <= kMinRingSize)
+        return kMinRingSize;
+
+    return (1 << (31 - __builtin_clz(size)));
+}
+
+/* With up to 32 segments we should be on the save side. */
+#define kMaxSegs 32
+
+/* Treshhold value to wake a stalled queue */
+#define kMinFreeDescs (kMaxSegs + 2)
+
+/*
+ * The number of page segments a tx buffer of len bytes at virtual
+ * address d is split into for DMA. Empty buffers take none.
+ */
+static inline UInt32 rtlTxPageSegs(IOVirtualAddress d, UInt32 len)
+{
+    if (!len)
+        return 0;
+
+    return (UInt32)((trunc_page(d + len - 1) - trunc_page(d)) >> PAGE_SHIFT) + 1;
+}
+
+/* Descriptors filled in before the doorbell is rung within a batch */
+#define kTxDoorbellTreshhold 64
+
+/*
+ * Advance a ring index by count descriptors. The index may be one
+ * below zero, i.e. UINT32_MAX, as the unsigned wrap around yields
+ * the last descriptor of the ring after masking.
+ */
+static inline UInt32 rtlRingAdvance(UInt32 index, UInt32 count, UInt32 mask)
+{
+    return (index + count) & mask;
+}
+
+/*
+ * The number of tx packets which can be dequeued at once, given the
+ * number of free descriptors and the bytes left below the byte limit.
+ * Even if all packets need kMaxSegs descriptors, at least
+ * kMinFreeDescs - kMaxSegs descriptors are left. Both budgets allow
+ * one packet more than fits, so that the caller only has to check
+ * that the ring has room for one packet.
+ */
+static inline UInt32 rtlTxBatchSize(UInt32 numFreeDesc, SInt32 bytesAvail,
+                                    UInt32 maxPktLen)
+{
+    UInt32 descBudget = ((numFreeDesc - kMinFreeDescs) / kMaxSegs) + 1;
+    UInt32 byteBudget = ((UInt32)bytesAvail / maxPktLen) + 1;
+
+    return (descBudget < byteBudget) ? descBudget : byteBudget;
+}
+
+#endif /* SimpleRTK5Ring_hpp */
@@ -0,0 +1,57 @@
+//
+//  SimpleRTK5Rss.hpp
+//  SimpleRTK5
+//
+//  Receive side scaling: layout of the indirection table. Kept free
+//  of kernel dependencies, so that it can be tested on the host.
+//
+
+#ifndef SimpleRTK5Rss_hpp
+#define SimpleRTK5Rss_hpp
+
+/* Receive side scaling */
+#define kMaxRxQueues 4
+#define kMaxTxQueues 2
+
+#define kRssKeySize 40
+#define kRssIndirTblSize 128
+
+/* The NIC uses the low 7 bits of the hash to index the table. */
+#define kRssIndirTblMask (kRssIndirTblSize - 1)
+
+/*
+ * log2 of the number of rx queues, which must be a power of 2. It's
+ * programmed into RSS_CTRL_8125 and Q_NUM_CTRL_8125.
+ */
+static inline UInt16 rtlRssQueueShift(UInt32 numQueues)
+{
+    UInt16 shift = 0;
+
+    for (; numQueues > 1; numQueues >>= 1)
+        shift++;
+
+    return shift;
+}
+
+/* The table's entries are spread round robin over all queues. */
+static inline UInt32 rtlRssQueue(UInt32 entry, UInt32 numQueues)
+{
+    return (entry & (numQueues - 1));
+}
+
+/*
+ * Value of the indirection table register, which holds the four
+ * entries starting at entry, one per byte.
+ */
+static inline UInt32 rtlRssReta(UInt32 entry, UInt32 numQueues)
+{
+    UInt32 reta = 0;
+    UInt32 j;
+
+    for (j = 0; j < 4; j++)
+        reta |= (rtlRssQueue(entry + j, numQueues) << (j * 8));
+
+    return reta;
+}
+
+#endif /* SimpleRTK5Rss_hpp */
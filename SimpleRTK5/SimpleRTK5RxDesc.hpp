@@ -0,0 +1,226 @@
+//
+//  SimpleRTK5RxDesc.hpp
+//  SimpleRTK5
+//
+//  Rx descriptor formats and the decoders of the extended formats.
+//  The decoders are pure functions, which are tested on the host.
+//
+
+#ifndef SimpleRTK5RxDesc_hpp
+#define SimpleRTK5RxDesc_hpp
+
+#include "rtl812x.h"
+
+/* The buffer size field of a rx descriptor is 14 bits wide. */
+#define kRxMaxDescBufSize 0x3ff8
+
+/* RTL8125's Rx descriptor. */
+typedef union RtlRxDesc {
+    struct {
+        UInt32 opts1;
+        UInt32 opts2;
+        UInt64 addr;
+    } cmd;
+    struct {
+        UInt64 blen;
+        UInt64 addr;
+    } buf;
+} RtlRxDesc;
+
+/* RTL8125's extended Rx descriptor (format v3). */
+typedef struct RtlRxDescV3 {
+    UInt64 rsv;
+    UInt64 rss;  /* RSS result, header length and header info */
+    UInt64 addr; /* Timestamp after write back */
+    UInt64 opts; /* opts2 in the lower and opts1 in the upper half */
+} RtlRxDescV3;
+
+/* RTL8125's extended Rx descriptor (format v4). */
+typedef struct RtlRxDescV4 {
+    UInt64 addr; /* RSS info and result after write back */
+    UInt64 opts; /* opts2 in the lower and opts1 in the upper half */
+} RtlRxDescV4;
+
+/* RSS header info bits of the extended Rx descriptors */
+enum RtlRxRssInfo {
+    RxRssUDP_v3 = (1 << 9),
+    RxRssIPv4_v3 = (1 << 10),
+    RxRssIPv6_v3 = (1 << 12),
+    RxRssTCP_v3 = (1 << 13),
+    RxRssUDP_v4 = (1 << 27),
+    RxRssIPv4_v4 = (1 << 28),
+    RxRssIPv6_v4 = (1 << 29),
+    RxRssTCP_v4 = (1 << 30),
+};
+
+/* Packet type as reported by the extended Rx descriptors */
+enum RtlRxPktType {
+    kRxPktTypeIPv4 = (1 << 0),
+    kRxPktTypeIPv6 = (1 << 1),
+    kRxPktTypeTCP = (1 << 2),
+    kRxPktTypeUDP = (1 << 3),
+};
+
+/*
+ * Status of a rx descriptor. Independent of the descriptor format,
+ * opts1 and opts2 are always in the layout of the legacy descriptor.
+ */
+typedef struct rtlRxDescStatus {
+    UInt32 opts1;
+    UInt32 opts2;
+    UInt32 hash;
+    UInt32 type;
+} rtlRxDescStatus;
+
+/*
+ * Decode the status of the extended descriptor formats. The error,
+ * fragment and checksum bits are translated into the layout of the
+ * legacy descriptor, so that the rx path can handle all formats in
+ * the same way. The packet type is taken from the RSS header info.
+ */
+static inline void rxDecodeDescV3(rtlRxDescStatus *status, UInt64 opts, UInt64 rss)
+{
+    UInt32 opts1 = (UInt32)(opts >> 32);
+    UInt32 opts2 = (UInt32)opts;
+    UInt32 info = (UInt32)(rss >> 48);
+    UInt32 s1, type = 0;
+
+    s1 = (opts1 & (DescOwn | RingEnd | 0x3fff));
+
+    if (opts1 & FirstFrag_V3)
+        s1 |= FirstFrag;
+
+    if (opts1 & LastFrag_V3)
+        s1 |= LastFrag;
+
+    if (unlikely(opts1 & RxRES_V3)) {
+        s1 |= RxRES;
+
+        if (opts1 & RxRWT_V3)
+            s1 |= RxRWT;
+
+        if (opts1 & RxRUNT_V3)
+            s1 |= RxRUNT;
+
+        if (opts1 & RxCRC_V3)
+            s1 |= RxCRC;
+    }
+    /* Checksum bits are reported in opts2. */
+    s1 |= ((opts2 >> 10) & (RxIPF | RxUDPF | RxTCPF));
+    s1 |= ((opts2 >> 11) & (RxUDPT | RxTCPT));
+
+    if (info & RxRssIPv4_v3)
+        type |= kRxPktTypeIPv4;
+
+    if (info & RxRssIPv6_v3)
+        type |= kRxPktTypeIPv6;
+
+    if (info & RxRssTCP_v3)
+        type |= kRxPktTypeTCP;
+
+    if (info & RxRssUDP_v3)
+        type |= kRxPktTypeUDP;
+
+    status->opts1 = s1;
+    status->opts2 = (opts2 & (RxV6F | RxV4F | RxVlanTag | 0xffff));
+    status->hash = (type) ? (UInt32)rss : 0;
+    status->type = type;
+}
+
+static inline void rxDecodeDescV4(rtlRxDescStatus *status, UInt64 opts, UInt64 rss)
+{
+    UInt32 opts1 = (UInt32)(opts >> 32);
+    UInt32 opts2 = (UInt32)opts;
+    UInt32 info = (UInt32)rss;
+    UInt32 type = 0;
+
+    if (info & RxRssIPv4_v4)
+        type |= kRxPktTypeIPv4;
+
+    if (info & RxRssIPv6_v4)
+        type |= kRxPktTypeIPv6;
+
+    if (info & RxRssTCP_v4)
+        type |= kRxPktTypeTCP;
+
+    if (info & RxRssUDP_v4)
+        type |= kRxPktTypeUDP;
+
+    /*
+     * Apart from the missing RxRWT bit, the error and checksum bits
+     * are those of the legacy format shifted left by one.
+     */
+    status->opts1 = ((opts1 & (DescOwn | RingEnd | FirstFrag | LastFrag | 0x3fff)) |
+                     ((opts1 >> 1) & (RxRES | RxRUNT | RxCRC | RxUDPT | RxTCPT | RxIPF | RxUDPF | RxTCPF)));
+    status->opts2 = opts2;
+    status->hash = (type) ? (UInt32)(rss >> 32) : 0;
+    status->type = type;
+}
+
+/*
+ * Get the status of up to count ready descriptors starting at index
+ * and return their number. The ring is mapped uncached, so that opts1
+ * and opts2 are read with a single 64 bit access each and the scan
+ * stops at the first descriptor, which is still owned by the NIC.
+ */
+static inline UInt32 rxScanDescs(const void *descArray, UInt32 descType,
+                                 UInt32 index, UInt32 mask,
+                                 rtlRxDescStatus *status, UInt32 count)
+{
+    const RtlRxDescV3 *descV3;
+    const RtlRxDescV4 *descV4;
+    const RtlRxDesc *desc;
+    UInt64 opts;
+    UInt32 n;
+
+    switch (descType) {
+    case RX_DESC_RING_TYPE_3:
+        descV3 = (const RtlRxDescV3 *)descArray;
+
+        for (n = 0; n < count; n++) {
+            opts = OSSwapLittleToHostInt64(descV3[index].opts);
+
+            if (opts & ((UInt64)DescOwn << 32))
+                break;
+
+            rxDecodeDescV3(&status[n], opts, OSSwapLittleToHostInt64(descV3[index].rss));
+            index = (index + 1) & mask;
+        }
+        break;
+
+    case RX_DESC_RING_TYPE_4:
+        descV4 = (const RtlRxDescV4 *)descArray;
+
+        for (n = 0; n < count; n++) {
+            opts = OSSwapLittleToHostInt64(descV4[index].opts);
+
+            if (opts & ((UInt64)DescOwn << 32))
+                break;
+
+            rxDecodeDescV4(&status[n], opts, OSSwapLittleToHostInt64(descV4[index].addr));
+            index = (index + 1) & mask;
+        }
+        break;
+
+    default:
+        desc = (const RtlRxDesc *)descArray;
+
+        for (n = 0; n < count; n++) {
+            opts = OSSwapLittleToHostInt64(desc[index].buf.blen);
+
+            /* DescOwn is negative and mustn't be sign extended. */
+            if ((UInt32)opts & DescOwn)
+                break;
+
+            status[n].opts1 = (UInt32)opts;
+            status[n].opts2 = (UInt32)(opts >> 32);
+            status[n].hash = 0;
+            status[n].type = 0;
+            index = (index + 1) & mask;
+        }
+        break;
+    }
+    return n;
+}
+
+#endif /* SimpleRTK5RxDesc_hpp */
@@ -0,0 +1,179 @@
+//
+//  SimpleRTK5RxMag.hpp
+//  SimpleRTK5
+//
+//  Magazine caches of the rx buffer pool. The exchange of magazines
+//  between the consumer and the refill thread is kept free of kernel
+//  dependencies, so that it can be stress tested on the host.
+//
+
+#ifndef SimpleRTK5RxMag_hpp
+#define SimpleRTK5RxMag_hpp
+
+#define kRxPoolMagSize  16
+
+/*
+ * A magazine holds a batch of preallocated packets. It's
+ * always owned by either the consumer or the refill thread.
+ */
+typedef struct RxPoolMag {
+    UInt32 count;
+    mbuf_t pkts[kRxPoolMagSize];
+} RxPoolMag;
+
+/*
+ * A cache of preallocated packets of one size. The consumer
+ * takes packets from its loaded magazine. Full magazines are
+ * passed from the refill thread to the consumer and empty ones
+ * back through two single producer / single consumer rings,
+ * so that neither side ever has to wait for the other one.
+ */
+typedef struct RxPoolCache {
+    RxPoolMag *mags;
+    RxPoolMag **fullRing;
+    RxPoolMag **emptyRing;
+    RxPoolMag *loaded;      /* owned by the consumer */
+    RxPoolMag *refilling;   /* owned by the refill thread */
+    UInt32 numMags;
+    UInt32 ringMask;
+    UInt32 refillTresh;
+    UInt32 bufSize;
+    volatile UInt32 fullHead;
+    volatile UInt32 fullTail;
+    volatile UInt32 emptyHead;
+    volatile UInt32 emptyTail;
+} RxPoolCache;
+
+typedef mbuf_t (*RxPoolAllocFunc)(UInt32 bufSize, mbuf_how_t how);
+
+/*
+ * Setup the geometry of a cache of at least capacity packets and
+ * return the size of its rings. One magazine more than required
+ * for capacity is used, which is the one initially loaded.
+ */
+static inline UInt32 rxMagSetup(RxPoolCache *cache, UInt32 capacity, UInt32 bufSize)
+{
+    UInt32 ringSize;
+
+    cache->numMags = (capacity + kRxPoolMagSize - 1) / kRxPoolMagSize + 1;
+    cache->bufSize = bufSize;
+
+    /* Both rings must be able to hold all magazines. */
+    for (ringSize = 1; ringSize < cache->numMags; ringSize <<= 1)
+        ;
+
+    cache->ringMask = ringSize - 1;
+    cache->refillTresh = cache->numMags >> 1;
+
+    return ringSize;
+}
+
+/*
+ * Both rings are large enough to hold all magazines, so that
+ * a put never fails. Only the producer writes the tail and only
+ * the consumer writes the head of a ring.
+ */
+static inline void rxMagPut(RxPoolMag **ring, UInt32 mask,
+                            volatile UInt32 *tail, RxPoolMag *mag)
+{
+    UInt32 t = *tail;
+
+    ring[t & mask] = mag;
+    __atomic_store_n(tail, t + 1, __ATOMIC_RELEASE);
+}
+
+static inline RxPoolMag *rxMagGet(RxPoolMag **ring, UInt32 mask,
+                                  volatile UInt32 *head, volatile UInt32 *tail,
+                                  UInt32 *left)
+{
+    UInt32 h = *head;
+    UInt32 t = __atomic_load_n(tail, __ATOMIC_ACQUIRE);
+    RxPoolMag *mag;
+
+    if (h == t)
+        return NULL;
+
+    mag = ring[h & mask];
+    __atomic_store_n(head, h + 1, __ATOMIC_RELEASE);
+
+    if (left)
+        *left = t - h - 1;
+
+    return mag;
+}
+
+/*
+ * Consumer side: take a packet from the loaded magazine. Once
+ * it's empty, hand it to the refill thread and load a full
+ * one. Sets *refill when the full ring is running low.
+ */
+static inline mbuf_t rxMagGetPacket(RxPoolCache *cache, bool *refill)
+{
+    RxPoolMag *mag = cache->loaded;
+    RxPoolMag *full;
+    UInt32 left;
+    mbuf_t m = NULL;
+
+    if (!mag)
+        goto done;
+
+    if (!mag->count) {
+        full = rxMagGet(cache->fullRing, cache->ringMask, &cache->fullHead,
+                        &cache->fullTail, &left);
+
+        if (!full) {
+            *refill = true;
+            goto done;
+        }
+        if (left < cache->refillTresh)
+            *refill = true;
+
+        rxMagPut(cache->emptyRing, cache->ringMask, &cache->emptyTail, mag);
+        cache->loaded = mag = full;
+    }
+    m = mag->pkts[--mag->count];
+
+done:
+    return m;
+}
+
+/*
+ * Refill thread side: fill up empty magazines and pass them
+ * back to the consumer. A magazine which couldn't be filled
+ * completely is kept and refilled with the next run.
+ */
+static inline bool rxMagRefill(RxPoolCache *cache, RxPoolAllocFunc alloc)
+{
+    RxPoolMag *mag;
+    mbuf_t m;
+
+    if (!cache->mags)
+        return true;
+
+    while (true) {
+        mag = cache->refilling;
+
+        if (!mag) {
+            mag = rxMagGet(cache->emptyRing, cache->ringMask, &cache->emptyHead,
+                           &cache->emptyTail, NULL);
+
+            if (!mag)
+                break;
+
+            cache->refilling = mag;
+        }
+        while (mag->count < kRxPoolMagSize) {
+            m = alloc(cache->bufSize, MBUF_DONTWAIT);
+
+            if (!m)
+                return false;
+
+            mag->pkts[mag->count++] = m;
+        }
+        rxMagPut(cache->fullRing, cache->ringMask, &cache->fullTail, mag);
+        cache->refilling = NULL;
+    }
+    return true;
+}
+
+#endif /* SimpleRTK5RxMag_hpp */
@@ -24,239 +24,468 @@ void SimpleRTK5RxPool::free()
         thread_call_free(refillCE);
         refillCE = NULL;
     }
-    if (cPktHead) {
-        mbuf_freem_list(cPktHead);
-        cPktHead = cPktTail = NULL;
-        cPktNum = 0;
-    }
-    if (mPktHead) {
-        mbuf_freem_list(mPktHead);
-        mPktHead = mPktTail = NULL;
-        mPktNum = 0;
-    }
+    freeCache(&jCache);
+    freeCache(&cCache);
+    freeCache(&mCache);
+    freePages();
+
     super::free();
 }
 
 bool SimpleRTK5RxPool::initWithCapacity(UInt32 mbufCapacity,
-                                         UInt32 clustCapacity)
+                                         UInt32 clustCapacity,
+                                         UInt32 pageCapacity,
+                                         UInt32 bufSize,
+                                         IOMapper *mapper)
 {
-    mbuf_t m;
-    void *data;
-    UInt32 i;
-    errno_t err;
-    unsigned int chunks;
     bool result = false;
     
     if ((mbufCapacity > 0) && (clustCapacity > 0)) {
-        cPktHead = cPktTail = NULL;
-        mPktHead = mPktTail = NULL;
-        cCapacity = clustCapacity;
-        cRefillTresh = cCapacity - (cCapacity >> 1);
-        mCapacity = mbufCapacity;
-        mRefillTresh = mCapacity - (mCapacity >> 1);
-        cPktNum = 0;
-        mPktNum = 0;
         maxCopySize = mbuf_get_mhlen();
-        refillScheduled = false;
+        rxBufSize = bufSize;
+        refillScheduled = 0;
 
-        nanoseconds_to_absolutetime(kRefillDelayTime, &refillDelay);
+        rxCopyBreakInit(&copyBreak, maxCopySize);
 
         refillCE = thread_call_allocate_with_options((thread_call_func_t) &refillThread, (void *) this, THREAD_CALL_PRIORITY_KERNEL, 0);
 
         if (!refillCE) {
             goto done;
         }
-        for (i = 0; i < mbufCapacity; i++) {
-            chunks = 1;
-            err = mbuf_allocpacket(MBUF_WAITOK, maxCopySize, &chunks, &m);
-
-            if (err)
-                goto fail_mbuf;
-
-            if (mPktHead) {
-                mbuf_setnextpkt(mPktTail, m);
-                mPktTail = m;
-                mPktNum++;
-            } else {
-                mPktHead = mPktTail = m;
-                mPktNum = 1;
-            }
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-        }
-        for (i = 0; i < clustCapacity; i++) {
-            chunks = 1;
-            err = mbuf_allocpacket(MBUF_WAITOK, PAGE_SIZE, &chunks, &m);
-
-            if (err)
-                goto fail_cluster;
-
-            if (cPktHead) {
-                mbuf_setnextpkt(cPktTail, m);
-                cPktTail = m;
-                cPktNum++;
-            } else {
-                cPktHead = cPktTail = m;
-                cPktNum = 1;
-            }
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-        }
+        if (!setupCache(&mCache, mbufCapacity, maxCopySize))
+            goto fail_mbuf;
+
+        if (!setupCache(&cCache, clustCapacity, PAGE_SIZE))
+            goto fail_cluster;
+
+        /* Jumbo buffers are cached separately. */
+        if ((bufSize > PAGE_SIZE) && !setupCache(&jCache, clustCapacity, bufSize))
+            goto fail_jumbo;
+
+        /* Without recycled pages, replaced buffers come from the caches. */
+        if (pageCapacity && !setupPages(pageCapacity, mapper))
+            IOLog("SimpleRTK5: Couldn't setup rx page pool, using clusters only.\n");
+
         result = true;
     }
 done:
     return result;
     
+fail_jumbo:
+    freeCache(&jCache);
+
 fail_cluster:
-    if (cPktHead) {
-        mbuf_freem_list(cPktHead);
-        cPktHead = cPktTail = NULL;
-        cPktNum = 0;
-    }
+    freeCache(&cCache);
 
 fail_mbuf:
-    if (mPktHead) {
-        mbuf_freem_list(mPktHead);
-        mPktHead = mPktTail = NULL;
-        mPktNum = 0;
-    }
+    freeCache(&mCache);
     goto done;
 }
 
 SimpleRTK5RxPool *
 SimpleRTK5RxPool::withCapacity(UInt32 mbufCapacity,
-                                UInt32 clustCapacity)
+                                UInt32 clustCapacity,
+                                UInt32 pageCapacity,
+                                UInt32 bufSize,
+                                IOMapper *mapper)
 {
     SimpleRTK5RxPool *pool = new SimpleRTK5RxPool;
     
     if (pool && !pool->initWithCapacity(mbufCapacity,
-                                        clustCapacity)) {
+                                        clustCapacity,
+                                        pageCapacity,
+                                        bufSize,
+                                        mapper)) {
         pool->release();
         pool = NULL;
     }
     return pool;
 }
 
+/*
+ * Packets requested with MBUF_DONTWAIT come from the caches in
+ * order to keep the allocator out of the interrupt path. The
+ * allocator is only used when the cache has run dry.
+ */
 mbuf_t SimpleRTK5RxPool::getPacket(UInt32 size, mbuf_how_t how)
+{
+    RxPoolCache *cache;
+    mbuf_t m = NULL;
+
+    if (size > PAGE_SIZE)
+        cache = &jCache;
+    else if (size > maxCopySize)
+        cache = &cCache;
+    else
+        cache = &mCache;
+
+    if (how == MBUF_DONTWAIT)
+        m = getCachePacket(cache);
+
+    if (!m)
+        m = allocPacket(cache->bufSize, how);
+
+    return m;
+}
+
+mbuf_t SimpleRTK5RxPool::allocPacket(UInt32 bufSize, mbuf_how_t how)
 {
     mbuf_t m = NULL;
     void * data;
-    errno_t err;
     unsigned int chunks = 1;
 
-    if (size > maxCopySize) {
-        err = mbuf_allocpacket(how, PAGE_SIZE, &chunks, &m);
-        
-        if (!err) {
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-            
-        } else if (cPktNum > 1) {
-            OSDecrementAtomic(&cPktNum);
-            
-            m = cPktHead;
-            cPktHead = mbuf_nextpkt(cPktHead);
-            mbuf_setnextpkt(m, NULL);
-            
-            if ((cPktNum < cRefillTresh) && !refillScheduled) {
-                refillScheduled = true;
-                thread_call_enter_delayed(refillCE, refillDelay);
-            }
+    if (!mbuf_allocpacket(how, bufSize, &chunks, &m)) {
+        data = mbuf_datastart(m);
+        mbuf_setdata(m, data, 0);
+    }
+    return m;
+}
+
+#pragma mark--- packet caches ---
+
+/*
+ * Setup a cache with at least capacity packets of bufSize. All
+ * but one magazines are filled up and placed in the full ring.
+ * The remaining empty one is loaded so that the first request
+ * swaps it for a full one.
+ */
+bool SimpleRTK5RxPool::setupCache(RxPoolCache *cache, UInt32 capacity, UInt32 bufSize)
+{
+    RxPoolMag *mag;
+    UInt32 ringSize;
+    UInt32 i;
+    bool result = false;
+
+    bzero(cache, sizeof(RxPoolCache));
+
+    ringSize = rxMagSetup(cache, capacity, bufSize);
+
+    cache->mags = (RxPoolMag *)IOMallocZero(cache->numMags * sizeof(RxPoolMag));
+    cache->fullRing = (RxPoolMag **)IOMallocZero(ringSize * sizeof(RxPoolMag *));
+    cache->emptyRing = (RxPoolMag **)IOMallocZero(ringSize * sizeof(RxPoolMag *));
+
+    if (!cache->mags || !cache->fullRing || !cache->emptyRing)
+        goto done;
+
+    cache->loaded = &cache->mags[0];
+
+    for (i = 1; i < cache->numMags; i++) {
+        mag = &cache->mags[i];
+
+        while (mag->count < kRxPoolMagSize) {
+            if (!(mag->pkts[mag->count] = allocPacket(bufSize, MBUF_WAITOK)))
+                goto done;
+
+            mag->count++;
         }
-    } else {
-        err = mbuf_allocpacket(how, maxCopySize, &chunks, &m);
+        rxMagPut(cache->fullRing, cache->ringMask, &cache->fullTail, mag);
+    }
+    result = true;
 
-        if (!err) {
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-            
-        } else if (mPktNum > 1) {
-            OSDecrementAtomic(&mPktNum);
-            
-            m = mPktHead;
-            mPktHead = mbuf_nextpkt(mPktHead);
-            mbuf_setnextpkt(m, NULL);
-            
-            if ((mPktNum < mRefillTresh) && !refillScheduled) {
-                refillScheduled = true;
-                thread_call_enter_delayed(refillCE, refillDelay);
-            }
+done:
+    return result;
+}
+
+void SimpleRTK5RxPool::freeCache(RxPoolCache *cache)
+{
+    RxPoolMag *mag;
+    UInt32 ringSize = cache->ringMask + 1;
+    UInt32 i, j;
+
+    if (cache->mags) {
+        for (i = 0; i < cache->numMags; i++) {
+            mag = &cache->mags[i];
+
+            for (j = 0; j < mag->count; j++)
+                mbuf_freem(mag->pkts[j]);
         }
+        IOFree(cache->mags, cache->numMags * sizeof(RxPoolMag));
     }
+    if (cache->fullRing)
+        IOFree(cache->fullRing, ringSize * sizeof(RxPoolMag *));
+
+    if (cache->emptyRing)
+        IOFree(cache->emptyRing, ringSize * sizeof(RxPoolMag *));
+
+    bzero(cache, sizeof(RxPoolCache));
+}
+
+/* Consumer side, see rxMagGetPacket(). */
+mbuf_t SimpleRTK5RxPool::getCachePacket(RxPoolCache *cache)
+{
+    bool refill = false;
+    mbuf_t m;
+
+    m = rxMagGetPacket(cache, &refill);
+
+    if (refill)
+        scheduleRefill();
+
     return m;
 }
 
+/* Refill thread side, see rxMagRefill(). */
+bool SimpleRTK5RxPool::refillCache(RxPoolCache *cache)
+{
+    return rxMagRefill(cache, allocPacket);
+}
+
+void SimpleRTK5RxPool::scheduleRefill()
+{
+    if (OSCompareAndSwap(0, 1, &refillScheduled))
+        thread_call_enter(refillCE);
+}
+
 void SimpleRTK5RxPool::refillPool()
 {
-    mbuf_t m;
-    void * data;
-    errno_t err;
-    unsigned int chunks;
-    
-    while (mPktNum < mCapacity) {
-        chunks = 1;
-        err = mbuf_allocpacket(MBUF_DONTWAIT, maxCopySize, &chunks, &m);
+    refillCache(&mCache);
+    refillCache(&cCache);
+    refillCache(&jCache);
 
-        if (!err) {
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-            
-            mbuf_setnextpkt(mPktTail, m);
-            mPktTail = m;
-            OSIncrementAtomic(&mPktNum);
-        } else {
-            goto done;
-        }
+    __atomic_store_n(&refillScheduled, 0, __ATOMIC_RELEASE);
+}
+
+void SimpleRTK5RxPool::refillThread(thread_call_param_t param0)
+{
+    ((SimpleRTK5RxPool *) param0)->refillPool();
+}
+
+#pragma mark--- recycled pages ---
+
+/*
+ * Allocate the recycled pages and map them for DMA once. The
+ * mapping is kept until the pool is freed, so that a page can
+ * be handed to the stack and reused without remapping it. As
+ * the pages are wired, their number is limited, so that they
+ * don't take more than kRxPoolPageBytes.
+ *
+ * Free pages are kept in two lists. The consumer owns a local
+ * list while pages returned by the stack are pushed lock-free
+ * to a shared one, which the consumer grabs as a whole when its
+ * local list is empty.
+ */
+bool SimpleRTK5RxPool::setupPages(UInt32 capacity, IOMapper *mapper)
+{
+    IODMACommand::Segment64 seg;
+    UInt64 offset = 0;
+    UInt32 numSegs;
+    UInt32 i;
+    bool result = false;
+
+    /* Pages have the size of a receive buffer. */
+    for (pageShift = PAGE_SHIFT; (1U << pageShift) < rxBufSize; pageShift++)
+        ;
+
+    pageSize = 1U << pageShift;
+    capacity = min(capacity, (UInt32)(kRxPoolPageBytes >> pageShift));
+
+    pageAddr = (IOPhysicalAddress64 *)IOMallocZero(capacity * sizeof(IOPhysicalAddress64));
+    pageNext = (UInt32 *)IOMallocZero(capacity * sizeof(UInt32));
+
+    if (!pageAddr || !pageNext)
+        goto error_mem;
+
+    pageBufDesc = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut, capacity * pageSize, PAGE_SIZE);
+
+    if (!pageBufDesc)
+        goto error_mem;
+
+    if (pageBufDesc->prepare() != kIOReturnSuccess)
+        goto error_mem;
+
+    pageBase = (UInt8 *)pageBufDesc->getBytesNoCopy();
+
+    pageDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, pageSize, IODMACommand::kMapped, 0, 1, mapper, NULL);
+
+    if (!pageDmaCmd)
+        goto error_mem;
+
+    if (pageDmaCmd->setMemoryDescriptor(pageBufDesc) != kIOReturnSuccess)
+        goto error_mem;
+
+    for (i = 0; i < capacity; i++) {
+        numSegs = 1;
+
+        if ((pageDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) ||
+            (seg.fLength != pageSize))
+            goto error_mem;
+
+        pageAddr[i] = seg.fIOVMAddr;
+        pageNext[i] = (i + 1 < capacity) ? (i + 1) : kRxPoolPageNone;
     }
-    while (cPktNum < cCapacity) {
-        chunks = 1;
-        err = mbuf_allocpacket(MBUF_DONTWAIT, PAGE_SIZE, &chunks, &m);
-        
-        if (!err) {
-            data = mbuf_datastart(m);
-            mbuf_setdata(m, data, 0);
-
-            mbuf_setnextpkt(cPktTail, m);
-            cPktTail = m;
-            OSIncrementAtomic(&cPktNum);
-        } else {
-            goto done;
-        }
+    pageCapacity = capacity;
+    pageLocalHead = 0;
+    pageFreeHead = kRxPoolPageNone;
+    pageHits = 0;
+    pageMisses = 0;
+
+    result = true;
+
+done:
+    return result;
+
+error_mem:
+    pageCapacity = capacity;
+    freePages();
+    goto done;
+}
+
+void SimpleRTK5RxPool::freePages()
+{
+    if (pageDmaCmd) {
+        pageDmaCmd->clearMemoryDescriptor();
+        pageDmaCmd->release();
+        pageDmaCmd = NULL;
     }
+    if (pageBufDesc) {
+        if (pageBase)
+            pageBufDesc->complete();
+
+        pageBufDesc->release();
+        pageBufDesc = NULL;
+    }
+    if (pageAddr) {
+        IOFree(pageAddr, pageCapacity * sizeof(IOPhysicalAddress64));
+        pageAddr = NULL;
+    }
+    if (pageNext) {
+        IOFree(pageNext, pageCapacity * sizeof(UInt32));
+        pageNext = NULL;
+    }
+    pageBase = NULL;
+    pageCapacity = 0;
+    pageLocalHead = pageFreeHead = kRxPoolPageNone;
+}
+
+/*
+ * Get a free page and wrap it into a packet header mbuf. The page
+ * is returned to the pool by pageFree() as soon as the stack frees
+ * the mbuf. Each page in use holds a reference to the pool, so that
+ * the pool and its pages stay valid after the driver has released
+ * it in freeRxRing(), until the stack has freed the last of them.
+ * As long as the pool has a live instance, the kext can't be
+ * unloaded either, which keeps pageFree() around for the callbacks.
+ */
+mbuf_t SimpleRTK5RxPool::getPage(IOPhysicalAddress64 *addr)
+{
+    mbuf_t m = NULL;
+    caddr_t buf;
+    UInt32 index;
+
+    if (pageLocalHead == kRxPoolPageNone)
+        pageLocalHead = __atomic_exchange_n(&pageFreeHead, kRxPoolPageNone, __ATOMIC_ACQUIRE);
+
+    if (pageLocalHead == kRxPoolPageNone)
+        goto miss;
+
+    if (mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m))
+        goto miss;
+
+    index = pageLocalHead;
+    pageLocalHead = pageNext[index];
+
+    buf = (caddr_t)(pageBase + (index << pageShift));
+
+    if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m, buf, pageFree, pageSize, (caddr_t)this)) {
+        mbuf_free(m);
+        m = NULL;
+
+        pageNext[index] = pageLocalHead;
+        pageLocalHead = index;
+        goto miss;
+    }
+    retain();
+    mbuf_setdata(m, buf, 0);
+    *addr = pageAddr[index];
+    pageHits++;
 
 done:
-    refillScheduled = false;
+    return m;
+
+miss:
+    pageMisses++;
+    goto done;
 }
 
-void SimpleRTK5RxPool::refillThread(thread_call_param_t param0)
+/*
+ * Pages may be returned from any context. Push them lock-free
+ * to the shared list.
+ */
+void SimpleRTK5RxPool::returnPage(UInt32 index)
 {
-    ((SimpleRTK5RxPool *) param0)->refillPool();
+    UInt32 head;
+
+    do {
+        head = pageFreeHead;
+        pageNext[index] = head;
+    } while (!OSCompareAndSwap(head, index, &pageFreeHead));
+
+    release();
+}
+
+void SimpleRTK5RxPool::pageFree(caddr_t buf, u_int size, caddr_t arg)
+{
+    SimpleRTK5RxPool *pool = (SimpleRTK5RxPool *)arg;
+
+    pool->returnPage((UInt32)(((UInt8 *)buf - pool->pageBase) >> pool->pageShift));
+}
+
+#pragma mark--- adaptive copybreak ---
+
+/* Called at the end of each rx drain, see rxCopyBreakUpdate(). */
+void SimpleRTK5RxPool::updateCopyBreak(UInt64 mapCost)
+{
+    rxCopyBreakUpdate(&copyBreak, mapCost);
 }
 
 /*
  * This is an exact copy of IONetworkController's method
  * replaceOrCopyPacket(), except that it tries to get new
- * packets form one of our pool.
+ * packets form one of our pool and that packets are copied
+ * up to the adaptive copybreak.
  */
 mbuf_t SimpleRTK5RxPool::replaceOrCopyPacket(mbuf_t *mp,
                                               UInt32 len,
-                                              bool * replaced)
+                                              bool * replaced,
+                                              IOPhysicalAddress64 *addr)
 {
     mbuf_t m = NULL;
+    UInt64 start = 0;
+    UInt64 end;
+    UInt32 bucket;
+    bool timed;
     
+    *addr = 0;
+
     if ((mp != NULL) && (replaced != NULL)) {
+        bucket = rxCopyBreakCount(&copyBreak, len, &timed);
+
+        if (timed)
+            clock_get_uptime(&start);
+
         /*
-         * Packet needs to be replaced. Try to alloc one
-         * get or get one from the cluster buffer pool.
+         * Packet needs to be replaced. Try to get a recycled
+         * page first, which is already mapped for DMA. Otherwise
+         * alloc one or get one from the cluster buffer pool.
          */
-        if (len > maxCopySize) {
+        if (rxCopyBreakReplace(&copyBreak, len, bucket)) {
             m = *mp;
-            
-            if ((*mp = getPacket(len, MBUF_DONTWAIT)) == NULL) {
+
+            if (pageCapacity && ((*mp = getPage(addr)) != NULL))
+                goto replace;
+
+            if ((*mp = getPacket(rxBufSize, MBUF_DONTWAIT)) == NULL) {
                 *mp = m;
                 m = NULL;
             }
+replace:
             *replaced = true;
+            copyBreak.drainReplaced++;
+
+            if (timed) {
+                clock_get_uptime(&end);
+                copyBreak.replaceCost = rxCopyBreakAvg(copyBreak.replaceCost, end - start);
+            }
         } else {
             /*
              * Packet should be copied. Try to get
@@ -268,6 +497,11 @@ mbuf_t SimpleRTK5RxPool::replaceOrCopyPacket(mbuf_t *mp,
                 mbuf_copy_pkthdr(m, *mp);
                 mbuf_pkthdr_setheader(m, NULL);
                 bcopy(mbuf_data(*mp), mbuf_data(m), len);
+
+                if (timed) {
+                    clock_get_uptime(&end);
+                    copyBreak.copyCost[bucket] = rxCopyBreakAvg(copyBreak.copyCost[bucket], end - start);
+                }
             }
             *replaced = false;
         }
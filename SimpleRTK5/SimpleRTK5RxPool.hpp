@@ -8,8 +8,13 @@
 #ifndef SimpleRTK5RxPool_hpp
 #define SimpleRTK5RxPool_hpp
 
+#include "SimpleRTK5RxMag.hpp"
+#include "SimpleRTK5CopyBreak.hpp"
 
-#define kRefillDelayTime  5000UL
+#define kRxPoolPageNone 0xffffffff
+
+/* Upper limit of the wired memory of the recycled pages per pool */
+#define kRxPoolPageBytes (4 * 1024 * 1024)
 
 class SimpleRTK5RxPool : public OSObject
 {
@@ -21,37 +26,76 @@ public:
     virtual void free() APPLE_KEXT_OVERRIDE;
     
     virtual bool initWithCapacity(UInt32 mbufCapacity,
-                                  UInt32 clustCapacity);
+                                  UInt32 clustCapacity,
+                                  UInt32 pageCapacity,
+                                  UInt32 bufSize,
+                                  IOMapper *mapper);
 
     static SimpleRTK5RxPool * withCapacity(UInt32 mbufCapacity,
-                                            UInt32 clustCapacity);
+                                            UInt32 clustCapacity,
+                                            UInt32 pageCapacity,
+                                            UInt32 bufSize,
+                                            IOMapper *mapper);
 
     virtual mbuf_t getPacket(UInt32 size, mbuf_how_t how);
 
     
     mbuf_t replaceOrCopyPacket(mbuf_t *mp,
                                UInt32 len,
-                               bool * replaced);
+                               bool * replaced,
+                               IOPhysicalAddress64 *addr);
     
+    UInt64 getPageHits() { return pageHits; };
+    UInt64 getPageMisses() { return pageMisses; };
+
+    void updateCopyBreak(UInt64 mapCost);
+
+    UInt32 getCopyBreak() { return copyBreak.limit; };
+    const UInt64 *getSizeHistogram() { return copyBreak.histTotal; };
+
 protected:
     void refillPool();
 
     static void refillThread(thread_call_param_t param0);
 
+    bool setupCache(RxPoolCache *cache, UInt32 capacity, UInt32 bufSize);
+    void freeCache(RxPoolCache *cache);
+    mbuf_t getCachePacket(RxPoolCache *cache);
+    bool refillCache(RxPoolCache *cache);
+    void scheduleRefill();
+
+    static mbuf_t allocPacket(UInt32 bufSize, mbuf_how_t how);
+
+    bool setupPages(UInt32 pageCapacity, IOMapper *mapper);
+    void freePages();
+    mbuf_t getPage(IOPhysicalAddress64 *addr);
+    void returnPage(UInt32 index);
+
+    static void pageFree(caddr_t buf, u_int size, caddr_t arg);
+
     thread_call_t refillCE;
-    UInt64 refillDelay;
-    mbuf_t cPktHead;
-    mbuf_t cPktTail;
-    mbuf_t mPktHead;
-    mbuf_t mPktTail;
-    UInt32 cCapacity;
-    UInt32 cRefillTresh;
-    SInt32 cPktNum;
-    UInt32 mCapacity;
-    UInt32 mRefillTresh;
-    SInt32 mPktNum;
+    RxPoolCache cCache;
+    RxPoolCache mCache;
+    RxPoolCache jCache;
+    UInt32 rxBufSize;
     UInt32 maxCopySize;
-    bool refillScheduled;
+    volatile UInt32 refillScheduled;
+
+    RxCopyBreak copyBreak;
+
+    /* Recycled pages which stay DMA mapped while they are in use. */
+    IOBufferMemoryDescriptor *pageBufDesc;
+    IODMACommand *pageDmaCmd;
+    UInt8 *pageBase;
+    IOPhysicalAddress64 *pageAddr;
+    UInt32 *pageNext;
+    UInt32 pageCapacity;
+    UInt32 pageSize;
+    UInt32 pageShift;
+    UInt32 pageLocalHead;   /* owned by the consumer */
+    volatile UInt32 pageFreeHead;
+    UInt64 pageHits;
+    UInt64 pageMisses;
 };
 
 #endif /* SimpleRTK5RxPool_hpp */
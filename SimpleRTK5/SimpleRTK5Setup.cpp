@@ -73,6 +73,14 @@ struct rtlMediumTable mediumArray[MIDX_COUNT] = {
 
 #pragma mark --- data structure initialization methods ---
 
+static UInt32 getRingSize(OSNumber *num)
+{
+    if (num == NULL)
+        return kDefaultRingSize;
+    
+    return rtlRingSize(num->unsigned32BitValue());
+}
+
 void SimpleRTK5::getParams()
 {
     OSDictionary *params;
@@ -81,9 +89,23 @@ void SimpleRTK5::getParams()
     OSString *fbAddr;
     OSBoolean *tsoV4;
     OSBoolean *tsoV6;
+    OSBoolean *softTSO;
+    OSBoolean *bql;
+    OSBoolean *reclaim;
+    OSBoolean *msix;
+    OSBoolean *filter;
+    OSBoolean *busy;
+    OSBoolean *tuning;
     OSBoolean *aspm;
+    OSBoolean *jumbo;
+    OSBoolean *lro;
+    OSBoolean *extDesc;
     OSNumber *tv;
+    OSNumber *nq;
+    OSNumber *rs;
+    OSNumber *cb;
     UInt32 interval;
+    UInt32 queues;
     
     if (version_major >= Tahoe) {
         params = serviceMatching("AppleVTD");
@@ -118,11 +140,112 @@ void SimpleRTK5::getParams()
         
         IOLog("SimpleRTK5: TCP/IPv6 segmentation offload %s.\n", enableTSO6 ? onName : offName);
         
+        softTSO = OSDynamicCast(OSBoolean, params->getObject(kEnableSoftTSOName));
+        enableSoftTSO = (softTSO != NULL) ? softTSO->getValue() : false;
+        
+        IOLog("SimpleRTK5: Software segmentation %s.\n", enableSoftTSO ? onName : offName);
+        
+        bql = OSDynamicCast(OSBoolean, params->getObject(kEnableTxByteLimitName));
+        enableTxByteLimit = (bql != NULL) ? bql->getValue() : false;
+        
+        IOLog("SimpleRTK5: Tx byte limit %s.\n", enableTxByteLimit ? onName : offName);
+        
+        reclaim = OSDynamicCast(OSBoolean, params->getObject(kEnableTxReclaimThreadName));
+        enableTxReclaimThread = (reclaim != NULL) ? reclaim->getValue() : false;
+        
+        IOLog("SimpleRTK5: Tx reclaim thread %s.\n", enableTxReclaimThread ? onName : offName);
+        
+        msix = OSDynamicCast(OSBoolean, params->getObject(kEnableMSIXName));
+        enableMSIX = (msix != NULL) ? msix->getValue() : false;
+        
+        IOLog("SimpleRTK5: MSI-X %s.\n", enableMSIX ? onName : offName);
+        
+        filter = OSDynamicCast(OSBoolean, params->getObject(kEnableIntrFilterName));
+        enableIntrFilter = (filter != NULL) ? filter->getValue() : true;
+        
+        IOLog("SimpleRTK5: Interrupt filter %s.\n", enableIntrFilter ? onName : offName);
+        
+        busy = OSDynamicCast(OSBoolean, params->getObject(kEnableBusyPollName));
+        enableBusyPoll = (busy != NULL) ? busy->getValue() : false;
+        
+        IOLog("SimpleRTK5: Busy poll %s.\n", enableBusyPoll ? onName : offName);
+        
+        tv = OSDynamicCast(OSNumber, params->getObject(kBusyPollBudgetName));
+        
+        if (tv != NULL) {
+            interval = tv->unsigned32BitValue();
+            busyPollBudget = (interval > kBusyPollMaxBudget) ? kBusyPollMaxBudget : max(interval, 1U);
+        } else {
+            busyPollBudget = kBusyPollDefBudget;
+        }
+        tv = OSDynamicCast(OSNumber, params->getObject(kBusyPollRateName));
+        busyPollRate = (tv != NULL) ? max(tv->unsigned32BitValue(), (UInt32)kBusyPollMinRate) : kBusyPollDefRate;
+        
         aspm = OSDynamicCast(OSBoolean, params->getObject(kEnableASPM));
         enableASPM = (aspm != NULL) ? aspm->getValue() : false;
         
         IOLog("SimpleRTK5: Active State Power Management %s.\n", enableASPM ? onName : offName);
 
+        nq = OSDynamicCast(OSNumber, params->getObject(kNumRxQueuesName));
+
+        if (nq != NULL) {
+            queues = nq->unsigned32BitValue();
+
+            /* The number of rx queues must be a power of 2. */
+            if (queues >= kMaxRxQueues)
+                numRxQueues = kMaxRxQueues;
+            else if (queues >= 2)
+                numRxQueues = 2;
+            else
+                numRxQueues = 1;
+        } else {
+            numRxQueues = 1;
+        }
+
+        nq = OSDynamicCast(OSNumber, params->getObject(kNumTxQueuesName));
+
+        if (nq != NULL) {
+            queues = nq->unsigned32BitValue();
+            numTxQueues = (queues >= kMaxTxQueues) ? kMaxTxQueues : 1;
+        } else {
+            numTxQueues = 1;
+        }
+
+        rs = OSDynamicCast(OSNumber, params->getObject(kRxRingSizeName));
+        numRxDesc = getRingSize(rs);
+
+        rs = OSDynamicCast(OSNumber, params->getObject(kTxRingSizeName));
+        numTxDesc = getRingSize(rs);
+
+        IOLog("SimpleRTK5: Ring sizes rx: %u, tx: %u.\n", numRxDesc, numTxDesc);
+
+        cb = OSDynamicCast(OSNumber, params->getObject(kTxCopyBreakName));
+        txCopyBreak = (cb != NULL) ? min(cb->unsigned32BitValue(), kTxBounceBufSize) : kTxDefCopyBreak;
+
+        jumbo = OSDynamicCast(OSBoolean, params->getObject(kEnableJumboRxName));
+        enableJumboRx = (jumbo != NULL) ? jumbo->getValue() : false;
+
+        /*
+         * A 16KB cluster isn't guaranteed to be physically contiguous,
+         * so that it can only be used as a single DMA target with
+         * AppleVTD, which maps it to a contiguous IOVA range.
+         */
+        if (enableJumboRx && !useAppleVTD) {
+            IOLog("SimpleRTK5: Jumbo frame receive buffers require AppleVTD.\n");
+            enableJumboRx = false;
+        }
+        IOLog("SimpleRTK5: Jumbo frame receive buffers %s.\n", enableJumboRx ? onName : offName);
+
+        lro = OSDynamicCast(OSBoolean, params->getObject(kEnableLROName));
+        enableLRO = (lro != NULL) ? lro->getValue() : false;
+
+        IOLog("SimpleRTK5: Large receive offload %s.\n", enableLRO ? onName : offName);
+
+        extDesc = OSDynamicCast(OSBoolean, params->getObject(kEnableExtRxDescName));
+        enableExtRxDesc = (extDesc != NULL) ? extDesc->getValue() : false;
+
+        IOLog("SimpleRTK5: Extended rx descriptors %s.\n", enableExtRxDesc ? onName : offName);
+
         tv = OSDynamicCast(OSNumber, params->getObject(kPollTime10GName));
 
         if (tv != NULL) {
@@ -165,6 +288,24 @@ void SimpleRTK5::getParams()
         } else {
             pollTime2G = 120000;
         }
+        tv = OSDynamicCast(OSNumber, params->getObject(kPollTime1GName));
+
+        if (tv != NULL) {
+            interval = tv->unsigned32BitValue();
+            
+            if (interval > 1000)
+                pollTime1G = 1000000;
+            else if (interval < 100)
+                pollTime1G = 100000;
+            else
+                pollTime1G = interval * 1000;
+        } else {
+            pollTime1G = 170000;
+        }
+        tuning = OSDynamicCast(OSBoolean, params->getObject(kEnablePollTuningName));
+        enablePollTuning = (tuning != NULL) ? tuning->getValue() : true;
+        
+        IOLog("SimpleRTK5: Poll interval tuning %s.\n", enablePollTuning ? onName : offName);
         
         fbAddr = OSDynamicCast(OSString, params->getObject(kFallbackName));
         
@@ -185,11 +326,40 @@ void SimpleRTK5::getParams()
         /* Use default values in case of missing config data. */
         enableTSO4 = false;
         enableTSO6 = false;
+        enableSoftTSO = false;
+        enableTxByteLimit = false;
+        enableTxReclaimThread = false;
+        enableMSIX = false;
+        enableIntrFilter = true;
+        enableBusyPoll = false;
+        busyPollBudget = kBusyPollDefBudget;
+        busyPollRate = kBusyPollDefRate;
         enableASPM = false;
+        numRxQueues = 1;
+        numTxQueues = 1;
+        numRxDesc = kDefaultRingSize;
+        numTxDesc = kDefaultRingSize;
+        txCopyBreak = kTxDefCopyBreak;
+        enableJumboRx = false;
+        enableLRO = false;
+        enableExtRxDesc = false;
         pollTime10G = 100000;
         pollTime5G = 120000;
         pollTime2G = 160000;
+        pollTime1G = 170000;
+        enablePollTuning = true;
     }
+    /* Derive the ring dependent values from the ring sizes. */
+    rxDescMask = numRxDesc - 1;
+    numRxMemDesc = numRxDesc >> kRxMemBaseShift;
+    rxMapMemSize = sizeof(struct rtlRxMapInfo) + numRxMemDesc * sizeof(IOMemoryDescriptor *) + numRxDesc * sizeof(IOAddressRange);
+
+    txDescMask = numTxDesc - 1;
+    numTxMemDesc = numTxDesc / 2;
+    txMemDescMask = numTxMemDesc - 1;
+    txMapMemSize = sizeof(struct rtlTxMapInfo) + numTxMemDesc * sizeof(IOMemoryDescriptor *) + (numTxDesc + kMaxSegs) * sizeof(IOAddressRange);
+    txQueueWakeTreshhold = numTxDesc / 10;
+
     if (versionString)
         IOLog("SimpleRTK5: Version %s\n", versionString->getCStringNoCopy());
 }
@@ -270,6 +440,17 @@ bool SimpleRTK5::initEventSources(IOService *provider)
     }
     txQueue->retain();
     
+    if (msixLayout) {
+        if (initMsixSources(provider)) {
+            IOLog("SimpleRTK5: Using MSI-X with separate rx, tx and link vectors.\n");
+            goto timer;
+        }
+        IOLog("SimpleRTK5: Failed to setup MSI-X. Falling back to MSI.\n");
+        msixLayout = NULL;
+
+        /* The second tx ring stays allocated but unused. */
+        numTxQueues = 1;
+    }
     while (pciDevice->getInterruptType(intrIndex, &intrType) == kIOReturnSuccess) {
         if (intrType & kIOInterruptTypePCIMessaged){
             msiIndex = intrIndex;
@@ -281,9 +462,9 @@ bool SimpleRTK5::initEventSources(IOService *provider)
         DebugLog("SimpleRTK5: MSI interrupt index: %d\n", msiIndex);
         
         if (useAppleVTD) {
-            interruptSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::interruptOccurredVTD), provider, msiIndex);
+            interruptSource = IOFilterInterruptEventSource::filterInterruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::interruptOccurredVTD), OSMemberFunctionCast(IOFilterInterruptEventSource::Filter, this, &SimpleRTK5::intrFilter), provider, msiIndex);
         } else {
-            interruptSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::interruptOccurred), provider, msiIndex);
+            interruptSource = IOFilterInterruptEventSource::filterInterruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &SimpleRTK5::interruptOccurred), OSMemberFunctionCast(IOFilterInterruptEventSource::Filter, this, &SimpleRTK5::intrFilter), provider, msiIndex);
         }
     }
     if (!interruptSource) {
@@ -292,6 +473,7 @@ bool SimpleRTK5::initEventSources(IOService *provider)
     }
     workLoop->addEventSource(interruptSource);
     
+timer:
     timerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &SimpleRTK5::timerAction));
     
     if (!timerSource) {
@@ -300,14 +482,24 @@ bool SimpleRTK5::initEventSources(IOService *provider)
     }
     workLoop->addEventSource(timerSource);
 
+    if (!initBusyPoll())
+        goto error_busy;
+
     result = true;
     
 done:
     return result;
     
+error_busy:
+    workLoop->removeEventSource(timerSource);
+    RELEASE(timerSource);
+
 error_timer:
-    workLoop->removeEventSource(interruptSource);
-    RELEASE(interruptSource);
+    if (interruptSource) {
+        workLoop->removeEventSource(interruptSource);
+        RELEASE(interruptSource);
+    }
+    freeMsixSources();
 
 error_intr:
     IOLog("SimpleRTK5: Error initializing event sources.\n");
@@ -317,96 +509,161 @@ error_intr:
 }
 
 bool SimpleRTK5::setupRxResources()
+{
+    UInt32 i;
+    bool result = false;
+
+    /*
+     * In jumbo mode, the buffers are large enough to receive a
+     * frame of maximum size with a single descriptor.
+     */
+    rxBufferSize = enableJumboRx ? kRxJumboBufferSize : kRxBufferSize;
+    rxDescBufSize = min(rxBufferSize, kRxMaxDescBufSize);
+
+    /*
+     * Use the extended descriptor format in case the chip supports
+     * it, as it reports the RSS hash and the packet type. As it
+     * hasn't been verified on all chips yet, it must be enabled
+     * explicitly.
+     */
+    switch (enableExtRxDesc ? linuxData.HwSuppRxDescType : RX_DESC_RING_TYPE_1) {
+    case RX_DESC_RING_TYPE_3:
+    case RX_DESC_RING_TYPE_4:
+        rxDescType = linuxData.HwSuppRxDescType;
+        break;
+
+    default:
+        rxDescType = RX_DESC_RING_TYPE_1;
+        break;
+    }
+    DebugLog("SimpleRTK5: Rx descriptor format v%u.\n", rxDescType);
+
+    for (i = 0; i < numRxQueues; i++) {
+        rxRing[i].queue = i;
+
+        if (!setupRxRing(&rxRing[i])) {
+            IOLog("SimpleRTK5: Couldn't setup rx queue %u.\n", i);
+            goto error_ring;
+        }
+    }
+    result = true;
+
+done:
+    return result;
+
+error_ring:
+    while (i-- > 0)
+        freeRxRing(&rxRing[i]);
+
+    goto done;
+}
+
+bool SimpleRTK5::setupRxRing(rtlRxRing *ring)
 {
     IOPhysicalAddress64 pa = 0;
     IODMACommand::Segment64 seg;
     mbuf_t m;
     UInt64 offset = 0;
-    UInt64 word1;
+    UInt32 descSize;
+    UInt32 word1;
     UInt32 numSegs = 1;
+    UInt32 pageCap;
     UInt32 i;
     bool result = false;
     
     /* Alloc rx mbuf_t array. */
-    rxBufArrayMem = IOMallocZero(kRxBufArraySize);
+    ring->rxBufArrayMem = IOMallocZero(numRxDesc * sizeof(struct rtlRxBufferInfo));
     
-    if (!rxBufArrayMem) {
+    if (!ring->rxBufArrayMem) {
         IOLog("SimpleRTK5: Couldn't alloc receive buffer array.\n");
         goto done;
     }
-    rxBufArray = (rtlRxBufferInfo *)rxBufArrayMem;
+    ring->rxBufArray = (rtlRxBufferInfo *)ring->rxBufArrayMem;
 
     /* Create receiver descriptor array. */
-    rxBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), kRxDescSize, 0xFFFFFFFFFFFFFF00ULL);
+    descSize = numRxDesc * ((rxDescType == RX_DESC_RING_TYPE_3) ? sizeof(struct RtlRxDescV3) : sizeof(union RtlRxDesc));
+    ring->rxBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), descSize, 0xFFFFFFFFFFFFFF00ULL);
     
-    if (!rxBufDesc) {
+    if (!ring->rxBufDesc) {
         IOLog("SimpleRTK5: Couldn't alloc rxBufDesc.\n");
         goto error_buff;
     }
-    if (rxBufDesc->prepare() != kIOReturnSuccess) {
+    if (ring->rxBufDesc->prepare() != kIOReturnSuccess) {
         IOLog("SimpleRTK5: rxBufDesc->prepare() failed.\n");
         goto error_prep;
     }
-    rxDescArray = (RtlRxDesc *)rxBufDesc->getBytesNoCopy();
+    ring->rxDescArray = (RtlRxDesc *)ring->rxBufDesc->getBytesNoCopy();
 
-    rxDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+    ring->rxDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
     
-    if (!rxDescDmaCmd) {
+    if (!ring->rxDescDmaCmd) {
         IOLog("SimpleRTK5: Couldn't alloc rxDescDmaCmd.\n");
         goto error_dma;
     }
     
-    if (rxDescDmaCmd->setMemoryDescriptor(rxBufDesc) != kIOReturnSuccess) {
+    if (ring->rxDescDmaCmd->setMemoryDescriptor(ring->rxBufDesc) != kIOReturnSuccess) {
         IOLog("SimpleRTK5: setMemoryDescriptor() failed.\n");
         goto error_set_desc;
     }
     
-    if (rxDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
+    if (ring->rxDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
         IOLog("SimpleRTK5: gen64IOVMSegments() failed.\n");
         goto error_segm;
     }
     /* And the rx ring's physical address too. */
-    rxPhyAddr = seg.fIOVMAddr;
+    ring->rxPhyAddr = seg.fIOVMAddr;
     
     /* Initialize rxDescArray. */
-    bzero(rxDescArray, kRxDescSize);
-    rxDescArray[kRxLastDesc].cmd.opts1 = OSSwapHostToLittleInt32(RingEnd);
+    bzero(ring->rxDescArray, descSize);
+    rxDescSet(ring, numRxDesc - 1, 0, RingEnd);
+
+    ring->rxNextDescIndex = 0;
+    ring->rxMapNextIndex = 0;
+    ring->rxPacketHead = ring->rxPacketTail = NULL;
+    ring->rxPacketSize = 0;
+    ring->rxListHead = ring->rxListTail = NULL;
+    ring->rxListCount = 0;
+    ring->rxListBytes = 0;
+    ring->lroNumFlows = 0;
+    ring->lroEvict = 0;
 
-    rxNextDescIndex = 0;
-    rxMapNextIndex = 0;
-
-    rxPool = SimpleRTK5RxPool::withCapacity(kRxPoolMbufCap, kRxPoolClstCap);
+    /*
+     * Without AppleVTD, jumbo buffers can't be recycled as their
+     * pages aren't guaranteed to be physically contiguous. The pool
+     * limits the number of pages to its memory budget.
+     */
+    pageCap = ((rxBufferSize > PAGE_SIZE) && !useAppleVTD) ? 0 : numRxDesc;
+    ring->rxPool = SimpleRTK5RxPool::withCapacity(kRxPoolMbufCap, kRxPoolClstCap, pageCap, rxBufferSize, mapper);
 
-    if (!rxPool) {
+    if (!ring->rxPool) {
         IOLog("SimpleRTK5: Couldn't alloc receive buffer pool.\n");
         goto error_segm;
     }
 
     /* Alloc receive buffers. */
-    for (i = 0; i < kNumRxDesc; i++) {
-        m = rxPool->getPacket(kRxBufferSize, MBUF_WAITOK);
+    for (i = 0; i < numRxDesc; i++) {
+        m = ring->rxPool->getPacket(rxBufferSize, MBUF_WAITOK);
 
         if (!m) {
             IOLog("SimpleRTK5: Couldn't get receive buffer from pool.\n");
             goto error_buf;
         }
-        rxBufArray[i].mbuf = m;
+        ring->rxBufArray[i].mbuf = m;
 
         if (!useAppleVTD) {
-            word1 = (kRxBufferSize | DescOwn);
+            word1 = (rxDescBufSize | DescOwn);
 
-            if (i == kRxLastDesc)
+            if (i == (numRxDesc - 1))
                 word1 |= RingEnd;
 
             pa = mbuf_data_to_physical(mbuf_datastart(m));
-            rxBufArray[i].phyAddr = pa;
+            ring->rxBufArray[i].phyAddr = pa;
 
-            rxDescArray[i].buf.blen = OSSwapHostToLittleInt64(word1);
-            rxDescArray[i].buf.addr = OSSwapHostToLittleInt64(pa);
+            rxDescSet(ring, i, pa, word1);
         }
     }
     if (useAppleVTD)
-        result = setupRxMap();
+        result = setupRxMap(ring);
     else
         result = true;
 
@@ -414,36 +671,78 @@ done:
     return result;
     
 error_buf:
-    for (i = 0; i < kNumRxDesc; i++) {
-        if (rxBufArray[i].mbuf) {
-            mbuf_freem_list(rxBufArray[i].mbuf);
-            rxBufArray[i].mbuf = NULL;
-            rxBufArray[i].phyAddr = 0;
+    for (i = 0; i < numRxDesc; i++) {
+        if (ring->rxBufArray[i].mbuf) {
+            mbuf_freem_list(ring->rxBufArray[i].mbuf);
+            ring->rxBufArray[i].mbuf = NULL;
+            ring->rxBufArray[i].phyAddr = 0;
         }
     }
-    RELEASE(rxPool);
+    RELEASE(ring->rxPool);
 
 error_segm:
-    rxDescDmaCmd->clearMemoryDescriptor();
+    ring->rxDescDmaCmd->clearMemoryDescriptor();
 
 error_set_desc:
-    RELEASE(rxDescDmaCmd);
+    RELEASE(ring->rxDescDmaCmd);
 
 error_dma:
-    rxBufDesc->complete();
+    ring->rxBufDesc->complete();
     
 error_prep:
-    RELEASE(rxBufDesc);
+    RELEASE(ring->rxBufDesc);
 
 error_buff:
-    IOFree(rxBufArrayMem, kRxBufArraySize);
-    rxBufArrayMem = NULL;
-    rxBufArray = NULL;
+    IOFree(ring->rxBufArrayMem, numRxDesc * sizeof(struct rtlRxBufferInfo));
+    ring->rxBufArrayMem = NULL;
+    ring->rxBufArray = NULL;
 
     goto done;
 }
 
 bool SimpleRTK5::setupTxResources()
+{
+    UInt32 i;
+    bool result = false;
+
+    if (!useAppleVTD) {
+        txMbufCursor = IOMbufNaturalMemoryCursor::withSpecification(0x4000, kMaxSegs);
+        
+        if (!txMbufCursor) {
+            IOLog("SimpleRTK5: Couldn't create txMbufCursor.\n");
+            goto done;
+        }
+    }
+    for (i = 0; i < numTxQueues; i++) {
+        txRing[i].queue = i;
+
+        if (!setupTxRing(&txRing[i])) {
+            IOLog("SimpleRTK5: Couldn't setup tx queue %u.\n", i);
+            goto error_ring;
+        }
+    }
+    if (enableTxReclaimThread) {
+        txReclaimCall = thread_call_allocate_with_options((thread_call_func_t) &runTxReclaimThread, (void *) this, THREAD_CALL_PRIORITY_KERNEL, 0);
+
+        if (!txReclaimCall) {
+            IOLog("SimpleRTK5: Couldn't alloc tx reclaim thread_call.\n");
+            goto error_ring;
+        }
+    }
+    result = true;
+
+done:
+    return result;
+
+error_ring:
+    while (i-- > 0)
+        freeTxRing(&txRing[i]);
+
+    RELEASE(txMbufCursor);
+    goto done;
+}
+
+bool SimpleRTK5::setupTxRing(rtlTxRing *ring)
 {
     IODMACommand::Segment64 seg;
     UInt64 offset = 0;
@@ -451,70 +750,66 @@ bool SimpleRTK5::setupTxResources()
     bool result = false;
     
     /* Alloc tx mbuf_t array. */
-    txBufArrayMem = IOMallocZero(kTxBufArraySize);
+    ring->txBufArrayMem = IOMallocZero(numTxDesc * sizeof(struct rtlTxBufferInfo));
     
-    if (!txBufArrayMem) {
+    if (!ring->txBufArrayMem) {
         IOLog("SimpleRTK5: Couldn't alloc transmit buffer array.\n");
         goto done;
     }
-    txBufArray = (rtlTxBufferInfo *)txBufArrayMem;
+    ring->txBufArray = (rtlTxBufferInfo *)ring->txBufArrayMem;
     
     /* Create transmitter descriptor array. */
-    txBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), kTxDescSize, 0xFFFFFFFFFFFFFF00ULL);
+    ring->txBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), numTxDesc * sizeof(struct RtlTxDesc), 0xFFFFFFFFFFFFFF00ULL);
             
-    if (!txBufDesc) {
+    if (!ring->txBufDesc) {
         IOLog("SimpleRTK5: Couldn't alloc txBufDesc.\n");
         goto error_buff;
     }
-    if (txBufDesc->prepare() != kIOReturnSuccess) {
+    if (ring->txBufDesc->prepare() != kIOReturnSuccess) {
         IOLog("SimpleRTK5: txBufDesc->prepare() failed.\n");
         goto error_prep;
     }
-    txDescArray = (RtlTxDesc *)txBufDesc->getBytesNoCopy();
+    ring->txDescArray = (RtlTxDesc *)ring->txBufDesc->getBytesNoCopy();
     
-    txDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+    ring->txDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
     
-    if (!txDescDmaCmd) {
+    if (!ring->txDescDmaCmd) {
         IOLog("SimpleRTK5: Couldn't alloc txDescDmaCmd.\n");
         goto error_dma;
     }
     
-    if (txDescDmaCmd->setMemoryDescriptor(txBufDesc) != kIOReturnSuccess) {
+    if (ring->txDescDmaCmd->setMemoryDescriptor(ring->txBufDesc) != kIOReturnSuccess) {
         IOLog("SimpleRTK5: setMemoryDescriptor() failed.\n");
         goto error_set_desc;
     }
     
-    if (txDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
+    if (ring->txDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
         IOLog("SimpleRTK5: gen64IOVMSegments() failed.\n");
         goto error_segm;
     }
     /* Now get tx ring's physical address. */
-    txPhyAddr = seg.fIOVMAddr;
+    ring->txPhyAddr = seg.fIOVMAddr;
     
     /* Initialize txDescArray. */
-    bzero(txDescArray, kTxDescSize);
-    txDescArray[kTxLastDesc].opts1 = OSSwapHostToLittleInt32(RingEnd);
+    bzero(ring->txDescArray, numTxDesc * sizeof(struct RtlTxDesc));
+    ring->txDescArray[numTxDesc - 1].opts1 = OSSwapHostToLittleInt32(RingEnd);
     
-    txNextDescIndex = txDirtyDescIndex = 0;
+    ring->txNextDescIndex = ring->txDirtyDescIndex = 0;
     
 #ifdef ENABLE_TX_NO_CLOSE
-    txTailPtr0 = txClosePtr0 = 0;
+    ring->txTailPtr0 = ring->txClosePtr0 = 0;
 #endif
 
-    txNumFreeDesc = kNumTxDesc;
+    ring->txNumFreeDesc = numTxDesc;
+    ring->txPendingDescs = 0;
+    txBqlReset(ring);
     
     if (useAppleVTD) {
-        result = setupTxMap();
+        result = setupTxMap(ring);
         
         if (!result)
             goto error_segm;
     } else {
-        txMbufCursor = IOMbufNaturalMemoryCursor::withSpecification(0x4000, kMaxSegs);
-        
-        if (!txMbufCursor) {
-            IOLog("SimpleRTK5: Couldn't create txMbufCursor.\n");
-            goto error_segm;
-        }
         result = true;
     }
 
@@ -522,21 +817,21 @@ done:
     return result;
     
 error_segm:
-    txDescDmaCmd->clearMemoryDescriptor();
+    ring->txDescDmaCmd->clearMemoryDescriptor();
 
 error_set_desc:
-    RELEASE(txDescDmaCmd);
+    RELEASE(ring->txDescDmaCmd);
     
 error_dma:
-    txBufDesc->complete();
+    ring->txBufDesc->complete();
 
 error_prep:
-    RELEASE(txBufDesc);
+    RELEASE(ring->txBufDesc);
     
 error_buff:
-    IOFree(txBufArrayMem, kTxBufArraySize);
-    txBufArrayMem = NULL;
-    txBufArray = NULL;
+    IOFree(ring->txBufArrayMem, numTxDesc * sizeof(struct rtlTxBufferInfo));
+    ring->txBufArrayMem = NULL;
+    ring->txBufArray = NULL;
     
     goto done;
 }
@@ -614,61 +909,88 @@ error_mem:
 }
 
 void SimpleRTK5::freeRxResources()
+{
+    UInt32 i;
+
+    for (i = 0; i < kMaxRxQueues; i++)
+        freeRxRing(&rxRing[i]);
+}
+
+void SimpleRTK5::freeRxRing(rtlRxRing *ring)
 {
     UInt32 i;
         
     if (useAppleVTD)
-        freeRxMap();
-
-    if (rxDescDmaCmd) {
-        rxDescDmaCmd->complete();
-        rxDescDmaCmd->clearMemoryDescriptor();
-        rxDescDmaCmd->release();
-        rxDescDmaCmd = NULL;
-    }
-    if (rxBufDesc) {
-        rxBufDesc->complete();
-        rxBufDesc->release();
-        rxBufDesc = NULL;
-        rxPhyAddr = (IOPhysicalAddress64)NULL;
-    }
-    RELEASE(rxPool);
-    
-    if (rxBufArrayMem) {
-        for (i = 0; i < kNumRxDesc; i++) {
-            if (rxBufArray[i].mbuf) {
-                mbuf_freem_list(rxBufArray[i].mbuf);
-                rxBufArray[i].mbuf = NULL;
+        freeRxMap(ring);
+
+    if (ring->rxDescDmaCmd) {
+        ring->rxDescDmaCmd->complete();
+        ring->rxDescDmaCmd->clearMemoryDescriptor();
+        ring->rxDescDmaCmd->release();
+        ring->rxDescDmaCmd = NULL;
+    }
+    if (ring->rxBufDesc) {
+        ring->rxBufDesc->complete();
+        ring->rxBufDesc->release();
+        ring->rxBufDesc = NULL;
+        ring->rxPhyAddr = (IOPhysicalAddress64)NULL;
+    }
+    /* Pages still owned by the stack keep the pool alive. */
+    RELEASE(ring->rxPool);
+    
+    if (ring->rxBufArrayMem) {
+        for (i = 0; i < numRxDesc; i++) {
+            if (ring->rxBufArray[i].mbuf) {
+                mbuf_freem_list(ring->rxBufArray[i].mbuf);
+                ring->rxBufArray[i].mbuf = NULL;
             }
         }
-        IOFree(rxBufArrayMem, kRxBufArraySize);
-        rxBufArrayMem = NULL;
-        rxBufArray = NULL;
+        IOFree(ring->rxBufArrayMem, numRxDesc * sizeof(struct rtlRxBufferInfo));
+        ring->rxBufArrayMem = NULL;
+        ring->rxBufArray = NULL;
     }
 }
 
 void SimpleRTK5::freeTxResources()
+{
+    UInt32 i;
+
+    if (txReclaimCall) {
+        thread_call_cancel_wait(txReclaimCall);
+        thread_call_free(txReclaimCall);
+        txReclaimCall = NULL;
+    }
+    for (i = 0; i < kMaxTxQueues; i++)
+        freeTxRing(&txRing[i]);
+
+    RELEASE(txMbufCursor);
+}
+
+void SimpleRTK5::freeTxRing(rtlTxRing *ring)
 {
     if (useAppleVTD)
-        freeTxMap();
-    else
-        RELEASE(txMbufCursor);
+        freeTxMap(ring);
+
+    if (ring->txBacklogHead) {
+        mbuf_freem_list(ring->txBacklogHead);
+        ring->txBacklogHead = ring->txBacklogTail = NULL;
+    }
 
-    if (txBufDesc) {
-        txBufDesc->complete();
-        txBufDesc->release();
-        txBufDesc = NULL;
-        txPhyAddr = (IOPhysicalAddress64)NULL;
+    if (ring->txBufDesc) {
+        ring->txBufDesc->complete();
+        ring->txBufDesc->release();
+        ring->txBufDesc = NULL;
+        ring->txPhyAddr = (IOPhysicalAddress64)NULL;
     }
-    if (txDescDmaCmd) {
-        txDescDmaCmd->clearMemoryDescriptor();
-        txDescDmaCmd->release();
-        txDescDmaCmd = NULL;
+    if (ring->txDescDmaCmd) {
+        ring->txDescDmaCmd->clearMemoryDescriptor();
+        ring->txDescDmaCmd->release();
+        ring->txDescDmaCmd = NULL;
     }
-    if (txBufArrayMem) {
-        IOFree(txBufArrayMem, kTxBufArraySize);
-        txBufArrayMem = NULL;
-        txBufArray = NULL;
+    if (ring->txBufArrayMem) {
+        IOFree(ring->txBufArrayMem, numTxDesc * sizeof(struct rtlTxBufferInfo));
+        ring->txBufArrayMem = NULL;
+        ring->txBufArray = NULL;
     }
 }
 
@@ -696,74 +1018,101 @@ void SimpleRTK5::freeStatResources()
 void SimpleRTK5::clearRxTxRings()
 {
     IOMemoryDescriptor *md;
+    rtlTxRing *txr;
+    rtlRxRing *ring;
     mbuf_t m;
-    UInt64 word1;
-    UInt32 i;
+    UInt32 word1;
+    UInt32 i, q;
     
     DebugLog("SimpleRTK5: clearRxTxRings() ===>\n");
     
-    if (useAppleVTD && txMapInfo) {
-        for (i = 0; i < kNumTxMemDesc; i++) {
-            md = txMapInfo->txMemIO[i];
+    /* Wait for a pending reclaim pass before the rings are reset. */
+    if (txReclaimCall) {
+        thread_call_cancel_wait(txReclaimCall);
+        clear_bit(__TX_RECLAIM, &stateFlags);
+    }
+    /* Stop the busy poll thread. The caller restores the interrupt mask. */
+    busyPollStop();
+
+    for (q = 0; q < numTxQueues; q++) {
+        txr = &txRing[q];
+
+        if (useAppleVTD && txr->txMapInfo) {
+            for (i = 0; i < numTxMemDesc; i++) {
+                md = txr->txMapInfo->txMemIO[i];
+                
+                if (md && (md->getTag() == kIOMemoryActive)) {
+                    md->complete();
+                    md->setTag(kIOMemoryInactive);
+                }
+            }
+            txr->txMapInfo->txNextMem2Use = txr->txMapInfo->txNextMem2Free = 0;
+            txr->txMapInfo->txNumFreeMem = numTxMemDesc;
+        }
+        for (i = 0; i < numTxDesc; i++) {
+            txr->txDescArray[i].opts1 = OSSwapHostToLittleInt32((i != (numTxDesc - 1)) ? 0 : RingEnd);
+            m = txr->txBufArray[i].mbuf;
             
-            if (md && (md->getTag() == kIOMemoryActive)) {
-                md->complete();
-                md->setTag(kIOMemoryInactive);
+            if (m) {
+                mbuf_freem_list(m);
+                txr->txBufArray[i].mbuf = NULL;
+                txr->txBufArray[i].numDescs = 0;
+                txr->txBufArray[i].packetBytes = 0;
+                txr->txBufArray[i].premapped = false;
             }
+            txr->txBufArray[i].iova = NULL;
         }
-        txMapInfo->txNextMem2Use = txMapInfo->txNextMem2Free = 0;
-        txMapInfo->txNumFreeMem = kNumTxMemDesc;
-    }
-    for (i = 0; i < kNumTxDesc; i++) {
-        txDescArray[i].opts1 = OSSwapHostToLittleInt32((i != kTxLastDesc) ? 0 : RingEnd);
-        m = txBufArray[i].mbuf;
-        
-        if (m) {
-            mbuf_freem_list(m);
-            txBufArray[i].mbuf = NULL;
-            txBufArray[i].numDescs = 0;
-            txBufArray[i].packetBytes = 0;
+        if (useAppleVTD)
+            txIovaFlush(txr);
+        if (txr->txBacklogHead) {
+            mbuf_freem_list(txr->txBacklogHead);
+            txr->txBacklogHead = txr->txBacklogTail = NULL;
         }
-    }
-    
+        
 #ifdef ENABLE_TX_NO_CLOSE
-    txTailPtr0 = txClosePtr0 = 0;
+        txr->txTailPtr0 = txr->txClosePtr0 = 0;
 #endif
 
-    txDirtyDescIndex = txNextDescIndex = 0;
-    txNumFreeDesc = kNumTxDesc;
+        txr->txDirtyDescIndex = txr->txNextDescIndex = 0;
+        txr->txNumFreeDesc = numTxDesc;
+        txr->txPendingDescs = 0;
+        txBqlReset(txr);
+    }
         
-    if (useAppleVTD)
-        rxMapBuffers(0, kNumRxMemDesc);
+    for (q = 0; q < numRxQueues; q++) {
+        ring = &rxRing[q];
 
-    for (i = 0; i < kNumRxDesc; i++) {
-        word1 = (kRxBufferSize | DescOwn);
-        
-        if (i == kRxLastDesc)
-            word1 |= RingEnd;
-        
-        rxDescArray[i].buf.blen = OSSwapHostToLittleInt64(word1);
-        rxDescArray[i].buf.addr = OSSwapHostToLittleInt64(rxBufArray[i].phyAddr);
+        if (useAppleVTD)
+            rxMapBuffers(ring, 0, numRxMemDesc);
+
+        for (i = 0; i < numRxDesc; i++) {
+            word1 = (rxDescBufSize | DescOwn);
+            
+            if (i == (numRxDesc - 1))
+                word1 |= RingEnd;
+            
+            rxDescSet(ring, i, ring->rxBufArray[i].phyAddr, word1);
+        }
+        ring->rxNextDescIndex = 0;
+        ring->rxMapNextIndex = 0;
+
+        /* Free packet fragments which haven't been upstreamed yet.  */
+        discardPacketFragment(ring);
     }
-    rxNextDescIndex = 0;
-    rxMapNextIndex = 0;
     deadlockWarn = 0;
 
-    /* Free packet fragments which haven't been upstreamed yet.  */
-    discardPacketFragment();
-
     DebugLog("SimpleRTK5: clearRxTxRings() <===\n");
 }
 
-void SimpleRTK5::discardPacketFragment()
+void SimpleRTK5::discardPacketFragment(rtlRxRing *ring)
 {
     /*
      * In case there is a packet fragment which hasn't been enqueued yet
      * we have to free it in order to prevent a memory leak.
      */
-    if (rxPacketHead)
-        mbuf_freem_list(rxPacketHead);
+    if (ring->rxPacketHead)
+        mbuf_freem_list(ring->rxPacketHead);
     
-    rxPacketHead = rxPacketTail = NULL;
-    rxPacketSize = 0;
+    ring->rxPacketHead = ring->rxPacketTail = NULL;
+    ring->rxPacketSize = 0;
 }
@@ -0,0 +1,162 @@
+//
+//  SimpleRTK5TSO.cpp
+//  SimpleRTK5
+//
+
+#include "SimpleRTK5Ethernet.hpp"
+
+#pragma mark --- tx header parsing methods ---
+
+/*
+ * Find the L3 and L4 headers of an outgoing packet. The headers may
+ * be spread over several mbufs, so that they are copied first and
+ * parsed by rtlTxParseHdrs(). Returns false in case the headers
+ * couldn't be parsed.
+ */
+bool SimpleRTK5::txParseHeaders(mbuf_t m, rtlTxHdrInfo *info)
+{
+    UInt8 hdr[kTxMaxHdrLen];
+    UInt32 len;
+
+    len = min((UInt32)mbuf_pkthdr_len(m), kTxMaxHdrLen);
+    mbuf_copydata(m, 0, len, hdr);
+
+    return rtlTxParseHdrs(hdr, len, info);
+}
+
+#pragma mark --- software segmentation methods ---
+
+/*
+ * Check if a TSO packet has to be segmented by the driver, because
+ * hardware TSO is either disabled for its protocol, can't be used
+ * with the current MTU or the header layout exceeds the limits of
+ * the NIC, which takes a TCP header offset of at most GTTCPHO_MAX.
+ */
+bool SimpleRTK5::txNeedsSoftTSO(mbuf_t m, UInt32 *tsoFlags, UInt32 *mss)
+{
+    rtlTxHdrInfo info;
+    bool hwTSO;
+
+    if (mbuf_get_tso_requested(m, tsoFlags, mss) ||
+        !(*tsoFlags & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) ||
+        ((mbuf_pkthdr_len(m) - ETH_HLEN) <= mtu))
+        return false;
+
+    hwTSO = ((*tsoFlags & MBUF_TSO_IPV4) ? enableTSO4 : enableTSO6) &&
+            (mtu <= MSS_MAX);
+
+    if (!hwTSO && enableSoftTSO)
+        return true;
+
+    return (txParseHeaders(m, &info) && (info.l4Proto == IPPROTO_TCP) &&
+            (info.l4Off > GTTCPHO_MAX));
+}
+
+/*
+ * Split a TSO packet into a list of packets of at most mss bytes
+ * of payload. Each segment gets a copy of the headers in an mbuf
+ * of its own, which is patched with the segment's length,
+ * sequence number and flags, while the payload is referenced by
+ * mbuf_copym() without copying the clusters. The checksums are
+ * left to the NIC's checksum offload. Returns the list of segments
+ * and its tail or NULL in case the packet had to be dropped. The
+ * original packet is consumed in any case.
+ */
+mbuf_t SimpleRTK5::txSoftSegment(mbuf_t m, UInt32 tsoFlags, UInt32 mss,
+                                 mbuf_t *tail)
+{
+    UInt8 hdr[kTxMaxHdrLen];
+    rtlTxHdrInfo info;
+    mbuf_t head = NULL;
+    mbuf_t last = NULL;
+    mbuf_t seg;
+    mbuf_t payload;
+    struct ip *ipHdr;
+    struct tcphdr *tcpHdr;
+    mbuf_csum_request_flags_t csumFlags;
+    UInt32 pktLen, hdrLen;
+    UInt32 off, len, seq;
+    UInt16 ipId = 0;
+    UInt16 vlanTag;
+    UInt8 flags;
+    errno_t err;
+    bool hasTag;
+
+    pktLen = (UInt32)mbuf_pkthdr_len(m);
+    hasTag = !mbuf_get_vlan_tag(m, &vlanTag);
+
+    if (!txParseHeaders(m, &info) || (info.l4Proto != IPPROTO_TCP))
+        goto drop;
+
+    /* Use the headers of the packet as template for the segments. */
+    hdrLen = info.hdrLen;
+    mbuf_copydata(m, 0, hdrLen, hdr);
+
+    tcpHdr = (struct tcphdr *)(hdr + info.l4Off);
+    ipHdr = (struct ip *)(hdr + info.l3Off);
+
+    if (info.etherType == ETHERTYPE_IP) {
+        ipId = ntohs(ipHdr->ip_id);
+        csumFlags = (MBUF_CSUM_REQ_IP | MBUF_CSUM_REQ_TCP);
+    } else {
+        csumFlags = MBUF_CSUM_REQ_TCPIPV6;
+    }
+    if (!mss || (mss > (mtu - (hdrLen - ETH_HLEN))))
+        mss = mtu - (hdrLen - ETH_HLEN);
+
+    seq = ntohl(tcpHdr->th_seq);
+    flags = tcpHdr->th_flags;
+
+    for (off = hdrLen; off < pktLen; off += len) {
+        len = min(mss, pktLen - off);
+
+        /* Headers, which don't fit into a small mbuf, need a cluster. */
+        if (hdrLen > mbuf_get_mhlen())
+            err = mbuf_getpacket(MBUF_DONTWAIT, &seg);
+        else
+            err = mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &seg);
+
+        if (err)
+            goto error;
+
+        if (mbuf_maxlen(seg) < hdrLen) {
+            mbuf_freem(seg);
+            goto error;
+        }
+        if (mbuf_copym(m, off, len, MBUF_DONTWAIT, &payload)) {
+            mbuf_freem(seg);
+            goto error;
+        }
+        rtlTsoPatchHdrs(hdr, &info, seq, flags, ipId++, off, len, pktLen);
+        bcopy(hdr, mbuf_data(seg), hdrLen);
+        mbuf_setlen(seg, hdrLen);
+        mbuf_setnext(seg, payload);
+        mbuf_pkthdr_setlen(seg, hdrLen + len);
+        mbuf_set_csum_requested(seg, csumFlags, 0);
+
+        if (hasTag)
+            mbuf_set_vlan_tag(seg, vlanTag);
+
+        if (last)
+            mbuf_setnextpkt(last, seg);
+        else
+            head = seg;
+
+        last = seg;
+    }
+    *tail = last;
+
+done:
+    mbuf_freem(m);
+    return head;
+
+error:
+    DebugLog("SimpleRTK5: Software segmentation failed. Dropping packet.\n");
+    mbuf_freem_list(head);
+    head = NULL;
+    goto done;
+
+drop:
+    DebugLog("SimpleRTK5: Can't segment packet. Dropping it.\n");
+    goto done;
+}
@@ -0,0 +1,198 @@
+//
+//  SimpleRTK5TxHdr.hpp
+//  SimpleRTK5
+//
+//  Headers of outgoing packets. The header parser and the patching
+//  of the headers of software TSO segments are kept free of kernel
+//  dependencies, so that they can be tested on the host.
+//
+
+#ifndef SimpleRTK5TxHdr_hpp
+#define SimpleRTK5TxHdr_hpp
+
+/* Maximum length of the headers of a tx packet, which are parsed */
+#define kTxMaxHdrLen 256
+#define kTxMaxVlanTags 2
+#define kTxMaxExtHdrs 8
+
+#ifndef ETHERTYPE_QINQ
+#define ETHERTYPE_QINQ 0x88a8
+#endif
+
+#define kIPv6HdrLen sizeof(struct ip6_hdr)
+#define kIPv4HdrLen sizeof(struct ip)
+#define kTcpHdrLen sizeof(struct tcphdr)
+
+/*
+ * Header layout of an outgoing packet. The offsets are relative
+ * to the start of the frame and may point into any mbuf of the
+ * chain.
+ */
+typedef struct rtlTxHdrInfo {
+    UInt32 l3Off;
+    UInt32 l4Off;
+    UInt32 hdrLen;
+    UInt16 etherType;
+    UInt8 l4Proto;
+    bool extHdrs;
+} rtlTxHdrInfo;
+
+/*
+ * Find the L3 and L4 headers in the first len bytes of an outgoing
+ * packet at hdr. Follows up to kTxMaxVlanTags VLAN tags inserted by
+ * software, 802.1Q as well as 802.1ad, and skips IPv4 options and up
+ * to kTxMaxExtHdrs IPv6 extension headers. Returns false in case the
+ * headers are truncated or couldn't be parsed.
+ */
+static inline bool rtlTxParseHdrs(const UInt8 *hdr, UInt32 len, rtlTxHdrInfo *info)
+{
+    const struct ip *ipHdr;
+    const struct ip6_hdr *ip6Hdr;
+    const struct ip6_ext *extHdr;
+    const struct tcphdr *tcpHdr;
+    UInt32 off, l;
+    UInt16 etherType;
+    UInt8 nxt;
+    UInt8 i;
+    bool result = false;
+
+    if (len < ETH_HLEN)
+        goto done;
+
+    etherType = ntohs(*(const UInt16 *)(hdr + 12));
+    off = ETH_HLEN;
+
+    for (i = 0; ((etherType == ETHERTYPE_VLAN) || (etherType == ETHERTYPE_QINQ)); i++) {
+        if ((i == kTxMaxVlanTags) || ((off + 4) > len))
+            goto done;
+
+        etherType = ntohs(*(const UInt16 *)(hdr + off + 2));
+        off += 4;
+    }
+    info->l3Off = off;
+    info->etherType = etherType;
+    info->extHdrs = false;
+
+    if (etherType == ETHERTYPE_IP) {
+        if ((off + kIPv4HdrLen) > len)
+            goto done;
+
+        ipHdr = (const struct ip *)(hdr + off);
+        l = ipHdr->ip_hl << 2;
+
+        if (l < kIPv4HdrLen)
+            goto done;
+
+        info->extHdrs = (l > kIPv4HdrLen);
+        nxt = ipHdr->ip_p;
+        off += l;
+    } else if (etherType == ETHERTYPE_IPV6) {
+        if ((off + kIPv6HdrLen) > len)
+            goto done;
+
+        ip6Hdr = (const struct ip6_hdr *)(hdr + off);
+        nxt = ip6Hdr->ip6_nxt;
+        off += kIPv6HdrLen;
+
+        for (i = 0; i < kTxMaxExtHdrs; i++) {
+            if ((nxt != IPPROTO_HOPOPTS) && (nxt != IPPROTO_ROUTING) &&
+                (nxt != IPPROTO_DSTOPTS) && (nxt != IPPROTO_AH))
+                break;
+
+            if ((off + sizeof(struct ip6_ext)) > len)
+                goto done;
+
+            extHdr = (const struct ip6_ext *)(hdr + off);
+            l = (nxt == IPPROTO_AH) ? ((extHdr->ip6e_len + 2) << 2) : ((extHdr->ip6e_len + 1) << 3);
+            nxt = extHdr->ip6e_nxt;
+            off += l;
+
+            info->extHdrs = true;
+        }
+    } else {
+        goto done;
+    }
+    /* The L4 header must start within the packet's headers. */
+    if (off > len)
+        goto done;
+
+    info->l4Off = off;
+    info->l4Proto = nxt;
+    info->hdrLen = off;
+
+    if (nxt == IPPROTO_TCP) {
+        if ((off + kTcpHdrLen) > len)
+            goto done;
+
+        tcpHdr = (const struct tcphdr *)(hdr + off);
+        l = tcpHdr->th_off << 2;
+
+        if ((l < kTcpHdrLen) || ((off + l) > len))
+            goto done;
+
+        info->hdrLen = off + l;
+    }
+    result = true;
+
+done:
+    return result;
+}
+
+/*
+ * The pseudo header checksum the stack puts into the TCP header
+ * when it requests checksum offload.
+ */
+static inline UInt16 rtlPseudoHdrChecksum(const UInt16 *addr, UInt32 words,
+                                          UInt32 tcpLen)
+{
+    UInt32 sum = IPPROTO_TCP + tcpLen;
+    UInt32 i;
+
+    for (i = 0; i < words; i++)
+        sum += ntohs(addr[i]);
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return htons((UInt16)sum);
+}
+
+/*
+ * Patch a copy of the headers of a TSO packet of pktLen bytes for
+ * its segment with len bytes of payload at offset off. seq and flags
+ * are those of the original TCP header, ipId is the segment's IPv4
+ * ID. The checksums are left to the NIC's checksum offload.
+ */
+static inline void rtlTsoPatchHdrs(UInt8 *hdr, const rtlTxHdrInfo *info,
+                                   UInt32 seq, UInt8 flags, UInt16 ipId,
+                                   UInt32 off, UInt32 len, UInt32 pktLen)
+{
+    struct ip *ipHdr = (struct ip *)(hdr + info->l3Off);
+    struct ip6_hdr *ip6Hdr = (struct ip6_hdr *)(hdr + info->l3Off);
+    struct tcphdr *tcpHdr = (struct tcphdr *)(hdr + info->l4Off);
+    UInt32 hdrLen = info->hdrLen;
+    UInt32 tcpHdrLen = hdrLen - info->l4Off;
+
+    tcpHdr->th_seq = htonl(seq + (off - hdrLen));
+    tcpHdr->th_flags = flags;
+
+    if (off != hdrLen)
+        tcpHdr->th_flags &= ~TH_CWR;
+
+    if ((off + len) < pktLen)
+        tcpHdr->th_flags &= ~(TH_FIN | TH_PUSH);
+
+    if (info->etherType == ETHERTYPE_IP) {
+        ipHdr->ip_len = htons(hdrLen - info->l3Off + len);
+        ipHdr->ip_id = htons(ipId);
+        ipHdr->ip_sum = 0;
+        tcpHdr->th_sum = rtlPseudoHdrChecksum((UInt16 *)&ipHdr->ip_src, 4,
+                                              tcpHdrLen + len);
+    } else {
+        ip6Hdr->ip6_plen = htons(hdrLen - info->l3Off - kIPv6HdrLen + len);
+        tcpHdr->th_sum = rtlPseudoHdrChecksum((UInt16 *)&ip6Hdr->ip6_src, 16,
+                                              tcpHdrLen + len);
+    }
+}
+
+#endif /* SimpleRTK5TxHdr_hpp */
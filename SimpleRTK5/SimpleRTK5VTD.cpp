@@ -15,34 +15,38 @@
 
 #pragma mark --- initialisation methods for AppleVTD support ---
 
-bool SimpleRTK5::setupRxMap()
+bool SimpleRTK5::setupRxMap(rtlRxRing *ring)
 {
     IOMemoryDescriptor *md;
     IOPhysicalAddress pa;
     IOByteCount offset;
-    UInt64 word1;
+    UInt32 word1;
     UInt32 end;
     UInt32 i, n, idx;
     bool result = false;
 
     /* Alloc ixgbeRxBufferInfo. */
-    rxMapMem = IOMallocZero(kRxMapMemSize);
+    ring->rxMapMem = IOMallocZero(rxMapMemSize);
     
-    if (!rxMapMem) {
+    if (!ring->rxMapMem) {
         IOLog("SimpleRTK5: Couldn't alloc rx map.\n");
         goto done;
     }
-    rxMapInfo = (rtlRxMapInfo *)rxMapMem;
+    ring->rxMapInfo = (rtlRxMapInfo *)ring->rxMapMem;
     
+    /* The arrays are located behind the map info. */
+    ring->rxMapInfo->rxMemIO = (IOMemoryDescriptor **)(ring->rxMapInfo + 1);
+    ring->rxMapInfo->rxMemRange = (IOAddressRange *)(ring->rxMapInfo->rxMemIO + numRxMemDesc);
+
     /* Setup Ranges for IOMemoryDescriptors. */
-    for (i = 0; i < kNumRxDesc; i++) {
-        rxMapInfo->rxMemRange[i].address = (IOVirtualAddress)mbuf_datastart(rxBufArray[i].mbuf);
-        rxMapInfo->rxMemRange[i].length = PAGE_SIZE;
+    for (i = 0; i < numRxDesc; i++) {
+        ring->rxMapInfo->rxMemRange[i].address = (IOVirtualAddress)mbuf_datastart(ring->rxBufArray[i].mbuf);
+        ring->rxMapInfo->rxMemRange[i].length = rxBufferSize;
     }
 
     /* Alloc IOMemoryDescriptors. */
-    for (i = 0, idx = 0; i < kNumRxMemDesc; i++, idx += kRxMemBatchSize) {
-        md = IOMemoryDescriptor::withOptions(&rxMapInfo->rxMemRange[idx], kRxMemBatchSize, 0, kernel_task, (kIOMemoryTypeVirtual | kIODirectionIn | kIOMemoryAsReference), mapper);
+    for (i = 0, idx = 0; i < numRxMemDesc; i++, idx += kRxMemBatchSize) {
+        md = IOMemoryDescriptor::withOptions(&ring->rxMapInfo->rxMemRange[idx], kRxMemBatchSize, 0, kernel_task, (kIOMemoryTypeVirtual | kIODirectionIn | kIOMemoryAsReference), mapper);
         
         if (!md) {
             IOLog("SimpleRTK5: Couldn't alloc IOMemoryDescriptor.\n");
@@ -52,22 +56,22 @@ bool SimpleRTK5::setupRxMap()
             IOLog("SimpleRTK5: IOMemoryDescriptor::prepare() failed.\n");
             goto error_prep;
         }
-        rxMapInfo->rxMemIO[i] = md;
+        md->setTag(kIOMemoryActive);
+        ring->rxMapInfo->rxMemIO[i] = md;
         offset = 0;
         end = idx + kRxMemBatchSize;
-        word1 = (kRxBufferSize | DescOwn);
+        word1 = (rxDescBufSize | DescOwn);
 
         for (n = idx; n < end; n++) {
-            if (n == kRxLastDesc)
+            if (n == (numRxDesc - 1))
                 word1 |= RingEnd;
             
             pa = md->getPhysicalSegment(offset, NULL);
-            rxBufArray[n].phyAddr = pa;
+            ring->rxBufArray[n].phyAddr = pa;
             
-            rxDescArray[i].buf.blen = OSSwapHostToLittleInt64(word1);
-            rxDescArray[i].buf.addr = OSSwapHostToLittleInt64(rxBufArray[i].phyAddr);
+            rxDescSet(ring, n, pa, word1);
 
-            offset += PAGE_SIZE;
+            offset += rxBufferSize;
         }
     }
     result = true;
@@ -76,61 +80,78 @@ done:
     return result;
             
 error_prep:
-    md->complete();
     RELEASE(md);
 
 error_rx_desc:
-    if (rxMapMem) {
-        for (i = 0; i < kNumRxMemDesc; i++) {
-            md = rxMapInfo->rxMemIO[i];
+    if (ring->rxMapMem) {
+        for (i = 0; i < numRxMemDesc; i++) {
+            md = ring->rxMapInfo->rxMemIO[i];
                             
             if (md) {
-                md->complete();
+                if (md->getTag() == kIOMemoryActive)
+                    md->complete();
+
                 md->release();
             }
-            rxMapInfo->rxMemIO[i] = NULL;
+            ring->rxMapInfo->rxMemIO[i] = NULL;
         }
-        IOFree(rxMapMem, kRxMapMemSize);
-        rxMapMem = NULL;
+        IOFree(ring->rxMapMem, rxMapMemSize);
+        ring->rxMapMem = NULL;
     }
     goto done;
 }
 
-void SimpleRTK5::freeRxMap()
+void SimpleRTK5::freeRxMap(rtlRxRing *ring)
 {
     IOMemoryDescriptor *md;
     UInt32 i;
 
-    if (rxMapMem) {
-        for (i = 0; i < kNumRxMemDesc; i++) {
-            md = rxMapInfo->rxMemIO[i];
+    if (ring->rxMapMem) {
+        for (i = 0; i < numRxMemDesc; i++) {
+            md = ring->rxMapInfo->rxMemIO[i];
                             
             if (md) {
-                md->complete();
+                if (md->getTag() == kIOMemoryActive)
+                    md->complete();
+
                 md->release();
             }
-            rxMapInfo->rxMemIO[i] = NULL;
+            ring->rxMapInfo->rxMemIO[i] = NULL;
         }
-        IOFree(rxMapMem, kRxMapMemSize);
-        rxMapMem = NULL;
+        IOFree(ring->rxMapMem, rxMapMemSize);
+        ring->rxMapMem = NULL;
     }
 }
 
-bool SimpleRTK5::setupTxMap()
+bool SimpleRTK5::setupTxMap(rtlTxRing *ring)
 {
     bool result = false;
 
-    txMapMem = IOMallocZero(kTxMapMemSize);
+    ring->txMapMem = IOMallocZero(txMapMemSize);
     
-    if (!txMapMem) {
+    if (!ring->txMapMem) {
         IOLog("SimpleRTK5: Couldn't alloc memory for tx map.\n");
         goto done;
     }
-    txMapInfo = (rtlTxMapInfo *)txMapMem;
+    ring->txMapInfo = (rtlTxMapInfo *)ring->txMapMem;
     
-    txMapInfo->txNextMem2Use = 0;
-    txMapInfo->txNextMem2Free = 0;
-    txMapInfo->txNumFreeMem = kNumTxMemDesc;
+    /* The arrays are located behind the map info. */
+    ring->txMapInfo->txMemIO = (IOMemoryDescriptor **)(ring->txMapInfo + 1);
+    ring->txMapInfo->txMemRange = (IOAddressRange *)(ring->txMapInfo->txMemIO + numTxMemDesc);
+
+    ring->txMapInfo->txNextMem2Use = 0;
+    ring->txMapInfo->txNextMem2Free = 0;
+    ring->txMapInfo->txNumFreeMem = numTxMemDesc;
+
+    /* The IOVA cache and the bounce buffers are optional. */
+    ring->txIovaCache = (rtlIovaEntry *)IOMallocZero(kTxIovaCacheSize * sizeof(rtlIovaEntry));
+
+    if (!ring->txIovaCache)
+        IOLog("SimpleRTK5: Tx IOVA cache disabled for queue %u.\n", ring->queue);
+
+
+    if (txCopyBreak && !setupTxBounce(ring))
+        IOLog("SimpleRTK5: Tx bounce buffers disabled for queue %u.\n", ring->queue);
 
     result = true;
     
@@ -138,20 +159,101 @@ done:
     return result;
 }
 
-void SimpleRTK5::freeTxMap()
+void SimpleRTK5::freeTxMap(rtlTxRing *ring)
 {
     UInt32 i;
 
-    if (txMapMem) {
-        for (i = 0; i < kNumTxMemDesc; i++) {
-            if (txMapInfo->txMemIO[i]) {
-                txMapInfo->txMemIO[i]->complete();
-                txMapInfo->txMemIO[i]->release();
-                txMapInfo->txMemIO[i] = NULL;
+    if (ring->txMapMem) {
+        for (i = 0; i < numTxMemDesc; i++) {
+            if (ring->txMapInfo->txMemIO[i]) {
+                ring->txMapInfo->txMemIO[i]->complete();
+                ring->txMapInfo->txMemIO[i]->release();
+                ring->txMapInfo->txMemIO[i] = NULL;
             }
         }
-        IOFree(txMapMem, kTxMapMemSize);
-        txMapMem = NULL;
+        IOFree(ring->txMapMem, txMapMemSize);
+        ring->txMapMem = NULL;
+    }
+    if (ring->txIovaCache) {
+        txIovaFlush(ring);
+        IOFree(ring->txIovaCache, kTxIovaCacheSize * sizeof(rtlIovaEntry));
+        ring->txIovaCache = NULL;
+    }
+    freeTxBounce(ring);
+}
+
+/*
+ * Allocate a bounce buffer for each tx descriptor. The buffers are
+ * mapped once for the lifetime of the ring, so that small packets
+ * can be copied and sent without mapping them with AppleVTD.
+ */
+bool SimpleRTK5::setupTxBounce(rtlTxRing *ring)
+{
+    IODMACommand::Segment64 seg;
+    UInt64 offset = 0;
+    UInt32 numSegs = 1;
+    bool result = false;
+
+    ring->txBounceDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionOut | kIOMemoryPhysicallyContiguous), numTxDesc * kTxBounceBufSize, 0xFFFFFFFFFFFFF000ULL);
+
+    if (!ring->txBounceDesc) {
+        IOLog("SimpleRTK5: Couldn't alloc txBounceDesc.\n");
+        goto done;
+    }
+    if (ring->txBounceDesc->prepare() != kIOReturnSuccess) {
+        IOLog("SimpleRTK5: txBounceDesc->prepare() failed.\n");
+        goto error_prep;
+    }
+    ring->txBounceDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+
+    if (!ring->txBounceDmaCmd) {
+        IOLog("SimpleRTK5: Couldn't alloc txBounceDmaCmd.\n");
+        goto error_dma;
+    }
+    if (ring->txBounceDmaCmd->setMemoryDescriptor(ring->txBounceDesc) != kIOReturnSuccess) {
+        IOLog("SimpleRTK5: setMemoryDescriptor() failed.\n");
+        goto error_set_desc;
+    }
+    if (ring->txBounceDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
+        IOLog("SimpleRTK5: gen64IOVMSegments() failed.\n");
+        goto error_segm;
+    }
+    ring->txBouncePhyAddr = seg.fIOVMAddr;
+    ring->txBounceArray = (UInt8 *)ring->txBounceDesc->getBytesNoCopy();
+
+    result = true;
+
+done:
+    return result;
+
+error_segm:
+    ring->txBounceDmaCmd->clearMemoryDescriptor();
+
+error_set_desc:
+    RELEASE(ring->txBounceDmaCmd);
+
+error_dma:
+    ring->txBounceDesc->complete();
+
+error_prep:
+    RELEASE(ring->txBounceDesc);
+    goto done;
+}
+
+void SimpleRTK5::freeTxBounce(rtlTxRing *ring)
+{
+    ring->txBounceArray = NULL;
+    ring->txBouncePhyAddr = (IOPhysicalAddress64)NULL;
+
+    if (ring->txBounceDmaCmd) {
+        ring->txBounceDmaCmd->clearMemoryDescriptor();
+        ring->txBounceDmaCmd->release();
+        ring->txBounceDmaCmd = NULL;
+    }
+    if (ring->txBounceDesc) {
+        ring->txBounceDesc->complete();
+        ring->txBounceDesc->release();
+        ring->txBounceDesc = NULL;
     }
 }
 
@@ -162,23 +264,19 @@ void SimpleRTK5::interruptOccurredVTD(OSObject *client, IOInterruptEventSource *
     struct srtk5_private *tp = &linuxData;
     UInt32 rxPackets = 0;
     UInt32 status;
+    UInt32 i;
 
-    status = RTL_R32(tp, ISR0_8125);
-    
-    //DebugLog("SimpleRTK5: interruptHandler: status = 0x%x.\n", status);
+    status = intrGetStatus(tp);
 
-    /* hotplug/major error/no more work/shared irq */
-    if ((status == 0xFFFFFFFF) || !status)
+    if (!status)
         goto done;
-    
-    RTL_W32(tp, IMR0_8125, 0x0000);
-    RTL_W32(tp, ISR0_8125, (status & ~RxFIFOOver));
 
     if (!test_bit(__POLL_MODE, &stateFlags) &&
         !test_and_set_bit(__POLLING, &stateFlags)) {
         /* Rx interrupt */
         if (status & (RxOK | RxDescUnavail)) {
-            rxPackets = rxInterruptVTD(netif, kNumRxDesc, NULL, NULL);
+            for (i = 0; i < numRxQueues; i++)
+                rxPackets += rxInterruptVTD(&rxRing[i], netif, numRxDesc, NULL, NULL);
             
             if (rxPackets)
                 netif->flushInputQueue();
@@ -192,7 +290,7 @@ void SimpleRTK5::interruptOccurredVTD(OSObject *client, IOInterruptEventSource *
         }
         /* Tx interrupt */
         if (status & (TxOK)) {
-            txInterrupt();
+            txReclaim();
             
             etherStats->dot3TxExtraEntry.interrupts++;
         }
@@ -207,6 +305,10 @@ void SimpleRTK5::interruptOccurredVTD(OSObject *client, IOInterruptEventSource *
         } else {
             intrMask = intrMaskRxTx;
         }
+        /* Leave the rings to the busy poll thread under load. */
+        if (busyPollCheck())
+            intrMask = intrMaskPoll;
+
         clear_bit(__POLLING, &stateFlags);
     }
     if (status & LinkChg) {
@@ -219,6 +321,7 @@ void SimpleRTK5::interruptOccurredVTD(OSObject *client, IOInterruptEventSource *
     
 done:
     RTL_W32(tp, IMR0_8125, intrMask);
+    rtl812xSetQueueIntrMask(tp, intrMask);
 }
 
 #pragma mark --- tx methods for AppleVTD support ---
@@ -227,11 +330,14 @@ done:
  * Map a tx packet for read DMA access by the NIC.
  * The packet is split up into physical contiguous segments
  * and an IOMemoryDescriptor is used to map all segments for
- * DMA access.
+ * DMA access, unless all pages of the packet are found in the IOVA
+ * cache.
  */
-UInt32 SimpleRTK5::txMapPacket(mbuf_t packet,
+UInt32 SimpleRTK5::txMapPacket(rtlTxRing *ring,
+                            mbuf_t packet,
                             IOPhysicalSegment *vector,
-                            UInt32 maxSegs)
+                            UInt32 maxSegs,
+                            bool *premapped)
 {
     IOMemoryDescriptor *md = NULL;
     IOAddressRange *srcRange;
@@ -246,7 +352,7 @@ UInt32 SimpleRTK5::txMapPacket(mbuf_t packet,
     bool result = false;
 
     if (packet && vector && maxSegs) {
-        srcRange = txMapInfo->txSCRange;
+        srcRange = ring->txMapInfo->txSCRange;
         m = packet;
         
         /*
@@ -282,22 +388,27 @@ UInt32 SimpleRTK5::txMapPacket(mbuf_t packet,
             m = mbuf_next(m);
         } while (m);
 map:
+        /* Pages which are still mapped need no IOMemoryDescriptor. */
+        if (ring->txIovaCache && txIovaLookup(ring, srcRange, segIndex, vector)) {
+            *premapped = true;
+            goto done;
+        }
         /*
          * Get IORanges, fill in the virtual segments and grab
          * an IOMemoryDescriptor to map the packet.
          */
-        if (txMapInfo->txNumFreeMem > 1) {
-            dstRange = &txMapInfo->txMemRange[txNextDescIndex];
+        if (ring->txMapInfo->txNumFreeMem > 1) {
+            dstRange = &ring->txMapInfo->txMemRange[ring->txNextDescIndex];
             
             for (i = 0; i < segIndex; i++) {
                 dstRange[i].address = (srcRange[i].address & ~PAGE_MASK);
                 dstRange[i].length = PAGE_SIZE;
                 srcRange[i].address &= PAGE_MASK;
             }
-            OSAddAtomic16(-1, &txMapInfo->txNumFreeMem);
-            saveMem = txMapInfo->txNextMem2Use++;
-            txMapInfo->txNextMem2Use &= kTxMemDescMask;
-            md = txMapInfo->txMemIO[saveMem];
+            OSAddAtomic16(-1, &ring->txMapInfo->txNumFreeMem);
+            saveMem = ring->txMapInfo->txNextMem2Use++;
+            ring->txMapInfo->txNextMem2Use &= txMemDescMask;
+            md = ring->txMapInfo->txMemIO[saveMem];
             
             if (md) {
                 result = md->initWithOptions(dstRange, segIndex, 0, kernel_task, (kIOMemoryTypeVirtual | kIODirectionOut | kIOMemoryAsReference), mapper);
@@ -308,7 +419,7 @@ map:
                     DebugLog("SimpleRTK5: Couldn't alloc IOMemoryDescriptor for tx packet.");
                     goto error_map;
                 }
-                txMapInfo->txMemIO[saveMem] = md;
+                ring->txMapInfo->txMemIO[saveMem] = md;
                 result = true;
             }
             if (!result) {
@@ -339,8 +450,8 @@ done:
     return segIndex;
 
 error_map:
-    txMapInfo->txNextMem2Use = saveMem;
-    OSAddAtomic16(1, &txMapInfo->txNumFreeMem);
+    ring->txMapInfo->txNextMem2Use = saveMem;
+    OSAddAtomic16(1, &ring->txMapInfo->txNumFreeMem);
 
     segIndex = 0;
     goto done;
@@ -350,15 +461,210 @@ error_map:
  * Unmap a tx packet. Complete the IOMemoryDecriptor and free it
  * for reuse.
  */
-void SimpleRTK5::txUnmapPacket()
+void SimpleRTK5::txUnmapPacket(rtlTxRing *ring)
 {
-    IOMemoryDescriptor *md = txMapInfo->txMemIO[txMapInfo->txNextMem2Free];
+    IOMemoryDescriptor *md = ring->txMapInfo->txMemIO[ring->txMapInfo->txNextMem2Free];
     
     md->complete();
     md->setTag(kIOMemoryInactive);
     
-    ++(txMapInfo->txNextMem2Free) &= kTxMemDescMask;
-    OSAddAtomic16(1, &txMapInfo->txNumFreeMem);
+    ++(ring->txMapInfo->txNextMem2Free) &= txMemDescMask;
+    OSAddAtomic16(1, &ring->txMapInfo->txNumFreeMem);
+}
+
+#pragma mark --- tx IOVA cache methods ---
+
+/*
+ * The network stack reuses the same cluster pages over and over
+ * again. Instead of mapping them for each packet, pages are kept
+ * mapped as long as there are packets in flight, which use them,
+ * and their bus address is taken from the cache. A page is looked
+ * up in a set of kTxIovaWays entries, which is selected by the page
+ * number. An entry holds one reference for each descriptor in
+ * flight, which is dropped in txInterrupt() when the descriptor has
+ * been completed and its mbuf has been freed. The page is unmapped
+ * along with the last reference, so that the device never keeps
+ * access to a page the stack has taken back.
+ *
+ * outputStart(), txInterrupt() and timerAction() may run
+ * concurrently. References are taken and dropped atomically and an
+ * entry is only unmapped by the one who has claimed it, changing its
+ * count from 0 to kTxIovaReleased (see SimpleRTK5Iova.hpp). Entries
+ * are only mapped in the context of outputStart().
+ */
+bool SimpleRTK5::txIovaLookup(rtlTxRing *ring, IOAddressRange *srcRange,
+                              UInt32 numSegs, IOPhysicalSegment *vector)
+{
+    rtlIovaEntry *entry;
+    IOVirtualAddress page;
+    addr64_t phyPage;
+    UInt32 index = ring->txNextDescIndex;
+    UInt64 now;
+    UInt32 i, j;
+    bool result = false;
+
+    clock_get_uptime(&now);
+
+    if (now >= ring->txIovaSweepDeadline)
+        txIovaSweep(ring);
+
+    for (i = 0; i < numSegs; i++) {
+        page = trunc_page(srcRange[i].address);
+        phyPage = (mbuf_data_to_physical((void *)srcRange[i].address) & ~((addr64_t)PAGE_MASK));
+        entry = rtlIovaFind(rtlIovaSet(ring->txIovaCache, page >> PAGE_SHIFT), page);
+
+        /* Don't trust an entry in case the page has been replaced. */
+        if (entry && (entry->phyPage != phyPage)) {
+            if (!rtlIovaClaim(entry))
+                goto error;
+
+            txIovaRelease(entry);
+            ring->txIovaEvictions++;
+            entry = NULL;
+        }
+        if (entry && rtlIovaGet(entry)) {
+            ring->txIovaHits++;
+        } else {
+            ring->txIovaMisses++;
+            entry = txIovaInsert(ring, page, phyPage);
+
+            if (!entry || !rtlIovaGet(entry))
+                goto error;
+        }
+        vector[i].location = entry->iova + (srcRange[i].address & PAGE_MASK);
+        vector[i].length = srcRange[i].length;
+        ring->txBufArray[rtlRingAdvance(index, i, txDescMask)].iova = entry;
+    }
+    result = true;
+
+done:
+    return result;
+
+error:
+    /* Drop the references taken so far. */
+    while (i-- > 0) {
+        j = rtlRingAdvance(index, i, txDescMask);
+        txIovaPut(ring, ring->txBufArray[j].iova);
+        ring->txBufArray[j].iova = NULL;
+    }
+    goto done;
+}
+
+/*
+ * Map a page and add it to its set. In case the set is full, an
+ * entry without references, which hasn't been used since the last
+ * pass, is evicted.
+ */
+rtlIovaEntry *SimpleRTK5::txIovaInsert(rtlTxRing *ring, IOVirtualAddress page,
+                                       addr64_t phyPage)
+{
+    IOAddressRange range;
+    IOMemoryDescriptor *md;
+    rtlIovaEntry *entry;
+    bool evict;
+
+    entry = rtlIovaVictim(rtlIovaSet(ring->txIovaCache, page >> PAGE_SHIFT), &evict);
+
+    if (!entry)
+        goto done;
+
+    if (evict) {
+        txIovaRelease(entry);
+        ring->txIovaEvictions++;
+    }
+    range.address = page;
+    range.length = PAGE_SIZE;
+
+    md = IOMemoryDescriptor::withOptions(&range, 1, 0, kernel_task, (kIOMemoryTypeVirtual | kIODirectionOut), mapper);
+
+    if (!md) {
+        DebugLog("SimpleRTK5: Couldn't alloc IOMemoryDescriptor for tx page.\n");
+        goto error;
+    }
+    if (md->prepare() != kIOReturnSuccess) {
+        DebugLog("SimpleRTK5: Failed to prepare() tx page.\n");
+        md->release();
+        goto error;
+    }
+    rtlIovaPublish(entry, page, phyPage, md->getPhysicalSegment(0, NULL), md);
+
+done:
+    return entry;
+
+error:
+    entry = NULL;
+    goto done;
+}
+
+/*
+ * Drop a descriptor's reference and unmap the page with the last
+ * one. Called by txInterrupt() after the mbuf has been freed.
+ */
+void SimpleRTK5::txIovaPut(rtlTxRing *ring, rtlIovaEntry *entry)
+{
+    if (rtlIovaPut(entry)) {
+        txIovaRelease(entry);
+        OSAddAtomic64(1, &ring->txIovaReleases);
+    }
+}
+
+/* Unmap a claimed entry and free it. */
+void SimpleRTK5::txIovaRelease(rtlIovaEntry *entry)
+{
+    entry->md->complete();
+    entry->md->release();
+    rtlIovaFree(entry);
+}
+
+/*
+ * Unmap the pages without references, which haven't been used since
+ * the last sweep, and clear the used flag of all others. Called from
+ * outputStart() and timerAction(), so that the pages of an idle ring
+ * don't stay mapped either.
+ */
+void SimpleRTK5::txIovaSweep(rtlTxRing *ring)
+{
+    rtlIovaEntry *entry;
+    UInt64 delta;
+    UInt32 i;
+
+    for (i = 0; i < kTxIovaCacheSize; i++) {
+        entry = &ring->txIovaCache[i];
+
+        if (!entry->md || entry->refs)
+            continue;
+
+        if (entry->used) {
+            entry->used = false;
+            continue;
+        }
+        if (rtlIovaClaim(entry)) {
+            txIovaRelease(entry);
+            OSAddAtomic64(1, &ring->txIovaReleases);
+        }
+    }
+    clock_get_uptime(&ring->txIovaSweepDeadline);
+    nanoseconds_to_absolutetime(kTxIovaSweepTime, &delta);
+    ring->txIovaSweepDeadline += delta;
+}
+
+void SimpleRTK5::txIovaFlush(rtlTxRing *ring)
+{
+    rtlIovaEntry *entry;
+    UInt32 i;
+
+    if (!ring->txIovaCache)
+        return;
+
+    for (i = 0; i < kTxIovaCacheSize; i++) {
+        entry = &ring->txIovaCache[i];
+
+        if (entry->md) {
+            entry->md->complete();
+            entry->md->release();
+        }
+        bzero(entry, sizeof(rtlIovaEntry));
+    }
 }
 
 #pragma mark --- rx methods for AppleVTD support ---
@@ -370,11 +676,11 @@ void SimpleRTK5::txUnmapPacket()
  * @count       Number of batches to map.
  * @result      The index of the next batch to map.
  */
-UInt16 SimpleRTK5::rxMapBuffers(UInt16 index, UInt16 count)
+UInt16 SimpleRTK5::rxMapBuffers(rtlRxRing *ring, UInt16 index, UInt16 count)
 {
     IOPhysicalAddress pa;
     IOMemoryDescriptor *md;
-    UInt64 length;
+    UInt32 length;
     IOByteCount offset;
     UInt32 batch = count;
     UInt16 end, i;
@@ -383,23 +689,50 @@ UInt16 SimpleRTK5::rxMapBuffers(UInt16 index, UInt16 count)
     while (batch--) {
         /*
          * Get the coresponding IOMemoryDescriptor and complete
-         * the mapping;
+         * the mapping of the old buffers, which have been passed
+         * to the stack already. A batch, which has been refilled
+         * with recycled pages only, leaves the descriptor unprepared.
          */
-        md = rxMapInfo->rxMemIO[index >> kRxMemBaseShift];
-        md->complete();
-        
+        md = ring->rxMapInfo->rxMemIO[index >> kRxMemBaseShift];
+
+        if (md->getTag() == kIOMemoryActive) {
+            md->complete();
+            md->setTag(kIOMemoryInactive);
+        }
         /*
-         * Update IORanges with the addresses of the replaced buffers.
+         * Buffers from the pool's recycled pages come with a valid
+         * DMA address. In case all buffers of the batch have one,
+         * there is no need to remap the batch. Just hand the
+         * descriptors back to the NIC.
          */
         for (i = index, end = index + kRxMemBatchSize; i < end; i++) {
-            if (rxBufArray[i].phyAddr == 0) {
-                rxMapInfo->rxMemRange[i].address = (IOVirtualAddress)mbuf_datastart(rxBufArray[i].mbuf);
+            if (ring->rxBufArray[i].phyAddr == 0)
+                break;
+        }
+        if (i == end) {
+            length = (rxDescBufSize | DescOwn);
+
+            for (i = index; i < end; i++) {
+                if (i == (numRxDesc - 1))
+                    length |= RingEnd;
+
+                rxDescSet(ring, i, ring->rxBufArray[i].phyAddr, length);
             }
+            wmb();
+            goto next_batch;
+        }
+
+        /*
+         * Update IORanges with the addresses of the buffers. Recycled
+         * pages may have replaced buffers too, so update all of them.
+         */
+        for (i = index, end = index + kRxMemBatchSize; i < end; i++) {
+            ring->rxMapInfo->rxMemRange[i].address = (IOVirtualAddress)mbuf_datastart(ring->rxBufArray[i].mbuf);
         }
         /*
          * Prepare IOMemoryDescriptor with updated buffer addresses.
          */
-        result = md->initWithOptions(&rxMapInfo->rxMemRange[index], kRxMemBatchSize, 0, kernel_task, kIOMemoryTypeVirtual | kIODirectionIn | kIOMemoryAsReference, mapper);
+        result = md->initWithOptions(&ring->rxMapInfo->rxMemRange[index], kRxMemBatchSize, 0, kernel_task, kIOMemoryTypeVirtual | kIODirectionIn | kIOMemoryAsReference, mapper);
 
         if (!result) {
             IOLog("SimpleRTK5: Failed to reinit rx IOMemoryDescriptor.\n");
@@ -409,25 +742,26 @@ UInt16 SimpleRTK5::rxMapBuffers(UInt16 index, UInt16 count)
             IOLog("SimpleRTK5: Failed to prepare rx IOMemoryDescriptor.\n");
             goto done;
         }
+        md->setTag(kIOMemoryActive);
+
         /*
          * Get physical addresses of the buffers and update buffer info,
          * as well as the descriptor ring with new addresses.
          */
-        length = (kRxBufferSize | DescOwn);
+        length = (rxDescBufSize | DescOwn);
         offset = 0;
 
         for (i = index, end = index + kRxMemBatchSize; i < end; i++) {
-            if (i == kRxLastDesc)
+            if (i == (numRxDesc - 1))
                 length |= RingEnd;
             
             pa = md->getPhysicalSegment(offset, NULL);
-            rxBufArray[i].phyAddr = pa;
+            ring->rxBufArray[i].phyAddr = pa;
             
-            rxDescArray[i].buf.addr = OSSwapHostToLittleInt64(pa);
-            rxDescArray[i].buf.blen = OSSwapHostToLittleInt64(length);
+            rxDescSet(ring, i, pa, length);
 
             //DebugLog("SimpleRTK5: rxDescArray[%u]: 0x%x %llu\n", i, (unsigned int)length, pa);
-            offset += PAGE_SIZE;
+            offset += rxBufferSize;
         }
         wmb();
         
@@ -435,25 +769,42 @@ next_batch:
         /*
          * Update indices after every batch.
          */
-        index = (index + kRxMemBatchSize) & kRxDescMask;
-        rxMapNextIndex = index;
+        index = rtlRingAdvance(index, kRxMemBatchSize, rxDescMask);
+        ring->rxMapNextIndex = index;
     }
     
 done:
     return index;
 }
 
-UInt32 SimpleRTK5::rxInterruptVTD(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context)
+UInt32 SimpleRTK5::rxInterruptVTD(rtlRxRing *ring, IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context)
 {
-    RtlRxDesc *desc = &rxDescArray[rxNextDescIndex];
+    rtlRxDescStatus batchStatus[kRxScanBatch];
+    rtlRxDescStatus *status;
     mbuf_t bufPkt, newPkt;
     UInt32 goodPkts = 0;
     UInt32 numMap = 0;
+    UInt32 batchCount = 0;
+    UInt32 batchIndex = 0;
     UInt32 descStatus1, descStatus2;
     SInt32 pktSize;
+    IOPhysicalAddress64 pa;
+    UInt64 mapStart, mapEnd;
+    UInt64 mapCost = 0;
     bool replaced;
     
-    while (!((descStatus1 = OSSwapLittleToHostInt32(desc->cmd.opts1)) & DescOwn) && (goodPkts < maxCount)) {
+    while (goodPkts < maxCount) {
+        /* Get the status of the next batch of ready descriptors. */
+        if (batchIndex == batchCount) {
+            batchCount = rxScanBatch(ring, batchStatus, min(maxCount - goodPkts, kRxScanBatch));
+            batchIndex = 0;
+
+            if (!batchCount)
+                break;
+        }
+        status = &batchStatus[batchIndex++];
+        descStatus1 = status->opts1;
+        descStatus2 = status->opts2;
 
         /* Drop packets with receive errors. */
         if (unlikely(descStatus1 & RxRES)) {
@@ -465,16 +816,15 @@ UInt32 SimpleRTK5::rxInterruptVTD(IONetworkInterface *interface, uint32_t maxCou
             if (descStatus1 & RxCRC)
                 etherStats->dot3StatsEntry.fcsErrors++;
 
-            discardPacketFragment();
+            discardPacketFragment(ring);
             goto nextDesc;
         }
         
-        descStatus2 = OSSwapLittleToHostInt32(desc->cmd.opts2);
-        pktSize = (descStatus1 & 0x1fff);
-        bufPkt = rxBufArray[rxNextDescIndex].mbuf;
+        pktSize = (descStatus1 & 0x3fff);
+        bufPkt = ring->rxBufArray[ring->rxNextDescIndex].mbuf;
         DebugLog("SimpleRTK5: rxInterrupt(): descStatus1=0x%x, descStatus2=0x%x, pktSize=%u\n", descStatus1, descStatus2, pktSize);
         
-        newPkt = rxPool->replaceOrCopyPacket(&bufPkt, pktSize, &replaced);
+        newPkt = ring->rxPool->replaceOrCopyPacket(&bufPkt, pktSize, &replaced, &pa);
         
         if (unlikely(!newPkt)) {
             /*
@@ -482,7 +832,7 @@ UInt32 SimpleRTK5::rxInterruptVTD(IONetworkInterface *interface, uint32_t maxCou
              * original packet in place.
              */
             DebugLog("SimpleRTK5: replaceOrCopyPacket() failed.\n");
-            discardPacketFragment();
+            discardPacketFragment(ring);
             etherStats->dot3RxExtraEntry.resourceErrors++;
             goto nextDesc;
         }
@@ -492,25 +842,26 @@ handle_pkt:
             if (unlikely(mbuf_next(bufPkt) != NULL)) {
                 DebugLog("SimpleRTK5: getPhysicalSegment() failed.\n");
                 etherStats->dot3RxExtraEntry.resourceErrors++;
-                discardPacketFragment();
+                discardPacketFragment(ring);
                 mbuf_freem_list(bufPkt);
                 goto nextDesc;
             }
-            rxBufArray[rxNextDescIndex].mbuf = bufPkt;
-            rxBufArray[rxNextDescIndex].phyAddr = 0;
+            ring->rxBufArray[ring->rxNextDescIndex].mbuf = bufPkt;
+            /* A zero address marks the buffer to be mapped. */
+            ring->rxBufArray[ring->rxNextDescIndex].phyAddr = pa;
         }
         if (descStatus1 & LastFrag) {
             pktSize -= kIOEthernetCRCSize;
             
-            if (rxPacketHead) {
+            if (ring->rxPacketHead) {
                 if (pktSize > 0) {
                     /* This is the last buffer of a jumbo frame. */
                     mbuf_setlen(newPkt, pktSize);
 
                     mbuf_setflags_mask(newPkt, 0, MBUF_PKTHDR);
-                    mbuf_setnext(rxPacketTail, newPkt);
+                    mbuf_setnext(ring->rxPacketTail, newPkt);
                     
-                    rxPacketTail = newPkt;
+                    ring->rxPacketTail = newPkt;
                 } else {
                     /*
                      * The last fragment consists only of the FCS or a part
@@ -519,9 +870,9 @@ handle_pkt:
                      */
                     DebugLog("SimpleRTK5: Packet size: %d. Dropping!\n", pktSize);
                     mbuf_free(newPkt);
-                    mbuf_adjustlen(rxPacketTail, pktSize);
+                    mbuf_adjustlen(ring->rxPacketTail, pktSize);
                 }
-                rxPacketSize += pktSize;
+                ring->rxPacketSize += pktSize;
             } else {
                 /*
                  * We've got a complete packet in one buffer.
@@ -529,36 +880,40 @@ handle_pkt:
                  */
                 mbuf_setlen(newPkt, pktSize);
 
-                rxPacketHead = newPkt;
-                rxPacketSize = pktSize;
+                ring->rxPacketHead = newPkt;
+                ring->rxPacketSize = pktSize;
             }
             getChecksumResult(newPkt, descStatus1, descStatus2);
             
             /* Also get the VLAN tag if there is any. */
             if (descStatus2 & RxVlanTag)
-                setVlanTag(rxPacketHead, OSSwapInt16(descStatus2 & 0xffff));
+                setVlanTag(ring->rxPacketHead, OSSwapInt16(descStatus2 & 0xffff));
             
-            mbuf_pkthdr_setlen(rxPacketHead, rxPacketSize);
-            interface->enqueueInputPacket(rxPacketHead, pollQueue);
+            mbuf_pkthdr_setlen(ring->rxPacketHead, ring->rxPacketSize);
+
+            if (enableLRO)
+                lroInput(ring, ring->rxPacketHead, status);
+            else
+                rxListAppend(ring, ring->rxPacketHead);
             
-            rxPacketHead = rxPacketTail = NULL;
-            rxPacketSize = 0;
+            ring->rxPacketHead = ring->rxPacketTail = NULL;
+            ring->rxPacketSize = 0;
             
             goodPkts++;
         } else {
             mbuf_setlen(newPkt, pktSize);
 
-            if (rxPacketHead) {
+            if (ring->rxPacketHead) {
                 /* We are in the middle of a jumbo frame. */
                 mbuf_setflags_mask(newPkt, 0, MBUF_PKTHDR);
-                mbuf_setnext(rxPacketTail, newPkt);
+                mbuf_setnext(ring->rxPacketTail, newPkt);
                 
-                rxPacketTail = newPkt;
-                rxPacketSize += pktSize;
+                ring->rxPacketTail = newPkt;
+                ring->rxPacketSize += pktSize;
             } else {
                 /* This is the first buffer of a jumbo frame. */
-                rxPacketHead = rxPacketTail = newPkt;
-                rxPacketSize = pktSize;
+                ring->rxPacketHead = ring->rxPacketTail = newPkt;
+                ring->rxPacketSize = pktSize;
             }
         }
         
@@ -567,16 +922,29 @@ handle_pkt:
          * If a batch has been completed, increment the number of
          * batches, which need to be mapped.
          */
-        if ((rxNextDescIndex & kRxMemDescMask) == kRxMemDescMask)
+        if ((ring->rxNextDescIndex & kRxMemDescMask) == kRxMemDescMask)
             numMap++;
 
         /* Get the next descriptor to process. */
-        ++rxNextDescIndex &= kRxDescMask;
-        desc = &rxDescArray[rxNextDescIndex];
+        ++ring->rxNextDescIndex &= rxDescMask;
     }
     if (numMap) {
-        //DebugLog("SimpleRTK5: rxMapNextIndex: %u, numMap: %u\n", rxMapNextIndex, numMap);
-        rxMapBuffers(rxMapNextIndex, numMap);
+        //DebugLog("SimpleRTK5: rxMapNextIndex: %u, numMap: %u\n", ring->rxMapNextIndex, numMap);
+        clock_get_uptime(&mapStart);
+        rxMapBuffers(ring, ring->rxMapNextIndex, numMap);
+        clock_get_uptime(&mapEnd);
+        mapCost = mapEnd - mapStart;
     }
+    if (enableLRO)
+        lroFlushAll(ring);
+
+    /* Hand the packets of this drain over to the stack. */
+    if (ring->rxListHead)
+        rxListHandoff(ring, interface, pollQueue);
+
+    /* Let the copybreak account for the cost of remapping. */
+    if (goodPkts)
+        ring->rxPool->updateCopyBreak(mapCost);
+
     return goodPkts;
 }
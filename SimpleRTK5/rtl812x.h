@@ -603,6 +603,19 @@ enum RTL8125_register_content {
     /* IPC2 */
     RISC_IPC2_INTR = (1 << 1),
 
+    /* RSS */
+    RSS_CTRL_TCP_IPV4_SUPP = (1 << 0),
+    RSS_CTRL_IPV4_SUPP = (1 << 1),
+    RSS_CTRL_TCP_IPV6_SUPP = (1 << 2),
+    RSS_CTRL_IPV6_SUPP = (1 << 3),
+    RSS_CTRL_IPV6_EXT_SUPP = (1 << 4),
+    RSS_CTRL_TCP_IPV6_EXT_SUPP = (1 << 5),
+    RSS_CTRL_UDP_IPV4_SUPP = (1 << 11),
+    RSS_CTRL_UDP_IPV6_SUPP = (1 << 12),
+    RSS_CTRL_UDP_IPV6_EXT_SUPP = (1 << 13),
+    RSS_MASK_BITS_OFFSET = 8,
+    RSS_CPU_NUM_OFFSET = 16,
+
     /* Magic Number */
     RTL8125_MAGIC_NUMBER = 0x0badbadbadbadbadull,
 };
@@ -0,0 +1,357 @@
+//
+//  BqlTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the tx byte limit in SimpleRTK5Bql.hpp: growth of the
+//  limit when the ring starved while packets were waiting, shrinking
+//  by the lowest slack only after the hold time, the clamps at
+//  kTxBqlMinLimit and kTxBqlMaxLimit and the history ring exported by
+//  updateTxBqlStats(). A replay of a sender and a NIC draining the ring
+//  at link rate reports the limit each rate and completion interval
+//  settles at. Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/BqlTests.cpp -o /tmp/BqlTests && /tmp/BqlTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5Bql.hpp"
+
+#define kHoldTime   1000000ULL  /* ns, shorter than kTxBqlHoldTime */
+#define kTsoSize    65536
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* Same as txBqlAvail() in SimpleRTK5Ethernet.hpp */
+static inline SInt32 bqlAvail(const rtlTxBql *bql)
+{
+    return (SInt32)(bql->adjLimit - bql->numQueued);
+}
+
+/*
+ * Queue packets of pktLen bytes like outputStart(), as long as the
+ * limit isn't exceeded. Returns the number of bytes queued.
+ */
+static UInt32 fill(rtlTxBql *bql, UInt32 pktLen)
+{
+    UInt32 bytes = 0;
+
+    while (bqlAvail(bql) >= 0) {
+        rtlTxBqlQueued(bql, pktLen);
+        bytes += pktLen;
+    }
+    return bytes;
+}
+
+/* Same as SimpleRTK5::updateTxBqlStats() with a vector for the OSArray */
+static void readHistory(const rtlTxBql *bql, std::vector<UInt32> &hist)
+{
+    UInt32 j, k;
+
+    hist.clear();
+    k = (bql->historyIndex + kTxBqlHistorySize - bql->historyCount) % kTxBqlHistorySize;
+
+    for (j = 0; j < bql->historyCount; j++) {
+        hist.push_back(bql->history[k]);
+        k = (k + 1) % kTxBqlHistorySize;
+    }
+}
+
+static void testReset()
+{
+    rtlTxBql bql;
+
+    memset(&bql, 0xff, sizeof(bql));
+    rtlTxBqlReset(&bql, true, kHoldTime, 5);
+
+    CHECK(bql.limit == kTxBqlMinLimit, "limit %x", bql.limit);
+    CHECK(bql.adjLimit == kTxBqlMinLimit, "adjLimit %x", bql.adjLimit);
+    CHECK(bql.numQueued == 0 && bql.numCompleted == 0, "counters not cleared");
+    CHECK(bql.historyCount == 0 && bql.historyIndex == 0, "history not cleared");
+    CHECK(bql.slackStartTime == 5 && bql.slackHoldTime == kHoldTime, "times");
+
+    /* A TSO packet of maximum size fits into an empty ring. */
+    CHECK(bqlAvail(&bql) >= 0, "avail %d", bqlAvail(&bql));
+
+    rtlTxBqlReset(&bql, false, kHoldTime, 5);
+    CHECK(bql.limit == kTxBqlNoLimit, "limit %x", bql.limit);
+    rtlTxBqlQueued(&bql, kTsoSize * 1024);
+    CHECK(bqlAvail(&bql) >= 0, "no limit, avail %d", bqlAvail(&bql));
+}
+
+/*
+ * The ring runs empty while the output queue holds packets. The limit
+ * grows by the bytes completed beyond the last interval's queue, is
+ * clamped at kTxBqlMaxLimit and stays there.
+ */
+static void testGrowth()
+{
+    rtlTxBql bql;
+    UInt32 queued, prev, pass;
+    UInt64 now = 0;
+
+    rtlTxBqlReset(&bql, true, kHoldTime, now);
+
+    queued = fill(&bql, kTsoSize);
+    CHECK(queued == 2 * kTsoSize, "queued %x", queued);
+
+    rtlTxBqlCompleted(&bql, queued, ++now);
+    CHECK(bql.limit == kTxBqlMinLimit + queued, "limit %x", bql.limit);
+    CHECK(bql.adjLimit == bql.limit + bql.numCompleted, "adjLimit %x", bql.adjLimit);
+    CHECK(bql.prevOvLimit == 0, "prevOvLimit %x after a change", bql.prevOvLimit);
+
+    for (pass = 0; pass < 32; pass++) {
+        prev = bql.limit;
+        queued = fill(&bql, kTsoSize);
+        rtlTxBqlCompleted(&bql, queued, ++now);
+
+        CHECK(bql.limit <= kTxBqlMaxLimit, "pass %u limit %x", pass, bql.limit);
+        CHECK((bql.limit > prev) || (prev == kTxBqlMaxLimit),
+              "pass %u limit %x after %x", pass, bql.limit, prev);
+    }
+    CHECK(bql.limit == kTxBqlMaxLimit, "limit %x", bql.limit);
+    CHECK(bql.historyCount < kTxBqlHistorySize, "%u changes", bql.historyCount);
+
+    /* Small packets grow the limit as well. */
+    rtlTxBqlReset(&bql, true, kHoldTime, now);
+    queued = fill(&bql, 1514);
+    rtlTxBqlCompleted(&bql, queued, ++now);
+    CHECK(bql.limit == kTxBqlMinLimit + queued, "limit %x queued %x", bql.limit, queued);
+}
+
+/*
+ * Half of the bytes in flight complete in each pass, so that there is
+ * always a backlog from the last pass. The limit mustn't shrink before
+ * the hold time has passed and shrinks by the lowest slack seen after
+ * it, but never below kTxBqlMinLimit.
+ */
+static void testShrink()
+{
+    rtlTxBql bql;
+    UInt32 start, prev, done, lowest, slack, pass;
+    UInt64 t0, now = 100;
+
+    rtlTxBqlReset(&bql, true, kHoldTime, now);
+
+    while (bql.limit < kTxBqlMaxLimit)
+        rtlTxBqlCompleted(&bql, fill(&bql, kTsoSize), ++now);
+
+    start = bql.limit;
+    t0 = bql.slackStartTime;
+    lowest = UINT32_MAX;
+
+    /* Ramp up the queue without starving, one packet per pass. */
+    fill(&bql, kTsoSize);
+    rtlTxBqlCompleted(&bql, kTsoSize, ++now);
+
+    for (pass = 0; now + 1000 <= t0 + kHoldTime; pass++) {
+        fill(&bql, kTsoSize);
+        done = kTsoSize;
+        slack = bql.limit + bql.prevOvLimit - 2 * done;
+        lowest = (slack < lowest) ? slack : lowest;
+
+        now += 1000;
+        rtlTxBqlCompleted(&bql, done, now);
+
+        CHECK(bql.limit == start, "pass %u limit %x before the hold time", pass, bql.limit);
+    }
+    CHECK(bql.lowestSlack == lowest, "lowestSlack %x expected %x", bql.lowestSlack, lowest);
+
+    /* At exactly the end of the hold time nothing happens. */
+    now = t0 + kHoldTime;
+    fill(&bql, kTsoSize);
+    rtlTxBqlCompleted(&bql, kTsoSize, now);
+    CHECK(bql.limit == start, "limit %x at the end of the hold time", bql.limit);
+
+    prev = bql.limit;
+    lowest = bql.lowestSlack;
+    fill(&bql, kTsoSize);
+    slack = bql.limit + bql.prevOvLimit - 2 * kTsoSize;
+    lowest = (slack < lowest) ? slack : lowest;
+    rtlTxBqlCompleted(&bql, kTsoSize, now + 1);
+
+    CHECK(bql.limit == ((prev - lowest > kTxBqlMinLimit) ? prev - lowest : kTxBqlMinLimit),
+          "limit %x after %x, lowest slack %x", bql.limit, prev, lowest);
+    CHECK(bql.limit < prev, "limit %x didn't shrink", bql.limit);
+    CHECK(bql.lowestSlack == UINT32_MAX, "lowestSlack %x not reset", bql.lowestSlack);
+    CHECK(bql.slackStartTime == now + 1, "slackStartTime %llu", (unsigned long long)bql.slackStartTime);
+
+    /* A trickle of completions shrinks the limit to the minimum. */
+    for (pass = 0; pass < 64; pass++) {
+        fill(&bql, 1514);
+        now += kHoldTime + 1;
+        rtlTxBqlCompleted(&bql, 1514, now);
+
+        CHECK(bql.limit >= kTxBqlMinLimit, "pass %u limit %x", pass, bql.limit);
+    }
+    CHECK(bql.limit == kTxBqlMinLimit, "limit %x", bql.limit);
+
+    /* A starvation in between restarts the hold time. */
+    fill(&bql, kTsoSize);
+    rtlTxBqlCompleted(&bql, bql.numQueued - bql.numCompleted, now + 5);
+    CHECK(bql.slackStartTime == now + 5, "slackStartTime %llu", (unsigned long long)bql.slackStartTime);
+    CHECK(bql.lowestSlack == UINT32_MAX, "lowestSlack %x", bql.lowestSlack);
+}
+
+/* Complete bytes and record the limit in expected in case it changed. */
+static void complete(rtlTxBql *bql, UInt32 bytes, UInt64 now, std::vector<UInt32> &expected)
+{
+    UInt32 prev = bql->limit;
+
+    rtlTxBqlCompleted(bql, bytes, now);
+
+    if (bql->limit != prev)
+        expected.push_back(bql->limit);
+}
+
+/*
+ * Each change of the limit is recorded. The readout of the ring
+ * returns the last kTxBqlHistorySize limits, oldest first.
+ */
+static void testHistory()
+{
+    rtlTxBql bql;
+    std::vector<UInt32> expected, hist;
+    UInt32 pass, i, n;
+    UInt64 now = 0;
+
+    rtlTxBqlReset(&bql, true, kHoldTime, now);
+    readHistory(&bql, hist);
+    CHECK(hist.empty(), "%zu entries after reset", hist.size());
+
+    for (pass = 0; pass < 3 * kTxBqlHistorySize + 5; pass++) {
+        fill(&bql, 1514);
+
+        if ((bql.limit == kTxBqlMaxLimit) || (pass & 1)) {
+            /* Shrink after the hold time by completing a trickle. */
+            complete(&bql, 1514, ++now, expected);
+            fill(&bql, 1514);
+            now += kHoldTime + 1;
+            complete(&bql, 1514, now, expected);
+        } else {
+            /* Starve the ring. */
+            complete(&bql, bql.numQueued - bql.numCompleted, ++now, expected);
+        }
+        readHistory(&bql, hist);
+        n = (expected.size() < kTxBqlHistorySize) ? (UInt32)expected.size() : kTxBqlHistorySize;
+
+        CHECK(bql.historyCount == n, "pass %u count %u, %zu changes",
+              pass, bql.historyCount, expected.size());
+        CHECK(bql.historyIndex == expected.size() % kTxBqlHistorySize,
+              "pass %u index %u", pass, bql.historyIndex);
+        CHECK(hist.size() == n, "pass %u %zu entries", pass, hist.size());
+
+        for (i = 0; (i < hist.size()) && (i < n); i++) {
+            CHECK(hist[i] == expected[expected.size() - n + i],
+                  "pass %u entry %u is %x expected %x", pass, i,
+                  hist[i], expected[expected.size() - n + i]);
+        }
+    }
+    CHECK(expected.size() > 2 * kTxBqlHistorySize, "only %zu changes", expected.size());
+
+    /* Passes without a change don't add entries. */
+    rtlTxBqlReset(&bql, true, kHoldTime, now);
+    fill(&bql, kTsoSize);
+
+    for (i = 0; i < 4; i++)
+        rtlTxBqlCompleted(&bql, 0, ++now);
+
+    CHECK(bql.limit == kTxBqlMinLimit, "limit %x", bql.limit);
+    CHECK(bql.historyCount == 0, "%u entries without a change", bql.historyCount);
+}
+
+/*
+ * A NIC sends rate bytes per ns and its completions are handled every
+ * interval ns. The sender refills the ring after each pass. Returns the
+ * limit after the replay, the number of passes in which the ring ran
+ * empty in its second half and the mean bytes in flight.
+ */
+static UInt32 replay(double rate, UInt64 interval, UInt32 pktLen, UInt32 *starved,
+                     UInt32 *inFlight)
+{
+    rtlTxBql bql;
+    UInt64 now = 0, sum = 0;
+    UInt32 pass, passes, capacity, done, pending;
+    double credit = 0;
+
+    passes = (UInt32)(40 * kTxBqlHoldTime / interval);
+    rtlTxBqlReset(&bql, true, kTxBqlHoldTime, now);
+    *starved = 0;
+
+    for (pass = 0; pass < passes; pass++) {
+        fill(&bql, pktLen);
+
+        pending = bql.numQueued - bql.numCompleted;
+        credit += rate * interval;
+        capacity = (UInt32)credit;
+        done = (capacity < pending) ? capacity - capacity % pktLen : pending;
+        credit -= done;
+
+        if (credit > pktLen * 2.0 && done == pending)
+            credit = 0;     /* the link idles */
+
+        if ((done == pending) && (pass >= passes / 2))
+            (*starved)++;
+
+        if (pass >= passes / 2)
+            sum += pending;
+
+        now += interval;
+        rtlTxBqlCompleted(&bql, done, now);
+    }
+    *inFlight = (UInt32)(sum / (passes - passes / 2));
+    return bql.limit;
+}
+
+static void testReplay()
+{
+    static const struct {
+        const char *name;
+        double rate;    /* bytes per ns */
+    } links[] = {
+        { "1G", 0.125 }, { "2.5G", 0.3125 }, { "5G", 0.625 },
+    };
+    static const UInt64 intervals[] = { 125000, 500000, 2000000 };
+    UInt32 i, j, limit, starved, inFlight;
+
+    for (i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        for (j = 0; j < sizeof(intervals) / sizeof(intervals[0]); j++) {
+            limit = replay(links[i].rate, intervals[j], kTsoSize, &starved, &inFlight);
+
+            printf("  %-4s %4llu us: limit %7u, %5u bytes/interval, %7u in flight, %u starved\n",
+                   links[i].name, (unsigned long long)intervals[j] / 1000, limit,
+                   (UInt32)(links[i].rate * intervals[j]), inFlight, starved);
+
+            CHECK((limit >= kTxBqlMinLimit) && (limit <= kTxBqlMaxLimit), "limit %x", limit);
+        }
+    }
+}
+
+int main()
+{
+    testReset();
+    testGrowth();
+    testShrink();
+    testHistory();
+    testReplay();
+
+    if (failures) {
+        printf("BqlTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("BqlTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,280 @@
+//
+//  BusyPollTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the enter and exit rules of the driver owned busy poll
+//  mode in SimpleRTK5BusyPoll.hpp: the rx rate is only sampled over
+//  complete windows, polling starts once it reaches busyPollRate and
+//  a round finding less than half the packets expected at that rate
+//  ends it, after which a new window starts. A simulation of
+//  busyPollCheck(), busyPollThread() and busyPollDone() over steady,
+//  bursty and decaying traffic reports entries, rounds and the share
+//  of time spent polling. Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/BusyPollTests.cpp -o /tmp/BusyPollTests && /tmp/BusyPollTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5BusyPoll.hpp"
+
+/* Interrupt interval with the default moderation timer */
+#define kIntrIntervalNs 78000ULL
+#define kNsPerSec       1000000000ULL
+#define kMaxPhases      200
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static void testMinPackets()
+{
+    CHECK(rtlBusyPollMinPackets(kBusyPollDefRate, kBusyPollDefBudget) == 2, "default %u",
+          rtlBusyPollMinPackets(kBusyPollDefRate, kBusyPollDefBudget));
+    CHECK(rtlBusyPollMinPackets(kBusyPollDefRate, 10) == 1, "less than one packet");
+    CHECK(rtlBusyPollMinPackets(kBusyPollMinRate, 1) == 1, "minimum rate");
+    CHECK(rtlBusyPollMinPackets(200000, kBusyPollMaxBudget) == 100, "%u",
+          rtlBusyPollMinPackets(200000, kBusyPollMaxBudget));
+    CHECK(rtlBusyPollMinPackets(UINT32_MAX, kBusyPollMaxBudget) == (UInt32)((UINT32_MAX * 1000ULL) / 2000000),
+          "no overflow");
+}
+
+/*
+ * A window is only evaluated once it's complete. Polling starts at
+ * exactly busyPollRate.
+ */
+static void testSample()
+{
+    rtlBusyPoll bp;
+    UInt64 now = 5000000;
+
+    memset(&bp, 0, sizeof(bp));
+    rtlBusyPollRestart(&bp, 1000, now);
+
+    /* A short window isn't evaluated, however many packets arrived. */
+    CHECK(!rtlBusyPollSample(&bp, 1000000, now + kBusyPollWindow - 1, kBusyPollWindow - 1, kBusyPollDefRate),
+          "short window");
+    CHECK(bp.windowStart == now && bp.lastRxPackets == 1000 && !bp.rxRate, "short window changed the state");
+
+    /* Exactly the rate in one window */
+    now += kBusyPollWindow;
+    CHECK(rtlBusyPollSample(&bp, 1100, now, kBusyPollWindow, kBusyPollDefRate), "rate %llu",
+          (unsigned long long)bp.rxRate);
+    CHECK(bp.rxRate == kBusyPollDefRate, "rate %llu", (unsigned long long)bp.rxRate);
+    CHECK(bp.windowStart == now && bp.lastRxPackets == 1100, "window not restarted");
+
+    /* One packet less */
+    now += kBusyPollWindow;
+    CHECK(!rtlBusyPollSample(&bp, 1199, now, kBusyPollWindow, kBusyPollDefRate), "rate %llu",
+          (unsigned long long)bp.rxRate);
+    CHECK(bp.rxRate == kBusyPollDefRate - 1000, "rate %llu", (unsigned long long)bp.rxRate);
+
+    /* A long window averages over its length. */
+    now += 4 * kBusyPollWindow;
+    CHECK(!rtlBusyPollSample(&bp, 1199 + 300, now, 4 * kBusyPollWindow, kBusyPollDefRate), "rate %llu",
+          (unsigned long long)bp.rxRate);
+    CHECK(bp.rxRate == 75000, "rate %llu", (unsigned long long)bp.rxRate);
+}
+
+/* Polling goes on with at least minPackets per round. */
+static void testContinue()
+{
+    rtlBusyPoll bp;
+
+    memset(&bp, 0, sizeof(bp));
+    bp.minPackets = rtlBusyPollMinPackets(kBusyPollDefRate, kBusyPollDefBudget);
+
+    CHECK(!rtlBusyPollContinue(&bp, 0), "empty round");
+    CHECK(!rtlBusyPollContinue(&bp, bp.minPackets - 1), "round below minPackets");
+    CHECK(rtlBusyPollContinue(&bp, bp.minPackets), "round with minPackets");
+}
+
+/*
+ * The packets polled by the thread don't count for the next window,
+ * otherwise a long busy poll phase would start the next one at once.
+ */
+static void testRestart()
+{
+    rtlBusyPoll bp;
+    UInt64 now = 0;
+
+    memset(&bp, 0, sizeof(bp));
+    rtlBusyPollRestart(&bp, 0, now);
+
+    /* 100 ms of polling at 500k packets/s, then 20k packets/s */
+    now += 100 * kBusyPollWindow;
+    rtlBusyPollRestart(&bp, 50000, now);
+
+    now += kBusyPollWindow;
+    CHECK(!rtlBusyPollSample(&bp, 50020, now, kBusyPollWindow, kBusyPollDefRate), "rate %llu",
+          (unsigned long long)bp.rxRate);
+    CHECK(bp.rxRate == 20000, "rate %llu", (unsigned long long)bp.rxRate);
+}
+
+typedef struct Phase {
+    UInt32 ms;
+    UInt32 pktRate;
+} Phase;
+
+typedef struct SimStats {
+    UInt64 entries;
+    UInt64 exits;
+    UInt64 rounds;
+    UInt64 emptyRounds;
+    UInt64 interrupts;
+    UInt64 pollNs;
+    UInt64 ns;
+    UInt64 phaseExits[kMaxPhases];
+    UInt64 phaseEntries[kMaxPhases];
+} SimStats;
+
+/*
+ * Same as busyPollCheck() called from the interrupt handler, the
+ * rounds of busyPollThread() and busyPollDone(), with an interrupt
+ * after each kIntrIntervalNs with packets or on each packet at lower
+ * rates and the thread scheduled without delay.
+ */
+static void simulate(const Phase *phases, UInt32 numPhases, UInt32 rate, UInt32 budget,
+                     SimStats *stats)
+{
+    rtlBusyPoll bp;
+    UInt64 now = 0, end, dt, rxPackets = 0, arrived;
+    UInt64 budgetNs = budget * 1000ULL;
+    UInt32 i, packets;
+    double credit = 0;
+    bool polling = false;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&bp, 0, sizeof(bp));
+    bp.minPackets = rtlBusyPollMinPackets(rate, budget);
+    rtlBusyPollRestart(&bp, 0, now);
+
+    for (i = 0; i < numPhases; i++) {
+        end = now + phases[i].ms * 1000000ULL;
+
+        while (now < end) {
+            if (polling) {
+                dt = budgetNs;
+            } else if (phases[i].pktRate) {
+                dt = kNsPerSec / phases[i].pktRate;
+                dt = (dt < kIntrIntervalNs) ? kIntrIntervalNs : dt;
+            } else {
+                dt = end - now;
+            }
+            dt = (now + dt > end) ? end - now : dt;
+
+            credit += ((double)phases[i].pktRate * dt) / kNsPerSec;
+            arrived = (UInt64)credit;
+            credit -= arrived;
+            now += dt;
+
+            if (polling) {
+                packets = (UInt32)arrived;
+                rxPackets += packets;
+                stats->pollNs += dt;
+                stats->rounds++;
+
+                if (!packets)
+                    stats->emptyRounds++;
+
+                if (!rtlBusyPollContinue(&bp, packets)) {
+                    rtlBusyPollRestart(&bp, rxPackets, now);
+                    polling = false;
+                    stats->exits++;
+                    stats->phaseExits[i]++;
+                }
+            } else if (arrived) {
+                rxPackets += arrived;
+                stats->interrupts++;
+
+                if (rtlBusyPollSample(&bp, rxPackets, now, now - bp.windowStart, rate)) {
+                    polling = true;
+                    stats->entries++;
+                    stats->phaseEntries[i]++;
+                }
+            }
+        }
+    }
+    stats->ns = now;
+}
+
+static void report(const char *name, const Phase *phases, UInt32 numPhases, SimStats *stats)
+{
+    simulate(phases, numPhases, kBusyPollDefRate, kBusyPollDefBudget, stats);
+
+    printf("  %-10s %4llu entries, %6llu rounds, %5llu empty, %3llu%% polling, %6llu interrupts/s\n",
+           name, (unsigned long long)stats->entries, (unsigned long long)stats->rounds,
+           (unsigned long long)stats->emptyRounds,
+           (unsigned long long)((stats->pollNs * 100) / stats->ns),
+           (unsigned long long)((stats->interrupts * kNsPerSec) / stats->ns));
+}
+
+static void testSimulation()
+{
+    static const Phase high[] = { { 2000, 300000 } };
+    static const Phase low[] = { { 2000, 90000 } };
+    static const Phase decay[] = {
+        { 500, 300000 }, { 1000, 60000 }, { 1000, 30000 }, { 500, 0 }, { 500, 150000 },
+    };
+    static Phase bursty[kMaxPhases];
+    SimStats stats;
+    UInt32 i;
+
+    report("high", high, 1, &stats);
+    CHECK(stats.entries == 1 && stats.exits == 0, "high: %llu entries %llu exits",
+          (unsigned long long)stats.entries, (unsigned long long)stats.exits);
+    CHECK(stats.pollNs > (stats.ns * 99) / 100, "high: %llu ns polling", (unsigned long long)stats.pollNs);
+
+    /* Below busyPollRate the rings stay with the interrupt handler. */
+    report("low", low, 1, &stats);
+    CHECK(stats.entries == 0, "low: %llu entries", (unsigned long long)stats.entries);
+
+    /*
+     * Once polling, it goes on down to half busyPollRate. Below it,
+     * polling ends and isn't started again until the rate reaches
+     * busyPollRate.
+     */
+    report("decay", decay, 5, &stats);
+    CHECK(stats.phaseEntries[0] == 1, "decay: %llu entries at 300k",
+          (unsigned long long)stats.phaseEntries[0]);
+    CHECK(stats.phaseExits[1] == 0, "decay: %llu exits at 60k", (unsigned long long)stats.phaseExits[1]);
+    CHECK(stats.phaseExits[2] == 1, "decay: %llu exits at 30k", (unsigned long long)stats.phaseExits[2]);
+    CHECK(stats.phaseEntries[2] == 0 && stats.phaseEntries[3] == 0, "decay: entries below the rate");
+    CHECK(stats.phaseEntries[4] == 1, "decay: %llu entries at 150k", (unsigned long long)stats.phaseEntries[4]);
+
+    /* 5 ms bursts at 400k packets/s every 20 ms */
+    for (i = 0; i < kMaxPhases; i += 2) {
+        bursty[i] = (Phase){ 5, 400000 };
+        bursty[i + 1] = (Phase){ 15, 5000 };
+    }
+    report("bursty", bursty, kMaxPhases, &stats);
+    CHECK(stats.entries <= 100, "bursty: %llu entries", (unsigned long long)stats.entries);
+    CHECK(stats.entries == stats.exits, "bursty: %llu entries %llu exits",
+          (unsigned long long)stats.entries, (unsigned long long)stats.exits);
+}
+
+int main()
+{
+    testMinPackets();
+    testSample();
+    testContinue();
+    testRestart();
+    testSimulation();
+
+    if (failures) {
+        printf("BusyPollTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("BusyPollTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,262 @@
+//
+//  CopyBreakTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Replay of packet size traces through the adaptive copybreak. The
+//  cost of a copy and of a replacement come from a simple model of
+//  the rx path with and without AppleVTD. For each trace the replay
+//  reports the copybreak it settles on and the cost per packet
+//  compared to the fixed copybreak and to the best one in hindsight.
+//  Build and run on the host with:
+//
+//  c++ -std=c++17 -ITests/include -ISimpleRTK5 Tests/CopyBreakTests.cpp -o /tmp/CopyBreakTests && /tmp/CopyBreakTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5CopyBreak.hpp"
+
+/* mbuf_get_mhlen() on current releases of macOS */
+#define kMaxCopySize 224
+
+#define kDrainSize 64
+#define kTraceDrains 20000
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/*
+ * Cost model in ns: a copy costs the allocation of a small mbuf plus
+ * the copy itself. A replacement costs the allocation of a cluster
+ * and, with AppleVTD, the mapping of the new buffer.
+ */
+typedef struct CostModel {
+    const char *name;
+    UInt32 copyBase;
+    UInt32 copyPerKB;
+    UInt32 replace;
+    UInt32 map;
+} CostModel;
+
+static const CostModel models[] = {
+    { "no VTD", 60, 200, 240, 0 },
+    { "VTD", 60, 200, 240, 260 },
+};
+
+static UInt32 copyCost(const CostModel *model, UInt32 len)
+{
+    return model->copyBase + (model->copyPerKB * len) / 1024;
+}
+
+typedef UInt32 (*TraceFunc)(UInt32 n);
+
+/* Bulk TCP receive: full sized segments and a few pure ACKs. */
+static UInt32 traceBulk(UInt32 n)
+{
+    return ((rand() % 8) == 0) ? 66 : 1514;
+}
+
+/* Simple IMIX, 7:4:1 of 64, 594 and 1518 byte frames */
+static UInt32 traceImix(UInt32 n)
+{
+    UInt32 r = rand() % 12;
+
+    return (r < 7) ? 64 : ((r < 11) ? 594 : 1518);
+}
+
+/* Request/response traffic of mostly small packets */
+static UInt32 traceSmall(UInt32 n)
+{
+    return 60 + (rand() % 700);
+}
+
+/* The mix changes from small packets to bulk halfway through. */
+static UInt32 traceShift(UInt32 n)
+{
+    return (n < kTraceDrains * kDrainSize / 2) ? traceSmall(n) : traceBulk(n);
+}
+
+typedef struct Trace {
+    const char *name;
+    TraceFunc func;
+} Trace;
+
+static const Trace traces[] = {
+    { "bulk", traceBulk },
+    { "imix", traceImix },
+    { "small", traceSmall },
+    { "shift", traceShift },
+};
+
+/* Cost of a packet with a fixed copybreak */
+static UInt32 packetCost(const CostModel *model, UInt32 limit, UInt32 len)
+{
+    UInt32 bucket = len >> kCopyBreakBucketShift;
+
+    if ((len > limit) || (bucket >= kCopyBreakBuckets - 1))
+        return model->replace + model->map;
+
+    return copyCost(model, len);
+}
+
+/*
+ * Replay a trace through the copybreak the same way the rx path
+ * does. Returns the mean cost per packet of the second half of the
+ * trace, after the copybreak has settled.
+ */
+static double replay(const Trace *trace, const CostModel *model,
+                     RxCopyBreak *cb, double *fixedCost, double *bestCost)
+{
+    UInt64 costs[kCopyBreakBuckets] = { 0 };
+    UInt64 cost = 0, fixed = 0;
+    UInt64 mapCost;
+    UInt32 drain, i, k, len, bucket, c;
+    UInt32 half = kTraceDrains / 2;
+    UInt32 count = 0;
+    bool timed;
+
+    rxCopyBreakInit(cb, kMaxCopySize);
+    srand(1);
+
+    for (drain = 0; drain < kTraceDrains; drain++) {
+        mapCost = 0;
+
+        for (i = 0; i < kDrainSize; i++) {
+            len = trace->func(drain * kDrainSize + i);
+            bucket = rxCopyBreakCount(cb, len, &timed);
+
+            if (rxCopyBreakReplace(cb, len, bucket)) {
+                cb->drainReplaced++;
+                mapCost += model->map;
+                c = model->replace + model->map;
+
+                if (timed)
+                    cb->replaceCost = rxCopyBreakAvg(cb->replaceCost, model->replace);
+            } else {
+                c = copyCost(model, len);
+
+                if (timed)
+                    cb->copyCost[bucket] = rxCopyBreakAvg(cb->copyCost[bucket], c);
+            }
+            if (drain >= half) {
+                cost += c;
+                fixed += packetCost(model, kMaxCopySize, len);
+
+                for (k = 0; k < kCopyBreakBuckets; k++)
+                    costs[k] += packetCost(model, (k << kCopyBreakBucketShift) - 1, len);
+
+                count++;
+            }
+        }
+        rxCopyBreakUpdate(cb, mapCost);
+
+        CHECK(cb->limit >= kMaxCopySize, "limit %u", cb->limit);
+        CHECK(cb->limit < (kCopyBreakBuckets << kCopyBreakBucketShift), "limit %u", cb->limit);
+        CHECK(cb->index < kCopyBreakBuckets, "index %u", cb->index);
+    }
+    *bestCost = (double)fixed;
+
+    for (k = (kMaxCopySize + 1) >> kCopyBreakBucketShift; k < kCopyBreakBuckets; k++) {
+        if (costs[k] < *bestCost)
+            *bestCost = (double)costs[k];
+    }
+    *fixedCost = (double)fixed / count;
+    *bestCost /= count;
+
+    return (double)cost / count;
+}
+
+static void testInit()
+{
+    RxCopyBreak cb;
+
+    rxCopyBreakInit(&cb, kMaxCopySize);
+    CHECK(cb.limit == kMaxCopySize, "limit %u", cb.limit);
+    CHECK(cb.index == 1, "index %u", cb.index);
+
+    /* No cost estimates yet, the copybreak stays where it is. */
+    rxCopyBreakUpdate(&cb, 0);
+    CHECK(cb.limit == kMaxCopySize, "limit %u", cb.limit);
+    CHECK(cb.index == 1, "index %u", cb.index);
+
+    CHECK(rxCopyBreakAvg(0, 100) == (100 << kCopyBreakAvgShift), "first sample");
+    CHECK(rxCopyBreakAvg(800, 100) == 800, "steady");
+}
+
+/*
+ * With a maxCopySize below the first bucket boundary and copies
+ * which are more expensive than replacements, the best index is 0.
+ * The copybreak must not wrap around, which would copy everything.
+ */
+static void testUnderflow()
+{
+    RxCopyBreak cb;
+    bool timed;
+    UInt32 i, bucket;
+
+    rxCopyBreakInit(&cb, 100);
+    CHECK(cb.index == 0, "index %u", cb.index);
+
+    cb.replaceCost = rxCopyBreakAvg(0, 10);
+    cb.copyCost[0] = rxCopyBreakAvg(0, 1000);
+
+    for (i = 0; i < 64; i++) {
+        bucket = rxCopyBreakCount(&cb, 64, &timed);
+        CHECK(bucket == 0, "bucket %u", bucket);
+    }
+    rxCopyBreakUpdate(&cb, 0);
+
+    CHECK(cb.index == 0, "index %u", cb.index);
+    CHECK(cb.limit == 100, "limit %u", cb.limit);
+    CHECK(!rxCopyBreakReplace(&cb, 100, 0), "copy at maxCopySize");
+    CHECK(rxCopyBreakReplace(&cb, 101, 0), "replace above maxCopySize");
+    CHECK(rxCopyBreakReplace(&cb, 4000, kCopyBreakBuckets - 1), "last bucket");
+}
+
+/* The adaptive copybreak gets within a few percent of the best one. */
+static void testReplay()
+{
+    RxCopyBreak cb;
+    double cost, fixed, best;
+    UInt32 t, m;
+
+    for (m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+        for (t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+            cost = replay(&traces[t], &models[m], &cb, &fixed, &best);
+
+            printf("CopyBreakTests: %-6s %-5s copybreak %4u: %6.1f ns/pkt, "
+                   "fixed %6.1f ns/pkt, best %6.1f ns/pkt\n", models[m].name,
+                   traces[t].name, cb.limit, cost, fixed, best);
+
+            CHECK(cost <= best * 1.05, "%s %s cost %.1f best %.1f",
+                  models[m].name, traces[t].name, cost, best);
+            CHECK(cost <= fixed * 1.01, "%s %s cost %.1f fixed %.1f",
+                  models[m].name, traces[t].name, cost, fixed);
+        }
+    }
+}
+
+int main()
+{
+    testInit();
+    testUnderflow();
+    testReplay();
+
+    if (failures) {
+        printf("CopyBreakTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("CopyBreakTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,419 @@
+//
+//  DimTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the dynamic interrupt moderation in SimpleRTK5Dim.hpp:
+//  the EWMA of the rates, the move by one profile at a time, the
+//  hysteresis of kDimHoldWindows windows, the step down only below
+//  3/4 of the lower profile's bound, the bulk profile for large
+//  packets and its limit with jumbo frames. A replay of steady, bursty
+//  and mixed traffic reports the profile switches and the interrupts
+//  per second. The interrupt timer is assumed to count at 125 MHz.
+//  Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/DimTests.cpp -o /tmp/DimTests && /tmp/DimTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5Dim.hpp"
+
+#define kTimerTickNs    8
+#define kNsPerSec       1000000000ULL
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* A window of kDimWindow with pktRate packets/s of pktSize bytes */
+static void window(rtlDimState *dim, UInt64 pktRate, UInt64 pktSize, bool jumbo)
+{
+    dim->packets = (pktRate * kDimWindow) / kNsPerSec;
+    dim->bytes = dim->packets * pktSize;
+
+    rtlDimEndWindow(dim, kDimWindow, jumbo);
+}
+
+/* Start in profile with the rates settled at pktRate packets/s of pktSize bytes. */
+static void settle(rtlDimState *dim, UInt32 profile, UInt64 pktRate, UInt64 pktSize)
+{
+    memset(dim, 0, sizeof(rtlDimState));
+    rtlDimReset(dim);
+
+    dim->profile = profile;
+    dim->pktRate = pktRate;
+    dim->byteRate = pktRate * pktSize;
+}
+
+/* Jump to a settled rate without moving the profile. */
+static void setRate(rtlDimState *dim, UInt64 pktRate, UInt64 pktSize)
+{
+    dim->pktRate = pktRate;
+    dim->byteRate = pktRate * pktSize;
+}
+
+static void testReset()
+{
+    rtlDimState dim;
+
+    memset(&dim, 0xff, sizeof(dim));
+    dim.switches = 7;
+    rtlDimReset(&dim);
+
+    CHECK(dim.profile == kDimDefProfile, "profile %u", dim.profile);
+    CHECK(dim.switches == 7, "switches %llu", (unsigned long long)dim.switches);
+    CHECK(!dim.pktRate && !dim.byteRate && !dim.packets && !dim.bytes, "rates not cleared");
+    CHECK(!dim.holdCount && !dim.holdDir, "hold not cleared");
+}
+
+/*
+ * The rates move by 1/2^kDimEwmaShift of the difference per window,
+ * up as well as down, and the window's counters are cleared.
+ */
+static void testEwma()
+{
+    rtlDimState dim;
+    UInt64 expected = 0;
+    UInt32 i;
+
+    settle(&dim, kDimDefProfile, 0, 0);
+
+    for (i = 0; i < 40; i++) {
+        window(&dim, 100000, 1000, false);
+        expected += (100000 - expected) >> kDimEwmaShift;
+
+        CHECK(dim.pktRate == expected, "window %u rate %llu expected %llu", i,
+              (unsigned long long)dim.pktRate, (unsigned long long)expected);
+        CHECK(!dim.packets && !dim.bytes, "window %u counters not cleared", i);
+    }
+    CHECK(dim.pktRate > 99990, "rate %llu", (unsigned long long)dim.pktRate);
+    CHECK(dim.byteRate / dim.pktRate == 1000, "size %llu",
+          (unsigned long long)(dim.byteRate / dim.pktRate));
+
+    window(&dim, 20000, 1000, false);
+    CHECK(dim.pktRate == expected + ((SInt64)(20000 - expected) >> kDimEwmaShift),
+          "rate %llu after a drop", (unsigned long long)dim.pktRate);
+
+    /* A longer window gives the same rate. */
+    settle(&dim, kDimDefProfile, 0, 0);
+    dim.packets = 300;
+    dim.bytes = 300000;
+    rtlDimEndWindow(&dim, 3 * kDimWindow, false);
+    CHECK(dim.pktRate == (100000 >> kDimEwmaShift), "rate %llu", (unsigned long long)dim.pktRate);
+}
+
+/*
+ * The profile moves one step after kDimHoldWindows windows pointing
+ * to the same direction, however far away the target is.
+ */
+static void testOneStep()
+{
+    rtlDimState dim;
+    UInt32 i;
+
+    settle(&dim, 0, 500000, 500);
+
+    for (i = 1; i <= 3 * kDimHoldWindows; i++) {
+        window(&dim, 500000, 500, false);
+
+        CHECK(dim.profile == i / kDimHoldWindows, "window %u profile %u", i, dim.profile);
+        CHECK(dim.switches == i / kDimHoldWindows, "window %u %llu switches", i,
+              (unsigned long long)dim.switches);
+    }
+    window(&dim, 500000, 500, false);
+    window(&dim, 500000, 500, false);
+    CHECK(dim.profile == kDimNumProfiles - 1, "profile %u", dim.profile);
+    CHECK(dim.switches == kDimNumProfiles - 1, "%llu switches", (unsigned long long)dim.switches);
+
+    /* And back down, one step at a time. */
+    settle(&dim, kDimNumProfiles - 1, 1000, 100);
+
+    for (i = 1; i <= 3 * kDimHoldWindows; i++) {
+        window(&dim, 1000, 100, false);
+        CHECK(dim.profile == kDimNumProfiles - 1 - i / kDimHoldWindows, "window %u profile %u", i, dim.profile);
+    }
+}
+
+/*
+ * A single window pointing away from the profile, or windows pointing
+ * to alternating directions, don't move it.
+ */
+static void testHysteresis()
+{
+    rtlDimState dim;
+    UInt32 i;
+
+    settle(&dim, 1, 50000, 500);
+    window(&dim, 50000, 500, false);
+    CHECK(dim.profile == 1 && !dim.holdCount, "profile %u hold %u", dim.profile, dim.holdCount);
+
+    /* Up for one window, then back in range */
+    setRate(&dim, 150000, 500);
+    window(&dim, 150000, 500, false);
+    CHECK(dim.profile == 1 && dim.holdCount == 1 && dim.holdDir == 1,
+          "profile %u hold %u dir %d", dim.profile, dim.holdCount, dim.holdDir);
+
+    setRate(&dim, 50000, 500);
+    window(&dim, 50000, 500, false);
+    CHECK(dim.profile == 1 && !dim.holdCount && !dim.holdDir,
+          "profile %u hold %u dir %d", dim.profile, dim.holdCount, dim.holdDir);
+
+    /* Alternating directions */
+    for (i = 0; i < 20; i++) {
+        setRate(&dim, (i & 1) ? 10000 : 150000, 500);
+        window(&dim, dim.pktRate, 500, false);
+        CHECK(dim.profile == 1, "window %u profile %u", i, dim.profile);
+    }
+    CHECK(dim.switches == 0, "%llu switches", (unsigned long long)dim.switches);
+
+    /* Up for two windows in a row */
+    setRate(&dim, 150000, 500);
+    window(&dim, 150000, 500, false);
+    window(&dim, 150000, 500, false);
+    CHECK(dim.profile == 2, "profile %u", dim.profile);
+}
+
+/*
+ * Moving up happens right above a profile's bound, moving down only
+ * below 3/4 of the lower profile's bound.
+ */
+static void testStepDown()
+{
+    rtlDimState dim;
+    UInt64 bound = dimProfiles[1].maxPktRate;
+    UInt32 i;
+
+    settle(&dim, 1, bound + 400, 500);
+
+    for (i = 0; i < kDimHoldWindows; i++)
+        window(&dim, bound + 400, 500, false);
+
+    CHECK(dim.profile == 2, "profile %u above the bound", dim.profile);
+
+    settle(&dim, 2, bound - 400, 500);
+
+    for (i = 0; i < 10; i++)
+        window(&dim, bound - 400, 500, false);
+
+    CHECK(dim.profile == 2, "profile %u right below the bound", dim.profile);
+
+    settle(&dim, 2, (bound / 4) * 3 + 400, 500);
+
+    for (i = 0; i < 10; i++)
+        window(&dim, (bound / 4) * 3 + 400, 500, false);
+
+    CHECK(dim.profile == 2, "profile %u above 3/4 of the bound", dim.profile);
+
+    settle(&dim, 2, (bound / 4) * 3 - 400, 500);
+
+    for (i = 0; i < kDimHoldWindows; i++)
+        window(&dim, (bound / 4) * 3 - 400, 500, false);
+
+    CHECK(dim.profile == 1, "profile %u below 3/4 of the bound", dim.profile);
+}
+
+/*
+ * Large packets select the bulk profile at any packet rate, except
+ * with jumbo frames.
+ */
+static void testBulk()
+{
+    rtlDimState dim;
+    UInt32 i;
+
+    settle(&dim, 0, 5000, 30000);
+
+    for (i = 0; i < 10; i++)
+        window(&dim, 5000, 30000, false);
+
+    CHECK(dim.profile == kDimNumProfiles - 1, "profile %u", dim.profile);
+
+    settle(&dim, 0, 5000, kDimBulkPktSize);
+
+    for (i = 0; i < 10; i++)
+        window(&dim, 5000, kDimBulkPktSize, false);
+
+    CHECK(dim.profile == 0, "profile %u at kDimBulkPktSize", dim.profile);
+
+    settle(&dim, 0, 500000, 9000);
+
+    for (i = 0; i < 10; i++)
+        window(&dim, 500000, 9000, true);
+
+    CHECK(dim.profile == kDimJumboProfile, "profile %u with jumbo frames", dim.profile);
+
+    settle(&dim, kDimNumProfiles - 1, 500000, 9000);
+    window(&dim, 500000, 9000, true);
+    window(&dim, 500000, 9000, true);
+    CHECK(dim.profile == kDimJumboProfile, "profile %u after the mtu change", dim.profile);
+}
+
+typedef struct Phase {
+    UInt32 ms;
+    UInt32 pktRate;     /* packets per second, 0 is idle */
+    UInt32 pktSize;
+} Phase;
+
+typedef struct ReplayStats {
+    UInt64 switches;
+    UInt64 interrupts;
+    UInt64 ns;
+    UInt64 profileNs[kDimNumProfiles];
+} ReplayStats;
+
+/*
+ * Same as SimpleRTK5::updateTimerValue() at 1 Gbit/s or more, called
+ * from interrupts of a link which carries the trace. With the timer
+ * armed, packets interrupt when it expires. An expiry without packets
+ * disarms it and the next packet interrupts right away.
+ */
+static void replay(const Phase *phases, UInt32 numPhases, bool jumbo, ReplayStats *stats)
+{
+    rtlDimState dim;
+    UInt64 now = 0, end, dt, gap, period, pkts;
+    UInt32 timer = 0;
+    UInt32 i;
+    double credit = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&dim, 0, sizeof(dim));
+    rtlDimReset(&dim);
+    dim.windowStart = now;
+
+    for (i = 0; i < numPhases; i++) {
+        end = now + phases[i].ms * 1000000ULL;
+
+        while (now < end) {
+            period = (UInt64)timer * kTimerTickNs;
+
+            if (!phases[i].pktRate) {
+                if (timer)
+                    stats->interrupts++;
+
+                timer = 0;
+                now = end;
+                break;
+            }
+            gap = kNsPerSec / phases[i].pktRate;
+
+            if (timer && (gap > period)) {
+                dt = (now + period > end) ? end - now : period;
+                stats->interrupts++;
+                stats->profileNs[dim.profile] += dt;
+                now += dt;
+                timer = 0;
+                continue;
+            }
+            dt = timer ? period : gap;
+            dt = (now + dt > end) ? end - now : dt;
+
+            credit += ((double)phases[i].pktRate * dt) / kNsPerSec;
+            pkts = (UInt64)credit;
+            credit -= pkts;
+
+            stats->profileNs[dim.profile] += dt;
+            now += dt;
+
+            if (!pkts)
+                continue;
+
+            stats->interrupts++;
+            dim.packets += pkts;
+            dim.bytes += pkts * phases[i].pktSize;
+
+            if (now - dim.windowStart >= kDimWindow) {
+                rtlDimEndWindow(&dim, now - dim.windowStart, jumbo);
+                dim.windowStart = now;
+            }
+            timer = dimProfiles[dim.profile].timer;
+        }
+    }
+    stats->switches = dim.switches;
+    stats->ns = now;
+}
+
+static void report(const char *name, const Phase *phases, UInt32 numPhases, bool jumbo,
+                   UInt64 maxSwitches)
+{
+    ReplayStats stats;
+    UInt64 intrRate;
+    UInt32 i;
+
+    replay(phases, numPhases, jumbo, &stats);
+    intrRate = (stats.interrupts * kNsPerSec) / stats.ns;
+
+    printf("  %-8s %5llu switches, %6llu interrupts/s, time per profile",
+           name, (unsigned long long)stats.switches, (unsigned long long)intrRate);
+
+    for (i = 0; i < kDimNumProfiles; i++)
+        printf(" %3llu%%", (unsigned long long)((stats.profileNs[i] * 100) / stats.ns));
+
+    printf("\n");
+
+    /* At most one switch per kDimHoldWindows windows */
+    CHECK(stats.switches <= stats.ns / (kDimWindow * kDimHoldWindows),
+          "%s: %llu switches", name, (unsigned long long)stats.switches);
+    CHECK(stats.switches <= maxSwitches, "%s: %llu switches", name, (unsigned long long)stats.switches);
+    CHECK(intrRate <= kNsPerSec / ((UInt64)kTimerLat1 * kTimerTickNs) + 1,
+          "%s: %llu interrupts/s", name, (unsigned long long)intrRate);
+}
+
+static void testReplay()
+{
+    static Phase steady[500], bursty[200];
+    static const Phase mixed[] = {
+        { 1000, 20000, 120 },       /* request/response */
+        { 1000, 40000, 16000 },     /* TSO and LRO */
+        { 1000, 150000, 1500 },
+        { 500, 0, 0 },
+        { 1000, 60000, 900 },
+        { 500, 250000, 64 },
+        { 1000, 5000, 200 },
+    };
+    UInt32 i;
+
+    /* Around the bound of the second profile, changing every 10 ms */
+    for (i = 0; i < 500; i++) {
+        steady[i].ms = 10;
+        steady[i].pktRate = (i & 1) ? 85000 : 75000;
+        steady[i].pktSize = 800;
+    }
+    /* 10 ms bursts every 50 ms */
+    for (i = 0; i < 200; i += 2) {
+        bursty[i] = (Phase){ 10, 300000, 600 };
+        bursty[i + 1] = (Phase){ 40, 5000, 300 };
+    }
+    /* The rate never falls below 3/4 of the bound, i.e. no flapping. */
+    report("steady", steady, 500, false, 2);
+    report("bursty", bursty, 200, false, UINT64_MAX);
+    report("mixed", mixed, sizeof(mixed) / sizeof(mixed[0]), false, UINT64_MAX);
+    report("jumbo", mixed, sizeof(mixed) / sizeof(mixed[0]), true, UINT64_MAX);
+}
+
+int main()
+{
+    testReset();
+    testEwma();
+    testOneStep();
+    testHysteresis();
+    testStepDown();
+    testBulk();
+    testReplay();
+
+    if (failures) {
+        printf("DimTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("DimTests: passed.\n");
+    return 0;
+}
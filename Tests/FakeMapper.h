@@ -0,0 +1,85 @@
+//
+//  FakeMapper.h
+//  SimpleRTK5 host tests
+//
+//  A fake IOMapper for the tests of the AppleVTD paths. It keeps an
+//  I/O page table under a lock, like AppleVTD does, and counts the
+//  calls to map and unmap pages. An unmap also counts the IOTLB
+//  invalidation it requires. The time it takes on the host is no
+//  measure of the real mapper, only the counts are.
+//
+
+#ifndef SimpleRTK5Tests_FakeMapper_h
+#define SimpleRTK5Tests_FakeMapper_h
+
+#include <mutex>
+#include <unordered_map>
+
+#define kFakePageShift  12
+#define kFakePageSize   (1 << kFakePageShift)
+#define kFakePageMask   (kFakePageSize - 1)
+
+typedef struct FakeMapper {
+    std::mutex lock;
+    std::unordered_map<UInt64, UInt64> table;   /* iova page -> page */
+    UInt64 nextIova;
+    UInt64 maps;
+    UInt64 unmaps;
+    UInt64 invalidations;
+} FakeMapper;
+
+static inline void fakeMapperReset(FakeMapper *mapper)
+{
+    std::lock_guard<std::mutex> guard(mapper->lock);
+
+    mapper->table.clear();
+    mapper->nextIova = 0x100000000ULL;
+    mapper->maps = 0;
+    mapper->unmaps = 0;
+    mapper->invalidations = 0;
+}
+
+/* Map a page and return its I/O virtual address. */
+static inline UInt64 fakeMapperMap(FakeMapper *mapper, UInt64 page)
+{
+    std::lock_guard<std::mutex> guard(mapper->lock);
+    UInt64 iova = mapper->nextIova;
+
+    mapper->nextIova += kFakePageSize;
+    mapper->table[iova] = page;
+    mapper->maps++;
+
+    return iova;
+}
+
+/* Unmap a page, returns false if it wasn't mapped. */
+static inline bool fakeMapperUnmap(FakeMapper *mapper, UInt64 iova)
+{
+    std::lock_guard<std::mutex> guard(mapper->lock);
+
+    if (!mapper->table.erase(iova & ~(UInt64)kFakePageMask))
+        return false;
+
+    mapper->unmaps++;
+    mapper->invalidations++;
+
+    return true;
+}
+
+/* The page an I/O virtual address is mapped to or 0 if unmapped. */
+static inline UInt64 fakeMapperLookup(FakeMapper *mapper, UInt64 iova)
+{
+    std::lock_guard<std::mutex> guard(mapper->lock);
+    auto it = mapper->table.find(iova & ~(UInt64)kFakePageMask);
+
+    return (it != mapper->table.end()) ? it->second : 0;
+}
+
+static inline UInt64 fakeMapperMapped(FakeMapper *mapper)
+{
+    std::lock_guard<std::mutex> guard(mapper->lock);
+
+    return mapper->table.size();
+}
+
+#endif /* SimpleRTK5Tests_FakeMapper_h */
@@ -0,0 +1,513 @@
+//
+//  IovaTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the tx IOVA cache in SimpleRTK5Iova.hpp and a simulation
+//  of the map and unmap calls per gigabyte sent. The lookup, insert,
+//  put and sweep of SimpleRTK5VTD.cpp are mirrored on top of the fake
+//  IOMapper. A stress test runs them concurrently like outputStart(),
+//  txInterrupt() and timerAction() and checks that a page is never
+//  used after it has been unmapped. The simulation sends packets from
+//  a LIFO pool of clusters, like the stack's mbuf cache, and compares
+//  mapping each packet, the cache with its pages unmapped on the last
+//  reference and the cache with its pages kept until they are swept.
+//  Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -pthread -ITests/include -ISimpleRTK5 Tests/IovaTests.cpp -o /tmp/IovaTests && /tmp/IovaTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <IOKit/IOLib.h>
+#include "FakeMapper.h"
+#include "SimpleRTK5Iova.hpp"
+
+#define kNumTxDesc      1024
+#define kTxDescMask     (kNumTxDesc - 1)
+#define kMaxSegs        32
+#define kCompleteBatch  64
+#define kSweepPackets   65536   /* about kTxIovaSweepTime at 10 Gbit/s */
+#define kSimBytes       (4ULL << 30)
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* The fake mapper has no memory descriptors, the iova stands for md. */
+#define fakeMd(iova)    ((IOMemoryDescriptor *)(uintptr_t)(iova))
+
+typedef struct SimCache {
+    rtlIovaEntry entries[kTxIovaCacheSize];
+    bool releaseOnPut;
+    UInt64 hits;
+    UInt64 misses;
+    UInt64 evictions;
+    volatile SInt64 releases;
+} SimCache;
+
+static FakeMapper mapper;
+static std::atomic<UInt64> badUnmaps;
+
+/* Same as SimpleRTK5::txIovaRelease() */
+static void simRelease(rtlIovaEntry *entry)
+{
+    if (!fakeMapperUnmap(&mapper, entry->iova))
+        badUnmaps++;
+
+    rtlIovaFree(entry);
+}
+
+/* Same as SimpleRTK5::txIovaInsert() */
+static rtlIovaEntry *simInsert(SimCache *cache, IOVirtualAddress page, addr64_t phyPage)
+{
+    rtlIovaEntry *entry;
+    UInt64 iova;
+    bool evict;
+
+    entry = rtlIovaVictim(rtlIovaSet(cache->entries, page >> kFakePageShift), &evict);
+
+    if (!entry)
+        return NULL;
+
+    if (evict) {
+        simRelease(entry);
+        cache->evictions++;
+    }
+    iova = fakeMapperMap(&mapper, phyPage);
+    rtlIovaPublish(entry, page, phyPage, iova, fakeMd(iova));
+
+    return entry;
+}
+
+/* Same as SimpleRTK5::txIovaLookup() for one page */
+static rtlIovaEntry *simLookup(SimCache *cache, IOVirtualAddress page, addr64_t phyPage)
+{
+    rtlIovaEntry *entry;
+
+    entry = rtlIovaFind(rtlIovaSet(cache->entries, page >> kFakePageShift), page);
+
+    if (entry && (entry->phyPage != phyPage)) {
+        if (!rtlIovaClaim(entry))
+            return NULL;
+
+        simRelease(entry);
+        cache->evictions++;
+        entry = NULL;
+    }
+    if (entry && rtlIovaGet(entry)) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+        entry = simInsert(cache, page, phyPage);
+
+        if (!entry || !rtlIovaGet(entry))
+            return NULL;
+    }
+    return entry;
+}
+
+/* Same as SimpleRTK5::txIovaPut(), or only drop the reference. */
+static void simPut(SimCache *cache, rtlIovaEntry *entry)
+{
+    if (!cache->releaseOnPut) {
+        OSDecrementAtomic(&entry->refs);
+    } else if (rtlIovaPut(entry)) {
+        simRelease(entry);
+        OSAddAtomic64(1, &cache->releases);
+    }
+}
+
+/* Same as SimpleRTK5::txIovaSweep() */
+static void simSweep(SimCache *cache)
+{
+    rtlIovaEntry *entry;
+    UInt32 i;
+
+    for (i = 0; i < kTxIovaCacheSize; i++) {
+        entry = &cache->entries[i];
+
+        if (!entry->md || entry->refs)
+            continue;
+
+        if (entry->used) {
+            entry->used = false;
+            continue;
+        }
+        if (rtlIovaClaim(entry)) {
+            simRelease(entry);
+            OSAddAtomic64(1, &cache->releases);
+        }
+    }
+}
+
+/* Same as SimpleRTK5::txIovaFlush() */
+static void simFlush(SimCache *cache)
+{
+    UInt32 i;
+
+    for (i = 0; i < kTxIovaCacheSize; i++) {
+        if (cache->entries[i].md)
+            fakeMapperUnmap(&mapper, cache->entries[i].iova);
+    }
+    memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+static void cacheInit(SimCache *cache, bool releaseOnPut)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->releaseOnPut = releaseOnPut;
+}
+
+/* The n-th page of set 0 */
+static inline IOVirtualAddress setPage(UInt32 n)
+{
+    return (IOVirtualAddress)(n + 1) * (kTxIovaSetMask + 1) << kFakePageShift;
+}
+
+static void testSets()
+{
+    static SimCache cache;
+    rtlIovaEntry *e[kTxIovaWays + 1];
+    UInt32 i;
+
+    fakeMapperReset(&mapper);
+    cacheInit(&cache, false);
+
+    /* Consecutive pages go to different sets, pages a cache apart to the same one. */
+    CHECK(rtlIovaSet(cache.entries, 1) == rtlIovaSet(cache.entries, 0) + kTxIovaWays, "set 1");
+    CHECK(rtlIovaSet(cache.entries, kTxIovaSetMask + 1) == cache.entries, "set wraps");
+
+    for (i = 0; i < kTxIovaWays; i++) {
+        e[i] = simLookup(&cache, setPage(i), setPage(i));
+        CHECK(e[i] == &cache.entries[i], "way %u", i);
+        CHECK(e[i]->refs == 1, "way %u refs %d", i, e[i]->refs);
+    }
+    CHECK(cache.misses == kTxIovaWays, "misses %llu", (unsigned long long)cache.misses);
+
+    /* A hit takes another reference. */
+    CHECK(simLookup(&cache, setPage(2), setPage(2)) == e[2], "hit");
+    CHECK(e[2]->refs == 2 && cache.hits == 1, "refs %d", e[2]->refs);
+
+    /* All ways are in use, nothing can be evicted. */
+    CHECK(!simLookup(&cache, setPage(kTxIovaWays), setPage(kTxIovaWays)), "full set");
+    CHECK(fakeMapperMapped(&mapper) == kTxIovaWays, "mapped %llu",
+          (unsigned long long)fakeMapperMapped(&mapper));
+
+    /*
+     * Drop the references of ways 1 and 3. Both have been used, the
+     * clock clears their flags and the first of them is evicted.
+     */
+    simPut(&cache, e[1]);
+    simPut(&cache, e[3]);
+    e[4] = simLookup(&cache, setPage(4), setPage(4));
+    CHECK(e[4] == &cache.entries[1], "evicted way %ld", (long)(e[4] - cache.entries));
+    CHECK(cache.evictions == 1, "evictions %llu", (unsigned long long)cache.evictions);
+    CHECK(!cache.entries[3].used, "used flag of way 3 not cleared");
+
+    /* Way 3 is now the unused one and goes before a used one. */
+    simPut(&cache, e[4]);
+    CHECK(simLookup(&cache, setPage(5), setPage(5)) == &cache.entries[3], "clock");
+    CHECK(!rtlIovaFind(cache.entries, setPage(3)), "page 3 still cached");
+
+    /* A replaced page isn't trusted and gets mapped again. */
+    e[0] = &cache.entries[0];
+    simPut(&cache, e[0]);
+    e[0] = simLookup(&cache, setPage(0), setPage(0) + 0x1000000);
+    CHECK(e[0] && (fakeMapperLookup(&mapper, e[0]->iova) == setPage(0) + 0x1000000), "replaced page");
+
+    /* A replaced page with packets in flight can't be used. */
+    CHECK(!simLookup(&cache, setPage(0), setPage(0)), "replaced page in flight");
+
+    simFlush(&cache);
+    CHECK(fakeMapperMapped(&mapper) == 0, "flush");
+    CHECK(!badUnmaps, "%llu bad unmaps", (unsigned long long)badUnmaps.load());
+}
+
+static void testRefs()
+{
+    static SimCache cache;
+    rtlIovaEntry *entry;
+    bool evict;
+
+    fakeMapperReset(&mapper);
+    cacheInit(&cache, true);
+
+    entry = simLookup(&cache, setPage(0), setPage(0));
+    CHECK(simLookup(&cache, setPage(0), setPage(0)) == entry, "hit");
+    CHECK(entry->refs == 2, "refs %d", entry->refs);
+    CHECK(!rtlIovaClaim(entry), "claimed with references");
+
+    /* Only the last reference unmaps the page. */
+    simPut(&cache, entry);
+    CHECK(entry->md && (fakeMapperMapped(&mapper) == 1), "unmapped too early");
+    simPut(&cache, entry);
+    CHECK(!entry->md && (fakeMapperMapped(&mapper) == 0), "not unmapped");
+    CHECK(entry->refs == kTxIovaReleased, "refs %d", entry->refs);
+    CHECK(cache.releases == 1, "releases %lld", (long long)cache.releases);
+
+    /* A released entry can't be referenced, but it's free. */
+    CHECK(!rtlIovaGet(entry), "reference on a released entry");
+    CHECK(rtlIovaVictim(cache.entries, &evict) == entry && !evict, "not free");
+
+    /* An entry being unmapped is neither found nor free. */
+    entry = simLookup(&cache, setPage(1), setPage(1));
+    OSDecrementAtomic(&entry->refs);
+    CHECK(rtlIovaClaim(entry), "claim");
+    CHECK(!rtlIovaFind(cache.entries, setPage(1)), "found while unmapped");
+    CHECK(rtlIovaVictim(cache.entries, &evict) != entry, "free while unmapped");
+    simRelease(entry);
+
+    CHECK(fakeMapperMapped(&mapper) == 0, "mapped %llu", (unsigned long long)fakeMapperMapped(&mapper));
+    CHECK(!badUnmaps, "%llu bad unmaps", (unsigned long long)badUnmaps.load());
+}
+
+/*
+ * The output thread takes references on random pages of a small
+ * working set and checks the mapping of each, the completion thread
+ * drops them and the timer thread sweeps the cache.
+ */
+static struct {
+    rtlIovaEntry *entries[kNumTxDesc];
+    std::atomic<UInt32> head;
+    std::atomic<UInt32> tail;
+} stressRing;
+
+static std::atomic<bool> stop;
+static std::atomic<UInt64> badMappings;
+
+static void stressOutput(SimCache *cache, UInt32 count)
+{
+    IOVirtualAddress page;
+    rtlIovaEntry *entry;
+    UInt32 head;
+
+    while (count) {
+        head = stressRing.head.load(std::memory_order_relaxed);
+
+        if (head - stressRing.tail.load(std::memory_order_acquire) >= kNumTxDesc) {
+            std::this_thread::yield();
+            continue;
+        }
+        page = setPage(rand() % (2 * kTxIovaWays)) + ((rand() & 3) << kFakePageShift);
+        entry = simLookup(cache, page, page);
+
+        if (!entry) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (fakeMapperLookup(&mapper, entry->iova) != page)
+            badMappings++;
+
+        stressRing.entries[head & kTxDescMask] = entry;
+        stressRing.head.store(head + 1, std::memory_order_release);
+        count--;
+    }
+}
+
+static void stressComplete(SimCache *cache)
+{
+    UInt32 tail;
+
+    while (true) {
+        tail = stressRing.tail.load(std::memory_order_relaxed);
+
+        if (tail == stressRing.head.load(std::memory_order_acquire)) {
+            if (stop)
+                break;
+
+            std::this_thread::yield();
+            continue;
+        }
+        simPut(cache, stressRing.entries[tail & kTxDescMask]);
+        stressRing.tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+static void stressSweep(SimCache *cache)
+{
+    while (!stop) {
+        simSweep(cache);
+        std::this_thread::yield();
+    }
+}
+
+static void testStress(bool releaseOnPut)
+{
+    static SimCache cache;
+
+    fakeMapperReset(&mapper);
+    cacheInit(&cache, releaseOnPut);
+    stressRing.head = stressRing.tail = 0;
+    badUnmaps = badMappings = 0;
+    stop = false;
+    srand(3);
+
+    std::thread complete(stressComplete, &cache);
+    std::thread sweep(stressSweep, &cache);
+
+    stressOutput(&cache, 200000);
+
+    stop = true;
+    complete.join();
+    sweep.join();
+
+    CHECK(!badMappings, "%llu pages used after unmap", (unsigned long long)badMappings.load());
+    CHECK(!badUnmaps, "%llu bad unmaps", (unsigned long long)badUnmaps.load());
+
+    for (UInt32 i = 0; i < kTxIovaCacheSize; i++)
+        CHECK(cache.entries[i].refs <= 0, "entry %u refs %d", i, cache.entries[i].refs);
+
+    /* Everything is unmapped on the last reference or by two sweeps. */
+    simSweep(&cache);
+    simSweep(&cache);
+    CHECK(fakeMapperMapped(&mapper) == 0, "%s: %llu pages mapped", releaseOnPut ? "release" : "sweep",
+          (unsigned long long)fakeMapperMapped(&mapper));
+}
+
+/*
+ * The simulation. A packet takes the clusters it needs from the top
+ * of a LIFO pool and uses one descriptor per page. The NIC completes
+ * the descriptors in batches once the ring is full, and the stack
+ * puts the clusters back.
+ */
+enum { kModeMap, kModeRelease, kModeSweep };
+
+typedef struct SimPool {
+    UInt8 *mem;
+    std::vector<UInt8 *> free;
+    UInt32 clusterSize;
+} SimPool;
+
+typedef struct SimDesc {
+    rtlIovaEntry *entry;
+    UInt64 iova;
+    UInt8 *cluster;
+    SimPool *pool;
+} SimDesc;
+
+static void poolInit(SimPool *pool, UInt32 clusterSize, UInt32 count)
+{
+    pool->mem = (UInt8 *)aligned_alloc(kFakePageSize, (size_t)clusterSize * count);
+    pool->clusterSize = clusterSize;
+    pool->free.clear();
+
+    for (UInt32 i = count; i > 0; i--)
+        pool->free.push_back(pool->mem + (size_t)(i - 1) * clusterSize);
+}
+
+static void simulate(const char *trace, UInt32 tsoPct, UInt32 mode)
+{
+    static SimCache cache;
+    static SimDesc descs[kNumTxDesc];
+    SimPool small, jumbo;
+    SimPool *pool;
+    UInt64 bytes = 0, packets = 0;
+    UInt32 head = 0, tail = 0;
+    UInt32 len, clusters, c, off, i;
+    IOVirtualAddress page;
+    UInt8 *cluster;
+
+    fakeMapperReset(&mapper);
+    cacheInit(&cache, mode == kModeRelease);
+    memset(descs, 0, sizeof(descs));
+    poolInit(&small, 2048, 8192);
+    poolInit(&jumbo, 16384, 1024);
+    srand(4);
+
+    while (bytes < kSimBytes) {
+        if ((UInt32)(rand() % 100) < tsoPct) {
+            len = 0x10000;
+            pool = &jumbo;
+        } else {
+            len = (rand() & 1) ? 1514 : 66;
+            pool = &small;
+        }
+        clusters = (len + pool->clusterSize - 1) / pool->clusterSize;
+
+        /* Complete a batch if the packet doesn't fit. */
+        while (kNumTxDesc - (head - tail) < kMaxSegs) {
+            for (i = 0; (i < kCompleteBatch) && (tail != head); i++, tail++) {
+                SimDesc *d = &descs[tail & kTxDescMask];
+
+                if (d->cluster)
+                    d->pool->free.push_back(d->cluster);
+
+                if (d->entry)
+                    simPut(&cache, d->entry);
+                else
+                    fakeMapperUnmap(&mapper, d->iova);
+
+                memset(d, 0, sizeof(*d));
+            }
+        }
+        for (c = 0; c < clusters; c++) {
+            cluster = pool->free.back();
+            pool->free.pop_back();
+
+            for (off = 0; off < pool->clusterSize; off += kFakePageSize) {
+                SimDesc *d = &descs[head++ & kTxDescMask];
+                page = (IOVirtualAddress)(cluster + off) & ~(IOVirtualAddress)kFakePageMask;
+
+                if (mode == kModeMap)
+                    d->iova = fakeMapperMap(&mapper, page);
+                else
+                    d->entry = simLookup(&cache, page, page);
+
+                if ((mode != kModeMap) && !d->entry)
+                    d->iova = fakeMapperMap(&mapper, page);
+
+                if (off + kFakePageSize >= pool->clusterSize) {
+                    d->cluster = cluster;
+                    d->pool = pool;
+                }
+            }
+        }
+        bytes += len;
+
+        if ((mode == kModeSweep) && !(++packets % kSweepPackets))
+            simSweep(&cache);
+    }
+    double gb = bytes / 1e9;
+
+    printf("IovaTests: %-6s %-16s %9.0f maps/GB, %9.0f unmaps/GB, %5.1f%% hits\n", trace,
+           (mode == kModeMap) ? "map per packet" : (mode == kModeRelease) ? "cache, release" : "cache, sweep",
+           mapper.maps / gb, mapper.unmaps / gb,
+           (mode == kModeMap) ? 0.0 : 100.0 * cache.hits / (cache.hits + cache.misses));
+
+    CHECK(!badUnmaps, "%llu bad unmaps", (unsigned long long)badUnmaps.load());
+
+    free(small.mem);
+    free(jumbo.mem);
+}
+
+int main()
+{
+    testSets();
+    testRefs();
+    testStress(true);
+    testStress(false);
+
+    for (UInt32 mode = kModeMap; mode <= kModeSweep; mode++)
+        simulate("mtu", 0, mode);
+    for (UInt32 mode = kModeMap; mode <= kModeSweep; mode++)
+        simulate("10% tso", 10, mode);
+
+    if (failures) {
+        printf("IovaTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("IovaTests: passed.\n");
+    return 0;
+}
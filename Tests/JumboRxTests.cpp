@@ -0,0 +1,403 @@
+//
+//  JumboRxTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Simulated rx ring comparing jumbo frame receive with the default
+//  4k buffers, which chain three fragments per 9000 byte frame, to
+//  the 16k buffers of enableJumboRx. A simulated NIC writes frames
+//  into the ring the way rxInterrupt() expects them, the driver side
+//  scans it with rxScanDescs() and replaces and chains the buffers
+//  like rxInterrupt(). Buffers are allocated with malloc() in place
+//  of the rx pool, so that the time per frame covers the loop and the
+//  allocations, but not the cost of mbufs and their DMA mappings.
+//  Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 -ISimpleRTK5/linux Tests/JumboRxTests.cpp -o /tmp/JumboRxTests && /tmp/JumboRxTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include <IOKit/IOLib.h>
+#include "linux/linux.h"
+#include "SimpleRTK5RxDesc.hpp"
+
+/* Same as in SimpleRTK5Ethernet.hpp */
+#define kRxBufferSize       4096
+#define kRxJumboBufferSize  (16 * 1024)
+#define kMaxMtu             9000
+#define kRxScanBatch        16
+
+/* mbuf_get_mhlen() on current releases of macOS */
+#define kCopyBreak          224
+
+#define kEthHdrLen          14
+#define kFcsLen             4
+
+#define kNumRxDesc          1024
+#define kRxDescMask         (kNumRxDesc - 1)
+#define kBenchFrames        (1024 * 1024)
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* A receive buffer, linked into a chain like an mbuf. */
+typedef struct RxBuf {
+    struct RxBuf *next;
+    UInt32 len;
+    UInt8 data[];
+} RxBuf;
+
+typedef struct SimRing {
+    UInt32 descType;
+    UInt32 bufSize;
+    UInt32 descBufSize;
+    void *descs;
+    RxBuf *bufs[kNumRxDesc];
+    UInt32 nicIndex;        /* next descriptor the NIC writes */
+    UInt32 nextIndex;       /* next descriptor the driver examines */
+    RxBuf *head;
+    RxBuf *tail;
+    UInt32 size;
+
+    /* statistics */
+    UInt64 frames;
+    UInt64 bytes;
+    UInt64 descsUsed;
+    UInt64 replacements;
+    UInt64 chainBufs;
+    UInt32 maxChain;
+} SimRing;
+
+static RxBuf *allocBuf(UInt32 size)
+{
+    RxBuf *b = (RxBuf *)malloc(sizeof(RxBuf) + size);
+
+    b->next = NULL;
+    b->len = 0;
+    return b;
+}
+
+static UInt32 descSize(UInt32 type)
+{
+    return (type == RX_DESC_RING_TYPE_3) ? sizeof(RtlRxDescV3) : sizeof(RtlRxDesc);
+}
+
+/* Hand a descriptor back to the NIC, like rxDescSet(). */
+static void descSetOwn(SimRing *r, UInt32 index)
+{
+    UInt32 opts1 = r->descBufSize | DescOwn | ((index == kNumRxDesc - 1) ? RingEnd : 0);
+
+    switch (r->descType) {
+    case RX_DESC_RING_TYPE_3:
+        ((RtlRxDescV3 *)r->descs)[index].opts = (UInt64)opts1 << 32;
+        break;
+
+    case RX_DESC_RING_TYPE_4:
+        ((RtlRxDescV4 *)r->descs)[index].opts = (UInt64)opts1 << 32;
+        break;
+
+    default:
+        ((RtlRxDesc *)r->descs)[index].buf.blen = opts1;
+        break;
+    }
+}
+
+static void ringInit(SimRing *r, UInt32 type, UInt32 bufSize)
+{
+    UInt32 i;
+
+    memset(r, 0, sizeof(*r));
+    r->descType = type;
+    r->bufSize = bufSize;
+    r->descBufSize = (bufSize < kRxMaxDescBufSize) ? bufSize : kRxMaxDescBufSize;
+    r->descs = calloc(kNumRxDesc, descSize(type));
+
+    for (i = 0; i < kNumRxDesc; i++) {
+        r->bufs[i] = allocBuf(bufSize);
+        descSetOwn(r, i);
+    }
+}
+
+static void ringFree(SimRing *r)
+{
+    UInt32 i;
+
+    for (i = 0; i < kNumRxDesc; i++)
+        free(r->bufs[i]);
+
+    free(r->descs);
+}
+
+/*
+ * NIC side: DMA a frame of len bytes plus FCS into as many descriptors
+ * as needed and write back their status. Returns false if the ring is
+ * full. The payload isn't copied, only the first byte of each buffer
+ * is tagged, so that the order of the fragments can be checked.
+ */
+static bool nicReceive(SimRing *r, UInt32 len, UInt8 tag)
+{
+    UInt32 left = len + kFcsLen;
+    UInt32 index, frag, opts1;
+    UInt64 own = (UInt64)DescOwn << 32;
+    bool first = true;
+
+    /* Check that all descriptors of the frame are available. */
+    for (index = r->nicIndex, frag = 0; frag < left; frag += r->descBufSize) {
+        switch (r->descType) {
+        case RX_DESC_RING_TYPE_3:
+            if (!(((RtlRxDescV3 *)r->descs)[index].opts & own))
+                return false;
+            break;
+
+        case RX_DESC_RING_TYPE_4:
+            if (!(((RtlRxDescV4 *)r->descs)[index].opts & own))
+                return false;
+            break;
+
+        default:
+            if (!(((RtlRxDesc *)r->descs)[index].cmd.opts1 & DescOwn))
+                return false;
+            break;
+        }
+        index = (index + 1) & kRxDescMask;
+    }
+    while (left) {
+        index = r->nicIndex;
+        frag = (left > r->descBufSize) ? r->descBufSize : left;
+        left -= frag;
+
+        r->bufs[index]->data[0] = tag++;
+
+        switch (r->descType) {
+        case RX_DESC_RING_TYPE_3:
+            opts1 = frag | (first ? FirstFrag_V3 : 0) | (left ? 0 : LastFrag_V3);
+            ((RtlRxDescV3 *)r->descs)[index].opts = ((UInt64)opts1 << 32) | RxV4F;
+            break;
+
+        case RX_DESC_RING_TYPE_4:
+            opts1 = frag | (first ? FirstFrag : 0) | (left ? 0 : LastFrag);
+            ((RtlRxDescV4 *)r->descs)[index].opts = ((UInt64)opts1 << 32) | RxV4F;
+            break;
+
+        default:
+            opts1 = frag | (first ? FirstFrag : 0) | (left ? 0 : LastFrag);
+            ((RtlRxDesc *)r->descs)[index].buf.blen = ((UInt64)RxV4F << 32) | opts1;
+            break;
+        }
+        first = false;
+        r->nicIndex = (index + 1) & kRxDescMask;
+    }
+    return true;
+}
+
+/* The network stack consumes the frame and frees its buffers. */
+static void deliver(SimRing *r, RxBuf *head, UInt32 size, UInt32 len)
+{
+    RxBuf *b, *next;
+    UInt32 chain = 0, total = 0;
+    UInt8 tag = head->data[0];
+
+    for (b = head; b; b = next) {
+        next = b->next;
+
+        CHECK(b->data[0] == tag, "fragment out of order");
+        total += b->len;
+        chain++;
+        tag++;
+        free(b);
+    }
+    CHECK(total == size, "chain %u size %u", total, size);
+
+    if (len)
+        CHECK(size == len, "size %u frame %u", size, len);
+
+    r->frames++;
+    r->bytes += size;
+    r->chainBufs += chain;
+
+    if (chain > r->maxChain)
+        r->maxChain = chain;
+}
+
+/*
+ * Driver side: the fragment handling of rxInterrupt(). Frames which
+ * fit into a single buffer and are below the copybreak are copied,
+ * all other buffers are replaced.
+ */
+static UInt32 driverPoll(SimRing *r, UInt32 len)
+{
+    rtlRxDescStatus status[kRxScanBatch];
+    UInt32 n, i, index, pktSize, done = 0;
+    RxBuf *b;
+
+    while ((n = rxScanDescs(r->descs, r->descType, r->nextIndex, kRxDescMask, status, kRxScanBatch))) {
+        for (i = 0; i < n; i++) {
+            index = r->nextIndex;
+            pktSize = status[i].opts1 & 0x3fff;
+
+            r->descsUsed++;
+
+            if (((status[i].opts1 & (FirstFrag | LastFrag)) == (FirstFrag | LastFrag)) &&
+                (pktSize - kFcsLen <= kCopyBreak)) {
+                b = allocBuf(pktSize);
+                memcpy(b->data, r->bufs[index]->data, pktSize);
+            } else {
+                b = r->bufs[index];
+                r->bufs[index] = allocBuf(r->bufSize);
+                r->replacements++;
+            }
+
+            b->len = pktSize;
+
+            if (status[i].opts1 & LastFrag) {
+                pktSize -= kFcsLen;
+
+                if (r->head) {
+                    if ((SInt32)pktSize > 0) {
+                        b->len = pktSize;
+                        r->tail->next = b;
+                        r->tail = b;
+                        r->size += pktSize;
+                    } else {
+                        /* Only the FCS or a part of it, drop it. */
+                        r->tail->len += (SInt32)pktSize;
+                        r->size += (SInt32)pktSize;
+                        free(b);
+                    }
+                } else {
+                    b->len = pktSize;
+                    r->head = b;
+                    r->size = pktSize;
+                }
+                deliver(r, r->head, r->size, len);
+                r->head = r->tail = NULL;
+                r->size = 0;
+                done++;
+            } else if (r->head) {
+                r->tail->next = b;
+                r->tail = b;
+                r->size += pktSize;
+            } else {
+                r->head = r->tail = b;
+                r->size = pktSize;
+            }
+            descSetOwn(r, index);
+            r->nextIndex = (index + 1) & kRxDescMask;
+        }
+    }
+    return done;
+}
+
+static const UInt32 types[] = { RX_DESC_RING_TYPE_1, RX_DESC_RING_TYPE_3, RX_DESC_RING_TYPE_4 };
+static const char *typeNames[] = { "legacy", "v3", "v4" };
+
+/*
+ * Frames of all sizes around the buffer boundaries are reassembled
+ * correctly, including the case where the last fragment consists of
+ * a part of the FCS only.
+ */
+static void testReassembly()
+{
+    static const UInt32 sizes[] = {
+        60, 1514, 4092, 4093, 4094, 4095, 4096, 8188, 8190, 8191, 8192,
+        kMaxMtu + kEthHdrLen, 12284, 16372, 16376
+    };
+    SimRing r;
+    UInt32 t, s, bufSize;
+
+    for (t = 0; t < 3; t++) {
+        for (bufSize = kRxBufferSize; bufSize <= kRxJumboBufferSize; bufSize *= 4) {
+            ringInit(&r, types[t], bufSize);
+
+            for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                if (sizes[s] + kFcsLen > kRxMaxDescBufSize * 4)
+                    continue;
+
+                CHECK(nicReceive(&r, sizes[s], 1), "%s ring full", typeNames[t]);
+                CHECK(driverPoll(&r, sizes[s]) == 1, "%s %u: no frame", typeNames[t], sizes[s]);
+            }
+            CHECK(!r.head, "%s: incomplete frame left", typeNames[t]);
+            ringFree(&r);
+        }
+    }
+    /* A 16k buffer is capped at the size field of the descriptor. */
+    ringInit(&r, RX_DESC_RING_TYPE_1, kRxJumboBufferSize);
+    CHECK(r.descBufSize == kRxMaxDescBufSize, "descBufSize 0x%x", r.descBufSize);
+    nicReceive(&r, kMaxMtu + kEthHdrLen, 1);
+    driverPoll(&r, kMaxMtu + kEthHdrLen);
+    CHECK(r.descsUsed == 1, "descriptors %llu", (unsigned long long)r.descsUsed);
+    ringFree(&r);
+
+    ringInit(&r, RX_DESC_RING_TYPE_1, kRxBufferSize);
+    nicReceive(&r, kMaxMtu + kEthHdrLen, 1);
+    driverPoll(&r, kMaxMtu + kEthHdrLen);
+    CHECK(r.descsUsed == 3, "descriptors %llu", (unsigned long long)r.descsUsed);
+    ringFree(&r);
+}
+
+/*
+ * Receive bursts of 9000 byte MTU frames, or a mix of jumbo frames
+ * and ACKs, and report the descriptors, replacements and buffers per
+ * frame as well as the time per frame of both buffer sizes.
+ */
+static void bench(UInt32 type, const char *typeName, bool mixed)
+{
+    SimRing r;
+    UInt32 bufSize, len, i, burst;
+
+    for (bufSize = kRxBufferSize; bufSize <= kRxJumboBufferSize; bufSize *= 4) {
+        ringInit(&r, type, bufSize);
+        srand(1);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (i = 0; i < kBenchFrames; i += burst) {
+            for (burst = 0; burst < 64; burst++) {
+                len = (mixed && (rand() & 1)) ? 60 : kMaxMtu + kEthHdrLen;
+
+                if (!nicReceive(&r, len, 1))
+                    break;
+            }
+            driverPoll(&r, 0);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+        printf("JumboRxTests: %-6s %-5s %2uk buffers: %4.2f desc/frame, %4.2f "
+               "replacements/frame, %4.2f bufs/frame (max %u), %6.1f ns/frame\n",
+               typeName, mixed ? "mixed" : "jumbo", bufSize / 1024,
+               (double)r.descsUsed / r.frames, (double)r.replacements / r.frames,
+               (double)r.chainBufs / r.frames, r.maxChain, ns / r.frames);
+
+        ringFree(&r);
+    }
+}
+
+int main()
+{
+    UInt32 t;
+
+    testReassembly();
+
+    for (t = 0; t < 3; t++) {
+        bench(types[t], typeNames[t], false);
+        bench(types[t], typeNames[t], true);
+    }
+    if (failures) {
+        printf("JumboRxTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("JumboRxTests: passed.\n");
+    return 0;
+}
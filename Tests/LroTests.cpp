@@ -0,0 +1,564 @@
+//
+//  LroTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Replay tests of receive coalescing. Traces of received segments
+//  are fed through the merge rules of SimpleRTK5Lro.hpp the way
+//  lroInput() and lroFlush() apply them and each packet passed up is
+//  compared byte for byte with the packet a reference coalescer builds
+//  from scratch: IPv4 total length and header checksum, IPv6 payload
+//  length, ack, window, flags and timestamps of the last segment and
+//  the concatenated payload. Segments, which can't be turned into a
+//  plain mbuf, must be passed up unchanged after their flow. Build
+//  and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/LroTests.cpp -o /tmp/LroTests && /tmp/LroTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include <IOKit/IOLib.h>
+#include <sys/kpi_mbuf.h>
+#include "PacketBuilder.h"
+#include "SimpleRTK5Lro.hpp"
+
+#define kMinFrameLen 60
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef std::vector<UInt8> Frame;
+typedef std::vector<Frame> FrameList;
+typedef std::vector<std::vector<UInt32>> GroupList;
+
+/* A received TCP segment of a trace */
+typedef struct SegSpec {
+    bool ipv6;
+    bool ts;
+    UInt16 sport;
+    UInt8 tos;
+    UInt8 flags;
+    UInt32 seq;
+    UInt32 ack;
+    UInt16 win;
+    UInt32 tsVal;
+    UInt32 tsEcr;
+    UInt16 ipId;
+    UInt32 payloadLen;
+} SegSpec;
+
+static UInt16 ipv4Checksum(const UInt8 *ipHdr)
+{
+    UInt8 hdr[kIPv4HdrLen];
+
+    memcpy(hdr, ipHdr, kIPv4HdrLen);
+    put16(hdr + 10, 0);
+
+    return ~onesFold(onesSum(hdr, kIPv4HdrLen, 0)) & 0xffff;
+}
+
+/* Build a segment as the NIC would receive it, padded to 60 bytes */
+static void buildSeg(const SegSpec *seg, Frame &frame)
+{
+    PacketSpec spec;
+    rtlTxHdrInfo info;
+    UInt8 *p, *tcp;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.ipv6 = seg->ipv6;
+    spec.tcpOptLen = seg->ts ? TCPOLEN_TSTAMP_APPA : 0;
+    spec.flags = seg->flags;
+    spec.payloadLen = seg->payloadLen;
+    buildPacket(&spec, frame, &info);
+
+    p = frame.data();
+    tcp = p + info.l4Off;
+
+    if (seg->ipv6) {
+        put32(p + info.l3Off, 0x60000000 | ((UInt32)seg->tos << 20));
+    } else {
+        p[info.l3Off + 1] = seg->tos;
+        put16(p + info.l3Off + 4, seg->ipId);
+        put16(p + info.l3Off + 10, ipv4Checksum(p + info.l3Off));
+    }
+    put16(tcp, seg->sport);
+    put32(tcp + 4, seg->seq);
+    put32(tcp + 8, seg->ack);
+    put16(tcp + 14, seg->win);
+
+    if (seg->ts) {
+        put32(tcp + 20, TCPOPT_TSTAMP_HDR);
+        put32(tcp + 24, seg->tsVal);
+        put32(tcp + 28, seg->tsEcr);
+    }
+    if (frame.size() < kMinFrameLen)
+        frame.resize(kMinFrameLen, 0);
+}
+
+/* Offsets of the headers of an untagged TCP frame */
+static UInt32 l4Off(const Frame &frame)
+{
+    return (get16(frame.data() + 12) == ETHERTYPE_IPV6) ? ETH_HLEN + kIPv6HdrLen : ETH_HLEN + kIPv4HdrLen;
+}
+
+static UInt32 hdrLen(const Frame &frame)
+{
+    return l4Off(frame) + ((frame[l4Off(frame) + 12] >> 4) << 2);
+}
+
+static UInt32 pktLen(const Frame &frame)
+{
+    const UInt8 *p = frame.data();
+
+    if (get16(p + 12) == ETHERTYPE_IPV6)
+        return ETH_HLEN + kIPv6HdrLen + get16(p + ETH_HLEN + 4);
+    else
+        return ETH_HLEN + get16(p + ETH_HLEN + 2);
+}
+
+/*
+ * The coalesced packet of a group of segments built from scratch:
+ * the headers of the first segment with the length of the whole
+ * packet, a new IPv4 header checksum, the ack, window and timestamps
+ * of the last segment and the flags of all of them.
+ */
+static void reference(const FrameList &segs, const std::vector<UInt32> &group, Frame &pkt)
+{
+    const Frame &first = segs[group[0]];
+    const Frame &last = segs[group.back()];
+    UInt32 tcp = l4Off(first), hdr = hdrLen(first);
+    UInt32 i;
+    UInt8 flags = 0;
+    UInt8 *p;
+
+    if (group.size() == 1) {
+        pkt = first;
+        return;
+    }
+    pkt.assign(first.begin(), first.begin() + hdr);
+
+    for (i = 0; i < group.size(); i++) {
+        const Frame &seg = segs[group[i]];
+
+        pkt.insert(pkt.end(), seg.begin() + hdr, seg.begin() + pktLen(seg));
+        flags |= seg[tcp + 13];
+    }
+    p = pkt.data();
+
+    if (get16(p + 12) == ETHERTYPE_IPV6) {
+        put16(p + ETH_HLEN + 4, pkt.size() - ETH_HLEN - kIPv6HdrLen);
+    } else {
+        put16(p + ETH_HLEN + 2, pkt.size() - ETH_HLEN);
+        put16(p + ETH_HLEN + 10, ipv4Checksum(p + ETH_HLEN));
+    }
+    memcpy(p + tcp + 8, last.data() + tcp + 8, 4);
+    p[tcp + 13] = flags;
+    memcpy(p + tcp + 14, last.data() + tcp + 14, 2);
+
+    if (hdr - tcp == kTcpHdrLenTS)
+        memcpy(p + tcp + 24, last.data() + tcp + 24, 8);
+}
+
+/* Receive coalescing of one ring with the mbufs as byte vectors */
+typedef struct LroRing {
+    rtlLroFlow flows[kLroMaxFlows];
+    Frame heads[kLroMaxFlows];
+    Frame chains[kLroMaxFlows];
+    UInt16 numFlows;
+    UInt16 evict;
+    FrameList input;
+} LroRing;
+
+/* Same as SimpleRTK5::lroFlush() */
+static void lroFlush(LroRing *ring, rtlLroFlow *flow)
+{
+    UInt32 i = (UInt32)(flow - ring->flows);
+    Frame pkt;
+
+    if (!flow->head)
+        return;
+
+    rtlLroFinish(flow);
+
+    pkt = ring->heads[i];
+    pkt.insert(pkt.end(), ring->chains[i].begin(), ring->chains[i].end());
+    CHECK(pkt.size() == flow->len, "flow length %u, packet %zu", flow->len, pkt.size());
+    ring->input.push_back(pkt);
+
+    flow->head = flow->tail = NULL;
+    ring->numFlows--;
+}
+
+static void lroFlushAll(LroRing *ring)
+{
+    UInt32 i;
+
+    for (i = 0; (i < kLroMaxFlows) && ring->numFlows; i++)
+        lroFlush(ring, &ring->flows[i]);
+}
+
+/*
+ * Same as SimpleRTK5::lroInput() for segments with verified checksums.
+ * mbuf_setflags_mask() fails in case failFlags is set.
+ */
+static void lroInput(LroRing *ring, const Frame &frame, bool failFlags)
+{
+    rtlLroFlow *flow = NULL;
+    const struct tcphdr *tcpHdr;
+    const struct ip *ipHdr;
+    const struct ip6_hdr *ip6Hdr;
+    const UInt8 *data = frame.data();
+    const UInt8 *l3Hdr = data + ETH_HLEN;
+    UInt32 len, hdr, tcpLen, payload;
+    UInt16 etherType;
+    UInt16 i;
+    UInt8 flags;
+    bool eligible;
+
+    len = (UInt32)frame.size();
+    etherType = get16(data + 12);
+
+    if (etherType == ETHERTYPE_IP) {
+        ipHdr = (const struct ip *)l3Hdr;
+
+        if ((len < (ETH_HLEN + kIPv4HdrLen + kTcpHdrLen)) ||
+            (ipHdr->ip_hl != (kIPv4HdrLen >> 2)) ||
+            (ipHdr->ip_p != IPPROTO_TCP) ||
+            (ntohs(ipHdr->ip_off) & (IP_MF | IP_OFFMASK)))
+            goto input;
+
+        hdr = ETH_HLEN + kIPv4HdrLen;
+        len = ETH_HLEN + ntohs(ipHdr->ip_len);
+    } else {
+        ip6Hdr = (const struct ip6_hdr *)l3Hdr;
+
+        if ((len < (ETH_HLEN + kIPv6HdrLen + kTcpHdrLen)) ||
+            (ip6Hdr->ip6_nxt != IPPROTO_TCP))
+            goto input;
+
+        hdr = ETH_HLEN + kIPv6HdrLen;
+        len = ETH_HLEN + kIPv6HdrLen + ntohs(ip6Hdr->ip6_plen);
+    }
+    tcpHdr = (const struct tcphdr *)(data + hdr);
+    tcpLen = tcpHdr->th_off << 2;
+    hdr += tcpLen;
+
+    if ((tcpLen < kTcpHdrLen) || (hdr > len) || (len > frame.size()))
+        goto input;
+
+    payload = len - hdr;
+    flags = tcpHdr->th_flags;
+    eligible = rtlLroEligible(tcpHdr, tcpLen, payload);
+
+    if (ring->numFlows) {
+        for (i = 0; i < kLroMaxFlows; i++) {
+            if (ring->flows[i].head &&
+                rtlLroSameFlow(&ring->flows[i], etherType, l3Hdr, tcpHdr)) {
+                flow = &ring->flows[i];
+                break;
+            }
+        }
+    }
+    if (flow) {
+        if (eligible && rtlLroCanMerge(flow, l3Hdr, tcpHdr, payload)) {
+            if (failFlags) {
+                lroFlush(ring, flow);
+                goto input;
+            }
+            ring->chains[flow - ring->flows].insert(ring->chains[flow - ring->flows].end(),
+                                                    data + hdr, data + len);
+            rtlLroMerge(flow, tcpHdr, tcpLen, payload);
+
+            if ((flags & TH_PUSH) || (flow->segs >= kLroMaxSegs))
+                lroFlush(ring, flow);
+
+            return;
+        }
+        lroFlush(ring, flow);
+    }
+    if (!eligible || (flags & TH_PUSH))
+        goto input;
+
+    if (!flow) {
+        for (i = 0; i < kLroMaxFlows; i++) {
+            if (!ring->flows[i].head) {
+                flow = &ring->flows[i];
+                break;
+            }
+        }
+        if (!flow) {
+            flow = &ring->flows[ring->evict];
+            ring->evict = (ring->evict + 1) % kLroMaxFlows;
+
+            lroFlush(ring, flow);
+        }
+    }
+    i = (UInt16)(flow - ring->flows);
+    ring->heads[i].assign(data, data + len);
+    ring->chains[i].clear();
+
+    flow->head = flow->tail = (mbuf_t)&ring->heads[i];
+    flow->l3Hdr = ring->heads[i].data() + ETH_HLEN;
+    flow->tcpHdr = (struct tcphdr *)(ring->heads[i].data() + (hdr - tcpLen));
+    flow->nextSeq = ntohl(tcpHdr->th_seq) + payload;
+    flow->len = len;
+    flow->segs = 1;
+    flow->etherType = etherType;
+    ring->numFlows++;
+    return;
+
+input:
+    ring->input.push_back(frame);
+}
+
+/* Name of the header field at offset off of a frame for the reports */
+static const char *fieldName(const Frame &pkt, UInt32 off)
+{
+    UInt32 tcp = l4Off(pkt);
+    bool ipv6 = (get16(pkt.data() + 12) == ETHERTYPE_IPV6);
+
+    if (!ipv6 && (off >= ETH_HLEN + 2) && (off < ETH_HLEN + 4))
+        return "ip_len";
+    if (!ipv6 && (off >= ETH_HLEN + 10) && (off < ETH_HLEN + 12))
+        return "ip_sum";
+    if (ipv6 && (off >= ETH_HLEN + 4) && (off < ETH_HLEN + 6))
+        return "ip6_plen";
+    if ((off >= tcp + 8) && (off < tcp + 12))
+        return "th_ack";
+    if (off == tcp + 13)
+        return "th_flags";
+    if ((off >= tcp + 14) && (off < tcp + 16))
+        return "th_win";
+    if ((off >= tcp + 20) && (off < hdrLen(pkt)))
+        return "timestamp";
+    if (off >= hdrLen(pkt))
+        return "payload";
+
+    return "header";
+}
+
+/*
+ * Replay the segments and compare the packets passed up with the
+ * reference packets of the expected groups.
+ */
+static void replay(const char *name, const std::vector<SegSpec> &specs, const GroupList &groups,
+                   UInt32 failFlagsSeg = ~0U)
+{
+    LroRing ring;
+    FrameList segs(specs.size());
+    Frame expected;
+    UInt32 i, off, bytes = 0;
+
+    for (i = 0; i < specs.size(); i++)
+        buildSeg(&specs[i], segs[i]);
+
+    memset(ring.flows, 0, sizeof(ring.flows));
+    ring.numFlows = ring.evict = 0;
+
+    for (i = 0; i < segs.size(); i++)
+        lroInput(&ring, segs[i], (i == failFlagsSeg));
+
+    lroFlushAll(&ring);
+
+    CHECK(ring.input.size() == groups.size(), "%s: %zu packets, expected %zu",
+          name, ring.input.size(), groups.size());
+
+    for (i = 0; (i < ring.input.size()) && (i < groups.size()); i++) {
+        reference(segs, groups[i], expected);
+        bytes += expected.size();
+
+        if (ring.input[i].size() != expected.size()) {
+            CHECK(false, "%s: packet %u has %zu bytes, expected %zu",
+                  name, i, ring.input[i].size(), expected.size());
+            continue;
+        }
+        for (off = 0; off < expected.size(); off++) {
+            if (ring.input[i][off] != expected[off])
+                break;
+        }
+        CHECK(off == expected.size(), "%s: packet %u differs at %u (%s): %02x, expected %02x",
+              name, i, off, fieldName(expected, off), ring.input[i][off], expected[off]);
+    }
+    printf("  %-12s %3zu segments, %3zu packets, %6u bytes\n", name, segs.size(), ring.input.size(), bytes);
+}
+
+static SegSpec makeSeg(bool ipv6, bool ts, UInt32 payloadLen)
+{
+    SegSpec seg;
+
+    memset(&seg, 0, sizeof(seg));
+    seg.ipv6 = ipv6;
+    seg.ts = ts;
+    seg.sport = 49152;
+    seg.flags = TH_ACK;
+    seg.seq = 0xfffff000;           /* wraps within the trace */
+    seg.ack = 0x01020304;
+    seg.win = 0x0400;
+    seg.tsVal = 0x10000000;
+    seg.tsEcr = 0x20000000;
+    seg.ipId = 0x1234;
+    seg.payloadLen = payloadLen;
+
+    return seg;
+}
+
+/* Segments of a bulk transfer with changing ack, window and timestamps */
+static void addSegs(std::vector<SegSpec> &specs, SegSpec *seg, UInt32 n)
+{
+    UInt32 i;
+
+    for (i = 0; i < n; i++) {
+        specs.push_back(*seg);
+
+        seg->seq += seg->payloadLen;
+        seg->ack += 1000 + i;
+        seg->win ^= (0x0101 << (i & 7));
+        seg->tsVal += 3;
+        seg->tsEcr += 1;
+        seg->ipId++;
+    }
+}
+
+static GroupList range(UInt32 first, UInt32 last)
+{
+    std::vector<UInt32> group;
+
+    for (; first <= last; first++)
+        group.push_back(first);
+
+    return GroupList(1, group);
+}
+
+static GroupList operator+(GroupList a, const GroupList &b)
+{
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+static void testReplay()
+{
+    std::vector<SegSpec> specs;
+    std::vector<UInt32> a, b;
+    SegSpec seg, seg6;
+    UInt32 i;
+
+    /* IPv4 with timestamps, kLroMaxSegs and a PSH at the end */
+    seg = makeSeg(false, true, 1448);
+    addSegs(specs, &seg, 19);
+    seg.flags |= TH_PUSH;
+    addSegs(specs, &seg, 1);
+    replay("ipv4-ts", specs, range(0, 15) + range(16, 19));
+
+    /* IPv6 without options, a lost segment ends the flow */
+    specs.clear();
+    seg = makeSeg(true, false, 1440);
+    addSegs(specs, &seg, 6);
+    seg.seq += 1440;
+    addSegs(specs, &seg, 4);
+    replay("ipv6-gap", specs, range(0, 5) + range(6, 9));
+
+    /* A CE mark must not be merged into segments without it. */
+    specs.clear();
+    seg = makeSeg(false, true, 1448);
+    addSegs(specs, &seg, 4);
+    seg.tos = IPTOS_ECN_CE;
+    addSegs(specs, &seg, 1);
+    seg.tos = 0;
+    addSegs(specs, &seg, 3);
+    replay("ipv4-ecn", specs, range(0, 3) + range(4, 4) + range(5, 7));
+
+    specs.clear();
+    seg6 = makeSeg(true, true, 1428);
+    seg6.tos = IPTOS_ECN_ECT0;
+    addSegs(specs, &seg6, 5);
+    seg6.tos = IPTOS_ECN_CE;
+    addSegs(specs, &seg6, 2);
+    replay("ipv6-ecn", specs, range(0, 4) + range(5, 6));
+
+    /* Jumbo frames up to kLroMaxLen */
+    specs.clear();
+    seg = makeSeg(false, false, 9000);
+    addSegs(specs, &seg, 10);
+    replay("ipv4-jumbo", specs, range(0, 6) + range(7, 9));
+
+    /* The padding of short frames isn't payload. */
+    specs.clear();
+    seg = makeSeg(false, false, 1);
+    addSegs(specs, &seg, 5);
+    replay("ipv4-tiny", specs, range(0, 4));
+
+    /* Two interleaved flows */
+    specs.clear();
+    seg = makeSeg(false, true, 1448);
+    seg6 = makeSeg(true, true, 1428);
+    seg6.sport = 49153;
+
+    for (i = 0; i < 8; i++) {
+        addSegs(specs, &seg, 1);
+        addSegs(specs, &seg6, 1);
+        a.push_back(2 * i);
+        b.push_back(2 * i + 1);
+    }
+    replay("interleaved", specs, GroupList(1, a) + GroupList(1, b));
+
+    /* A window update without payload is passed up after the flow. */
+    specs.clear();
+    seg = makeSeg(false, true, 1448);
+    addSegs(specs, &seg, 3);
+    seg.payloadLen = 0;
+    addSegs(specs, &seg, 1);
+    seg.payloadLen = 1448;
+    addSegs(specs, &seg, 2);
+    replay("ipv4-update", specs, range(0, 2) + range(3, 3) + range(4, 5));
+}
+
+/*
+ * In case the 4th segment can't be turned into a plain mbuf, the
+ * flow is passed up, followed by the segment unchanged.
+ */
+static void testSetFlagsFailure()
+{
+    std::vector<SegSpec> specs;
+    SegSpec seg;
+
+    seg = makeSeg(false, true, 1448);
+    addSegs(specs, &seg, 6);
+    replay("ipv4-flags", specs, range(0, 2) + range(3, 3) + range(4, 5), 3);
+
+    specs.clear();
+    seg = makeSeg(true, false, 1440);
+    addSegs(specs, &seg, 3);
+    replay("ipv6-flags", specs, range(0, 0) + range(1, 1) + range(2, 2), 1);
+}
+
+int main()
+{
+    srand(1);
+
+    testReplay();
+    testSetFlagsFailure();
+
+    if (failures) {
+        printf("LroTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("LroTests: passed.\n");
+    return 0;
+}
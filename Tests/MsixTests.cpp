@@ -0,0 +1,245 @@
+//
+//  MsixTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the MSI-X layouts in SimpleRTK5Msix.hpp against the
+//  interrupt register definitions of rtl812x.h. For each chip the
+//  layout must match the ISR version srtk5_init_software_variable()
+//  assigns and its message numbers the ISRIMR_V2, V5 or V7 bits of
+//  rx, tx and link change interrupts. A model of the IMR_V2 set and
+//  clear registers checks the mask rtl812xSetIntrMask() programs
+//  with and without rx interrupts. Build and run on the host with:
+//
+//  c++ -std=c++17 -ITests/include -ISimpleRTK5 -ISimpleRTK5/linux Tests/MsixTests.cpp -o /tmp/MsixTests && /tmp/MsixTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "linux/linux.h"
+#include "SimpleRTK5Msix.hpp"
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* Same as the interrupt version in srtk5_init_software_variable() */
+static UInt32 hwSuppIsrVer(UInt32 mcfg)
+{
+    switch (mcfg) {
+    case CFG_METHOD_4:
+    case CFG_METHOD_5:
+    case CFG_METHOD_7:
+        return 2;
+
+    case CFG_METHOD_8:
+    case CFG_METHOD_9:
+        return 4;
+
+    case CFG_METHOD_10:
+    case CFG_METHOD_11:
+    case CFG_METHOD_13:
+        return 5;
+
+    case CFG_METHOD_12:
+        return 7;
+
+    default:
+        return 1;
+    }
+}
+
+/* The ISR_V2/IMR_V2 bits of an interrupt register version */
+typedef struct IsrBits {
+    UInt32 rok0;
+    UInt32 tok[kMaxTxQueues];
+    UInt32 link;
+} IsrBits;
+
+static bool isrBits(UInt32 isrVer, IsrBits *bits)
+{
+    switch (isrVer) {
+    case 2:
+        *bits = (IsrBits){ ISRIMR_V2_ROK_Q0, { ISRIMR_TOK_Q0, ISRIMR_TOK_Q1 }, ISRIMR_V2_LINKCHG };
+        return true;
+
+    case 5:
+        *bits = (IsrBits){ ISRIMR_V5_ROK_Q0, { ISRIMR_V5_TOK_Q0, ISRIMR_V5_TOK_Q1 }, ISRIMR_V5_LINKCHG };
+        return true;
+
+    case 7:
+        *bits = (IsrBits){ ISRIMR_V7_ROK_Q0, { ISRIMR_V7_TOK_Q0, ISRIMR_V7_TOK_Q1 }, ISRIMR_V7_LINKCHG };
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* The registers rtl812xSetIntrMask() writes in MSI-X mode */
+typedef struct IntrRegs {
+    UInt32 imr0;
+    UInt32 imrV2;
+    UInt32 writes;
+} IntrRegs;
+
+static void regWrite(IntrRegs *regs, UInt32 reg, UInt32 val)
+{
+    switch (reg) {
+    case IMR0_8125:
+        regs->imr0 = val;
+        break;
+
+    case IMR_V2_CLEAR_REG_8125:
+        regs->imrV2 &= ~val;
+        break;
+
+    case IMR_V2_SET_REG_8125:
+        regs->imrV2 |= val;
+        break;
+
+    default:
+        CHECK(false, "write of %08x to register %04x", val, reg);
+        break;
+    }
+    regs->writes++;
+}
+
+/* Same as SimpleRTK5::rtl812xSetIntrMask() in MSI-X mode */
+static void setIntrMask(IntrRegs *regs, const rtlMsixLayout *layout,
+                        UInt32 numRxQueues, UInt32 numTxQueues, UInt32 mask)
+{
+    UInt32 v2Mask = rtlMsixIntrMask(layout, numRxQueues, numTxQueues, (mask & RxOK));
+
+    regWrite(regs, IMR0_8125, 0x0000);
+    regWrite(regs, IMR_V2_CLEAR_REG_8125, ~v2Mask);
+    regWrite(regs, IMR_V2_SET_REG_8125, v2Mask);
+}
+
+/*
+ * Each chip with ISR version 2, 5 or 7 has a layout of that version,
+ * all others have none.
+ */
+static void testLayouts()
+{
+    const rtlMsixLayout *layout;
+    IsrBits bits;
+    UInt32 mcfg, isrVer, used, i;
+    UInt32 numLayouts = 0;
+
+    for (mcfg = CFG_METHOD_2; mcfg < CFG_METHOD_MAX; mcfg++) {
+        layout = rtlMsixLayoutOf(mcfg);
+        isrVer = hwSuppIsrVer(mcfg);
+
+        if (!isrBits(isrVer, &bits)) {
+            CHECK(!layout, "mcfg %u ISR version %u has a layout", mcfg, isrVer);
+            continue;
+        }
+        CHECK(layout, "mcfg %u ISR version %u has no layout", mcfg, isrVer);
+
+        if (!layout)
+            continue;
+
+        numLayouts++;
+        CHECK(layout->isrVer == isrVer, "mcfg %u layout version %u, ISR version %u",
+              mcfg, layout->isrVer, isrVer);
+        CHECK(BIT(layout->linkMsg) == bits.link, "mcfg %u link message %u, bit %08x",
+              mcfg, layout->linkMsg, bits.link);
+        CHECK(layout->linkMsg < R8125_MAX_MSIX_VEC, "mcfg %u link message %u", mcfg, layout->linkMsg);
+
+        used = BIT(layout->linkMsg);
+
+        for (i = 0; i < kMaxTxQueues; i++) {
+            CHECK(BIT(layout->txMsg[i]) == bits.tok[i], "mcfg %u tx %u message %u, bit %08x",
+                  mcfg, i, layout->txMsg[i], bits.tok[i]);
+            CHECK(!(used & BIT(layout->txMsg[i])), "mcfg %u tx %u message %u shared",
+                  mcfg, i, layout->txMsg[i]);
+
+            used |= BIT(layout->txMsg[i]);
+        }
+        /* Rx queue n uses message n. */
+        for (i = 0; i < kMaxRxQueues; i++) {
+            CHECK(BIT(i) == (bits.rok0 << i), "mcfg %u rx %u", mcfg, i);
+            CHECK(!(used & BIT(i)), "mcfg %u rx %u message shared", mcfg, i);
+        }
+    }
+    /* CFG_METHOD_4, 5, 7, 10, 11, 12 and 13 */
+    CHECK(numLayouts == 7, "%u chips with MSI-X", numLayouts);
+}
+
+/*
+ * The mask has the link and tx bits of the layout and the rx bits
+ * of all rx queues with rx interrupts enabled. The set and clear
+ * registers leave exactly that mask, whatever was enabled before.
+ */
+static void testIntrMask()
+{
+    const rtlMsixLayout *layout;
+    IntrRegs regs;
+    IsrBits bits;
+    UInt32 mcfg, rxQueues, txQueues, expected, rxBits, i;
+    UInt32 prev[] = { 0, 0xffffffff, 0x5a5a5a5a };
+
+    for (mcfg = CFG_METHOD_2; mcfg < CFG_METHOD_MAX; mcfg++) {
+        if (!(layout = rtlMsixLayoutOf(mcfg)) || !isrBits(layout->isrVer, &bits))
+            continue;
+
+        for (rxQueues = 1; rxQueues <= kMaxRxQueues; rxQueues <<= 1) {
+            for (txQueues = 1; txQueues <= kMaxTxQueues; txQueues++) {
+                expected = bits.link;
+                rxBits = 0;
+
+                for (i = 0; i < txQueues; i++)
+                    expected |= bits.tok[i];
+
+                for (i = 0; i < rxQueues; i++)
+                    rxBits |= bits.rok0 << i;
+
+                for (i = 0; i < sizeof(prev) / sizeof(prev[0]); i++) {
+                    memset(&regs, 0, sizeof(regs));
+                    regs.imr0 = 0xffff;
+                    regs.imrV2 = prev[i];
+
+                    setIntrMask(&regs, layout, rxQueues, txQueues, RxOK | TxOK | LinkChg);
+                    CHECK(regs.imrV2 == (expected | rxBits), "mcfg %u rx %u tx %u: IMR_V2 %08x expected %08x",
+                          mcfg, rxQueues, txQueues, regs.imrV2, expected | rxBits);
+                    CHECK(regs.imr0 == 0, "mcfg %u: IMR0 %08x", mcfg, regs.imr0);
+
+                    /* Poll mode masks the rx vectors only. */
+                    setIntrMask(&regs, layout, rxQueues, txQueues, LinkChg | PCSTimeout);
+                    CHECK(regs.imrV2 == expected, "mcfg %u rx %u tx %u: poll IMR_V2 %08x expected %08x",
+                          mcfg, rxQueues, txQueues, regs.imrV2, expected);
+
+                    /* A rx vector handler masks its own vector. */
+                    setIntrMask(&regs, layout, rxQueues, txQueues, RxOK | TxOK | LinkChg);
+                    regWrite(&regs, IMR_V2_CLEAR_REG_8125, BIT(rxQueues - 1));
+                    CHECK(regs.imrV2 == ((expected | rxBits) & ~(bits.rok0 << (rxQueues - 1))),
+                          "mcfg %u: IMR_V2 %08x in the handler", mcfg, regs.imrV2);
+                    CHECK(regs.writes == 10, "mcfg %u: %u writes", mcfg, regs.writes);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    testLayouts();
+    testIntrMask();
+
+    if (failures) {
+        printf("MsixTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("MsixTests: passed.\n");
+    return 0;
+}
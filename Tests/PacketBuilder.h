@@ -0,0 +1,205 @@
+//
+//  PacketBuilder.h
+//  SimpleRTK5 host tests
+//
+//  Builds Ethernet frames with TCP over IPv4 or IPv6 for the tests
+//  of the tx header paths. A frame may carry VLAN tags, IPv4 options,
+//  IPv6 extension headers and TCP options. The header layout is
+//  returned along with the frame, computed from the spec and not by
+//  the driver's code. Include the system headers below before
+//  IOKit/IOLib.h.
+//
+
+#ifndef SimpleRTK5Tests_PacketBuilder_h
+#define SimpleRTK5Tests_PacketBuilder_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+/* net/ethernet.h would pick up SimpleRTK5/linux/if_ether.h. */
+#ifndef ETH_HLEN
+#define ETH_HLEN 14
+#endif
+
+#ifndef ETHERTYPE_IP
+#define ETHERTYPE_IP 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_IPV6 0x86dd
+#endif
+
+#ifndef TH_ECE
+#define TH_ECE 0x40
+#endif
+
+#ifndef TH_CWR
+#define TH_CWR 0x80
+#endif
+
+#include "SimpleRTK5TxHdr.hpp"
+
+#define kMaxSpecExtHdrs 10
+
+typedef struct PacketSpec {
+    UInt32 vlanTags;                    /* 2 tags are 802.1ad */
+    bool ipv6;
+    UInt32 ipOptLen;                    /* multiple of 4 */
+    UInt32 numExtHdrs;
+    UInt8 extTypes[kMaxSpecExtHdrs];
+    UInt32 extLens[kMaxSpecExtHdrs];    /* multiple of 8, of 4 for AH */
+    UInt8 l4Proto;                      /* 0 means TCP */
+    UInt32 tcpOptLen;                   /* multiple of 4 */
+    UInt8 flags;
+    UInt32 payloadLen;
+} PacketSpec;
+
+static inline void put16(UInt8 *p, UInt16 v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline void put32(UInt8 *p, UInt32 v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xffff);
+}
+
+static inline UInt16 get16(const UInt8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline UInt32 get32(const UInt8 *p)
+{
+    return ((UInt32)get16(p) << 16) | get16(p + 2);
+}
+
+/* The one's complement sum of a buffer, not folded */
+static inline UInt32 onesSum(const UInt8 *p, UInt32 len, UInt32 sum)
+{
+    UInt32 i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += get16(p + i);
+
+    if (len & 1)
+        sum += p[len - 1] << 8;
+
+    return sum;
+}
+
+static inline UInt16 onesFold(UInt32 sum)
+{
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xffff);
+
+    return (UInt16)sum;
+}
+
+/*
+ * Build a frame according to spec. Returns the offsets of the L3
+ * and L4 headers and the length of all headers in info.
+ */
+static void buildPacket(const PacketSpec *spec, std::vector<UInt8> &pkt, rtlTxHdrInfo *info)
+{
+    UInt8 l4Proto = spec->l4Proto ? spec->l4Proto : IPPROTO_TCP;
+    UInt32 off, i, l, tcpLen, l3Len;
+    UInt8 *p;
+
+    pkt.assign(kTxMaxHdrLen * 2 + spec->payloadLen, 0);
+    p = pkt.data();
+
+    for (i = 0; i < 12; i++)
+        p[i] = 0x10 + i;
+
+    off = 12;
+
+    for (i = 0; i < spec->vlanTags; i++) {
+        put16(p + off, ((spec->vlanTags == 2) && !i) ? ETHERTYPE_QINQ : ETHERTYPE_VLAN);
+        put16(p + off + 2, 100 + i);
+        off += 4;
+    }
+    put16(p + off, spec->ipv6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP);
+    off += 2;
+
+    memset(info, 0, sizeof(*info));
+    info->l3Off = off;
+    info->etherType = spec->ipv6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP;
+    tcpLen = sizeof(struct tcphdr) + spec->tcpOptLen;
+
+    if (!spec->ipv6) {
+        l3Len = kIPv4HdrLen + spec->ipOptLen;
+        p[off] = 0x40 | (l3Len >> 2);
+        put16(p + off + 2, l3Len + tcpLen + spec->payloadLen);
+        put16(p + off + 4, 0x1234);
+        p[off + 8] = 64;
+        p[off + 9] = l4Proto;
+        put32(p + off + 12, 0xc0a80001);
+        put32(p + off + 16, 0xc0a80102);
+
+        /* NOPs followed by end of options */
+        memset(p + off + kIPv4HdrLen, 1, spec->ipOptLen);
+
+        if (spec->ipOptLen)
+            p[off + l3Len - 1] = 0;
+
+        info->extHdrs = (spec->ipOptLen != 0);
+        off += l3Len;
+    } else {
+        l3Len = kIPv6HdrLen;
+
+        for (i = 0; i < spec->numExtHdrs; i++)
+            l3Len += spec->extLens[i];
+
+        put32(p + off, 0x60000000);
+        put16(p + off + 4, l3Len - kIPv6HdrLen + tcpLen + spec->payloadLen);
+        p[off + 6] = spec->numExtHdrs ? spec->extTypes[0] : l4Proto;
+        p[off + 7] = 64;
+
+        for (i = 0; i < 16; i++) {
+            p[off + 8 + i] = 0x20 + i;
+            p[off + 24 + i] = 0x40 + i;
+        }
+        off += kIPv6HdrLen;
+
+        for (i = 0; i < spec->numExtHdrs; i++) {
+            l = spec->extLens[i];
+            p[off] = (i + 1 < spec->numExtHdrs) ? spec->extTypes[i + 1] : l4Proto;
+            p[off + 1] = (spec->extTypes[i] == IPPROTO_AH) ? (l >> 2) - 2 : (l >> 3) - 1;
+            off += l;
+        }
+        info->extHdrs = (spec->numExtHdrs != 0);
+    }
+    info->l4Off = off;
+    info->l4Proto = l4Proto;
+    info->hdrLen = off;
+
+    if (l4Proto == IPPROTO_TCP) {
+        put16(p + off, 49152);
+        put16(p + off + 2, 443);
+        put32(p + off + 4, 0xfffff000);     /* wraps within the packet */
+        put32(p + off + 8, 0x01020304);
+        p[off + 12] = (tcpLen >> 2) << 4;
+        p[off + 13] = spec->flags;
+        put16(p + off + 14, 0xffff);
+
+        /* NOPs */
+        memset(p + off + sizeof(struct tcphdr), 1, spec->tcpOptLen);
+
+        off += tcpLen;
+        info->hdrLen = off;
+    }
+    for (i = 0; i < spec->payloadLen; i++)
+        p[off + i] = rand();
+
+    pkt.resize(off + spec->payloadLen);
+}
+
+#endif /* SimpleRTK5Tests_PacketBuilder_h */
@@ -0,0 +1,222 @@
+//
+//  RingTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the ring size selection, the ring index arithmetic and
+//  the page segment count, which decides if txLinearize() copies a
+//  tx packet. Build and run on the host with:
+//
+//  c++ -std=c++17 -ITests/include -ISimpleRTK5 Tests/RingTests.cpp -o /tmp/RingTests && /tmp/RingTests
+//
+
+#include <vector>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5Ring.hpp"
+
+/* Covers the largest number of segments of a tx packet. */
+#define kMaxAdvance 64
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static bool isPowerOf2(UInt32 n)
+{
+    return n && !(n & (n - 1));
+}
+
+/* Every requested size maps to a supported power of 2 not above it. */
+static void testRingSize()
+{
+    UInt32 req, size;
+
+    CHECK(rtlRingSize(0) == kMinRingSize, "0");
+    CHECK(rtlRingSize(UINT32_MAX) == kMaxRingSize, "UINT32_MAX");
+    CHECK(rtlRingSize(kDefaultRingSize) == kDefaultRingSize, "default");
+    CHECK(rtlRingSize(1000) == 512, "1000");
+    CHECK(rtlRingSize(1024) == 1024, "1024");
+    CHECK(rtlRingSize(4095) == 2048, "4095");
+
+    for (req = 0; req <= 2 * kMaxRingSize; req++) {
+        size = rtlRingSize(req);
+
+        CHECK(isPowerOf2(size), "req %u size %u", req, size);
+        CHECK((size >= kMinRingSize) && (size <= kMaxRingSize), "req %u size %u", req, size);
+
+        if ((req >= kMinRingSize) && (req <= kMaxRingSize))
+            CHECK((size <= req) && (2 * size > req), "req %u size %u", req, size);
+    }
+}
+
+/* Advancing by any count wraps around like modulo the ring size. */
+static void testAdvance(UInt32 size)
+{
+    UInt32 mask = size - 1;
+    UInt32 index, count;
+
+    for (index = 0; index < size; index++) {
+        for (count = 0; count <= kMaxAdvance; count++) {
+            CHECK(rtlRingAdvance(index, count, mask) == (index + count) % size,
+                  "size %u index %u count %u", size, index, count);
+        }
+    }
+    CHECK(rtlRingAdvance(mask, 1, mask) == 0, "size %u", size);
+
+    /* One below the first descriptor is the last one. */
+    CHECK(rtlRingAdvance(0 - 1, 0, mask) == mask, "size %u", size);
+    CHECK(rtlRingAdvance(0 - 1, 1, mask) == 0, "size %u", size);
+    CHECK(rtlRingAdvance(0 - 1, size, mask) == mask, "size %u", size);
+}
+
+/*
+ * The rx buffers are mapped in batches of kRxMemBatchSize. Batches
+ * must never straddle the end of the ring and one lap must visit
+ * each batch exactly once.
+ */
+static void testRxBatches(UInt32 size)
+{
+    UInt32 mask = size - 1;
+    UInt32 numBatches = size >> kRxMemBaseShift;
+    UInt32 seen[kMaxRingSize >> kRxMemBaseShift] = { 0 };
+    UInt32 index = 0;
+    UInt32 i;
+
+    CHECK((size % kRxMemBatchSize) == 0, "size %u", size);
+
+    for (i = 0; i < 2 * numBatches; i++) {
+        CHECK((index & kRxMemDescMask) == 0, "size %u index %u", size, index);
+        CHECK(index + kRxMemBatchSize <= size, "size %u index %u", size, index);
+
+        seen[index >> kRxMemBaseShift]++;
+        index = rtlRingAdvance(index, kRxMemBatchSize, mask);
+    }
+    CHECK(index == 0, "size %u index %u", size, index);
+
+    for (i = 0; i < numBatches; i++)
+        CHECK(seen[i] == 2, "size %u batch %u seen %u", size, i, seen[i]);
+}
+
+/* One buffer of an mbuf chain */
+typedef struct TxBuf {
+    IOVirtualAddress d;
+    UInt32 len;
+} TxBuf;
+
+/* Same as the count in SimpleRTK5::txLinearize() with a vector for the chain */
+static UInt32 chainSegs(const std::vector<TxBuf> &chain)
+{
+    UInt32 numSegs = 0;
+    size_t i;
+
+    for (i = 0; i < chain.size(); i++)
+        numSegs += rtlTxPageSegs(chain[i].d, chain[i].len);
+
+    return numSegs;
+}
+
+/* Count the pages a buffer touches one byte at a time. */
+static UInt32 refPageSegs(IOVirtualAddress d, UInt32 len)
+{
+    IOVirtualAddress page = 0;
+    UInt32 i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (!n || (((d + i) >> PAGE_SHIFT) != page)) {
+            page = (d + i) >> PAGE_SHIFT;
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Buffers which straddle page boundaries take a segment per page,
+ * empty ones none. A packet is only linearized with more than
+ * kMaxSegs segments.
+ */
+static void testPageSegs()
+{
+    std::vector<TxBuf> chain;
+    IOVirtualAddress base = 0x7f0000100000ULL;
+    UInt32 off, len, i;
+
+    CHECK(rtlTxPageSegs(base, 0) == 0, "empty");
+    CHECK(rtlTxPageSegs(base + PAGE_SIZE - 1, 0) == 0, "empty at page end");
+    CHECK(rtlTxPageSegs(base + PAGE_SIZE - 1, 1) == 1, "last byte of a page");
+    CHECK(rtlTxPageSegs(base + PAGE_SIZE - 1, 2) == 2, "2 bytes across a boundary");
+    CHECK(rtlTxPageSegs(base, PAGE_SIZE) == 1, "aligned page");
+    CHECK(rtlTxPageSegs(base + 1, PAGE_SIZE) == 2, "unaligned page");
+    CHECK(rtlTxPageSegs(base + 100, PAGE_SIZE - 100) == 1, "up to the boundary");
+    CHECK(rtlTxPageSegs(base + 100, 2 * PAGE_SIZE) == 3, "2 pages unaligned");
+    CHECK(rtlTxPageSegs(base, 65536) == 16, "64k aligned");
+    CHECK(rtlTxPageSegs(base + 2048, 65536) == 17, "64k unaligned");
+
+    /* Offsets around a boundary with lengths up to 3 pages */
+    for (off = 0; off < 2 * PAGE_SIZE; off += 61) {
+        for (len = 0; len <= 3 * PAGE_SIZE; len += (len < 8) ? 1 : 127) {
+            CHECK(rtlTxPageSegs(base + off, len) == refPageSegs(base + off, len),
+                  "off %u len %u: %u expected %u", off, len,
+                  rtlTxPageSegs(base + off, len), refPageSegs(base + off, len));
+        }
+    }
+
+    /* 16 mbufs, each straddling a page boundary, just fit. */
+    for (i = 0; i < kMaxSegs / 2; i++)
+        chain.push_back({ base + (2 * i + 1) * PAGE_SIZE - 50, 100 });
+
+    CHECK(chainSegs(chain) == kMaxSegs, "%u segments", chainSegs(chain));
+
+    /* Empty mbufs in between don't count. */
+    for (i = 0; i < kMaxSegs / 2; i++)
+        chain.insert(chain.begin() + 2 * i, { base + i * 64, 0 });
+
+    chain.push_back({ base + 64 * PAGE_SIZE, 0 });
+
+    CHECK(chainSegs(chain) == kMaxSegs, "%u segments with empty mbufs", chainSegs(chain));
+
+    /* One more byte across a boundary needs to be linearized. */
+    chain.push_back({ base + 64 * PAGE_SIZE - 1, 2 });
+    CHECK(chainSegs(chain) == kMaxSegs + 2, "%u segments", chainSegs(chain));
+
+    /* A chain of small mbufs in distinct pages */
+    chain.clear();
+
+    for (i = 0; i <= kMaxSegs; i++)
+        chain.push_back({ base + i * 3 * PAGE_SIZE + 256, 256 });
+
+    CHECK(chainSegs(chain) == kMaxSegs + 1, "%u segments", chainSegs(chain));
+
+    /* A single 64k TSO payload in one unaligned buffer fits. */
+    chain.clear();
+    chain.push_back({ base + 2, 66 });
+    chain.push_back({ base + PAGE_SIZE + 8, 65536 });
+    CHECK(chainSegs(chain) == 18, "%u segments", chainSegs(chain));
+}
+
+int main()
+{
+    UInt32 size;
+
+    testRingSize();
+    testPageSegs();
+
+    for (size = kMinRingSize; size <= kMaxRingSize; size <<= 1) {
+        testAdvance(size);
+        testRxBatches(size);
+    }
+    if (failures) {
+        printf("RingTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("RingTests: passed.\n");
+    return 0;
+}
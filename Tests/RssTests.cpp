@@ -0,0 +1,367 @@
+//
+//  RssTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Ring simulator for the RSS multi-queue receive path. A model of the
+//  NIC hashes flows with the Toeplitz function, steers them through the
+//  indirection table the driver programs and fills the per-queue rings,
+//  which are drained the same way pollInputPackets() does. Reports the
+//  spreading over the queues and the packets drained per poll. Build
+//  and run on the host with:
+//
+//  c++ -std=c++17 -ITests/include -ISimpleRTK5 Tests/RssTests.cpp -o /tmp/RssTests && /tmp/RssTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5Ring.hpp"
+#include "SimpleRTK5Rss.hpp"
+
+#define kMaxQueues 4
+#define kNumFlows 4096
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* Toeplitz hash as computed by the NIC. */
+static UInt32 toeplitz(const UInt8 *key, const UInt8 *data, UInt32 len)
+{
+    UInt32 hash = 0;
+    UInt32 window = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+    UInt32 i, b;
+
+    for (i = 0; i < len; i++) {
+        for (b = 0; b < 8; b++) {
+            if (data[i] & (0x80 >> b))
+                hash ^= window;
+
+            window <<= 1;
+
+            if ((i + 4 < kRssKeySize) && (key[i + 4] & (0x80 >> b)))
+                window |= 1;
+        }
+    }
+    return hash;
+}
+
+/* Hash input of an IPv4/TCP flow: addresses and ports in network order. */
+static void tcp4Tuple(UInt8 *tuple, const UInt8 *src, const UInt8 *dst,
+                      UInt16 sport, UInt16 dport)
+{
+    memcpy(&tuple[0], src, 4);
+    memcpy(&tuple[4], dst, 4);
+    tuple[8] = sport >> 8;
+    tuple[9] = sport & 0xff;
+    tuple[10] = dport >> 8;
+    tuple[11] = dport & 0xff;
+}
+
+/* The indirection table as read back from the registers. */
+static void loadTable(UInt8 *table, UInt32 numQueues)
+{
+    UInt32 reta;
+    UInt32 i, j;
+
+    for (i = 0; i < kRssIndirTblSize; i += 4) {
+        reta = rtlRssReta(i, numQueues);
+
+        for (j = 0; j < 4; j++)
+            table[i + j] = (reta >> (j * 8)) & 0xff;
+    }
+}
+
+/* Microsoft's RSS verification suite, IPv4 with TCP. */
+static void testToeplitz()
+{
+    static const UInt8 key[kRssKeySize] = {
+        0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+        0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+        0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+        0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+        0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+    };
+    static const struct {
+        UInt8 src[4];
+        UInt8 dst[4];
+        UInt16 sport;
+        UInt16 dport;
+        UInt32 hash;
+    } vectors[] = {
+        { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766, 0x51ccc178 },
+        { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739, 0xc626b0ea },
+        { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024, 0x5c2b394a },
+        { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217, 0xafc7327f },
+        { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303, 0x10e828a2 },
+    };
+    UInt8 tuple[12];
+    UInt32 hash;
+    UInt32 i;
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        tcp4Tuple(tuple, vectors[i].src, vectors[i].dst, vectors[i].sport, vectors[i].dport);
+        hash = toeplitz(key, tuple, sizeof(tuple));
+
+        CHECK(hash == vectors[i].hash, "vector %u hash 0x%08x", i, hash);
+    }
+}
+
+static void testTable()
+{
+    UInt8 table[kRssIndirTblSize];
+    UInt32 counts[kMaxQueues];
+    UInt32 numQueues, i;
+
+    CHECK(rtlRssQueueShift(1) == 0, "1");
+    CHECK(rtlRssQueueShift(2) == 1, "2");
+    CHECK(rtlRssQueueShift(4) == 2, "4");
+
+    CHECK(rtlRssReta(0, 1) == 0, "0x%08x", rtlRssReta(0, 1));
+    CHECK(rtlRssReta(0, 2) == 0x01000100, "0x%08x", rtlRssReta(0, 2));
+    CHECK(rtlRssReta(4, 4) == 0x03020100, "0x%08x", rtlRssReta(4, 4));
+
+    /* Every queue owns the same number of entries. */
+    for (numQueues = 1; numQueues <= kMaxQueues; numQueues <<= 1) {
+        loadTable(table, numQueues);
+        memset(counts, 0, sizeof(counts));
+
+        for (i = 0; i < kRssIndirTblSize; i++) {
+            CHECK(table[i] < numQueues, "queues %u entry %u", numQueues, i);
+            counts[table[i] % kMaxQueues]++;
+        }
+        for (i = 0; i < numQueues; i++)
+            CHECK(counts[i] == kRssIndirTblSize / numQueues,
+                  "queues %u queue %u entries %u", numQueues, i, counts[i]);
+    }
+}
+
+typedef struct SimFlow {
+    UInt32 hash;
+    UInt32 queue;
+    UInt32 seq;
+} SimFlow;
+
+/*
+ * A receive ring of the simulator. The NIC writes to the tail, the
+ * driver drains from the head. Each slot records the flow and the
+ * sequence number, so that the order within a flow can be checked.
+ */
+typedef struct SimRing {
+    UInt32 flow[kMaxRingSize];
+    UInt32 seq[kMaxRingSize];
+    UInt32 head;
+    UInt32 tail;
+    UInt32 count;
+    UInt64 received;
+    UInt64 drained;
+    UInt64 dropped;
+    UInt32 maxFill;
+} SimRing;
+
+typedef struct SimNic {
+    UInt8 key[kRssKeySize];
+    UInt8 table[kRssIndirTblSize];
+    SimFlow flows[kNumFlows];
+    SimRing rings[kMaxQueues];
+    UInt32 lastSeq[kNumFlows];
+    UInt32 numQueues;
+    UInt32 ringSize;
+    UInt32 pollQueue;
+} SimNic;
+
+static void simInit(SimNic *nic, UInt32 numQueues, UInt32 ringSize)
+{
+    UInt8 tuple[12];
+    UInt8 src[4], dst[4];
+    UInt32 i;
+
+    memset(nic, 0, sizeof(*nic));
+    nic->numQueues = numQueues;
+    nic->ringSize = ringSize;
+
+    for (i = 0; i < kRssKeySize; i++)
+        nic->key[i] = rand() & 0xff;
+
+    loadTable(nic->table, numQueues);
+
+    for (i = 0; i < kNumFlows; i++) {
+        *(UInt32 *)src = rand();
+        *(UInt32 *)dst = rand();
+        tcp4Tuple(tuple, src, dst, 1024 + (rand() % 60000), 443);
+
+        nic->flows[i].hash = toeplitz(nic->key, tuple, sizeof(tuple));
+        nic->flows[i].queue = nic->table[nic->flows[i].hash & kRssIndirTblMask];
+    }
+}
+
+/* The NIC receives a packet of a flow. */
+static void simReceive(SimNic *nic, UInt32 flow)
+{
+    SimFlow *f = &nic->flows[flow];
+    SimRing *ring = &nic->rings[f->queue];
+
+    ring->received++;
+
+    /* Out of descriptors, the frame is dropped. */
+    if (ring->count == nic->ringSize) {
+        ring->dropped++;
+        f->seq++;
+        return;
+    }
+    ring->flow[ring->tail] = flow;
+    ring->seq[ring->tail] = f->seq++;
+    ring->tail = rtlRingAdvance(ring->tail, 1, nic->ringSize - 1);
+    ring->count++;
+
+    if (ring->count > ring->maxFill)
+        ring->maxFill = ring->count;
+}
+
+/* Drain a ring like rxInterrupt() with at most budget packets. */
+static UInt32 simDrain(SimNic *nic, SimRing *ring, UInt32 budget)
+{
+    UInt32 flow, seq;
+    UInt32 n = 0;
+
+    while (ring->count && (n < budget)) {
+        flow = ring->flow[ring->head];
+        seq = ring->seq[ring->head];
+
+        CHECK(seq >= nic->lastSeq[flow], "flow %u seq %u last %u", flow, seq, nic->lastSeq[flow]);
+        nic->lastSeq[flow] = seq + 1;
+
+        ring->head = rtlRingAdvance(ring->head, 1, nic->ringSize - 1);
+        ring->count--;
+        n++;
+    }
+    ring->drained += n;
+    return n;
+}
+
+/*
+ * One poll of pollInputPackets(): the queues share the budget and the
+ * first queue rotates, so that no queue is starved.
+ */
+static UInt32 simPoll(SimNic *nic, UInt32 budget)
+{
+    UInt32 mask = nic->numQueues - 1;
+    UInt32 packets = 0;
+    UInt32 i;
+
+    for (i = 0; (i < nic->numQueues) && (packets < budget); i++)
+        packets += simDrain(nic, &nic->rings[(nic->pollQueue + i) & mask], budget - packets);
+
+    nic->pollQueue = (nic->pollQueue + 1) & mask;
+    return packets;
+}
+
+/* Flows hashed with a random key are spread evenly over the queues. */
+static void testSpreading(UInt32 numQueues)
+{
+    static SimNic nic;
+    UInt32 counts[kMaxQueues] = { 0 };
+    UInt32 mean = kNumFlows / numQueues;
+    UInt32 i;
+
+    simInit(&nic, numQueues, kDefaultRingSize);
+
+    for (i = 0; i < kNumFlows; i++)
+        counts[nic.flows[i].queue]++;
+
+    printf("RssTests: %u queue(s), flows per queue:", numQueues);
+
+    for (i = 0; i < numQueues; i++) {
+        printf(" %u", counts[i]);
+        CHECK((counts[i] > mean - mean / 10) && (counts[i] < mean + mean / 10),
+              "queues %u queue %u flows %u", numQueues, i, counts[i]);
+    }
+    printf("\n");
+}
+
+/*
+ * Offer load packets per poll of random flows plus a burst every
+ * kSimBurstPeriod polls and drain them with a budget per poll.
+ * Reports the packets drained per poll, the peak ring fill and the
+ * share of packets dropped for lack of descriptors.
+ */
+#define kSimBurstPeriod 64
+
+static void simulate(UInt32 numQueues, UInt32 ringSize, UInt32 load,
+                     UInt32 burst, UInt32 budget, UInt32 polls, bool lossless)
+{
+    static SimNic nic;
+    UInt64 drained = 0;
+    UInt64 received = 0;
+    UInt64 dropped = 0;
+    UInt32 maxFill = 0;
+    UInt32 p, i;
+
+    simInit(&nic, numQueues, ringSize);
+
+    for (p = 0; p < polls; p++) {
+        for (i = 0; i < load; i++)
+            simReceive(&nic, rand() % kNumFlows);
+
+        if ((p % kSimBurstPeriod) == 0) {
+            for (i = 0; i < burst; i++)
+                simReceive(&nic, rand() % kNumFlows);
+        }
+
+        drained += simPoll(&nic, budget);
+    }
+    for (i = 0; i < numQueues; i++) {
+        received += nic.rings[i].received;
+        dropped += nic.rings[i].dropped;
+        maxFill = (nic.rings[i].maxFill > maxFill) ? nic.rings[i].maxFill : maxFill;
+
+        CHECK(nic.rings[i].received == nic.rings[i].drained + nic.rings[i].dropped + nic.rings[i].count,
+              "queues %u queue %u", numQueues, i);
+        CHECK(nic.rings[i].drained > 0, "queues %u queue %u starved", numQueues, i);
+    }
+    if (lossless)
+        CHECK(dropped == 0, "queues %u ring %u burst %u dropped %llu",
+              numQueues, ringSize, burst, (unsigned long long)dropped);
+
+    printf("RssTests: %u queue(s), ring %4u, burst %4u: %5.1f pkts/poll, "
+           "max fill %4u, dropped %5.2f%%\n", numQueues, ringSize, burst,
+           (double)drained / polls, maxFill, 100.0 * dropped / received);
+}
+
+int main()
+{
+    UInt32 numQueues;
+
+    srand(1);
+
+    testToeplitz();
+    testTable();
+
+    for (numQueues = 2; numQueues <= kMaxQueues; numQueues <<= 1)
+        testSpreading(numQueues);
+
+    /*
+     * A burst of 1536 packets overflows a single ring of the default
+     * size, while it fits into four of them or into the largest ring.
+     */
+    for (numQueues = 1; numQueues <= kMaxQueues; numQueues <<= 1) {
+        simulate(numQueues, kDefaultRingSize, 32, 0, 64, 100000, true);
+        simulate(numQueues, kDefaultRingSize, 32, 1536, 64, 100000, numQueues == kMaxQueues);
+        simulate(numQueues, kMaxRingSize, 32, 1536, 64, 100000, true);
+    }
+    if (failures) {
+        printf("RssTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("RssTests: passed.\n");
+    return 0;
+}
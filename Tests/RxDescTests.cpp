@@ -0,0 +1,204 @@
+//
+//  RxDescTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the extended rx descriptor layouts and their decoders.
+//  The descriptor images are given as raw little endian bytes as the
+//  NIC writes them back, following the layouts of Realtek's r8125
+//  driver. Build and run on the host with:
+//
+//  c++ -std=c++17 -ITests/include -ISimpleRTK5 -ISimpleRTK5/linux Tests/RxDescTests.cpp -o /tmp/RxDescTests && /tmp/RxDescTests
+//
+
+#include <stddef.h>
+#include <string.h>
+
+#include <IOKit/IOLib.h>
+#include "linux/linux.h"
+#include "SimpleRTK5RxDesc.hpp"
+
+static int failures;
+
+#define CHECK_EQ(a, b)                                              \
+    do {                                                            \
+        UInt32 _a = (UInt32)(a), _b = (UInt32)(b);                  \
+        if (_a != _b) {                                             \
+            printf("%s:%d: %s == %s failed: 0x%x != 0x%x\n",        \
+                   __FILE__, __LINE__, #a, #b, _a, _b);             \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static UInt64 le64(const UInt8 *p)
+{
+    UInt64 v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+
+    return v;
+}
+
+static void testLayout()
+{
+    CHECK_EQ(sizeof(RtlRxDesc), 16);
+    CHECK_EQ(sizeof(RtlRxDescV3), 32);
+    CHECK_EQ(offsetof(RtlRxDescV3, rss), 8);
+    CHECK_EQ(offsetof(RtlRxDescV3, addr), 16);
+    CHECK_EQ(offsetof(RtlRxDescV3, opts), 24);
+    CHECK_EQ(sizeof(RtlRxDescV4), 16);
+    CHECK_EQ(offsetof(RtlRxDescV4, addr), 0);
+    CHECK_EQ(offsetof(RtlRxDescV4, opts), 8);
+}
+
+/* Decode a v3 image the same way rxScanBatch() does. */
+static void decodeV3(rtlRxDescStatus *status, const UInt8 *image)
+{
+    RtlRxDescV3 desc;
+
+    memcpy(&desc, image, sizeof(desc));
+    rxDecodeDescV3(status, le64((UInt8 *)&desc.opts), le64((UInt8 *)&desc.rss));
+}
+
+static void decodeV4(rtlRxDescStatus *status, const UInt8 *image)
+{
+    RtlRxDescV4 desc;
+
+    memcpy(&desc, image, sizeof(desc));
+    rxDecodeDescV4(status, le64((UInt8 *)&desc.opts), le64((UInt8 *)&desc.addr));
+}
+
+static void testDecodeV3()
+{
+    rtlRxDescStatus status;
+
+    /*
+     * IPv4/TCP frame of 1514 bytes with good checksums. RSS result
+     * 0x12345678, header info IPv4 | TCP, timestamp in the address
+     * field, opts2: RxV4F | RxTCPT_v3, opts1: FirstFrag_V3 |
+     * LastFrag_V3 | 0x5ea.
+     */
+    static const UInt8 tcp4[32] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x78, 0x56, 0x34, 0x12, 0x00, 0x00, 0x00, 0x24,
+        0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+        0x00, 0x00, 0x00, 0x50, 0xea, 0x05, 0x00, 0x03,
+    };
+    decodeV3(&status, tcp4);
+    CHECK_EQ(status.opts1, FirstFrag | LastFrag | RxTCPT | 0x5ea);
+    CHECK_EQ(status.opts2, RxV4F);
+    CHECK_EQ(status.hash, 0x12345678);
+    CHECK_EQ(status.type, kRxPktTypeIPv4 | kRxPktTypeTCP);
+
+    /*
+     * IPv6/UDP frame with a VLAN tag and a bad UDP checksum on the
+     * last descriptor of the ring. Header info IPv6 | UDP, opts2:
+     * RxV6F | RxUDPT_v3 | RxUDPF_v3 | RxVlanTag | 0x6400, opts1:
+     * RingEnd | FirstFrag_V3 | LastFrag_V3 | 0x80.
+     */
+    static const UInt8 udp6[32] = {
+        0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+        0xef, 0xbe, 0xad, 0xde, 0x00, 0x00, 0x00, 0x12,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x64, 0x01, 0xa2, 0x80, 0x00, 0x00, 0x43,
+    };
+    decodeV3(&status, udp6);
+    CHECK_EQ(status.opts1, RingEnd | FirstFrag | LastFrag | RxUDPT | RxUDPF | 0x80);
+    CHECK_EQ(status.opts2, RxV6F | RxVlanTag | 0x6400);
+    CHECK_EQ(status.hash, 0xdeadbeef);
+    CHECK_EQ(status.type, kRxPktTypeIPv6 | kRxPktTypeUDP);
+
+    /*
+     * Runt frame with a CRC error and a bad IP checksum. No header
+     * info, so that neither a hash nor a type is reported. opts2:
+     * RxV4F | RxIPF_v3, opts1: FirstFrag_V3 | LastFrag_V3 |
+     * RxRES_V3 | RxRUNT_V3 | RxCRC_V3 | 0x3c.
+     */
+    static const UInt8 runt[32] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x78, 0x56, 0x34, 0x12, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x44, 0x3c, 0x00, 0x1a, 0x03,
+    };
+    decodeV3(&status, runt);
+    CHECK_EQ(status.opts1, FirstFrag | LastFrag | RxRES | RxRUNT | RxCRC | RxIPF | 0x3c);
+    CHECK_EQ(status.opts2, RxV4F);
+    CHECK_EQ(status.hash, 0);
+    CHECK_EQ(status.type, 0);
+
+    /* A descriptor which is still owned by the NIC. */
+    static const UInt8 owned[32] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x10, 0x34, 0x12, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x80,
+    };
+    decodeV3(&status, owned);
+    CHECK_EQ(status.opts1, DescOwn | 0x800);
+}
+
+static void testDecodeV4()
+{
+    rtlRxDescStatus status;
+
+    /*
+     * IPv6/UDP frame of 100 bytes. RSS info IPv6 | UDP, RSS result
+     * 0xdeadbeef, opts2: RxV6F, opts1: FirstFrag | LastFrag |
+     * RxUDPT_v4 | 0x64.
+     */
+    static const UInt8 udp6[16] = {
+        0x00, 0x00, 0x00, 0x28, 0xef, 0xbe, 0xad, 0xde,
+        0x00, 0x00, 0x00, 0x80, 0x64, 0x00, 0x08, 0x30,
+    };
+    decodeV4(&status, udp6);
+    CHECK_EQ(status.opts1, FirstFrag | LastFrag | RxUDPT | 0x64);
+    CHECK_EQ(status.opts2, RxV6F);
+    CHECK_EQ(status.hash, 0xdeadbeef);
+    CHECK_EQ(status.type, kRxPktTypeIPv6 | kRxPktTypeUDP);
+
+    /*
+     * IPv4/TCP frame with bad IP and TCP checksums on the last
+     * descriptor of the ring. RSS info IPv4 | TCP, opts2: RxV4F |
+     * RxVlanTag | 0x0a00, opts1: RingEnd | FirstFrag | LastFrag |
+     * RxTCPT_v4 | RxIPF_v4 | RxTCPF_v4 | 0x5ea.
+     */
+    static const UInt8 tcp4[16] = {
+        0x00, 0x00, 0x00, 0x50, 0x44, 0x33, 0x22, 0x11,
+        0x00, 0x0a, 0x01, 0x40, 0xea, 0x85, 0x06, 0x70,
+    };
+    decodeV4(&status, tcp4);
+    CHECK_EQ(status.opts1, RingEnd | FirstFrag | LastFrag | RxTCPT | RxIPF | RxTCPF | 0x5ea);
+    CHECK_EQ(status.opts2, RxV4F | RxVlanTag | 0x0a00);
+    CHECK_EQ(status.hash, 0x11223344);
+    CHECK_EQ(status.type, kRxPktTypeIPv4 | kRxPktTypeTCP);
+
+    /*
+     * Frame with a CRC error and a bad UDP checksum. Without RSS
+     * info, neither a hash nor a type is reported. opts1: FirstFrag
+     * | LastFrag | RxRES_V4 | RxCRC_V4 | RxUDPF_v4 | 0x40.
+     */
+    static const UInt8 crc[16] = {
+        0x00, 0x00, 0x00, 0x00, 0x44, 0x33, 0x22, 0x11,
+        0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x51, 0x30,
+    };
+    decodeV4(&status, crc);
+    CHECK_EQ(status.opts1, FirstFrag | LastFrag | RxRES | RxCRC | RxUDPF | 0x40);
+    CHECK_EQ(status.opts2, 0);
+    CHECK_EQ(status.hash, 0);
+    CHECK_EQ(status.type, 0);
+}
+
+int main()
+{
+    testLayout();
+    testDecodeV3();
+    testDecodeV4();
+
+    if (failures) {
+        printf("RxDescTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("RxDescTests: passed.\n");
+    return 0;
+}
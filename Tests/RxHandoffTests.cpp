@@ -0,0 +1,257 @@
+//
+//  RxHandoffTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Benchmark of the handoff of received packets to the network stack
+//  with a mock IONetworkInterface. Handing each frame over as soon as
+//  it's complete is compared to collecting the frames of a drain in a
+//  list, the way rxListAppend() and rxListHandoff() do, and passing
+//  them up after the drain. Like real mbufs, the mock ones are 256
+//  bytes and point to a 2k cluster with the frame. Build and run on
+//  the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include Tests/RxHandoffTests.cpp -o /tmp/RxHandoffTests && /tmp/RxHandoffTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include <IOKit/IOLib.h>
+#include <sys/kpi_mbuf.h>
+
+#define kBatchSize      64
+#define kNumPackets     (16 * 1024)
+#define kMbufSize       256
+#define kClusterSize    2048
+#define kBenchBatches   (256 * 1024)
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* An mbuf with its packet header, pointing to a cluster. */
+struct __mbuf {
+    mbuf_t nextpkt;
+    UInt8 *data;
+    UInt32 len;
+    UInt8 pad[kMbufSize - 2 * sizeof(void *) - sizeof(UInt32)];
+};
+
+static inline mbuf_t mbuf_nextpkt(mbuf_t m) { return m->nextpkt; }
+static inline void mbuf_setnextpkt(mbuf_t m, mbuf_t next) { m->nextpkt = next; }
+static inline size_t mbuf_pkthdr_len(mbuf_t m) { return m->len; }
+
+/*
+ * Mock of IONetworkInterface::enqueueInputPacket(), which looks at
+ * the frame's header like the interface's input tap does and adds
+ * the packet to the input queue.
+ */
+typedef struct MockInterface {
+    mbuf_t queueHead;
+    mbuf_t queueTail;
+    UInt32 queued;
+    UInt64 calls;
+    UInt64 sum;
+} MockInterface;
+
+static void __attribute__((noinline)) enqueueInputPacket(MockInterface *intf, mbuf_t m)
+{
+    intf->sum += m->data[12] + m->data[13];
+
+    if (intf->queueTail)
+        intf->queueTail->nextpkt = m;
+    else
+        intf->queueHead = m;
+
+    intf->queueTail = m;
+    intf->queued++;
+    intf->calls++;
+}
+
+/* The stack takes the input queue, like flushInputQueue(). */
+static UInt32 flushInputQueue(MockInterface *intf)
+{
+    UInt32 count = intf->queued;
+
+    intf->queueHead = intf->queueTail = NULL;
+    intf->queued = 0;
+
+    return count;
+}
+
+typedef struct MockRing {
+    mbuf_t rxListHead;
+    mbuf_t rxListTail;
+    UInt32 rxListCount;
+    UInt32 rxListBytes;
+    UInt64 rxPackets;
+    UInt64 rxBytes;
+    UInt64 counterUpdates;
+} MockRing;
+
+/* Same as SimpleRTK5::rxListAppend() */
+static inline void rxListAppend(MockRing *ring, mbuf_t m)
+{
+    if (ring->rxListTail)
+        mbuf_setnextpkt(ring->rxListTail, m);
+    else
+        ring->rxListHead = m;
+
+    ring->rxListTail = m;
+    ring->rxListCount++;
+    ring->rxListBytes += (UInt32)mbuf_pkthdr_len(m);
+}
+
+/* Same as SimpleRTK5::rxListHandoff() */
+static void rxListHandoff(MockRing *ring, MockInterface *intf)
+{
+    mbuf_t m, next;
+
+    for (m = ring->rxListHead; m; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+
+        enqueueInputPacket(intf, m);
+    }
+    ring->rxPackets += ring->rxListCount;
+    ring->rxBytes += ring->rxListBytes;
+    ring->counterUpdates++;
+
+    ring->rxListHead = ring->rxListTail = NULL;
+    ring->rxListCount = 0;
+    ring->rxListBytes = 0;
+}
+
+static struct __mbuf *packets;
+static UInt8 *clusters;
+
+/* The completion of a frame in rxInterrupt() sets its length. */
+static inline mbuf_t completeFrame(UInt32 i)
+{
+    mbuf_t m = &packets[i % kNumPackets];
+
+    m->len = 60 + (i % 1455);
+    m->nextpkt = NULL;
+    return m;
+}
+
+/* Each frame is handed over as soon as it's complete. */
+static void drainPerFrame(MockRing *ring, MockInterface *intf, UInt32 first)
+{
+    mbuf_t m;
+    UInt32 i;
+
+    for (i = first; i < first + kBatchSize; i++) {
+        m = completeFrame(i);
+
+        ring->rxPackets++;
+        ring->rxBytes += mbuf_pkthdr_len(m);
+        ring->counterUpdates++;
+
+        enqueueInputPacket(intf, m);
+    }
+    flushInputQueue(intf);
+}
+
+/* The frames are collected and handed over after the drain. */
+static void drainList(MockRing *ring, MockInterface *intf, UInt32 first)
+{
+    UInt32 i;
+
+    for (i = first; i < first + kBatchSize; i++)
+        rxListAppend(ring, completeFrame(i));
+
+    if (ring->rxListHead)
+        rxListHandoff(ring, intf);
+
+    flushInputQueue(intf);
+}
+
+static void testList()
+{
+    MockInterface intf;
+    MockRing ring;
+    mbuf_t m;
+    UInt32 i, bytes = 0;
+
+    memset(&intf, 0, sizeof(intf));
+    memset(&ring, 0, sizeof(ring));
+
+    for (i = 0; i < kBatchSize; i++) {
+        rxListAppend(&ring, completeFrame(i));
+        bytes += 60 + i;
+    }
+    CHECK(ring.rxListCount == kBatchSize, "count %u", ring.rxListCount);
+    CHECK(ring.rxListBytes == bytes, "bytes %u expected %u", ring.rxListBytes, bytes);
+
+    rxListHandoff(&ring, &intf);
+    CHECK(intf.calls == kBatchSize, "calls %llu", (unsigned long long)intf.calls);
+    CHECK(ring.rxPackets == kBatchSize, "packets %llu", (unsigned long long)ring.rxPackets);
+    CHECK(ring.rxBytes == bytes, "bytes %llu", (unsigned long long)ring.rxBytes);
+    CHECK(!ring.rxListHead && !ring.rxListTail && !ring.rxListCount, "list not reset");
+
+    /* The packets are passed up in order. */
+    for (i = 0, m = intf.queueHead; m; m = m->nextpkt, i++)
+        CHECK(m == &packets[i], "packet %u out of order", i);
+
+    CHECK(i == kBatchSize, "queued %u", i);
+    CHECK(flushInputQueue(&intf) == kBatchSize, "flush");
+}
+
+typedef void (*DrainFunc)(MockRing *ring, MockInterface *intf, UInt32 first);
+
+static void bench(const char *name, DrainFunc drain)
+{
+    MockInterface intf;
+    MockRing ring;
+    UInt32 b;
+
+    memset(&intf, 0, sizeof(intf));
+    memset(&ring, 0, sizeof(ring));
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (b = 0; b < kBenchBatches; b++)
+        drain(&ring, &intf, b * kBatchSize);
+
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    CHECK(ring.rxPackets == (UInt64)kBenchBatches * kBatchSize, "%s: packets", name);
+
+    printf("RxHandoffTests: %-9s %5.1f enqueue calls, %5.1f counter updates, "
+           "%7.1f ns per %u packet batch\n", name, (double)intf.calls / kBenchBatches,
+           (double)ring.counterUpdates / kBenchBatches, ns / kBenchBatches, kBatchSize);
+}
+
+int main()
+{
+    packets = (struct __mbuf *)calloc(kNumPackets, sizeof(struct __mbuf));
+    clusters = (UInt8 *)calloc(kNumPackets, kClusterSize);
+
+    for (UInt32 i = 0; i < kNumPackets; i++)
+        packets[i].data = clusters + i * kClusterSize;
+
+    testList();
+    bench("per frame", drainPerFrame);
+    bench("list", drainList);
+
+    free(packets);
+    free(clusters);
+
+    if (failures) {
+        printf("RxHandoffTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("RxHandoffTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,334 @@
+//
+//  RxMagTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests and stress benchmark of the rx pool's magazine caches. The
+//  consumer and the refill thread run on two threads with a mock
+//  allocator, which tracks the state of each packet, so that a packet
+//  handed out twice or lost on the way is detected. Build and run on
+//  the host with:
+//
+//  c++ -std=c++17 -O2 -pthread -ITests/include -ISimpleRTK5 Tests/RxMagTests.cpp -o /tmp/RxMagTests && /tmp/RxMagTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <IOKit/IOLib.h>
+#include <sys/kpi_mbuf.h>
+#include "SimpleRTK5RxMag.hpp"
+
+#define kStressPackets (4 * 1024 * 1024)
+#define kStressCapacity 100
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+enum {
+    kPktFree = 0,   /* not allocated yet */
+    kPktCached,     /* allocated and in a magazine */
+    kPktUsed,       /* handed out to the consumer */
+};
+
+struct __mbuf {
+    std::atomic<UInt32> state;
+};
+
+/*
+ * Mock allocator: packets are taken from a static array in order.
+ * Every failPeriod-th allocation fails to exercise partial refills.
+ */
+static struct __mbuf *packets;
+static std::atomic<UInt32> nextPacket;
+static std::atomic<UInt32> allocCalls;
+static UInt32 numPackets;
+static UInt32 failPeriod;
+
+static mbuf_t mockAlloc(UInt32 bufSize, mbuf_how_t how)
+{
+    UInt32 expected = kPktFree;
+    UInt32 i;
+
+    if (failPeriod && ((allocCalls.fetch_add(1) % failPeriod) == failPeriod - 1))
+        return NULL;
+
+    i = nextPacket.fetch_add(1);
+
+    if (i >= numPackets)
+        return NULL;
+
+    if (!packets[i].state.compare_exchange_strong(expected, kPktCached))
+        printf("RxMagTests: packet %u allocated twice\n", i);
+
+    return &packets[i];
+}
+
+static void mockReset(UInt32 count, UInt32 period)
+{
+    delete[] packets;
+    packets = new struct __mbuf[count];
+
+    for (UInt32 i = 0; i < count; i++)
+        packets[i].state = kPktFree;
+
+    numPackets = count;
+    nextPacket = 0;
+    allocCalls = 0;
+    failPeriod = period;
+}
+
+/* The consumer marks a packet as used, which must have been cached. */
+static bool consume(mbuf_t m)
+{
+    UInt32 expected = kPktCached;
+
+    return m->state.compare_exchange_strong(expected, kPktUsed);
+}
+
+/* Same as SimpleRTK5RxPool::setupCache() with the mock allocator. */
+static bool setupCache(RxPoolCache *cache, UInt32 capacity)
+{
+    RxPoolMag *mag;
+    UInt32 ringSize;
+    UInt32 i;
+
+    memset(cache, 0, sizeof(*cache));
+    ringSize = rxMagSetup(cache, capacity, 2048);
+
+    cache->mags = (RxPoolMag *)calloc(cache->numMags, sizeof(RxPoolMag));
+    cache->fullRing = (RxPoolMag **)calloc(ringSize, sizeof(RxPoolMag *));
+    cache->emptyRing = (RxPoolMag **)calloc(ringSize, sizeof(RxPoolMag *));
+    cache->loaded = &cache->mags[0];
+
+    for (i = 1; i < cache->numMags; i++) {
+        mag = &cache->mags[i];
+
+        while (mag->count < kRxPoolMagSize) {
+            if (!(mag->pkts[mag->count] = mockAlloc(cache->bufSize, MBUF_WAITOK)))
+                return false;
+
+            mag->count++;
+        }
+        rxMagPut(cache->fullRing, cache->ringMask, &cache->fullTail, mag);
+    }
+    return true;
+}
+
+static void freeCache(RxPoolCache *cache)
+{
+    free(cache->mags);
+    free(cache->fullRing);
+    free(cache->emptyRing);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* Packets still held by the cache's magazines. */
+static UInt32 cachedPackets(RxPoolCache *cache)
+{
+    UInt32 count = 0;
+    UInt32 i;
+
+    for (i = 0; i < cache->numMags; i++)
+        count += cache->mags[i].count;
+
+    return count;
+}
+
+/* Every packet is either used or still cached, none got lost. */
+static void checkConservation(RxPoolCache *cache, UInt32 used)
+{
+    UInt32 allocated = std::min(nextPacket.load(), numPackets);
+    UInt32 cached = 0;
+    UInt32 i;
+
+    for (i = 0; i < allocated; i++) {
+        if (packets[i].state == kPktCached)
+            cached++;
+    }
+    CHECK(cached == cachedPackets(cache), "cached %u in magazines %u", cached, cachedPackets(cache));
+    CHECK(cached + used == allocated, "cached %u used %u allocated %u", cached, used, allocated);
+}
+
+static void testGeometry()
+{
+    RxPoolCache cache;
+    UInt32 ringSize;
+
+    memset(&cache, 0, sizeof(cache));
+
+    ringSize = rxMagSetup(&cache, 100, 2048);
+    CHECK(cache.numMags == 8, "%u", cache.numMags);
+    CHECK(ringSize == 8, "%u", ringSize);
+    CHECK(cache.refillTresh == 4, "%u", cache.refillTresh);
+
+    ringSize = rxMagSetup(&cache, 50, 256);
+    CHECK(cache.numMags == 5, "%u", cache.numMags);
+    CHECK(ringSize == 8, "%u", ringSize);
+
+    ringSize = rxMagSetup(&cache, 1, 256);
+    CHECK(cache.numMags == 2, "%u", cache.numMags);
+    CHECK(ringSize == 2, "%u", ringSize);
+}
+
+/* Single threaded: the cache runs dry, asks for a refill and recovers. */
+static void testDrainRefill()
+{
+    RxPoolCache cache;
+    UInt32 capacity, used = 0;
+    bool refill = false;
+    mbuf_t m;
+
+    mockReset(1024, 0);
+    CHECK(setupCache(&cache, kStressCapacity), "setup");
+    capacity = (cache.numMags - 1) * kRxPoolMagSize;
+
+    while ((m = rxMagGetPacket(&cache, &refill)) != NULL) {
+        CHECK(consume(m), "packet handed out twice");
+        used++;
+
+        /* A refill is requested once half of the magazines are gone. */
+        if (used == (cache.numMags - 1 - cache.refillTresh) * kRxPoolMagSize + 1)
+            CHECK(refill, "no refill requested after %u packets", used);
+    }
+    CHECK(used == capacity, "used %u capacity %u", used, capacity);
+    CHECK(refill, "no refill requested");
+    checkConservation(&cache, used);
+
+    /* The refill fills all empty magazines but the loaded one. */
+    CHECK(rxMagRefill(&cache, mockAlloc), "refill");
+    refill = false;
+
+    while ((m = rxMagGetPacket(&cache, &refill)) != NULL) {
+        CHECK(consume(m), "packet handed out twice");
+        used++;
+    }
+    CHECK(used == 2 * capacity, "used %u", used);
+    checkConservation(&cache, used);
+
+    /* An allocation failure leaves a partially filled magazine. */
+    mockReset(1024, 5);
+    freeCache(&cache);
+    CHECK(!setupCache(&cache, kStressCapacity), "setup with failures");
+    freeCache(&cache);
+
+    mockReset(1024, 0);
+    CHECK(setupCache(&cache, kStressCapacity), "setup");
+    used = 0;
+
+    while ((m = rxMagGetPacket(&cache, &refill)) != NULL)
+        used += consume(m);
+
+    failPeriod = 7;
+    CHECK(!rxMagRefill(&cache, mockAlloc), "refill with failures");
+    CHECK(cache.refilling && (cache.refilling->count < kRxPoolMagSize), "partial magazine");
+
+    failPeriod = 0;
+    CHECK(rxMagRefill(&cache, mockAlloc), "refill");
+    CHECK(!cache.refilling, "partial magazine kept");
+    checkConservation(&cache, used);
+
+    freeCache(&cache);
+}
+
+/*
+ * Two threads: the consumer takes packets as fast as it can and
+ * schedules refills the way SimpleRTK5RxPool::scheduleRefill() does,
+ * while the refill thread serves them. A miss is where the driver
+ * would fall back to the allocator.
+ */
+static void stress(UInt32 period)
+{
+    RxPoolCache cache;
+    std::atomic<UInt32> refillScheduled(0);
+    std::atomic<bool> stop(false);
+    UInt64 used = 0, misses = 0, refills = 0;
+    bool refill;
+    mbuf_t m;
+
+    mockReset(kStressPackets + 4096, period);
+    setupCache(&cache, kStressCapacity);
+
+    std::thread refiller([&] {
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (refillScheduled.load(std::memory_order_acquire)) {
+                rxMagRefill(&cache, mockAlloc);
+                refills++;
+                refillScheduled.store(0, std::memory_order_release);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+
+    while (used < kStressPackets) {
+        refill = false;
+        m = rxMagGetPacket(&cache, &refill);
+
+        if (refill) {
+            UInt32 expected = 0;
+
+            refillScheduled.compare_exchange_strong(expected, 1, std::memory_order_acq_rel);
+        }
+        /* Let the refill thread run in place of the allocator. */
+        if (!m) {
+            misses++;
+            std::this_thread::yield();
+            continue;
+        }
+        if (!consume(m))
+            CHECK(false, "packet %ld handed out twice", (long)(m - packets));
+
+        used++;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    stop = true;
+    refiller.join();
+
+    checkConservation(&cache, used);
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    char label[16] = "none";
+
+    if (period)
+        snprintf(label, sizeof(label), "1/%u", period);
+
+    printf("RxMagTests: %llu packets, allocs failing %-6s: %6.1f ns/packet, "
+           "%6llu refills, misses %.3f%%\n", (unsigned long long)used, label,
+           ns / used, (unsigned long long)refills, 100.0 * misses / (used + misses));
+
+    freeCache(&cache);
+}
+
+int main()
+{
+    testGeometry();
+    testDrainRefill();
+
+    stress(0);
+    stress(1000);
+    stress(50);
+
+    delete[] packets;
+
+    if (failures) {
+        printf("RxMagTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("RxMagTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,260 @@
+//
+//  TsoTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the header patching of software TSO. TSO packets are
+//  split the way txSoftSegment() does it with rtlTsoPatchHdrs() and
+//  each segment is compared byte for byte with the one a reference
+//  segmenter builds from scratch: IPv4 total length and ID, IPv6
+//  payload length, sequence number, flags and pseudo header checksum.
+//  The checksum the NIC completes from the pseudo header checksum is
+//  checked against a full TCP checksum of the segment. Build and run
+//  on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/TsoTests.cpp -o /tmp/TsoTests && /tmp/TsoTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include <IOKit/IOLib.h>
+#include "PacketBuilder.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef std::vector<std::vector<UInt8>> SegList;
+
+/* Same as SimpleRTK5::txSoftSegment() with the mbufs as byte vectors */
+static void softSegment(const std::vector<UInt8> &pkt, const rtlTxHdrInfo *info,
+                        UInt32 mss, UInt32 mtu, SegList &segs)
+{
+    UInt8 hdr[kTxMaxHdrLen];
+    struct ip *ipHdr;
+    struct tcphdr *tcpHdr;
+    UInt32 pktLen = (UInt32)pkt.size();
+    UInt32 hdrLen = info->hdrLen;
+    UInt32 off, len, seq;
+    UInt16 ipId = 0;
+    UInt8 flags;
+
+    memcpy(hdr, pkt.data(), hdrLen);
+
+    tcpHdr = (struct tcphdr *)(hdr + info->l4Off);
+    ipHdr = (struct ip *)(hdr + info->l3Off);
+
+    if (info->etherType == ETHERTYPE_IP)
+        ipId = ntohs(ipHdr->ip_id);
+
+    if (!mss || (mss > (mtu - (hdrLen - ETH_HLEN))))
+        mss = mtu - (hdrLen - ETH_HLEN);
+
+    seq = ntohl(tcpHdr->th_seq);
+    flags = tcpHdr->th_flags;
+    segs.clear();
+
+    for (off = hdrLen; off < pktLen; off += len) {
+        len = (mss < pktLen - off) ? mss : pktLen - off;
+
+        rtlTsoPatchHdrs(hdr, info, seq, flags, ipId++, off, len, pktLen);
+
+        std::vector<UInt8> seg(hdr, hdr + hdrLen);
+        seg.insert(seg.end(), pkt.begin() + off, pkt.begin() + off + len);
+        segs.push_back(seg);
+    }
+}
+
+/* The sum of the TCP pseudo header of a segment with tcpLen bytes */
+static UInt32 refPseudoSum(const UInt8 *seg, const rtlTxHdrInfo *info, UInt32 tcpLen)
+{
+    UInt8 ph[40];
+    UInt32 n;
+
+    memset(ph, 0, sizeof(ph));
+
+    if (info->etherType == ETHERTYPE_IP) {
+        memcpy(ph, seg + info->l3Off + 12, 8);
+        ph[9] = IPPROTO_TCP;
+        put16(ph + 10, tcpLen);
+        n = 12;
+    } else {
+        memcpy(ph, seg + info->l3Off + 8, 32);
+        put32(ph + 32, tcpLen);
+        ph[39] = IPPROTO_TCP;
+        n = 40;
+    }
+    return onesSum(ph, n, 0);
+}
+
+/* Build the segments from the original packet, field by field. */
+static void refSegment(const std::vector<UInt8> &pkt, const rtlTxHdrInfo *info,
+                       UInt32 mss, SegList &segs)
+{
+    UInt32 hdrLen = info->hdrLen;
+    UInt32 l3 = info->l3Off, l4 = info->l4Off;
+    UInt32 payload = (UInt32)pkt.size() - hdrLen;
+    UInt32 n = (payload + mss - 1) / mss;
+    UInt32 k, len, tcpLen;
+    UInt8 flags;
+
+    segs.clear();
+
+    for (k = 0; k < n; k++) {
+        len = (k + 1 < n) ? mss : payload - k * mss;
+        tcpLen = hdrLen - l4 + len;
+
+        std::vector<UInt8> seg(pkt.begin(), pkt.begin() + hdrLen);
+        UInt8 *s = seg.data();
+
+        if (info->etherType == ETHERTYPE_IP) {
+            put16(s + l3 + 2, hdrLen - l3 + len);
+            put16(s + l3 + 4, get16(pkt.data() + l3 + 4) + k);
+            put16(s + l3 + 10, 0);
+        } else {
+            put16(s + l3 + 4, hdrLen - l3 - 40 + len);
+        }
+        put32(s + l4 + 4, get32(pkt.data() + l4 + 4) + k * mss);
+
+        flags = pkt[l4 + 13];
+
+        if (k)
+            flags &= ~TH_CWR;
+
+        if (k + 1 < n)
+            flags &= ~(TH_FIN | TH_PUSH);
+
+        s[l4 + 13] = flags;
+        put16(s + l4 + 16, onesFold(refPseudoSum(s, info, tcpLen)));
+
+        seg.insert(seg.end(), pkt.begin() + hdrLen + k * mss, pkt.begin() + hdrLen + k * mss + len);
+        segs.push_back(seg);
+    }
+}
+
+/* The TCP checksum the NIC puts into a segment from its pseudo header checksum */
+static UInt16 nicChecksum(const std::vector<UInt8> &seg, const rtlTxHdrInfo *info)
+{
+    return ~onesFold(onesSum(seg.data() + info->l4Off, (UInt32)seg.size() - info->l4Off, 0));
+}
+
+/* The full TCP checksum of a segment */
+static UInt16 refChecksum(const std::vector<UInt8> &seg, const rtlTxHdrInfo *info)
+{
+    std::vector<UInt8> tcp(seg.begin() + info->l4Off, seg.end());
+
+    put16(tcp.data() + 16, 0);
+    return ~onesFold(onesSum(tcp.data(), (UInt32)tcp.size(),
+                             refPseudoSum(seg.data(), info, (UInt32)tcp.size())));
+}
+
+static void testSpec(const char *name, const PacketSpec *spec, UInt32 mss, UInt32 mtu)
+{
+    std::vector<UInt8> pkt, payload;
+    rtlTxHdrInfo info;
+    SegList segs, ref;
+    UInt32 i, maxMss;
+
+    buildPacket(spec, pkt, &info);
+    softSegment(pkt, &info, mss, mtu, segs);
+
+    maxMss = mtu - (info.hdrLen - ETH_HLEN);
+
+    if (!mss || (mss > maxMss))
+        mss = maxMss;
+
+    refSegment(pkt, &info, mss, ref);
+
+    CHECK(segs.size() == ref.size(), "%s: %zu segments, expected %zu", name, segs.size(), ref.size());
+
+    for (i = 0; (i < segs.size()) && (i < ref.size()); i++) {
+        CHECK(segs[i] == ref[i], "%s: segment %u differs", name, i);
+        CHECK(segs[i].size() <= mtu + ETH_HLEN, "%s: segment %u of %zu bytes", name, i, segs[i].size());
+        CHECK(nicChecksum(segs[i], &info) == refChecksum(segs[i], &info),
+              "%s: segment %u checksum %04x expected %04x", name, i,
+              nicChecksum(segs[i], &info), refChecksum(segs[i], &info));
+
+        payload.insert(payload.end(), segs[i].begin() + info.hdrLen, segs[i].end());
+    }
+    CHECK(std::equal(payload.begin(), payload.end(), pkt.begin() + info.hdrLen) &&
+          (payload.size() == pkt.size() - info.hdrLen), "%s: payload differs", name);
+}
+
+int main()
+{
+    PacketSpec spec;
+    UInt8 flags[] = { TH_ACK, TH_ACK | TH_PUSH, TH_ACK | TH_PUSH | TH_FIN, TH_ACK | TH_CWR | TH_ECE | TH_PUSH };
+    UInt32 lens[] = { 1448 * 4, 1448 * 4 + 1, 65000, 1449 };
+    char name[64];
+    UInt32 f, l;
+
+    srand(5);
+
+    for (f = 0; f < sizeof(flags); f++) {
+        for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            memset(&spec, 0, sizeof(spec));
+            spec.flags = flags[f];
+            spec.payloadLen = lens[l];
+            spec.tcpOptLen = 12;
+
+            snprintf(name, sizeof(name), "ipv4 flags %02x len %u", flags[f], lens[l]);
+            testSpec(name, &spec, 1448, 1500);
+
+            spec.ipv6 = true;
+            snprintf(name, sizeof(name), "ipv6 flags %02x len %u", flags[f], lens[l]);
+            testSpec(name, &spec, 1428, 1500);
+        }
+    }
+    memset(&spec, 0, sizeof(spec));
+    spec.flags = TH_ACK | TH_PUSH;
+    spec.payloadLen = 60000;
+
+    /* IPv4 options, a VLAN tag in the frame, the MSS derived from the MTU */
+    spec.ipOptLen = 40;
+    spec.tcpOptLen = 40;
+    testSpec("ipv4 options", &spec, 0, 1500);
+    spec.vlanTags = 1;
+    testSpec("ipv4 vlan", &spec, 9000, 1500);
+    spec.vlanTags = 2;
+    testSpec("ipv4 qinq jumbo", &spec, 0, 9000);
+
+    /* IPv6 extension headers, a header of more than the small mbuf size */
+    spec.ipOptLen = 0;
+    spec.vlanTags = 0;
+    spec.ipv6 = true;
+    spec.numExtHdrs = 3;
+    spec.extTypes[0] = IPPROTO_HOPOPTS;
+    spec.extLens[0] = 8;
+    spec.extTypes[1] = IPPROTO_DSTOPTS;
+    spec.extLens[1] = 48;
+    spec.extTypes[2] = IPPROTO_AH;
+    spec.extLens[2] = 24;
+    testSpec("ipv6 ext hdrs", &spec, 1200, 1500);
+    spec.extLens[1] = 104;
+    spec.tcpOptLen = 12;
+    spec.vlanTags = 2;
+    testSpec("ipv6 230 byte hdrs", &spec, 0, 1500);
+
+    if (failures) {
+        printf("TsoTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("TsoTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,423 @@
+//
+//  TxBatchTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the tx batch budget and of the doorbell, and benchmark of
+//  the batched dequeue of outputStart() with a mock IONetworkInterface.
+//  The mock output queue takes a lock per dequeue call like IOKit's
+//  output queue. The ring is simulated by its free descriptors, bytes
+//  in flight and the descriptors announced to the NIC. Build and run on
+//  the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/TxBatchTests.cpp -o /tmp/TxBatchTests && /tmp/TxBatchTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+
+#include <IOKit/IOLib.h>
+#include "SimpleRTK5Ring.hpp"
+
+#define kNumTxDesc      1024
+#define kQueueSize      4096
+#define kBenchPackets   (4 * 1024 * 1024)
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef struct Packet {
+    struct Packet *nextpkt;
+    UInt32 len;
+    UInt32 segs;
+    UInt32 tsoSegs;     /* segmented in software into tsoSegs packets */
+} Packet;
+
+/*
+ * Mock of the interface's output queue. The stack keeps it filled,
+ * dequeueOutputPackets() takes up to maxCount packets under the lock.
+ */
+typedef struct MockInterface {
+    std::mutex lock;
+    Packet pkts[kQueueSize];
+    UInt32 head;
+    UInt64 calls;
+} MockInterface;
+
+static Packet *dequeueOutputPackets(MockInterface *intf, UInt32 maxCount)
+{
+    Packet *list = NULL, *tail = NULL, *p;
+    UInt32 i;
+
+    std::lock_guard<std::mutex> guard(intf->lock);
+
+    intf->calls++;
+
+    for (i = 0; i < maxCount; i++) {
+        p = &intf->pkts[intf->head++ % kQueueSize];
+        p->nextpkt = NULL;
+
+        if (tail)
+            tail->nextpkt = p;
+        else
+            list = p;
+
+        tail = p;
+    }
+    return list;
+}
+
+typedef struct MockRing {
+    SInt32 numFreeDesc;
+    SInt32 minFreeDesc;
+    UInt32 limit;
+    UInt32 inFlight;
+    UInt32 nextIndex;       /* descriptors filled in */
+    UInt32 tailIndex;       /* descriptors announced to the NIC */
+    UInt32 dirtyIndex;      /* descriptors completed */
+    UInt32 pendingDescs;
+    UInt32 maxPending;
+    Packet *backlogHead;
+    Packet *backlogTail;
+    UInt64 packets;
+    UInt64 backlogged;
+    UInt64 segmented;
+    UInt64 doorbells;
+} MockRing;
+
+/* Segments of software TSO packets */
+static Packet segPool[kQueueSize];
+static UInt32 segNext;
+
+static inline SInt32 bytesAvail(MockRing *ring)
+{
+    return (SInt32)(ring->limit - ring->inFlight);
+}
+
+/* Same as txRingHasRoom() */
+static inline bool ringHasRoom(MockRing *ring)
+{
+    return ((ring->numFreeDesc > kMinFreeDescs) && !ring->backlogHead &&
+            (bytesAvail(ring) >= 0));
+}
+
+static inline void sendPacket(MockRing *ring, Packet *p)
+{
+    ring->numFreeDesc -= p->segs;
+    ring->inFlight += p->len;
+    ring->nextIndex += p->segs;
+    ring->pendingDescs += p->segs;
+    ring->packets++;
+
+    if (ring->numFreeDesc < ring->minFreeDesc)
+        ring->minFreeDesc = ring->numFreeDesc;
+
+    if (ring->pendingDescs > ring->maxPending)
+        ring->maxPending = ring->pendingDescs;
+}
+
+/* Same as txDoorbell() */
+static void doorbell(MockRing *ring)
+{
+    ring->tailIndex = ring->nextIndex;
+    ring->pendingDescs = 0;
+    ring->doorbells++;
+}
+
+/* Replace a TSO packet by its segments, like txSoftSegment(). */
+static Packet *softSegment(MockRing *ring, Packet *p, Packet **tail)
+{
+    Packet *segs = NULL, *s = NULL;
+    UInt32 i;
+
+    for (i = 0; i < p->tsoSegs; i++) {
+        s = &segPool[segNext++ % kQueueSize];
+        s->len = 1514;
+        s->segs = 2;
+        s->tsoSegs = 0;
+        s->nextpkt = segs;
+        segs = s;
+    }
+    ring->segmented += p->tsoSegs - 1;
+    *tail = &segPool[(segNext - p->tsoSegs) % kQueueSize];
+
+    return segs;
+}
+
+/* Same as txSendList() */
+static void sendList(MockRing *ring, Packet *list)
+{
+    Packet *p, *tail, *segs;
+
+    while (list) {
+        if ((ring->numFreeDesc <= kMinFreeDescs) || (bytesAvail(ring) < 0)) {
+            for (tail = list; tail->nextpkt; tail = tail->nextpkt)
+                ring->backlogged++;
+
+            ring->backlogged++;
+
+            if (ring->backlogTail)
+                ring->backlogTail->nextpkt = list;
+            else
+                ring->backlogHead = list;
+
+            ring->backlogTail = tail;
+            break;
+        }
+        p = list;
+        list = p->nextpkt;
+        p->nextpkt = NULL;
+
+        if (p->tsoSegs) {
+            segs = softSegment(ring, p, &tail);
+            tail->nextpkt = list;
+            list = segs;
+            continue;
+        }
+        sendPacket(ring, p);
+
+        if (ring->pendingDescs >= kTxDoorbellTreshhold)
+            doorbell(ring);
+    }
+}
+
+static void sendBacklog(MockRing *ring)
+{
+    Packet *list = ring->backlogHead;
+
+    ring->backlogHead = ring->backlogTail = NULL;
+    sendList(ring, list);
+}
+
+/* outputStart() before batching: one packet per dequeue call */
+static void outputStartSingle(MockRing *ring, MockInterface *intf, UInt32 maxPktLen)
+{
+    Packet *p;
+
+    while (ringHasRoom(ring) && (p = dequeueOutputPackets(intf, 1)))
+        sendList(ring, p);
+}
+
+/* outputStart() with batches sized by rtlTxBatchSize() */
+static void outputStartBatch(MockRing *ring, MockInterface *intf, UInt32 maxPktLen)
+{
+    Packet *list;
+
+    if (ring->backlogHead)
+        sendBacklog(ring);
+
+    while (ringHasRoom(ring) &&
+           (list = dequeueOutputPackets(intf, rtlTxBatchSize(ring->numFreeDesc, bytesAvail(ring), maxPktLen))))
+        sendList(ring, list);
+
+    if (ring->pendingDescs)
+        doorbell(ring);
+}
+
+static void ringReset(MockRing *ring, UInt32 limit)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->numFreeDesc = ring->minFreeDesc = kNumTxDesc;
+    ring->limit = limit;
+}
+
+/* The NIC completes everything in flight. */
+static void complete(MockRing *ring)
+{
+    ring->numFreeDesc = kNumTxDesc;
+    ring->inFlight = 0;
+}
+
+static void testBudget()
+{
+    UInt32 n;
+
+    /* Just enough room for one packet with kMaxSegs segments. */
+    CHECK(rtlTxBatchSize(kMinFreeDescs + 1, 0x10000, 1514) == 1, "one packet");
+    CHECK(rtlTxBatchSize(kMinFreeDescs + kMaxSegs, 0x10000, 1514) == 2, "two packets");
+
+    n = rtlTxBatchSize(kNumTxDesc, 0x7fffffff, 1514);
+    CHECK(n == (kNumTxDesc - kMinFreeDescs) / kMaxSegs + 1, "desc budget %u", n);
+
+    /* The byte limit allows one packet more than fits. */
+    n = rtlTxBatchSize(kNumTxDesc, 0, 1514);
+    CHECK(n == 1, "byte budget %u", n);
+    n = rtlTxBatchSize(kNumTxDesc, 10 * 1514, 1514);
+    CHECK(n == 11, "byte budget %u", n);
+}
+
+/*
+ * Even if every packet of a batch needs kMaxSegs descriptors, the
+ * ring never runs out of descriptors and no packet ends up in the
+ * backlog, as long as the byte limit isn't exceeded.
+ */
+static void testNoOverrun()
+{
+    static MockInterface intf;
+    MockRing ring;
+    UInt32 i, pass;
+
+    for (i = 0; i < kQueueSize; i++) {
+        intf.pkts[i].len = 1514;
+        intf.pkts[i].segs = kMaxSegs;
+    }
+    ringReset(&ring, 0x7fffffff);
+
+    for (pass = 0; pass < 100; pass++) {
+        outputStartBatch(&ring, &intf, 1514);
+        CHECK(!ringHasRoom(&ring), "pass %u: ring not filled", pass);
+
+        /* The NIC completes a part of the packets. */
+        ring.numFreeDesc += (pass % 7) * kMaxSegs;
+    }
+    CHECK(ring.minFreeDesc >= kMinFreeDescs - kMaxSegs, "min free %d", ring.minFreeDesc);
+    CHECK(!ring.backlogged, "backlogged %llu", (unsigned long long)ring.backlogged);
+}
+
+/*
+ * No descriptor is left unannounced at the end of outputStart(), no
+ * matter how the packets are split into batches, backlogged or
+ * segmented in software, and the NIC never waits for more than
+ * kTxDoorbellTreshhold + kMaxSegs descriptors before the doorbell.
+ */
+static void testDoorbell()
+{
+    static MockInterface intf;
+    MockRing ring;
+    UInt64 passes = 0, completed;
+    UInt32 i, pass, outstanding, done;
+
+    srand(2);
+
+    for (i = 0; i < kQueueSize; i++) {
+        if ((rand() % 100) < 20) {
+            intf.pkts[i].len = 0x10000;
+            intf.pkts[i].segs = 0;
+            intf.pkts[i].tsoSegs = 2 + rand() % 44;
+        } else {
+            intf.pkts[i].len = 1514;
+            intf.pkts[i].segs = 1 + rand() % kMaxSegs;
+            intf.pkts[i].tsoSegs = 0;
+        }
+    }
+    intf.head = 0;
+    segNext = 0;
+
+    /* A low byte limit forces the backlog. */
+    ringReset(&ring, 0x10000);
+
+    for (pass = 0; pass < 20000; pass++) {
+        outputStartBatch(&ring, &intf, 1514);
+        passes++;
+
+        CHECK(ring.tailIndex == ring.nextIndex, "pass %u: %u descriptors unannounced",
+              pass, ring.nextIndex - ring.tailIndex);
+        CHECK(!ring.pendingDescs, "pass %u: pending %u", pass, ring.pendingDescs);
+
+        /* The NIC completes a part of the announced descriptors. */
+        outstanding = ring.tailIndex - ring.dirtyIndex;
+        done = outstanding ? rand() % (outstanding + 1) : 0;
+
+        if (outstanding)
+            ring.inFlight -= (UInt32)((UInt64)ring.inFlight * done / outstanding);
+
+        ring.dirtyIndex += done;
+        ring.numFreeDesc += done;
+    }
+    CHECK(ring.maxPending < kTxDoorbellTreshhold + kMaxSegs, "max pending %u", ring.maxPending);
+    CHECK(ring.backlogged, "nothing backlogged");
+    CHECK(ring.segmented, "nothing segmented");
+
+    /* Send the rest of the backlog, all dequeued packets go out. */
+    while (ring.backlogHead) {
+        ring.dirtyIndex = ring.tailIndex;
+        complete(&ring);
+        sendBacklog(&ring);
+
+        if (ring.pendingDescs)
+            doorbell(&ring);
+    }
+    completed = (UInt64)intf.head + ring.segmented;
+    CHECK(ring.packets == completed, "sent %llu of %llu packets",
+          (unsigned long long)ring.packets, (unsigned long long)completed);
+    CHECK(ring.tailIndex == ring.nextIndex, "%u descriptors unannounced", ring.nextIndex - ring.tailIndex);
+
+    printf("TxBatchTests: doorbell %5.2f doorbells/pass, %6.1f descs/doorbell, max %u pending, "
+           "%4.2f%% backlogged\n", (double)ring.doorbells / passes,
+           (double)ring.nextIndex / ring.doorbells, ring.maxPending,
+           100.0 * ring.backlogged / ring.packets);
+}
+
+typedef void (*OutputFunc)(MockRing *ring, MockInterface *intf, UInt32 maxPktLen);
+
+/*
+ * Keep the ring full for kBenchPackets packets and report the dequeue
+ * calls per 1000 packets and the time per packet.
+ */
+static void bench(const char *name, const char *trace, OutputFunc output, UInt32 limit, UInt32 tsoPct)
+{
+    static MockInterface intf;
+    MockRing ring;
+    UInt32 i;
+
+    srand(1);
+
+    for (i = 0; i < kQueueSize; i++) {
+        if ((UInt32)(rand() % 100) < tsoPct) {
+            intf.pkts[i].len = 0x10000;
+            intf.pkts[i].segs = 2 + rand() % (kMaxSegs - 1);
+        } else {
+            intf.pkts[i].len = 1514;
+            intf.pkts[i].segs = 1 + (rand() & 1);
+        }
+    }
+    intf.head = 0;
+    intf.calls = 0;
+    ringReset(&ring, limit);
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (ring.packets < kBenchPackets) {
+        output(&ring, &intf, 1514);
+        complete(&ring);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    CHECK(ring.minFreeDesc >= kMinFreeDescs - kMaxSegs, "%s: min free %d", name, ring.minFreeDesc);
+
+    printf("TxBatchTests: %-6s %-14s %7.1f dequeue calls/1000 pkts, %5.1f ns/pkt, "
+           "%4.2f%% backlogged\n", name, trace, 1000.0 * intf.calls / ring.packets,
+           ns / ring.packets, 100.0 * ring.backlogged / ring.packets);
+}
+
+int main()
+{
+    testBudget();
+    testNoOverrun();
+    testDoorbell();
+
+    bench("single", "mtu", outputStartSingle, 0x7fffffff, 0);
+    bench("batch", "mtu", outputStartBatch, 0x7fffffff, 0);
+    bench("single", "mtu, 256k bql", outputStartSingle, 0x40000, 0);
+    bench("batch", "mtu, 256k bql", outputStartBatch, 0x40000, 0);
+    bench("single", "10% tso", outputStartSingle, 0x7fffffff, 10);
+    bench("batch", "10% tso", outputStartBatch, 0x7fffffff, 10);
+
+    if (failures) {
+        printf("TxBatchTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("TxBatchTests: passed.\n");
+    return 0;
+}
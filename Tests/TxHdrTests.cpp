@@ -0,0 +1,382 @@
+//
+//  TxHdrTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Tests of the tx header parser rtlTxParseHdrs(). Frames are built
+//  with VLAN tags, IPv4 options, IPv6 extension headers and TCP
+//  options, split into mbuf chains at every offset, and passed to a
+//  mirror of txParseHeaders(). Truncated and malformed headers must
+//  be rejected, and headers behind the TCP header offset limit of the
+//  NIC must be left to software TSO. Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -ITests/include -ISimpleRTK5 Tests/TxHdrTests.cpp -o /tmp/TxHdrTests && /tmp/TxHdrTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include <IOKit/IOLib.h>
+#include <sys/kpi_mbuf.h>
+#include "PacketBuilder.h"
+
+/* Same as in rtl812x.h */
+#define GTTCPHO_MAX     0x70U
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+/* An mbuf of a chain with a part of the frame */
+struct __mbuf {
+    mbuf_t next;
+    UInt8 *data;
+    UInt32 len;
+};
+
+typedef struct MockChain {
+    std::vector<struct __mbuf> mbufs;
+    UInt32 pktLen;
+} MockChain;
+
+/* Split the first pktLen bytes of a frame into mbufs at the offsets in cuts. */
+static mbuf_t buildChain(MockChain *chain, std::vector<UInt8> &pkt, UInt32 pktLen,
+                         const std::vector<UInt32> &cuts)
+{
+    UInt32 start = 0, i;
+
+    chain->mbufs.clear();
+    chain->pktLen = pktLen;
+
+    for (i = 0; i <= cuts.size(); i++) {
+        UInt32 end = (i < cuts.size()) ? cuts[i] : pktLen;
+
+        if (end > pktLen)
+            end = pktLen;
+
+        if (end <= start)
+            continue;
+
+        chain->mbufs.push_back({ NULL, pkt.data() + start, end - start });
+        start = end;
+    }
+    for (i = 0; i + 1 < chain->mbufs.size(); i++)
+        chain->mbufs[i].next = &chain->mbufs[i + 1];
+
+    return chain->mbufs.empty() ? NULL : &chain->mbufs[0];
+}
+
+/* Like mbuf_copydata(), which walks the chain */
+static void copyData(mbuf_t m, UInt32 off, UInt32 len, UInt8 *out)
+{
+    UInt32 l;
+
+    for (; m && len; m = m->next) {
+        if (off >= m->len) {
+            off -= m->len;
+            continue;
+        }
+        l = (m->len - off < len) ? m->len - off : len;
+        memcpy(out, m->data + off, l);
+        out += l;
+        len -= l;
+        off = 0;
+    }
+}
+
+/* Same as SimpleRTK5::txParseHeaders() */
+static bool parseHeaders(MockChain *chain, mbuf_t m, rtlTxHdrInfo *info)
+{
+    UInt8 hdr[kTxMaxHdrLen];
+    UInt32 len;
+
+    len = (chain->pktLen < kTxMaxHdrLen) ? chain->pktLen : kTxMaxHdrLen;
+    copyData(m, 0, len, hdr);
+
+    return rtlTxParseHdrs(hdr, len, info);
+}
+
+static bool sameInfo(const rtlTxHdrInfo *a, const rtlTxHdrInfo *b)
+{
+    return ((a->l3Off == b->l3Off) && (a->l4Off == b->l4Off) &&
+            (a->hdrLen == b->hdrLen) && (a->etherType == b->etherType) &&
+            (a->l4Proto == b->l4Proto) && (a->extHdrs == b->extHdrs));
+}
+
+/*
+ * Parse a frame in one mbuf, split at every offset of its headers,
+ * in mbufs of one byte each and truncated at every offset.
+ */
+static void testSpec(const char *name, const PacketSpec *spec)
+{
+    std::vector<UInt8> pkt;
+    std::vector<UInt32> cuts;
+    rtlTxHdrInfo expected, info;
+    MockChain chain;
+    mbuf_t m;
+    UInt32 pktLen, cut, i;
+
+    buildPacket(spec, pkt, &expected);
+    pktLen = (UInt32)pkt.size();
+
+    m = buildChain(&chain, pkt, pktLen, cuts);
+    memset(&info, 0xff, sizeof(info));
+    CHECK(parseHeaders(&chain, m, &info), "%s: not parsed", name);
+    CHECK(sameInfo(&info, &expected), "%s: l3 %u l4 %u hdr %u proto %u ext %d, expected l3 %u l4 %u hdr %u",
+          name, info.l3Off, info.l4Off, info.hdrLen, info.l4Proto, info.extHdrs,
+          expected.l3Off, expected.l4Off, expected.hdrLen);
+
+    for (cut = 1; cut < expected.hdrLen + 1; cut++) {
+        cuts.assign(1, cut);
+        m = buildChain(&chain, pkt, pktLen, cuts);
+        memset(&info, 0, sizeof(info));
+        CHECK(parseHeaders(&chain, m, &info) && sameInfo(&info, &expected), "%s: split at %u", name, cut);
+    }
+    cuts.clear();
+
+    for (i = 1; i <= expected.hdrLen; i++)
+        cuts.push_back(i);
+
+    m = buildChain(&chain, pkt, pktLen, cuts);
+    memset(&info, 0, sizeof(info));
+    CHECK(parseHeaders(&chain, m, &info) && sameInfo(&info, &expected), "%s: one byte mbufs", name);
+
+    /* All headers up to the end of the TCP header must be there. */
+    cuts.clear();
+
+    for (i = 0; i < expected.hdrLen; i++) {
+        m = buildChain(&chain, pkt, i, cuts);
+        CHECK(!parseHeaders(&chain, m, &info), "%s: truncated to %u bytes parsed", name, i);
+    }
+}
+
+/* Same as the header check of SimpleRTK5::txNeedsSoftTSO() */
+static bool needsSoftTSO(const PacketSpec *spec)
+{
+    std::vector<UInt8> pkt;
+    std::vector<UInt32> cuts;
+    rtlTxHdrInfo expected, info;
+    MockChain chain;
+    mbuf_t m;
+
+    buildPacket(spec, pkt, &expected);
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+
+    return (parseHeaders(&chain, m, &info) && (info.l4Proto == IPPROTO_TCP) &&
+            (info.l4Off > GTTCPHO_MAX));
+}
+
+static void addExtHdr(PacketSpec *spec, UInt8 type, UInt32 len)
+{
+    spec->extTypes[spec->numExtHdrs] = type;
+    spec->extLens[spec->numExtHdrs++] = len;
+}
+
+static void testVlan()
+{
+    PacketSpec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.payloadLen = 100;
+    spec.tcpOptLen = 12;
+
+    for (spec.vlanTags = 0; spec.vlanTags <= 2; spec.vlanTags++) {
+        spec.ipv6 = false;
+        testSpec(spec.vlanTags ? ((spec.vlanTags == 1) ? "ipv4 802.1q" : "ipv4 802.1ad") : "ipv4", &spec);
+        spec.ipv6 = true;
+        testSpec(spec.vlanTags ? ((spec.vlanTags == 1) ? "ipv6 802.1q" : "ipv6 802.1ad") : "ipv6", &spec);
+    }
+}
+
+static void testIPv4Options()
+{
+    PacketSpec spec;
+    char name[32];
+
+    memset(&spec, 0, sizeof(spec));
+    spec.payloadLen = 100;
+
+    for (spec.ipOptLen = 4; spec.ipOptLen <= 40; spec.ipOptLen += 4) {
+        spec.tcpOptLen = spec.ipOptLen;
+        snprintf(name, sizeof(name), "ipv4 %u option bytes", spec.ipOptLen);
+        testSpec(name, &spec);
+    }
+}
+
+static void testIPv6ExtHdrs()
+{
+    UInt8 types[] = { IPPROTO_HOPOPTS, IPPROTO_ROUTING, IPPROTO_DSTOPTS, IPPROTO_AH };
+    const char *names[] = { "hop-by-hop", "routing", "destination", "ah" };
+    PacketSpec spec;
+    char name[48];
+    UInt32 t, len;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.ipv6 = true;
+    spec.payloadLen = 100;
+    spec.tcpOptLen = 12;
+
+    /* Each extension header on its own, the length field of AH counts 4 bytes. */
+    for (t = 0; t < sizeof(types); t++) {
+        for (len = 8; len <= 64; len += 8) {
+            spec.numExtHdrs = 0;
+            addExtHdr(&spec, types[t], len);
+            snprintf(name, sizeof(name), "ipv6 %s %u bytes", names[t], len);
+            testSpec(name, &spec);
+        }
+    }
+    spec.numExtHdrs = 0;
+    addExtHdr(&spec, IPPROTO_AH, 12);
+    testSpec("ipv6 ah 12 bytes", &spec);
+
+    /* All of them in order */
+    spec.numExtHdrs = 0;
+    addExtHdr(&spec, IPPROTO_HOPOPTS, 8);
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 16);
+    addExtHdr(&spec, IPPROTO_ROUTING, 24);
+    addExtHdr(&spec, IPPROTO_AH, 20);
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 8);
+    spec.vlanTags = 2;
+    testSpec("ipv6 all ext hdrs", &spec);
+
+    /* kTxMaxExtHdrs are followed, the TCP header behind one more isn't found. */
+    std::vector<UInt8> pkt;
+    std::vector<UInt32> cuts;
+    rtlTxHdrInfo expected, info;
+    MockChain chain;
+    mbuf_t m;
+
+    spec.vlanTags = 0;
+    spec.numExtHdrs = 0;
+
+    for (t = 0; t < kTxMaxExtHdrs; t++)
+        addExtHdr(&spec, IPPROTO_DSTOPTS, 8);
+
+    testSpec("ipv6 max ext hdrs", &spec);
+
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 8);
+    buildPacket(&spec, pkt, &expected);
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(parseHeaders(&chain, m, &info) && (info.l4Proto == IPPROTO_DSTOPTS),
+          "too many ext hdrs: proto %u", info.l4Proto);
+}
+
+static void testMalformed()
+{
+    std::vector<UInt8> pkt;
+    std::vector<UInt32> cuts;
+    rtlTxHdrInfo expected, info;
+    PacketSpec spec;
+    MockChain chain;
+    mbuf_t m;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.payloadLen = 100;
+
+    /* Three VLAN tags */
+    buildPacket(&spec, pkt, &expected);
+    pkt.insert(pkt.begin() + 12, { 0x81, 0x00, 0x00, 0x01, 0x81, 0x00, 0x00, 0x02, 0x81, 0x00, 0x00, 0x03 });
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(!parseHeaders(&chain, m, &info), "three vlan tags parsed");
+
+    /* ARP */
+    buildPacket(&spec, pkt, &expected);
+    put16(pkt.data() + 12, 0x0806);
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(!parseHeaders(&chain, m, &info), "arp parsed");
+
+    /* IPv4 header length below 20 bytes */
+    buildPacket(&spec, pkt, &expected);
+    pkt[expected.l3Off] = 0x44;
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(!parseHeaders(&chain, m, &info), "ip_hl 4 parsed");
+
+    /* TCP data offset below 20 bytes */
+    buildPacket(&spec, pkt, &expected);
+    pkt[expected.l4Off + 12] = 0x40;
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(!parseHeaders(&chain, m, &info), "th_off 4 parsed");
+
+    /* Headers beyond kTxMaxHdrLen */
+    spec.ipv6 = true;
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 200);
+    buildPacket(&spec, pkt, &expected);
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(expected.hdrLen > kTxMaxHdrLen, "hdrLen %u", expected.hdrLen);
+    CHECK(!parseHeaders(&chain, m, &info), "%u bytes of headers parsed", expected.hdrLen);
+
+    /* A UDP header behind truncated extension headers */
+    spec.numExtHdrs = 0;
+    spec.l4Proto = IPPROTO_UDP;
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 64);
+    buildPacket(&spec, pkt, &expected);
+    m = buildChain(&chain, pkt, expected.l4Off - 1, cuts);
+    CHECK(!parseHeaders(&chain, m, &info), "truncated udp parsed");
+    m = buildChain(&chain, pkt, (UInt32)pkt.size(), cuts);
+    CHECK(parseHeaders(&chain, m, &info) && sameInfo(&info, &expected), "udp not parsed");
+}
+
+/* TCP headers behind offset GTTCPHO_MAX can't use hardware TSO. */
+static void testTcpOffset()
+{
+    PacketSpec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.payloadLen = 100;
+
+    spec.ipOptLen = 40;
+    spec.vlanTags = 2;
+    CHECK(!needsSoftTSO(&spec), "ipv4 with options, l4Off %u", 22 + 60);
+
+    spec.ipOptLen = 0;
+    spec.vlanTags = 0;
+    spec.ipv6 = true;
+    addExtHdr(&spec, IPPROTO_HOPOPTS, 56);
+    CHECK(!needsSoftTSO(&spec), "ipv6 l4Off 110");
+
+    /* The VLAN tags inserted by software count as well. */
+    spec.vlanTags = 2;
+    CHECK(needsSoftTSO(&spec), "ipv6 802.1ad l4Off 118");
+
+    spec.vlanTags = 0;
+    spec.numExtHdrs = 0;
+    addExtHdr(&spec, IPPROTO_HOPOPTS, 64);
+    CHECK(needsSoftTSO(&spec), "ipv6 l4Off 118");
+
+    spec.numExtHdrs = 0;
+    addExtHdr(&spec, IPPROTO_AH, 56);
+    addExtHdr(&spec, IPPROTO_DSTOPTS, 8);
+    CHECK(needsSoftTSO(&spec), "ipv6 ah l4Off 118");
+}
+
+int main()
+{
+    srand(6);
+
+    testVlan();
+    testIPv4Options();
+    testIPv6ExtHdrs();
+    testMalformed();
+    testTcpOffset();
+
+    if (failures) {
+        printf("TxHdrTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("TxHdrTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,233 @@
+//
+//  TxReclaimTests.cpp
+//  SimpleRTK5 host tests
+//
+//  Stress test and benchmark of the tx reclaim thread. An output
+//  thread fills a simulated tx ring like outputStart() and the NIC
+//  completes the descriptors at once. The poll thread processes a
+//  batch of received packets per pass and either reclaims the tx ring
+//  itself, like pollInputPackets() does by default, or leaves it to a
+//  reclaim thread like with enableTxReclaimThread. The freed
+//  descriptors are published to the output side with a single atomic
+//  add per pass, as in txInterrupt(). The test reports the time of a
+//  poll pass, which is the latency added to received packets, and the
+//  tx reclaim throughput. Build and run on the host with:
+//
+//  c++ -std=c++17 -O2 -pthread -ITests/include Tests/TxReclaimTests.cpp -o /tmp/TxReclaimTests && /tmp/TxReclaimTests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <IOKit/IOLib.h>
+
+#define kNumTxDesc      1024
+#define kTxDescMask     (kNumTxDesc - 1)
+#define kRxBatch        64
+#define kPollPasses     20000
+#define kPacketSize     256
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s failed: ", __FILE__, __LINE__, #cond);\
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+typedef struct SimTxDesc {
+    volatile UInt32 done;       /* written back by the NIC */
+    void *mbuf;                 /* buffer info of the descriptor */
+} SimTxDesc;
+
+typedef struct SimTxRing {
+    SimTxDesc descs[kNumTxDesc];
+    volatile SInt32 numFreeDesc;
+    UInt32 nextIndex;           /* owned by the output side */
+    UInt32 dirtyIndex;          /* owned by the reclaim side */
+    UInt64 sent;
+    UInt64 reclaimed;
+    UInt64 reused;              /* descriptors filled before reclaim */
+} SimTxRing;
+
+static SimTxRing ring;
+static std::atomic<bool> stop;
+static volatile UInt32 reclaimPending;
+
+/* The output thread: fill descriptors as long as there are free ones. */
+static void outputThread()
+{
+    SimTxDesc *desc;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (__atomic_load_n(&ring.numFreeDesc, __ATOMIC_ACQUIRE) <= 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        desc = &ring.descs[ring.nextIndex];
+
+        if (desc->mbuf)
+            ring.reused++;
+
+        desc->mbuf = malloc(kPacketSize);
+        ring.nextIndex = (ring.nextIndex + 1) & kTxDescMask;
+        ring.sent++;
+
+        OSAddAtomic(-1, &ring.numFreeDesc);
+
+        /* The NIC sends the packet right away. */
+        __atomic_store_n(&desc->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Same as txInterrupt(): free the packets of the completed
+ * descriptors and publish them to the output side at once.
+ */
+static void txReclaim()
+{
+    SimTxDesc *desc;
+    SInt32 done = 0;
+
+    while (true) {
+        desc = &ring.descs[ring.dirtyIndex];
+
+        if (!__atomic_load_n(&desc->done, __ATOMIC_ACQUIRE))
+            break;
+
+        free(desc->mbuf);
+        desc->mbuf = NULL;
+        desc->done = 0;
+
+        ring.dirtyIndex = (ring.dirtyIndex + 1) & kTxDescMask;
+        done++;
+    }
+    if (done) {
+        OSAddAtomic(done, &ring.numFreeDesc);
+        ring.reclaimed += done;
+    }
+}
+
+/* The thread call of enableTxReclaimThread */
+static void reclaimThread()
+{
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (__atomic_load_n(&reclaimPending, __ATOMIC_ACQUIRE)) {
+            /* Clear the flag first, like txReclaimThread(). */
+            OSBitAndAtomic(0, &reclaimPending);
+            txReclaim();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static UInt8 rxData[kRxBatch][2048];
+static volatile UInt32 rxSum;
+
+/* Process a batch of received packets. */
+static void rxPass()
+{
+    UInt32 i, j, sum = 0;
+
+    for (i = 0; i < kRxBatch; i++) {
+        for (j = 0; j < 64; j++)
+            sum += rxData[i][j * 32];
+    }
+    rxSum += sum;
+}
+
+static void run(bool threaded)
+{
+    std::vector<double> passTimes;
+    UInt32 pass;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.numFreeDesc = kNumTxDesc;
+    reclaimPending = 0;
+    stop = false;
+    passTimes.reserve(kPollPasses);
+
+    std::thread output(outputThread);
+    std::thread reclaimer;
+
+    if (threaded)
+        reclaimer = std::thread(reclaimThread);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (pass = 0; pass < kPollPasses; pass++) {
+        auto passStart = std::chrono::steady_clock::now();
+
+        rxPass();
+
+        /* Like txReclaim(), schedule the reclaim thread or reclaim inline. */
+        if (threaded)
+            OSBitOrAtomic(1, &reclaimPending);
+        else
+            txReclaim();
+
+        auto passEnd = std::chrono::steady_clock::now();
+        passTimes.push_back(std::chrono::duration<double, std::nano>(passEnd - passStart).count());
+
+        /* Let the other threads run between two polls. */
+        std::this_thread::yield();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    stop = true;
+    output.join();
+
+    if (threaded)
+        reclaimer.join();
+
+    /* Reclaim the rest and check that nothing got lost. */
+    txReclaim();
+
+    CHECK(!ring.reused, "%llu descriptors reused before reclaim", (unsigned long long)ring.reused);
+    CHECK(ring.reclaimed == ring.sent, "sent %llu reclaimed %llu",
+          (unsigned long long)ring.sent, (unsigned long long)ring.reclaimed);
+    CHECK(ring.numFreeDesc == kNumTxDesc, "free %d", ring.numFreeDesc);
+
+    std::sort(passTimes.begin(), passTimes.end());
+
+    double total = std::chrono::duration<double>(end - start).count();
+    double mean = 0;
+
+    for (double t : passTimes)
+        mean += t;
+
+    mean /= passTimes.size();
+
+    printf("TxReclaimTests: reclaim %-7s poll pass %6.0f ns mean, %6.0f ns p99, "
+           "tx reclaimed %5.2f Mpkts/s\n", threaded ? "thread" : "inline", mean,
+           passTimes[passTimes.size() * 99 / 100], ring.reclaimed / total / 1e6);
+}
+
+int main()
+{
+    UInt32 i, j;
+
+    for (i = 0; i < kRxBatch; i++) {
+        for (j = 0; j < sizeof(rxData[0]); j++)
+            rxData[i][j] = rand();
+    }
+    run(false);
+    run(true);
+
+    if (failures) {
+        printf("TxReclaimTests: %d failures.\n", failures);
+        return 1;
+    }
+    printf("TxReclaimTests: passed.\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+//
+//  IOLib.h
+//  SimpleRTK5 host tests
+//
+//  Stand-in for the kernel header, which provides just enough of it
+//  to compile the driver's kernel independent headers on the host.
+//
+
+#ifndef SimpleRTK5Tests_IOLib_h
+#define SimpleRTK5Tests_IOLib_h
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if !defined(__LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define __LITTLE_ENDIAN__ 1
+#endif
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+
+typedef bool Boolean;
+
+typedef uintptr_t IOVirtualAddress;
+typedef UInt64 IOPhysicalAddress64;
+typedef UInt64 addr64_t;
+
+#define OS_INLINE static inline
+#ifndef LONG_BIT
+#define LONG_BIT (__SIZEOF_LONG__ * CHAR_BIT)
+#endif
+#define NSEC_PER_USEC 1000ULL
+
+/* Same as in mach/vm_param.h on x86_64 */
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#endif
+#define trunc_page(x) ((x) & ~((uintptr_t)PAGE_MASK))
+
+/* Defined by the host's libc, but linux/linux.h defines its own. */
+#undef __always_inline
+
+#define IOLog printf
+
+/* The tests only run on little endian hosts. */
+#define OSSwapLittleToHostInt16(x) ((UInt16)(x))
+#define OSSwapLittleToHostInt32(x) ((UInt32)(x))
+#define OSSwapLittleToHostInt64(x) ((UInt64)(x))
+#define OSSwapHostToLittleInt16(x) ((UInt16)(x))
+#define OSSwapHostToLittleInt32(x) ((UInt32)(x))
+#define OSSwapHostToLittleInt64(x) ((UInt64)(x))
+
+/* Used by linux/linux.h, the tests never call them. */
+static inline void IODelay(unsigned) {}
+static inline void IOSleep(unsigned) {}
+static inline void clock_get_uptime(uint64_t *t) { *t = 0; }
+static inline void nanoseconds_to_absolutetime(uint64_t ns, uint64_t *t) { *t = ns; }
+static inline void clock_delay_until(uint64_t) {}
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *p) { return __atomic_fetch_add(p, amount, __ATOMIC_SEQ_CST); }
+static inline SInt32 OSIncrementAtomic(volatile SInt32 *p) { return __atomic_fetch_add(p, 1, __ATOMIC_SEQ_CST); }
+static inline SInt32 OSDecrementAtomic(volatile SInt32 *p) { return __atomic_fetch_sub(p, 1, __ATOMIC_SEQ_CST); }
+static inline UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32 *p) { return __atomic_fetch_and(p, mask, __ATOMIC_SEQ_CST); }
+static inline UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32 *p) { return __atomic_fetch_or(p, mask, __ATOMIC_SEQ_CST); }
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64 *p) { return __atomic_fetch_add(p, amount, __ATOMIC_SEQ_CST); }
+static inline bool OSCompareAndSwap(UInt32 o, UInt32 n, volatile UInt32 *p) { return __atomic_compare_exchange_n(p, &o, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+static inline bool OSCompareAndSwapPtr(void *o, void *n, void * volatile *p) { return __atomic_compare_exchange_n(p, &o, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+#endif /* SimpleRTK5Tests_IOLib_h */
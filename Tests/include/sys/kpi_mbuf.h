@@ -0,0 +1,19 @@
+//
+//  kpi_mbuf.h
+//  SimpleRTK5 host tests
+//
+//  Stand-in for the kernel's mbuf KPI. Only the types are provided,
+//  the tests define their own packets as struct __mbuf.
+//
+
+#ifndef SimpleRTK5Tests_kpi_mbuf_h
+#define SimpleRTK5Tests_kpi_mbuf_h
+
+typedef struct __mbuf *mbuf_t;
+
+typedef enum {
+    MBUF_WAITOK = 0,
+    MBUF_DONTWAIT = 1,
+} mbuf_how_t;
+
+#endif /* SimpleRTK5Tests_kpi_mbuf_h */